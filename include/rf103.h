@@ -62,6 +62,9 @@ rf103_t *rf103_open(int index, const char* imagefile);
 
 void rf103_close(rf103_t *this);
 
+/* STATUS_STREAMING between rf103_start_streaming() and
+ * rf103_stop_streaming(), STATUS_FAILED if either failed or a USB transfer
+ * stopped the stream (until rf103_reset_status()) */
 enum RF103Status rf103_status(rf103_t *this);
 
 
@@ -83,6 +86,10 @@ typedef void (*rf103_read_async_cb_t)(uint32_t data_size, uint8_t *data,
 
 int rf103_set_sample_rate(rf103_t *this, double sample_rate);
 
+/* callback can be 0 when all the consumers are internal (subscribers,
+ * DDC, shared memory, ...); with no callback and no consumer set up when
+ * rf103_start_streaming() is called, the stream is synchronous
+ * (rf103_read_sync()) */
 int rf103_set_async_params(rf103_t *this, uint32_t frame_size, 
                            uint32_t num_frames, rf103_read_async_cb_t callback,
                            void *callback_context);
@@ -97,6 +104,353 @@ int rf103_reset_status(rf103_t *this);
 
 int rf103_read_sync(rf103_t *this, uint8_t *data, int length, int *transferred);
 
+
+/* shared memory related functions */
+enum RF103ShmFlags {
+  RF103_SHM_HUGEPAGES = 0x01
+};
+
+/* publish every frame into a shared memory ring, so other local processes
+ * can read the stream through the rf103_shm client library (rf103_shm.h);
+ * must be called after rf103_set_async_params() */
+int rf103_set_shm_producer(rf103_t *this, const char *name,
+                           uint32_t num_slots, int flags);
+
+
+/* parallel processing related functions */
+
+/* split the per sample work done on every frame before the callbacks
+ * (currently the removal of the ADC randomization) into cache sized chunks
+ * processed by num_threads threads (0 means one per core, 1 means only
+ * the USB event thread, which is the default), each one pinned to its own
+ * core; the callbacks are still called once the whole frame is done; must
+ * be called after rf103_set_async_params() and while not streaming */
+int rf103_set_parallel_threads(rf103_t *this, uint32_t num_threads);
+
+
+/* ADC correction related functions */
+enum RF103ADCCorrectionFlags {
+  RF103_ADC_MEASURE_DC = 0x01,
+  RF103_ADC_REMOVE_DC  = 0x02,
+  RF103_ADC_CALIBRATE  = 0x04,
+  RF103_ADC_MEASURE_LEVELS = 0x08
+};
+
+#define RF103_ADC_HISTOGRAM_BINS (64)
+
+/* running estimates, in ADC counts */
+struct rf103_adc_stats {
+  uint64_t num_samples;     /* samples measured so far */
+  double dc_offset;         /* DC offset of the samples before correction */
+  double gain;              /* gain and offset currently applied */
+  double offset;
+  /* levels of the last frame, before correction (RF103_ADC_MEASURE_LEVELS) */
+  uint64_t num_frames;      /* frames measured so far */
+  uint32_t frame_samples;
+  int16_t min;
+  int16_t max;
+  uint32_t clipped;         /* samples at full scale */
+  uint64_t total_clipped;   /* since the start */
+  double rms;               /* DC included */
+  /* bin k counts the codes from -32768 + k * 65536 / RF103_ADC_HISTOGRAM_BINS */
+  uint32_t histogram[RF103_ADC_HISTOGRAM_BINS];
+};
+
+/* correct the samples before they reach the callbacks, in the same pass
+ * that removes the ADC randomization: RF103_ADC_MEASURE_DC tracks the DC
+ * offset with a single pole lowpass (time constant in seconds),
+ * RF103_ADC_REMOVE_DC also subtracts it (DC blocker), and
+ * RF103_ADC_CALIBRATE turns every sample x into (x - offset) * gain;
+ * RF103_ADC_MEASURE_LEVELS computes min, max, clipped samples, RMS and a
+ * coarse histogram of the codes of every frame, so a level control loop
+ * can react within a frame (about 1ms); can be called while streaming;
+ * must be called after rf103_set_async_params() */
+int rf103_set_adc_correction(rf103_t *this, double gain, double offset,
+                             double time_constant, int flags);
+
+/* lock free snapshot of the ADC statistics; can be called from any thread */
+int rf103_get_adc_stats(rf103_t *this, struct rf103_adc_stats *stats);
+
+
+/* DSP pipeline related functions */
+struct rf103_stage;
+
+/* copy every frame into a leased frame of the pipeline the stage belongs
+ * to (rf103_pipeline.h) and push it into the stage; frames are dropped when
+ * the pipeline has no free frames or the stage queue is full, which shows
+ * as a gap in the frame sequence numbers;
+ * the pipeline frames must be at least as large as the USB frames; must be
+ * called after rf103_set_async_params(), and the pipeline must outlive
+ * the stream */
+int rf103_set_pipeline_source(rf103_t *this, struct rf103_stage *stage);
+
+
+/* digital down converter related functions */
+enum RF103DDCFormat {
+  RF103_DDC_COMPLEX_FLOAT32,
+  RF103_DDC_COMPLEX_INT16
+};
+
+enum RF103DDCFlags {
+  RF103_DDC_WORKER_THREAD = 0x01,
+  RF103_DDC_FIXED_POINT   = 0x02,
+  RF103_DDC_CIC           = 0x04
+};
+
+typedef void (*rf103_ddc_cb_t)(uint32_t num_samples, const void *samples,
+                               void *context);
+
+/* convert the real ADC stream to complex samples centered on
+ * center_frequency (in Hz) at sample_rate / decimation; the callback gets
+ * num_samples interleaved I/Q pairs; with RF103_DDC_WORKER_THREAD the
+ * conversion runs on a library thread instead of the USB event thread;
+ * RF103_DDC_FIXED_POINT (only with RF103_DDC_COMPLEX_INT16) filters the
+ * int16 samples with Q15 arithmetic instead of converting them to float,
+ * which is faster on the CPUs with weak floating point units, at the cost
+ * of some noise (about 1 LSB, but up to 10 LSB when the decimation has an
+ * odd factor of 25 or more) and a few dB of stopband attenuation;
+ * RF103_DDC_CIC (for even decimations of at least 6; it is ignored for
+ * the others) replaces the first filters with a CIC decimator and a
+ * compensation filter, which costs about the same whatever the decimation
+ * is, and pays off for large ones;
+ * must be called after rf103_set_async_params() */
+int rf103_set_ddc(rf103_t *this, double center_frequency, uint32_t decimation,
+                  enum RF103DDCFormat format, int flags,
+                  rf103_ddc_cb_t callback, void *callback_context);
+
+/* retune while streaming */
+int rf103_set_ddc_frequency(rf103_t *this, double center_frequency);
+
+/* resample the DDC output to exactly output_rate samples per second
+ * (e.g. 48000), between 1/4 and 4 times sample_rate / decimation; the
+ * ratio is computed from the rate the ADC clock is actually synthesized
+ * at, which is often slightly off the requested sample rate; must be
+ * called after rf103_set_ddc() and before rf103_start_streaming() */
+int rf103_set_ddc_output_rate(rf103_t *this, double output_rate);
+
+/* measured deviation of the ADC clock from its synthesized rate, in ppm
+ * (e.g. from a drift estimate against a reference clock); it can be
+ * updated while streaming, by up to 1% in total, and the resampler follows
+ * it at the start of the next block */
+int rf103_set_ddc_rate_correction(rf103_t *this, double ppm);
+
+/* fast path for a band centered on sample_rate / 4: complex samples at
+ * sample_rate / 2 covering the whole 0 to sample_rate / 2 range; cheap
+ * enough to run in the USB event thread; the same as a subscriber at
+ * decimation 2 (and shares its filter with them); must be called after
+ * rf103_set_async_params() */
+int rf103_set_iq_fs4(rf103_t *this, enum RF103DDCFormat format,
+                     rf103_ddc_cb_t callback, void *callback_context);
+
+
+/* channelizer related functions */
+enum RF103ChannelizerFlags {
+  RF103_CHANNELIZER_OVERSAMPLED   = 0x01,
+  RF103_CHANNELIZER_WORKER_THREAD = 0x02
+};
+
+typedef void (*rf103_channel_cb_t)(uint32_t channel, uint32_t num_samples,
+                                   const float *samples, void *context);
+
+/* split the stream into num_channels (a power of 2) channels, each
+ * sample_rate / num_channels wide; channel k is centered on
+ * k * sample_rate / num_channels (k = 0 to num_channels / 2) and is sampled
+ * at sample_rate / num_channels, or twice that with
+ * RF103_CHANNELIZER_OVERSAMPLED (recommended, since critically sampled
+ * channels have aliases near their edges); the callback is called once per
+ * frame for every enabled channel with num_samples interleaved I/Q floats;
+ * must be called after rf103_set_async_params() */
+int rf103_set_channelizer(rf103_t *this, uint32_t num_channels, int flags,
+                          rf103_channel_cb_t callback, void *callback_context);
+
+/* all the channels are enabled initially */
+int rf103_channelizer_enable(rf103_t *this, uint32_t channel, int enable);
+
+
+/* VFO bank related functions */
+enum RF103VFOFlags {
+  RF103_VFO_WORKER_THREAD = 0x01
+};
+
+typedef void (*rf103_vfo_cb_t)(int vfo, uint32_t num_samples,
+                               const float *samples, void *context);
+
+/* extract any number of arbitrary channels (VFOs) with a shared
+ * overlap-save FFT of fft_size samples (a power of 2, 0 for the default);
+ * the callback gets num_samples interleaved I/Q floats from one VFO at a
+ * time; must be called after rf103_set_async_params() */
+int rf103_set_vfo_bank(rf103_t *this, uint32_t fft_size, int flags,
+                       rf103_vfo_cb_t callback, void *callback_context);
+
+/* frequency and bandwidth in Hz; the VFO is sampled at
+ * sample_rate / decimation (a power of 2) and the bandwidth must be less
+ * than 90% of that; returns the VFO number, or -1 on error; VFOs can be
+ * added, retuned and removed while streaming */
+int rf103_add_vfo(rf103_t *this, double frequency, double bandwidth,
+                  uint32_t decimation);
+
+int rf103_retune_vfo(rf103_t *this, int vfo, double frequency);
+
+int rf103_remove_vfo(rf103_t *this, int vfo);
+
+
+/* power spectrum related functions */
+enum RF103PSDWindow {
+  RF103_PSD_WINDOW_HANN,
+  RF103_PSD_WINDOW_BLACKMAN_HARRIS,
+  RF103_PSD_WINDOW_FLAT_TOP
+};
+
+enum RF103PSDMode {
+  RF103_PSD_AVERAGE,
+  RF103_PSD_PEAK_HOLD,
+  RF103_PSD_MIN_HOLD
+};
+
+/* num_bins = fft_size / 2 + 1 bins from 0 to sample_rate / 2, in dB
+ * relative to a full scale sine */
+typedef void (*rf103_psd_cb_t)(uint32_t num_bins, const float *bins,
+                               void *context);
+
+/* compute frame_rate power spectra per second, each one the average of the
+ * windowed FFTs of fft_size samples (overlapping by the fraction overlap)
+ * in its interval; with num_averages > 0 only that many FFTs per interval
+ * are computed; the FFTs run on num_threads threads (0 means one per
+ * core), and the callback is called from a library thread; must be called
+ * after rf103_set_async_params() and rf103_set_sample_rate() */
+int rf103_set_psd(rf103_t *this, uint32_t fft_size, double overlap,
+                  uint32_t num_averages, enum RF103PSDWindow window,
+                  double frame_rate, uint32_t num_threads,
+                  rf103_psd_cb_t callback, void *callback_context);
+
+/* average (the default), peak hold or min hold; also restarts the hold */
+int rf103_set_psd_mode(rf103_t *this, enum RF103PSDMode mode);
+
+
+/* preview related functions */
+
+/* num_samples real samples at sample_rate / decimation */
+typedef void (*rf103_preview_cb_t)(uint32_t num_samples,
+                                   const int16_t *samples, void *context);
+
+/* low rate view of the stream for user interfaces, next to the full rate
+ * callback: one frame in every frame_interval goes to the preview thread,
+ * which averages each group of decimation samples (1 keeps the full
+ * bandwidth; a larger value keeps only the bottom of the band, from 0 to
+ * sample_rate / (2 * decimation)) and calls the callback once per frame.
+ * The preview thread only runs when the CPUs would otherwise be idle, and
+ * a frame arriving while it is still busy is dropped, so the preview never
+ * slows down the other consumers; must be called after
+ * rf103_set_async_params() and before starting the stream */
+int rf103_set_preview(rf103_t *this, uint32_t frame_interval,
+                      uint32_t decimation, rf103_preview_cb_t callback,
+                      void *callback_context);
+
+/* frames skipped because the preview thread was busy */
+uint64_t rf103_get_preview_dropped(rf103_t *this);
+
+
+/* subscriber related functions */
+enum RF103SubscriberFormat {
+  RF103_SUBSCRIBER_REAL_INT16,        /* the ADC samples */
+  RF103_SUBSCRIBER_COMPLEX_FLOAT32,   /* interleaved I/Q */
+  RF103_SUBSCRIBER_COMPLEX_INT16
+};
+
+enum RF103SubscriberFlags {
+  RF103_SUBSCRIBER_WORKER_THREAD = 0x01
+};
+
+typedef void (*rf103_subscriber_cb_t)(uint32_t num_samples,
+                                      const void *samples, void *context);
+
+/* any number of consumers of the same stream besides the callback of
+ * rf103_set_async_params(), each with its own format and decimation:
+ * RF103_SUBSCRIBER_REAL_INT16 gets the ADC samples as they are
+ * (decimation 1); the complex formats get the band centered on
+ * sample_rate / 4 at sample_rate / decimation (a power of 2 from 2 up),
+ * with a passband of +/- 0.4 times that rate. The stages in common are
+ * computed once for all the subscribers: the removal of the ADC
+ * randomization, the fs/4 shift with the first half-band filter, and each
+ * following half-band filter up to the largest decimation requested. The
+ * frame size (in samples) must be a multiple of decimation; with
+ * RF103_SUBSCRIBER_WORKER_THREAD the callback is called from a library
+ * thread of its own instead of the USB event thread. Returns the
+ * subscriber number, or -1 on error; subscribers can be added and removed
+ * while streaming (but not from a subscriber callback), except that adding
+ * one fails when the stream was started synchronously (see
+ * rf103_set_async_params()); must be called after
+ * rf103_set_async_params() */
+int rf103_add_subscriber(rf103_t *this, enum RF103SubscriberFormat format,
+                         uint32_t decimation, int flags,
+                         rf103_subscriber_cb_t callback,
+                         void *callback_context);
+
+int rf103_remove_subscriber(rf103_t *this, int subscriber);
+
+
+/* overflow related functions */
+
+/* the consumers that run on a library thread of their own, and get the
+ * frames through a queue */
+enum RF103Consumer {
+  RF103_CONSUMER_DDC,          /* with RF103_DDC_WORKER_THREAD */
+  RF103_CONSUMER_CHANNELIZER,  /* with RF103_CHANNELIZER_WORKER_THREAD */
+  RF103_CONSUMER_VFO_BANK,     /* with RF103_VFO_WORKER_THREAD */
+  RF103_CONSUMER_PSD,
+  RF103_CONSUMER_PREVIEW,
+  RF103_CONSUMER_SUBSCRIBER    /* with RF103_SUBSCRIBER_WORKER_THREAD */
+};
+
+/* what happens to a frame when the queue of the consumer is full */
+enum RF103OverflowPolicy {
+  RF103_OVERFLOW_DROP_NEWEST,  /* drop the new frame (the default) */
+  RF103_OVERFLOW_DROP_OLDEST,  /* drop the oldest queued frame, e.g. for
+                                  live monitoring, which wants the latest
+                                  data */
+  RF103_OVERFLOW_BLOCK         /* wait until the consumer catches up */
+};
+
+struct rf103_overflow_stats {
+  uint64_t frames;             /* queued */
+  uint64_t dropped_newest;
+  uint64_t dropped_oldest;
+  uint64_t blocked;            /* frames that had to wait */
+  uint64_t blocked_ns;         /* total time spent waiting */
+  uint32_t queue_depth;
+  uint32_t max_queue_depth;
+  uint32_t queue_size;
+};
+
+/* subscriber is the number returned by rf103_add_subscriber() for
+ * RF103_CONSUMER_SUBSCRIBER, and is ignored otherwise; RF103_OVERFLOW_BLOCK
+ * holds up the USB event thread, and with it every other consumer and the
+ * USB transfers, so it is meant for recording every frame of a replayed or
+ * short stream rather than live streaming, and is not allowed for
+ * RF103_CONSUMER_PREVIEW, whose worker runs at idle priority; the policy can
+ * be changed while streaming */
+int rf103_set_overflow_policy(rf103_t *this, enum RF103Consumer consumer,
+                              int subscriber,
+                              enum RF103OverflowPolicy policy);
+
+/* counters since the consumer was set up; can be called from any thread */
+int rf103_get_overflow_stats(rf103_t *this, enum RF103Consumer consumer,
+                             int subscriber,
+                             struct rf103_overflow_stats *stats);
+
+
+/* design cache related functions */
+
+/* the filters designed by the library (and the FFT plans) are cached in
+ * memory, so a stage reconfigured with parameters it used before (e.g. a
+ * DDC decimation or a VFO bandwidth) is set up without designing them
+ * again; the filter designs can also be saved to a file and loaded back
+ * in a later session. These functions apply to the whole process, not to
+ * a device */
+int rf103_load_design_cache(const char *filename);
+
+int rf103_save_design_cache(const char *filename);
+
 #ifdef __cplusplus
 }
 #endif
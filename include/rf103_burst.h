@@ -0,0 +1,107 @@
+/*
+ * rf103_burst.h - energy burst detector and SigMF burst recorder
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RF103_BURST_H
+#define __RF103_BURST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* the detector follows the mean power of each channel over a sliding
+ * window (updated every quarter window) and reports when a burst starts
+ * and stops; the sink records only the bursts, with some padding before
+ * and after each of them, as a SigMF recording (a .sigmf-data file with
+ * the samples and a .sigmf-meta file that tells where each segment came
+ * from). Both work on interleaved float I/Q samples, like the output of
+ * the DDC and of the channelizer */
+typedef struct rf103_burst_detector rf103_burst_detector_t;
+typedef struct rf103_burst_sink rf103_burst_sink_t;
+
+enum rf103_burst_event_type {
+  RF103_BURST_START,
+  RF103_BURST_STOP
+};
+
+struct rf103_burst_event {
+  uint32_t channel;
+  enum rf103_burst_event_type type;
+  /* index of the first sample of the burst (start) or of the first sample
+     after it (stop), counting from the first sample of the channel; both
+     are conservative, i.e. they err on the side of a longer burst */
+  uint64_t sample_index;
+  /* mean power in dB over the window that triggered the start; for a stop
+     the highest mean power seen during the burst */
+  double power_db;
+};
+
+typedef void (*rf103_burst_cb_t)(const struct rf103_burst_event *event,
+                                 void *context);
+
+/* window is the length of the power window in samples (rounded down to a
+ * multiple of 4); a burst starts when the mean power goes above on_db and
+ * stops when it has stayed below off_db (<= on_db) for holdoff samples, so
+ * that short fades don't split a burst in two. The power is in dB relative
+ * to a mean |x|^2 of 1 (for the DDC output, a full scale ADC sine wave is
+ * at about 90 dB) */
+rf103_burst_detector_t *rf103_burst_detector_open(uint32_t num_channels,
+                                                  uint32_t window,
+                                                  double on_db, double off_db,
+                                                  uint32_t holdoff,
+                                                  rf103_burst_cb_t callback,
+                                                  void *callback_context);
+
+void rf103_burst_detector_close(rf103_burst_detector_t *this);
+
+/* the events are reported from within this function; different channels
+ * can be processed by different threads, but each channel by only one
+ * thread at a time */
+int rf103_burst_detector_process(rf103_burst_detector_t *this,
+                                 uint32_t channel, const float *samples,
+                                 uint32_t num_samples);
+
+/* the sink records one channel to basename.sigmf-data and, when it is
+ * closed, describes it in basename.sigmf-meta; pre and post are the
+ * padding (in samples) before the start and after the stop of each
+ * burst; bursts closer than that are merged into the same segment.
+ * frequency is the center frequency (0 if not known) */
+rf103_burst_sink_t *rf103_burst_sink_open(const char *basename,
+                                          double sample_rate,
+                                          double frequency, uint32_t pre,
+                                          uint32_t post);
+
+int rf103_burst_sink_close(rf103_burst_sink_t *this);
+
+/* pass on the events of the channel (typically from the detector callback)
+ * before writing the samples they refer to */
+int rf103_burst_sink_event(rf103_burst_sink_t *this,
+                           const struct rf103_burst_event *event);
+
+int rf103_burst_sink_write(rf103_burst_sink_t *this, const float *samples,
+                           uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RF103_BURST_H */
@@ -0,0 +1,70 @@
+/*
+ * rf103_goertzel.h - Goertzel tone detector bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RF103_GOERTZEL_H
+#define __RF103_GOERTZEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* a bank of Goertzel filters measures the power of the stream at a set of
+ * arbitrary frequencies (e.g. beacons or pilot tones), one block of samples
+ * at a time; for up to a few hundred frequencies this is much cheaper than
+ * a full FFT, since the filters are run on several frequencies at once with
+ * the vector units. The input is interleaved float I/Q samples, like the
+ * output of the DDC and of the channelizer */
+typedef struct rf103_goertzel rf103_goertzel_t;
+
+/* sample_index is the index (counting from the first sample processed) of
+ * the sample the report was made at; power is the mean power at each
+ * frequency, in dB relative to a mean |x|^2 of 1, averaged over the blocks
+ * that ended since the previous report */
+typedef void (*rf103_goertzel_cb_t)(uint64_t sample_index,
+                                    uint32_t num_frequencies,
+                                    const float *power, void *context);
+
+/* frequencies are in Hz relative to the center of the stream (from
+ * -sample_rate / 2 to sample_rate / 2); block_length sets the bandwidth of
+ * each filter (about sample_rate / block_length); the callback is called
+ * report_rate times per second of stream, which cannot be more than once
+ * per block */
+rf103_goertzel_t *rf103_goertzel_open(double sample_rate,
+                                      const double *frequencies,
+                                      uint32_t num_frequencies,
+                                      uint32_t block_length,
+                                      double report_rate,
+                                      rf103_goertzel_cb_t callback,
+                                      void *callback_context);
+
+void rf103_goertzel_close(rf103_goertzel_t *this);
+
+/* the reports are made from within this function */
+int rf103_goertzel_process(rf103_goertzel_t *this, const float *samples,
+                           uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RF103_GOERTZEL_H */
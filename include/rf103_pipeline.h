@@ -0,0 +1,115 @@
+/*
+ * rf103_pipeline - multi-threaded DSP pipeline
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RF103_PIPELINE_H
+#define __RF103_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* a pipeline is a graph of stages run by a pool of worker threads; stages
+ * exchange frames leased from a fixed pool through bounded lock-free
+ * queues. Each stage runs on one worker at a time (so it can keep state
+ * without locking) and sees its frames in order, while different stages
+ * run in parallel on different workers */
+typedef struct rf103_pipeline rf103_pipeline_t;
+typedef struct rf103_stage rf103_stage_t;
+
+typedef struct rf103_frame {
+  uint8_t *data;
+  uint32_t size;          /* capacity of data */
+  uint32_t length;        /* bytes used */
+  uint64_t sequence;
+} rf103_frame_t;
+
+/* called for every frame in the input queue of the stage; the frame is
+ * released when the function returns, so a stage that needs it for longer
+ * must take its own reference with rf103_frame_retain() */
+typedef void (*rf103_stage_fn_t)(rf103_stage_t *stage, rf103_frame_t *frame,
+                                 void *context);
+
+struct rf103_stage_stats {
+  const char *name;
+  uint64_t frames;              /* processed */
+  uint64_t dropped;             /* input queue full */
+  uint64_t lost;                /* no free frame in the pool for them */
+  uint64_t busy_ns;             /* total time spent in the stage function */
+  uint32_t queue_depth;
+  uint32_t max_queue_depth;
+  uint32_t queue_size;
+};
+
+/* num_threads workers (0 means one per core) and a pool of num_frames
+ * frames of frame_size bytes */
+rf103_pipeline_t *rf103_pipeline_create(uint32_t num_threads,
+                                        uint32_t frame_size,
+                                        uint32_t num_frames);
+
+/* stops the workers; the frames still queued are discarded */
+void rf103_pipeline_destroy(rf103_pipeline_t *this);
+
+/* stages and connections can only be added before rf103_pipeline_start() */
+rf103_stage_t *rf103_pipeline_add_stage(rf103_pipeline_t *this,
+                                        const char *name, uint32_t queue_size,
+                                        rf103_stage_fn_t function,
+                                        void *context);
+
+int rf103_pipeline_connect(rf103_stage_t *from, rf103_stage_t *to);
+
+int rf103_pipeline_start(rf103_pipeline_t *this);
+
+/* returns 0 when the pool is exhausted */
+rf103_frame_t *rf103_pipeline_lease(rf103_pipeline_t *this);
+
+void rf103_frame_retain(rf103_frame_t *frame);
+
+void rf103_frame_release(rf103_frame_t *frame);
+
+/* queue a frame into a stage (e.g. the source of the graph); the stage
+ * takes its own reference, so the caller still has to release its lease;
+ * returns 0, 1 if the frame was dropped because the input queue of the
+ * stage was full, or -1 on error */
+int rf103_pipeline_push(rf103_stage_t *stage, rf103_frame_t *frame);
+
+/* count a frame that never reached the stage because
+ * rf103_pipeline_lease() found the pool exhausted */
+void rf103_stage_count_lost(rf103_stage_t *stage);
+
+/* send a frame (the input frame or a newly leased one) to all the stages
+ * connected to the output of stage; same reference rules as
+ * rf103_pipeline_push(); returns the number of stages that dropped it */
+int rf103_stage_emit(rf103_stage_t *stage, rf103_frame_t *frame);
+
+rf103_pipeline_t *rf103_stage_pipeline(rf103_stage_t *stage);
+
+uint32_t rf103_pipeline_get_frame_size(rf103_pipeline_t *this);
+
+int rf103_stage_get_stats(rf103_stage_t *stage,
+                          struct rf103_stage_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RF103_PIPELINE_H */
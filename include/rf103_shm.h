@@ -0,0 +1,66 @@
+/*
+ * rf103_shm - client side of the rf103 shared memory broadcast ring
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RF103_SHM_H
+#define __RF103_SHM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* a reader attaches to a ring published by a process that owns the device
+ * (see rf103_set_shm_producer()); any number of readers can be attached at
+ * the same time and none of them can slow down the producer: a reader that
+ * falls behind by more than the ring size loses the oldest frames */
+typedef struct rf103_shm_reader rf103_shm_reader_t;
+
+rf103_shm_reader_t *rf103_shm_reader_open(const char *name);
+
+void rf103_shm_reader_close(rf103_shm_reader_t *this);
+
+/* wait up to timeout_ms for the next frame; returns 1 and a pointer into the
+ * shared memory (no copy) when a frame is available, 0 on timeout, -1 on
+ * error. The frame must be given back with rf103_shm_reader_release() */
+int rf103_shm_reader_next(rf103_shm_reader_t *this, const uint8_t **data,
+                          uint32_t *data_size, uint64_t *sequence,
+                          int timeout_ms);
+
+/* returns 0 if the frame was still intact when released, 1 if the producer
+ * overwrote it while it was being read (the data must then be discarded) */
+int rf103_shm_reader_release(rf103_shm_reader_t *this);
+
+uint32_t rf103_shm_reader_frame_size(rf103_shm_reader_t *this);
+
+uint32_t rf103_shm_reader_sample_rate(rf103_shm_reader_t *this);
+
+/* host time (CLOCK_REALTIME, ns) when the current frame was published */
+uint64_t rf103_shm_reader_timestamp(rf103_shm_reader_t *this);
+
+/* number of frames this reader lost because it did not keep up */
+uint64_t rf103_shm_reader_lost_frames(rf103_shm_reader_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RF103_SHM_H */
@@ -0,0 +1,95 @@
+/*
+ * rf103_xcorr.h - cross-correlation of two receivers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RF103_XCORR_H
+#define __RF103_XCORR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* cross-correlates the streams of two synchronized receivers (e.g. for
+ * time difference of arrival or direction finding), through the average
+ * of the cross spectra of many segments of the two streams. The input is
+ * interleaved float I/Q samples, like the output of the DDC and of the
+ * channelizer; the two streams are aligned by sample index, so both must
+ * count their samples from the same instant (e.g. a common start trigger
+ * or a timestamp converted to a sample index) */
+typedef struct rf103_xcorr rf103_xcorr_t;
+
+enum rf103_xcorr_flags {
+  /* phase transform weighting (GCC-PHAT): only the phase of the cross
+     spectrum is kept, which gives a much sharper peak for wideband signals
+     and in the presence of multipath; not suited to signals made of a few
+     tones, whose leakage into the empty bins pulls the peak to lag 0 */
+  RF103_XCORR_PHAT = 0x01
+};
+
+struct rf103_xcorr_result {
+  uint64_t sample_index;      /* first sample of the interval */
+  uint32_t num_segments;      /* averaged */
+  /* lag of stream 1 relative to stream 0 in samples (positive if stream
+     1 is late), with sub-sample resolution */
+  double lag;
+  double peak;                /* correlation coefficient, 0 to 1 */
+  double phase;               /* of the peak, in radians */
+  /* magnitude of the normalized correlation for the lags from
+     -fft_size / 2 to fft_size / 2 - 1 */
+  uint32_t num_lags;
+  const float *correlation;
+};
+
+typedef void (*rf103_xcorr_cb_t)(const struct rf103_xcorr_result *result,
+                                 void *context);
+
+/* each segment is fft_size / 2 samples, zero padded to fft_size, so lags
+ * up to +/- fft_size / 2 can be measured (the longer the lag, the fewer
+ * the samples of a segment that overlap); the peak is searched for within
+ * +/- max_lag samples (0 means the full range). update_rate results per
+ * second of stream are reported, each one the average of the segments in
+ * its interval (at most num_averages of them, if num_averages > 0); the
+ * FFTs of an interval run on num_threads threads (0 means one per core) */
+rf103_xcorr_t *rf103_xcorr_open(double sample_rate, uint32_t fft_size,
+                                uint32_t max_lag, double update_rate,
+                                uint32_t num_averages, int flags,
+                                uint32_t num_threads,
+                                rf103_xcorr_cb_t callback,
+                                void *callback_context);
+
+void rf103_xcorr_close(rf103_xcorr_t *this);
+
+/* adds num_samples samples of stream (0 or 1), the first one at
+ * sample_index; the streams can be written from different threads, and
+ * missing samples are replaced by zeros. The correlation runs in the
+ * thread whose write completes an interval, and the callback is called
+ * from there; a stream can be ahead of the other by up to about one
+ * interval */
+int rf103_xcorr_write(rf103_xcorr_t *this, uint32_t stream,
+                      uint64_t sample_index, const float *samples,
+                      uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RF103_XCORR_H */
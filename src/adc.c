@@ -25,6 +25,7 @@
  */
 
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -39,12 +40,29 @@
 #include "usb_device.h"
 #include "usb_device_internals.h"
 #include "logging.h"
+#include "parallel.h"
 
 
 typedef struct adc adc_t;
+struct condition_context;
+struct frame_levels;
 
 /* internal functions */
 static void adc_read_async_callback(struct libusb_transfer *transfer);
+static void derandomize(uint16_t *samples, uint32_t num_samples);
+static void derandomize_chunk(uint32_t begin, uint32_t end, void *context);
+static void init_correction(adc_t *this);
+static void pick_up_correction(adc_t *this);
+static void condition_frame(adc_t *this, uint16_t *samples,
+                            uint32_t num_samples);
+static void condition(uint16_t *samples, uint32_t num_samples,
+                      const struct condition_context *context,
+                      struct frame_levels *levels);
+static void measure_levels(const int16_t *samples, uint32_t num_samples,
+                           struct frame_levels *levels);
+static void merge_levels(struct frame_levels *levels,
+                         const struct frame_levels *chunk);
+static void condition_chunk(uint32_t begin, uint32_t end, void *context);
 
 
 enum ADCStatus {
@@ -55,6 +73,37 @@ enum ADCStatus {
   ADC_STATUS_FAILED = 0xff
 };
 
+struct adc_correction {
+  int flags;                 /* ADCCorrectionFlags */
+  double gain;
+  double offset;
+  double time_constant;      /* seconds */
+};
+
+/* levels of a frame (or of a chunk of it), before the correction */
+struct frame_levels {
+  int64_t sum;
+  uint64_t sum_squares;
+  int16_t min;
+  int16_t max;
+  uint32_t clipped;
+  /* four interleaved copies, so consecutive samples in the same bin do not
+     wait for each other's increment */
+  uint32_t histogram[4][RF103_ADC_HISTOGRAM_BINS];
+};
+
+/* what the threads of parallel_for() need for their chunks; each chunk
+   has its own levels, so the threads share nothing */
+struct condition_context {
+  uint16_t *samples;
+  uint16_t mask;
+  int correct;
+  int measure_levels;
+  float gain;
+  float bias;
+  struct frame_levels *chunk_levels;
+};
+
 typedef struct adc {
   enum ADCStatus status;
   int random;
@@ -67,6 +116,19 @@ typedef struct adc {
   uint8_t **frames;
   struct libusb_transfer **transfers;
   atomic_int active_transfers;
+  parallel_t *parallel;
+  struct frame_levels *chunk_levels;   /* one per parallel chunk */
+  struct adc_correction correction;
+  /* seqlock (odd while being written) for the pending correction, which
+     the USB thread picks up at the start of the next frame */
+  _Atomic uint32_t correction_sequence;
+  struct adc_correction pending_correction;
+  atomic_int update_correction;
+  double dc_estimate;        /* before the correction */
+  uint64_t measured_samples;
+  /* seqlock (odd while being written) for the published statistics */
+  _Atomic uint32_t stats_sequence;
+  struct rf103_adc_stats stats;
 } adc_t;
 
 
@@ -74,6 +136,8 @@ static const uint32_t DEFAULT_ADC_SAMPLE_RATE = 64000000;   /* 64Msps */
 static const uint32_t DEFAULT_ADC_FRAME_SIZE = (2 * DEFAULT_ADC_SAMPLE_RATE / 1000);  /* ~ 1 ms */
 static const uint32_t DEFAULT_ADC_NUM_FRAMES = 96;  /* we should not exceed 120 ms in total! */
 const unsigned int BULK_XFER_TIMEOUT = 5000; // timeout (in ms) for each bulk transfer
+static const uint32_t PARALLEL_CHUNK_SAMPLES = 16384;  /* 32kB, fits in L1 */
+static const uint32_t LEVELS_BLOCK_SAMPLES = 256;
 
 
 adc_t *adc_open_sync(usb_device_t *usb_device)
@@ -99,6 +163,9 @@ adc_t *adc_open_sync(usb_device_t *usb_device)
   this->frames = 0;
   this->transfers = 0;
   atomic_init(&this->active_transfers, 0);
+  this->parallel = 0;
+  this->chunk_levels = 0;
+  init_correction(this);
 
   ret_val = this;
   return ret_val;
@@ -172,6 +239,18 @@ adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
   }
   this->transfers = transfers;
   atomic_init(&this->active_transfers, 0);
+  this->parallel = 0;
+  uint32_t num_chunks = (frame_size / 2 + PARALLEL_CHUNK_SAMPLES - 1) /
+                        PARALLEL_CHUNK_SAMPLES;
+  this->chunk_levels = (struct frame_levels *) malloc(num_chunks *
+                                                sizeof(struct frame_levels));
+  if (this->chunk_levels == 0) {
+    log_error("malloc() failed", __func__, __FILE__, __LINE__);
+    /* frees the transfers and the frames too */
+    adc_close(this);
+    return ret_val;
+  }
+  init_correction(this);
 
   ret_val = this;
   return ret_val;
@@ -193,6 +272,7 @@ void adc_close(adc_t *this)
     }
     free(this->frames);
   }
+  free(this->chunk_levels);
   free(this);
   return;
 }
@@ -205,6 +285,69 @@ int adc_set_random(adc_t *this, int random)
 }
 
 
+int adc_set_callback(adc_t *this, rf103_read_async_cb_t callback,
+                     void *callback_context)
+{
+  if (this->status == ADC_STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - adc_set_callback() called while streaming\n");
+    return -1;
+  }
+  if (callback && this->transfers == 0) {
+    fprintf(stderr, "ERROR - adc_set_callback() failed: synchronous ADC\n");
+    return -1;
+  }
+  this->callback = callback;
+  this->callback_context = callback_context;
+  return 0;
+}
+
+
+int adc_set_parallel(adc_t *this, parallel_t *parallel)
+{
+  this->parallel = parallel;
+  return 0;
+}
+
+
+int adc_set_correction(adc_t *this, double gain, double offset,
+                       double time_constant, int flags)
+{
+  if (gain <= 0.0 || time_constant <= 0.0) {
+    fprintf(stderr, "ERROR - adc_set_correction() failed: invalid parameters\n");
+    return -1;
+  }
+  uint32_t sequence = atomic_load_explicit(&this->correction_sequence,
+                                           memory_order_relaxed);
+  atomic_store_explicit(&this->correction_sequence, sequence + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  this->pending_correction.flags = flags;
+  this->pending_correction.gain = gain;
+  this->pending_correction.offset = offset;
+  this->pending_correction.time_constant = time_constant;
+  atomic_store_explicit(&this->correction_sequence, sequence + 2,
+                        memory_order_release);
+  atomic_store_explicit(&this->update_correction, 1, memory_order_release);
+  return 0;
+}
+
+
+int adc_get_stats(adc_t *this, struct rf103_adc_stats *stats)
+{
+  /* retry while the USB thread is publishing new values */
+  uint32_t sequence;
+  do {
+    sequence = atomic_load_explicit(&this->stats_sequence,
+                                    memory_order_acquire);
+    *stats = this->stats;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((sequence & 1) != 0 ||
+           sequence != atomic_load_explicit(&this->stats_sequence,
+                                            memory_order_relaxed));
+  return 0;
+}
+
+
 int adc_set_sample_rate(adc_t *this, uint32_t sample_rate)
 {
   /* no checks yet */
@@ -213,6 +356,18 @@ int adc_set_sample_rate(adc_t *this, uint32_t sample_rate)
 }
 
 
+uint32_t adc_get_frame_size(adc_t *this)
+{
+  return this->frame_size;
+}
+
+
+uint32_t adc_get_num_frames(adc_t *this)
+{
+  return this->num_frames;
+}
+
+
 int adc_start(adc_t *this)
 {
   if (this->status != ADC_STATUS_READY) {
@@ -305,6 +460,12 @@ int adc_reset_status(adc_t *this)
 }
 
 
+int adc_has_failed(adc_t *this)
+{
+  return this->status == ADC_STATUS_FAILED;
+}
+
+
 int adc_read_sync(adc_t *this, uint8_t *data, int length, int *transferred)
 {
   int ret = libusb_bulk_transfer(this->usb_device->dev_handle,
@@ -317,13 +478,7 @@ int adc_read_sync(adc_t *this, uint8_t *data, int length, int *transferred)
 
   /* remove ADC randomization */
   if (this->random) {
-    uint16_t *samples = (uint16_t *) data;
-    int n = *transferred / 2;
-    for (int i = 0; i < n; ++i) {
-      if (samples[i] & 1) {
-        samples[i] ^= 0xfffe;
-      }
-    }
+    derandomize((uint16_t *) data, *transferred / 2);
   }
 
   return 0;
@@ -339,14 +494,22 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
     case LIBUSB_TRANSFER_COMPLETED:
       /* success!!! */
       if (this->status == ADC_STATUS_STREAMING) {
-        /* remove ADC randomization */
-        if (this->random) {
-          uint16_t *samples = (uint16_t *) transfer->buffer;
-          int n = transfer->actual_length / 2;
-          for (int i = 0; i < n; ++i) {
-            if (samples[i] & 1) {
-              samples[i] ^= 0xfffe;
-            }
+        if (atomic_exchange_explicit(&this->update_correction, 0,
+                                     memory_order_acquire)) {
+          pick_up_correction(this);
+        }
+        /* remove ADC randomization (and correct the samples) */
+        if (this->correction.flags) {
+          condition_frame(this, (uint16_t *) transfer->buffer,
+                          transfer->actual_length / 2);
+        } else if (this->random) {
+          if (this->parallel) {
+            parallel_for(this->parallel, transfer->actual_length / 2,
+                         PARALLEL_CHUNK_SAMPLES, derandomize_chunk,
+                         transfer->buffer);
+          } else {
+            derandomize((uint16_t *) transfer->buffer,
+                        transfer->actual_length / 2);
           }
         }
         this->callback(transfer->actual_length, transfer->buffer,
@@ -359,7 +522,9 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
       }
       break;
     case LIBUSB_TRANSFER_CANCELLED:
-      /* librtlsdr does also ignore LIBUSB_TRANSFER_CANCELLED */
+      /* librtlsdr does also ignore LIBUSB_TRANSFER_CANCELLED; we only keep
+         track of it, so the ADC can be restarted after adc_stop() */
+      atomic_fetch_sub(&this->active_transfers, 1);
       return;
     case LIBUSB_TRANSFER_ERROR:
     case LIBUSB_TRANSFER_TIMED_OUT:
@@ -386,3 +551,249 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
   return;
 }
 
+/* when the LSB is set, the other bits are inverted; written without
+   branches so the compiler vectorizes it */
+static void derandomize(uint16_t *samples, uint32_t num_samples)
+{
+  for (uint32_t i = 0; i < num_samples; ++i) {
+    uint16_t sample = samples[i];
+    samples[i] = sample ^ ((uint16_t) -(sample & 1) & 0xfffe);
+  }
+  return;
+}
+
+static void derandomize_chunk(uint32_t begin, uint32_t end, void *context)
+{
+  derandomize((uint16_t *) context + begin, end - begin);
+  return;
+}
+
+static void init_correction(adc_t *this)
+{
+  this->correction.flags = 0;
+  this->correction.gain = 1.0;
+  this->correction.offset = 0.0;
+  this->correction.time_constant = 1.0;
+  atomic_init(&this->correction_sequence, 0);
+  this->pending_correction = this->correction;
+  atomic_init(&this->update_correction, 0);
+  this->dc_estimate = 0.0;
+  this->measured_samples = 0;
+  atomic_init(&this->stats_sequence, 0);
+  memset(&this->stats, 0, sizeof(this->stats));
+  this->stats.gain = 1.0;
+  return;
+}
+
+static void pick_up_correction(adc_t *this)
+{
+  /* never wait for adc_set_correction() here: if it is in the middle of
+     writing, try again with the next frame */
+  struct adc_correction correction;
+  uint32_t sequence = atomic_load_explicit(&this->correction_sequence,
+                                           memory_order_acquire);
+  correction = this->pending_correction;
+  atomic_thread_fence(memory_order_acquire);
+  if ((sequence & 1) != 0 ||
+      sequence != atomic_load_explicit(&this->correction_sequence,
+                                       memory_order_relaxed)) {
+    atomic_store_explicit(&this->update_correction, 1, memory_order_relaxed);
+    return;
+  }
+  this->correction = correction;
+  return;
+}
+
+/* one pass over a frame that removes the randomization, measures the DC
+   offset and the levels, and applies the correction, with the same chunks
+   and threads as derandomize(); the DC estimate is a single pole lowpass
+   of the frame means, so the correction of a frame uses the estimate of
+   the previous ones */
+static void condition_frame(adc_t *this, uint16_t *samples,
+                            uint32_t num_samples)
+{
+  const struct adc_correction *correction = &this->correction;
+  int calibrate = (correction->flags & ADC_CALIBRATE) != 0;
+  int remove_dc = (correction->flags & ADC_REMOVE_DC) != 0;
+  if (num_samples == 0) {
+    return;
+  }
+
+  /* y = (x - offset - dc) * gain */
+  double gain = calibrate ? correction->gain : 1.0;
+  double offset = (calibrate ? correction->offset : 0.0) +
+                  (remove_dc ? this->dc_estimate : 0.0);
+  struct condition_context context = {
+    .samples = samples,
+    .mask = this->random ? 0xfffe : 0,
+    .correct = calibrate || remove_dc,
+    .measure_levels = (correction->flags & ADC_MEASURE_LEVELS) != 0,
+    .gain = (float) gain,
+    .bias = (float) (-offset * gain),
+    .chunk_levels = this->chunk_levels
+  };
+  uint32_t num_chunks = 1;
+  if (this->parallel) {
+    num_chunks = (num_samples + PARALLEL_CHUNK_SAMPLES - 1) /
+                 PARALLEL_CHUNK_SAMPLES;
+    parallel_for(this->parallel, num_samples, PARALLEL_CHUNK_SAMPLES,
+                 condition_chunk, &context);
+  } else {
+    condition(samples, num_samples, &context, &this->chunk_levels[0]);
+  }
+  struct frame_levels *levels = &this->chunk_levels[0];
+  for (uint32_t i = 1; i < num_chunks; ++i) {
+    merge_levels(levels, &this->chunk_levels[i]);
+  }
+
+  double mean = (double) levels->sum / num_samples;
+  double alpha = 1.0 - exp(-(double) num_samples /
+                           (correction->time_constant * this->sample_rate));
+  this->dc_estimate = this->measured_samples == 0 ? mean :
+                      this->dc_estimate + alpha * (mean - this->dc_estimate);
+  this->measured_samples += num_samples;
+
+  uint32_t sequence = atomic_load_explicit(&this->stats_sequence,
+                                           memory_order_relaxed);
+  atomic_store_explicit(&this->stats_sequence, sequence + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  struct rf103_adc_stats *stats = &this->stats;
+  stats->num_samples = this->measured_samples;
+  stats->dc_offset = this->dc_estimate;
+  stats->gain = gain;
+  stats->offset = offset;
+  if (context.measure_levels) {
+    ++stats->num_frames;
+    stats->frame_samples = num_samples;
+    stats->min = levels->min;
+    stats->max = levels->max;
+    stats->clipped = levels->clipped;
+    stats->total_clipped += levels->clipped;
+    stats->rms = sqrt((double) levels->sum_squares / num_samples);
+    for (uint32_t b = 0; b < RF103_ADC_HISTOGRAM_BINS; ++b) {
+      stats->histogram[b] = levels->histogram[0][b] + levels->histogram[1][b] +
+                            levels->histogram[2][b] + levels->histogram[3][b];
+    }
+  }
+  atomic_store_explicit(&this->stats_sequence, sequence + 2,
+                        memory_order_release);
+  return;
+}
+
+/* works on blocks small enough to stay in L1: the first loop removes the
+   randomization (and corrects the samples) keeping a copy of the codes,
+   and measure_levels() goes over that copy; the rounding and the clipping
+   to int16 are written without branches, so the compiler vectorizes the
+   loops */
+static void condition(uint16_t *samples, uint32_t num_samples,
+                      const struct condition_context *context,
+                      struct frame_levels *levels)
+{
+  uint16_t mask = context->mask;
+  float gain = context->gain;
+  float bias = context->bias;
+  int16_t codes[LEVELS_BLOCK_SAMPLES];
+
+  memset(levels, 0, sizeof(*levels));
+  levels->min = INT16_MAX;
+  levels->max = INT16_MIN;
+  for (uint32_t begin = 0; begin < num_samples;
+       begin += LEVELS_BLOCK_SAMPLES) {
+    uint16_t *block = samples + begin;
+    uint32_t length = num_samples - begin < LEVELS_BLOCK_SAMPLES ?
+                      num_samples - begin : LEVELS_BLOCK_SAMPLES;
+    if (context->correct) {
+      for (uint32_t i = 0; i < length; ++i) {
+        uint16_t sample = block[i];
+        sample ^= (uint16_t) -(sample & 1) & mask;
+        codes[i] = (int16_t) sample;
+        float y = (int16_t) sample * gain + bias;
+        y = y < -32768.0f ? -32768.0f : y;
+        y = y > 32767.0f ? 32767.0f : y;
+        /* round half up (the truncation of a positive value is a floor) */
+        block[i] = (uint16_t) ((int32_t) (y + 32768.5f) - 32768);
+      }
+    } else {
+      for (uint32_t i = 0; i < length; ++i) {
+        uint16_t sample = block[i];
+        sample ^= (uint16_t) -(sample & 1) & mask;
+        codes[i] = (int16_t) sample;
+        block[i] = sample;
+      }
+    }
+    if (context->measure_levels) {
+      measure_levels(codes, length, levels);
+    } else {
+      int64_t sum = 0;
+      for (uint32_t i = 0; i < length; ++i) {
+        sum += codes[i];
+      }
+      levels->sum += sum;
+    }
+  }
+  return;
+}
+
+static void condition_chunk(uint32_t begin, uint32_t end, void *context)
+{
+  struct condition_context *c = (struct condition_context *) context;
+  condition(c->samples + begin, end - begin, c,
+            &c->chunk_levels[begin / PARALLEL_CHUNK_SAMPLES]);
+  return;
+}
+
+/* a full scale code counts as clipped; the histogram has
+   RF103_ADC_HISTOGRAM_BINS bins over the whole code range */
+static void measure_levels(const int16_t *samples, uint32_t num_samples,
+                           struct frame_levels *levels)
+{
+  int64_t sum = 0;
+  uint64_t sum_squares = 0;
+  int16_t min = levels->min;
+  int16_t max = levels->max;
+  uint32_t clipped = 0;
+  for (uint32_t i = 0; i < num_samples; ++i) {
+    int16_t x = samples[i];
+    sum += x;
+    sum_squares += (uint32_t) (x * x);
+    min = x < min ? x : min;
+    max = x > max ? x : max;
+    clipped += (x == INT16_MAX) | (x == INT16_MIN);
+  }
+  levels->sum += sum;
+  levels->sum_squares += sum_squares;
+  levels->min = min;
+  levels->max = max;
+  levels->clipped += clipped;
+
+  const uint32_t bin_shift = 16 - __builtin_ctz(RF103_ADC_HISTOGRAM_BINS);
+  uint32_t (*histogram)[RF103_ADC_HISTOGRAM_BINS] = levels->histogram;
+  uint32_t i = 0;
+  for (; i + 4 <= num_samples; i += 4) {
+    ++histogram[0][((uint16_t) samples[i] ^ 0x8000) >> bin_shift];
+    ++histogram[1][((uint16_t) samples[i + 1] ^ 0x8000) >> bin_shift];
+    ++histogram[2][((uint16_t) samples[i + 2] ^ 0x8000) >> bin_shift];
+    ++histogram[3][((uint16_t) samples[i + 3] ^ 0x8000) >> bin_shift];
+  }
+  for (; i < num_samples; ++i) {
+    ++histogram[0][((uint16_t) samples[i] ^ 0x8000) >> bin_shift];
+  }
+  return;
+}
+
+static void merge_levels(struct frame_levels *levels,
+                         const struct frame_levels *chunk)
+{
+  levels->sum += chunk->sum;
+  levels->sum_squares += chunk->sum_squares;
+  levels->min = chunk->min < levels->min ? chunk->min : levels->min;
+  levels->max = chunk->max > levels->max ? chunk->max : levels->max;
+  levels->clipped += chunk->clipped;
+  for (uint32_t k = 0; k < 4; ++k) {
+    for (uint32_t b = 0; b < RF103_ADC_HISTOGRAM_BINS; ++b) {
+      levels->histogram[k][b] += chunk->histogram[k][b];
+    }
+  }
+  return;
+}
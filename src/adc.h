@@ -24,6 +24,7 @@
 
 #include "usb_device.h"
 #include "rf103.h"
+#include "parallel.h"
 
 
 #ifdef __cplusplus
@@ -42,14 +43,50 @@ void adc_close(adc_t *this);
 
 int adc_set_random(adc_t *this, int random);
 
+/* replace the callback of an ADC opened with adc_open_async() while not
+   streaming; without a callback the stream is synchronous
+   (adc_read_sync()) */
+int adc_set_callback(adc_t *this, rf103_read_async_cb_t callback,
+                     void *callback_context);
+
+/* split the per sample work on each frame (removing the randomization)
+   across the threads of parallel; 0 to run it in the USB thread */
+int adc_set_parallel(adc_t *this, parallel_t *parallel);
+
+enum ADCCorrectionFlags {
+  ADC_MEASURE_DC = 0x01,    /* track the DC offset */
+  ADC_REMOVE_DC  = 0x02,    /* and subtract it (DC blocker) */
+  ADC_CALIBRATE  = 0x04,    /* apply gain and offset */
+  ADC_MEASURE_LEVELS = 0x08 /* min/max, clipping, RMS, histogram */
+};
+
+/* samples become (x - offset - dc) * gain, rounded to int16, in the same
+   pass that removes the randomization (and measures the levels); the DC
+   offset is tracked with a single pole lowpass with the given time
+   constant (in seconds); can be called while streaming (but not from two
+   threads at once), the new values apply from the next frame */
+int adc_set_correction(adc_t *this, double gain, double offset,
+                       double time_constant, int flags);
+
+/* lock free snapshot of the running estimates; can be called from any
+   thread */
+int adc_get_stats(adc_t *this, struct rf103_adc_stats *stats);
+
 int adc_set_sample_rate(adc_t *this, uint32_t sample_rate);
 
+uint32_t adc_get_frame_size(adc_t *this);
+
+uint32_t adc_get_num_frames(adc_t *this);
+
 int adc_start(adc_t *this);
 
 int adc_stop(adc_t *this);
 
 int adc_reset_status(adc_t *this);
 
+/* 1 if a transfer failed (the stream stopped on its own) */
+int adc_has_failed(adc_t *this);
+
 int adc_read_sync(adc_t *this, uint8_t *data, int length, int *transferred);
 
 #ifdef __cplusplus
@@ -0,0 +1,597 @@
+/*
+ * burst.c - energy burst detector and SigMF burst recorder
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The detector keeps the energy of the last BURST_HOPS quarter windows of
+ * each channel: every time a quarter window fills up, the oldest one is
+ * replaced and the mean power of the whole window is compared with the
+ * thresholds. The energy of the samples is computed with the vector kernel
+ * in dsp.c, so the per sample cost is a multiply-add per I/Q value.
+ *
+ * The sink keeps the last 'pre' samples in a ring, so when a burst starts
+ * it can go back and record them too; the segments are appended one after
+ * the other to the data file, and the metadata file has a capture (with
+ * the index of its first sample in the stream) for each segment and an
+ * annotation for each burst.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf103_burst.h"
+#include "dsp.h"
+
+
+#define BURST_HOPS (4)
+#define BURST_NO_STOP (UINT64_MAX)
+
+struct burst_channel {
+  double hop_energy[BURST_HOPS];
+  double window_energy;
+  double energy;             /* of the current hop */
+  uint32_t hop;              /* oldest entry of hop_energy */
+  uint32_t hop_samples;      /* samples in the current hop */
+  uint32_t num_hops;         /* hops since the first sample (saturated) */
+  int active;
+  uint64_t below_since;      /* power below off since (BURST_NO_STOP: not) */
+  double peak;
+  uint64_t sample_index;     /* next sample */
+};
+
+typedef struct rf103_burst_detector {
+  uint32_t num_channels;
+  uint32_t hop_size;
+  double on_level;           /* window energies */
+  double off_level;
+  uint64_t holdoff;
+  rf103_burst_cb_t callback;
+  void *callback_context;
+  struct burst_channel *channels;
+} rf103_burst_detector_t;
+
+struct burst_capture {
+  uint64_t file_start;
+  uint64_t global_start;
+};
+
+struct burst_annotation {
+  uint64_t file_start;
+  uint64_t count;
+};
+
+typedef struct rf103_burst_sink {
+  char *basename;
+  FILE *data;
+  double sample_rate;
+  double frequency;
+  uint32_t pre;
+  uint32_t post;
+  float *history;            /* last pre samples (ring) */
+  uint32_t history_head;     /* next sample to be written */
+  uint32_t history_count;
+  uint64_t sample_index;     /* of the next sample */
+  uint64_t file_samples;
+  int recording;
+  uint64_t record_from;
+  uint64_t record_until;     /* BURST_NO_STOP while the burst is on */
+  uint64_t burst_start;      /* global index of the current burst */
+  uint64_t segment_start;    /* global index of the first sample written */
+  struct burst_capture *captures;
+  uint32_t num_captures;
+  uint32_t max_captures;
+  struct burst_annotation *annotations;
+  uint32_t num_annotations;
+  uint32_t max_annotations;
+} rf103_burst_sink_t;
+
+
+/* internal functions */
+static void end_of_hop(rf103_burst_detector_t *this, uint32_t channel,
+                       struct burst_channel *state);
+static double to_db(double power);
+static void save_history(rf103_burst_sink_t *this, const float *samples,
+                         uint32_t num_samples);
+static int write_history(rf103_burst_sink_t *this, uint64_t from);
+static int write_samples(rf103_burst_sink_t *this, const float *samples,
+                         uint32_t num_samples);
+static int start_segment(rf103_burst_sink_t *this, uint64_t from);
+static int end_burst(rf103_burst_sink_t *this, uint64_t until);
+static void *grow(void *array, uint32_t *max_items, size_t item_size);
+static int write_metadata(rf103_burst_sink_t *this);
+
+
+rf103_burst_detector_t *rf103_burst_detector_open(uint32_t num_channels,
+                                                  uint32_t window,
+                                                  double on_db, double off_db,
+                                                  uint32_t holdoff,
+                                                  rf103_burst_cb_t callback,
+                                                  void *callback_context)
+{
+  rf103_burst_detector_t *ret_val = 0;
+
+  if (num_channels == 0 || window < BURST_HOPS || off_db > on_db ||
+      callback == 0) {
+    fprintf(stderr, "ERROR - rf103_burst_detector_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+
+  rf103_burst_detector_t *this = (rf103_burst_detector_t *)
+                                 malloc(sizeof(rf103_burst_detector_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
+  this->channels = (struct burst_channel *) calloc(num_channels,
+                                                   sizeof(struct burst_channel));
+  if (this->channels == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(this);
+    return ret_val;
+  }
+  this->num_channels = num_channels;
+  this->hop_size = window / BURST_HOPS;
+  /* compare energies, not powers, to save a division per hop */
+  double window_size = (double) this->hop_size * BURST_HOPS;
+  this->on_level = window_size * pow(10.0, on_db / 10.0);
+  this->off_level = window_size * pow(10.0, off_db / 10.0);
+  this->holdoff = holdoff;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  for (uint32_t c = 0; c < num_channels; ++c) {
+    this->channels[c].below_since = BURST_NO_STOP;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void rf103_burst_detector_close(rf103_burst_detector_t *this)
+{
+  free(this->channels);
+  free(this);
+  return;
+}
+
+
+int rf103_burst_detector_process(rf103_burst_detector_t *this,
+                                 uint32_t channel, const float *samples,
+                                 uint32_t num_samples)
+{
+  if (channel >= this->num_channels) {
+    fprintf(stderr, "ERROR - rf103_burst_detector_process() failed: invalid channel %u\n",
+            channel);
+    return -1;
+  }
+
+  struct burst_channel *state = &this->channels[channel];
+  uint32_t hop_size = this->hop_size;
+  uint32_t i = 0;
+  while (i < num_samples) {
+    uint32_t length = hop_size - state->hop_samples;
+    if (length > num_samples - i) {
+      length = num_samples - i;
+    }
+    state->energy += dsp_energy(samples + 2 * (size_t) i, 2 * (size_t) length);
+    state->hop_samples += length;
+    state->sample_index += length;
+    i += length;
+    if (state->hop_samples == hop_size) {
+      end_of_hop(this, channel, state);
+    }
+  }
+  return 0;
+}
+
+
+rf103_burst_sink_t *rf103_burst_sink_open(const char *basename,
+                                          double sample_rate,
+                                          double frequency, uint32_t pre,
+                                          uint32_t post)
+{
+  rf103_burst_sink_t *ret_val = 0;
+
+  if (sample_rate <= 0.0) {
+    fprintf(stderr, "ERROR - rf103_burst_sink_open() failed: invalid sample rate\n");
+    return ret_val;
+  }
+
+  rf103_burst_sink_t *this = (rf103_burst_sink_t *)
+                             calloc(1, sizeof(rf103_burst_sink_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  size_t basename_size = strlen(basename) + 1;
+  this->basename = (char *) malloc(basename_size);
+  this->history = (float *) malloc((pre > 0 ? pre : 1) * 2 * sizeof(float));
+  if (this->basename == 0 || this->history == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL;
+  }
+  memcpy(this->basename, basename, basename_size);
+
+  char *filename = (char *) malloc(basename_size + 16);
+  if (filename == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL;
+  }
+  sprintf(filename, "%s.sigmf-data", basename);
+  this->data = fopen(filename, "wb");
+  if (this->data == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    free(filename);
+    goto FAIL;
+  }
+  free(filename);
+
+  this->sample_rate = sample_rate;
+  this->frequency = frequency;
+  this->pre = pre;
+  this->post = post;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  free(this->history);
+  free(this->basename);
+  free(this);
+  return ret_val;
+}
+
+
+int rf103_burst_sink_close(rf103_burst_sink_t *this)
+{
+  int ret_val = 0;
+
+  /* a burst still on is cut at the last sample */
+  if (this->recording) {
+    if (this->record_until == BURST_NO_STOP) {
+      ret_val |= end_burst(this, this->sample_index);
+    }
+    this->recording = 0;
+  }
+  if (fclose(this->data) != 0) {
+    fprintf(stderr, "ERROR - fclose() failed\n");
+    ret_val = -1;
+  }
+  if (write_metadata(this) != 0) {
+    ret_val = -1;
+  }
+  free(this->annotations);
+  free(this->captures);
+  free(this->history);
+  free(this->basename);
+  free(this);
+  return ret_val;
+}
+
+
+int rf103_burst_sink_event(rf103_burst_sink_t *this,
+                           const struct rf103_burst_event *event)
+{
+  if (event->type == RF103_BURST_START) {
+    if (this->recording && this->record_until != BURST_NO_STOP) {
+      /* within the post padding of the previous burst: same segment */
+      this->record_until = BURST_NO_STOP;
+      this->burst_start = event->sample_index;
+      return 0;
+    }
+    if (this->recording) {
+      return 0;
+    }
+    uint64_t from = event->sample_index > this->pre ?
+                    event->sample_index - this->pre : 0;
+    this->burst_start = event->sample_index;
+    return start_segment(this, from);
+  }
+
+  if (!this->recording || this->record_until != BURST_NO_STOP) {
+    return 0;
+  }
+  if (end_burst(this, event->sample_index) != 0) {
+    return -1;
+  }
+  this->record_until = event->sample_index + this->post;
+  if (this->record_until <= this->sample_index) {
+    this->recording = 0;
+  }
+  return 0;
+}
+
+
+int rf103_burst_sink_write(rf103_burst_sink_t *this, const float *samples,
+                           uint32_t num_samples)
+{
+  int ret_val = 0;
+
+  if (this->recording) {
+    uint64_t first = this->sample_index;
+    uint64_t last = first + num_samples;
+    uint64_t from = this->record_from > first ? this->record_from : first;
+    uint64_t until = this->record_until < last ? this->record_until : last;
+    if (from < until) {
+      ret_val = write_samples(this, samples + 2 * (from - first),
+                              (uint32_t) (until - from));
+    }
+    if (this->record_until <= last) {
+      this->recording = 0;
+    }
+  }
+  save_history(this, samples, num_samples);
+  this->sample_index += num_samples;
+  return ret_val;
+}
+
+
+/* internal functions */
+static void end_of_hop(rf103_burst_detector_t *this, uint32_t channel,
+                       struct burst_channel *state)
+{
+  /* subtract and add instead of summing the hops, with a fresh sum once
+     per window so the rounding errors don't build up */
+  state->window_energy += state->energy - state->hop_energy[state->hop];
+  state->hop_energy[state->hop] = state->energy;
+  state->hop = (state->hop + 1) % BURST_HOPS;
+  if (state->hop == 0) {
+    double sum = 0.0;
+    for (uint32_t k = 0; k < BURST_HOPS; ++k) {
+      sum += state->hop_energy[k];
+    }
+    state->window_energy = sum;
+  }
+  state->energy = 0.0;
+  state->hop_samples = 0;
+  if (state->num_hops < BURST_HOPS) {
+    if (++state->num_hops < BURST_HOPS) {
+      return;
+    }
+  }
+
+  double window_energy = state->window_energy;
+  uint64_t window_size = (uint64_t) this->hop_size * BURST_HOPS;
+  double window_scale = 1.0 / window_size;
+  struct rf103_burst_event event;
+  event.channel = channel;
+
+  if (!state->active) {
+    if (window_energy > this->on_level) {
+      /* the burst cannot have started before the window did */
+      state->active = 1;
+      state->below_since = BURST_NO_STOP;
+      state->peak = window_energy;
+      event.type = RF103_BURST_START;
+      event.sample_index = state->sample_index - window_size;
+      event.power_db = to_db(window_energy * window_scale);
+      this->callback(&event, this->callback_context);
+    }
+    return;
+  }
+
+  if (window_energy > state->peak) {
+    state->peak = window_energy;
+  }
+  if (window_energy >= this->off_level) {
+    state->below_since = BURST_NO_STOP;
+    return;
+  }
+  if (state->below_since == BURST_NO_STOP) {
+    state->below_since = state->sample_index;
+  }
+  if (state->sample_index - state->below_since >= this->holdoff) {
+    /* the first quiet window may still hold the tail of the burst, so
+       the burst ends where that window does */
+    state->active = 0;
+    event.type = RF103_BURST_STOP;
+    event.sample_index = state->below_since;
+    event.power_db = to_db(state->peak * window_scale);
+    state->below_since = BURST_NO_STOP;
+    this->callback(&event, this->callback_context);
+  }
+  return;
+}
+
+static double to_db(double power)
+{
+  return power > 0.0 ? 10.0 * log10(power) : -INFINITY;
+}
+
+static void save_history(rf103_burst_sink_t *this, const float *samples,
+                         uint32_t num_samples)
+{
+  uint32_t pre = this->pre;
+  if (pre == 0) {
+    return;
+  }
+  if (num_samples > pre) {
+    samples += 2 * (size_t) (num_samples - pre);
+    num_samples = pre;
+  }
+  while (num_samples > 0) {
+    uint32_t length = pre - this->history_head;
+    if (length > num_samples) {
+      length = num_samples;
+    }
+    memcpy(this->history + 2 * (size_t) this->history_head, samples,
+           length * 2 * sizeof(float));
+    this->history_head = (this->history_head + length) % pre;
+    samples += 2 * (size_t) length;
+    num_samples -= length;
+    this->history_count += length;
+  }
+  if (this->history_count > pre) {
+    this->history_count = pre;
+  }
+  return;
+}
+
+/* write the samples of the history from index 'from' onwards */
+static int write_history(rf103_burst_sink_t *this, uint64_t from)
+{
+  uint32_t pre = this->pre;
+  uint32_t count = (uint32_t) (this->sample_index - from);
+  uint32_t start = (this->history_head + pre - count) % pre;
+  uint32_t length = pre - start < count ? pre - start : count;
+  if (write_samples(this, this->history + 2 * (size_t) start, length) != 0) {
+    return -1;
+  }
+  return write_samples(this, this->history, count - length);
+}
+
+static int write_samples(rf103_burst_sink_t *this, const float *samples,
+                         uint32_t num_samples)
+{
+  if (num_samples == 0) {
+    return 0;
+  }
+  if (fwrite(samples, 2 * sizeof(float), num_samples, this->data) !=
+      num_samples) {
+    fprintf(stderr, "ERROR - fwrite() failed\n");
+    return -1;
+  }
+  this->file_samples += num_samples;
+  return 0;
+}
+
+static int start_segment(rf103_burst_sink_t *this, uint64_t from)
+{
+  /* no further back than the history goes */
+  uint64_t oldest = this->sample_index - this->history_count;
+  if (from < oldest) {
+    from = oldest;
+  }
+  if (this->num_captures == this->max_captures) {
+    void *captures = grow(this->captures, &this->max_captures,
+                          sizeof(struct burst_capture));
+    if (captures == 0) {
+      return -1;
+    }
+    this->captures = (struct burst_capture *) captures;
+  }
+  struct burst_capture *capture = &this->captures[this->num_captures++];
+  capture->file_start = this->file_samples;
+  capture->global_start = from;
+  this->segment_start = from;
+  this->recording = 1;
+  this->record_from = from;
+  this->record_until = BURST_NO_STOP;
+  if (from < this->sample_index) {
+    if (write_history(this, from) != 0) {
+      return -1;
+    }
+    this->record_from = this->sample_index;
+  }
+  return 0;
+}
+
+static int end_burst(rf103_burst_sink_t *this, uint64_t until)
+{
+  if (this->num_annotations == this->max_annotations) {
+    void *annotations = grow(this->annotations, &this->max_annotations,
+                             sizeof(struct burst_annotation));
+    if (annotations == 0) {
+      return -1;
+    }
+    this->annotations = (struct burst_annotation *) annotations;
+  }
+  /* the burst start may be before the history (no pre padding) */
+  uint64_t start = this->burst_start > this->segment_start ?
+                   this->burst_start : this->segment_start;
+  struct burst_annotation *annotation =
+                              &this->annotations[this->num_annotations++];
+  struct burst_capture *capture = &this->captures[this->num_captures - 1];
+  annotation->file_start = capture->file_start + (start - this->segment_start);
+  annotation->count = until > start ? until - start : 0;
+  return 0;
+}
+
+static void *grow(void *array, uint32_t *max_items, size_t item_size)
+{
+  uint32_t max = *max_items > 0 ? 2 * *max_items : 64;
+  void *ret_val = realloc(array, max * item_size);
+  if (ret_val == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return ret_val;
+  }
+  *max_items = max;
+  return ret_val;
+}
+
+static int write_metadata(rf103_burst_sink_t *this)
+{
+  size_t filename_size = strlen(this->basename) + 16;
+  char *filename = (char *) malloc(filename_size);
+  if (filename == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  sprintf(filename, "%s.sigmf-meta", this->basename);
+  FILE *fp = fopen(filename, "w");
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    free(filename);
+    return -1;
+  }
+  free(filename);
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"global\": {\n");
+  fprintf(fp, "    \"core:datatype\": \"cf32_le\",\n");
+  fprintf(fp, "    \"core:sample_rate\": %.17g,\n", this->sample_rate);
+  fprintf(fp, "    \"core:recorder\": \"librf103\",\n");
+  fprintf(fp, "    \"core:version\": \"1.0.0\"\n");
+  fprintf(fp, "  },\n");
+  fprintf(fp, "  \"captures\": [");
+  for (uint32_t i = 0; i < this->num_captures; ++i) {
+    const struct burst_capture *capture = &this->captures[i];
+    fprintf(fp, "%s\n    {\n", i > 0 ? "," : "");
+    fprintf(fp, "      \"core:sample_start\": %llu,\n",
+            (unsigned long long) capture->file_start);
+    if (this->frequency != 0.0) {
+      fprintf(fp, "      \"core:frequency\": %.17g,\n", this->frequency);
+    }
+    fprintf(fp, "      \"core:global_index\": %llu\n",
+            (unsigned long long) capture->global_start);
+    fprintf(fp, "    }");
+  }
+  fprintf(fp, "%s],\n", this->num_captures > 0 ? "\n  " : "");
+  fprintf(fp, "  \"annotations\": [");
+  for (uint32_t i = 0; i < this->num_annotations; ++i) {
+    const struct burst_annotation *annotation = &this->annotations[i];
+    fprintf(fp, "%s\n    {\n", i > 0 ? "," : "");
+    fprintf(fp, "      \"core:sample_start\": %llu,\n",
+            (unsigned long long) annotation->file_start);
+    fprintf(fp, "      \"core:sample_count\": %llu,\n",
+            (unsigned long long) annotation->count);
+    fprintf(fp, "      \"core:label\": \"burst\"\n");
+    fprintf(fp, "    }");
+  }
+  fprintf(fp, "%s]\n", this->num_annotations > 0 ? "\n  " : "");
+  fprintf(fp, "}\n");
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "ERROR - fclose() failed\n");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ * channelizer.c - polyphase filter bank channelizer
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - F. J. Harris, "Multirate Signal Processing for Communication Systems",
+ *    chapter 9
+ *
+ * Channel k is the input shifted down by k fs / M, lowpass filtered with
+ * the prototype h and decimated by D (M or M / 2). Splitting h into M
+ * branches, every output block needs one M-point polyphase sum (the branch
+ * sums are vectorized across the branches) and one inverse FFT that gives
+ * all the channels at once; for D = M / 2 the odd channels of odd blocks
+ * are negated. When only a few channels are enabled, their DFT bins are
+ * computed directly instead.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channelizer.h"
+#include "dsp.h"
+#include "fft.h"
+#include "filter_design.h"
+#include "simd.h"
+
+
+static const uint32_t CHANNELIZER_TAPS_PER_BRANCH = 16;
+static const double CHANNELIZER_ATTENUATION = 80.0;   /* dB */
+
+typedef struct channelizer {
+  uint32_t num_channels;     /* M (also the number of branches) */
+  uint32_t num_outputs;      /* M / 2 + 1 */
+  uint32_t decimation;
+  uint32_t num_taps;
+  uint32_t max_direct;       /* compute up to this many bins without FFT */
+  float *taps;               /* prototype, reversed */
+  fft_t *fft;
+  float *fft_in;
+  float *fft_out;
+  float *branches;
+  float *roots;              /* exp(j 2 pi i / M) */
+  atomic_uchar *enabled;
+  uint32_t *active;
+  uint64_t num_blocks;
+  float *buffer;
+  uint32_t buffer_length;
+  uint32_t buffer_size;
+  float *outputs;            /* num_outputs rows of output_size samples */
+  uint32_t output_size;
+  channelizer_output_cb_t callback;
+  void *callback_context;
+} channelizer_t;
+
+
+/* internal functions */
+static int reserve(channelizer_t *this, uint32_t length,
+                   uint32_t num_blocks);
+static void run_block(channelizer_t *this, const float *x, uint32_t n,
+                      uint32_t num_active);
+
+
+channelizer_t *channelizer_open(uint32_t num_channels, int oversampled,
+                                channelizer_output_cb_t callback,
+                                void *callback_context)
+{
+  channelizer_t *ret_val = 0;
+
+  if (num_channels < SIMD_FLOAT_LANES ||
+      (num_channels & (num_channels - 1)) != 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed: the number of channels must be a power of 2 (at least %d)\n",
+            SIMD_FLOAT_LANES);
+    return ret_val;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed: no callback\n");
+    return ret_val;
+  }
+
+  channelizer_t *this = (channelizer_t *) calloc(1, sizeof(channelizer_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  uint32_t m = num_channels;
+  this->num_channels = m;
+  this->num_outputs = m / 2 + 1;
+  this->decimation = oversampled ? m / 2 : m;
+  this->num_taps = m * CHANNELIZER_TAPS_PER_BRANCH;
+  /* a direct DFT bin costs M complex multiply-adds, the FFT about
+     M / 2 log2(M) */
+  this->max_direct = 0;
+  while ((1U << this->max_direct) < m) {
+    ++this->max_direct;
+  }
+  this->max_direct /= 2;
+  this->callback = callback;
+  this->callback_context = callback_context;
+
+  float *prototype = fir_design_lowpass(this->num_taps, 0.5 / m,
+                                        CHANNELIZER_ATTENUATION);
+  this->taps = (float *) malloc(this->num_taps * sizeof(float));
+  this->fft = fft_open(m, FFT_INVERSE);
+  this->fft_in = (float *) malloc(2 * m * sizeof(float));
+  this->fft_out = (float *) malloc(2 * m * sizeof(float));
+  this->branches = (float *) malloc(m * sizeof(float));
+  this->roots = (float *) malloc(2 * m * sizeof(float));
+  this->enabled = (atomic_uchar *) malloc(this->num_outputs *
+                                          sizeof(atomic_uchar));
+  this->active = (uint32_t *) malloc(this->num_outputs * sizeof(uint32_t));
+  if (prototype == 0 || this->taps == 0 || this->fft == 0 ||
+      this->fft_in == 0 || this->fft_out == 0 || this->branches == 0 ||
+      this->roots == 0 || this->enabled == 0 || this->active == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed: out of memory\n");
+    free(prototype);
+    channelizer_close(this);
+    return ret_val;
+  }
+
+  /* the factor 2 gives unity gain for the positive frequency half of a
+     real signal */
+  for (uint32_t i = 0; i < this->num_taps; ++i) {
+    this->taps[this->num_taps - 1 - i] = 2.0f * prototype[i];
+  }
+  free(prototype);
+  for (uint32_t i = 0; i < m; ++i) {
+    this->roots[2 * i] = (float) cos(2.0 * M_PI * i / m);
+    this->roots[2 * i + 1] = (float) sin(2.0 * M_PI * i / m);
+  }
+  for (uint32_t k = 0; k < this->num_outputs; ++k) {
+    atomic_init(&this->enabled[k], 1);
+  }
+  this->num_blocks = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void channelizer_close(channelizer_t *this)
+{
+  free(this->taps);
+  if (this->fft) {
+    fft_close(this->fft);
+  }
+  free(this->fft_in);
+  free(this->fft_out);
+  free(this->branches);
+  free(this->roots);
+  free(this->enabled);
+  free(this->active);
+  free(this->buffer);
+  free(this->outputs);
+  free(this);
+  return;
+}
+
+
+int channelizer_enable(channelizer_t *this, uint32_t channel, int enable)
+{
+  if (channel >= this->num_outputs) {
+    fprintf(stderr, "ERROR - channelizer_enable() failed: invalid channel %u\n",
+            channel);
+    return -1;
+  }
+  atomic_store_explicit(&this->enabled[channel], enable ? 1 : 0,
+                        memory_order_relaxed);
+  return 0;
+}
+
+
+int channelizer_process(channelizer_t *this, const int16_t *samples,
+                        uint32_t num_samples)
+{
+  uint32_t length = this->buffer_length + num_samples;
+  uint32_t num_blocks = length >= this->num_taps ?
+                        (length - this->num_taps) / this->decimation + 1 : 0;
+  if (reserve(this, length, num_blocks) < 0) {
+    return -1;
+  }
+  dsp_int16_to_float(samples, this->buffer + this->buffer_length,
+                     num_samples);
+  this->buffer_length = length;
+
+  uint32_t num_active = 0;
+  for (uint32_t k = 0; k < this->num_outputs; ++k) {
+    if (atomic_load_explicit(&this->enabled[k], memory_order_relaxed)) {
+      this->active[num_active++] = k;
+    }
+  }
+
+  for (uint32_t n = 0; n < num_blocks; ++n) {
+    run_block(this, this->buffer + n * this->decimation, n, num_active);
+  }
+
+  uint32_t consumed = num_blocks * this->decimation;
+  this->buffer_length -= consumed;
+  memmove(this->buffer, this->buffer + consumed,
+          this->buffer_length * sizeof(float));
+
+  if (num_blocks == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < num_active; ++i) {
+    uint32_t k = this->active[i];
+    this->callback(k, num_blocks,
+                   this->outputs + (size_t) k * 2 * this->output_size,
+                   this->callback_context);
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static int reserve(channelizer_t *this, uint32_t length, uint32_t num_blocks)
+{
+  if (length > this->buffer_size) {
+    float *buffer = (float *) realloc(this->buffer, length * sizeof(float));
+    if (buffer == 0) {
+      fprintf(stderr, "ERROR - realloc() failed\n");
+      return -1;
+    }
+    this->buffer = buffer;
+    this->buffer_size = length;
+  }
+  if (num_blocks > this->output_size) {
+    float *outputs = (float *) malloc((size_t) this->num_outputs * 2 *
+                                      num_blocks * sizeof(float));
+    if (outputs == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      return -1;
+    }
+    free(this->outputs);
+    this->outputs = outputs;
+    this->output_size = num_blocks;
+  }
+  return 0;
+}
+
+static void run_block(channelizer_t *this, const float *x, uint32_t n,
+                      uint32_t num_active)
+{
+  uint32_t m = this->num_channels;
+
+  /* branch sums, with the branches in reverse order */
+  float *branches = this->branches;
+  for (uint32_t r = 0; r < m; r += SIMD_FLOAT_LANES) {
+    v8sf acc = { 0 };
+    for (uint32_t j = r; j < this->num_taps; j += m) {
+      acc += V8SF_LOAD(this->taps + j) * V8SF_LOAD(x + j);
+    }
+    V8SF_STORE(branches + r, acc);
+  }
+
+  /* for D = M / 2 every other block the odd channels change sign */
+  float odd_sign = 1.0f;
+  if (this->decimation != m && (this->num_blocks++ & 1)) {
+    odd_sign = -1.0f;
+  }
+
+  float *outputs = this->outputs + 2 * n;
+  size_t row = 2 * (size_t) this->output_size;
+  if (num_active <= this->max_direct) {
+    const float *roots = this->roots;
+    for (uint32_t i = 0; i < num_active; ++i) {
+      uint32_t k = this->active[i];
+      float re = 0.0f;
+      float im = 0.0f;
+      for (uint32_t p = 0, index = 0; p < m; ++p, index = (index + k) & (m - 1)) {
+        float v = branches[m - 1 - p];
+        re += v * roots[2 * index];
+        im += v * roots[2 * index + 1];
+      }
+      float sign = (k & 1) ? odd_sign : 1.0f;
+      outputs[k * row] = sign * re;
+      outputs[k * row + 1] = sign * im;
+    }
+    return;
+  }
+
+  for (uint32_t p = 0; p < m; ++p) {
+    this->fft_in[2 * p] = branches[m - 1 - p];
+    this->fft_in[2 * p + 1] = 0.0f;
+  }
+  fft_execute(this->fft, this->fft_in, this->fft_out);
+  for (uint32_t i = 0; i < num_active; ++i) {
+    uint32_t k = this->active[i];
+    float sign = (k & 1) ? odd_sign : 1.0f;
+    outputs[k * row] = sign * this->fft_out[2 * k];
+    outputs[k * row + 1] = sign * this->fft_out[2 * k + 1];
+  }
+  return;
+}
@@ -0,0 +1,60 @@
+/*
+ * channelizer.h - polyphase filter bank channelizer
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CHANNELIZER_H
+#define __CHANNELIZER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct channelizer channelizer_t;
+
+/* num_samples complex samples (interleaved floats) for one channel */
+typedef void (*channelizer_output_cb_t)(uint32_t channel, uint32_t num_samples,
+                                        const float *samples, void *context);
+
+/* split the real stream into num_channels channels of width fs/num_channels
+   (num_channels must be a power of 2); channel k is centered on
+   k * fs / num_channels, for k = 0 to num_channels / 2; the channels are
+   sampled at fs / num_channels, or at twice that rate when oversampled is
+   set, so that the band edges are free of aliases; all the channels start
+   enabled */
+channelizer_t *channelizer_open(uint32_t num_channels, int oversampled,
+                                channelizer_output_cb_t callback,
+                                void *callback_context);
+
+void channelizer_close(channelizer_t *this);
+
+/* can be called from any thread; takes effect at the next block */
+int channelizer_enable(channelizer_t *this, uint32_t channel, int enable);
+
+int channelizer_process(channelizer_t *this, const int16_t *samples,
+                        uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CHANNELIZER_H */
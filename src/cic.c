@@ -0,0 +1,298 @@
+/*
+ * cic.c - CIC decimator
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - E. B. Hogenauer, "An Economical Class of Digital Filters for
+ *    Decimation and Interpolation", IEEE Trans. ASSP, vol. 29, 1981
+ */
+
+/* The registers are unsigned 64 bit integers, so the integrators can wrap
+ * around freely: as long as the output of a section fits in 64 bits, the
+ * combs undo the wrap arounds exactly (modular arithmetic). The channels
+ * are processed in pairs, one per lane of a 128 bit vector, so each step
+ * handles two channels (e.g. I and Q) at once. The samples go through the
+ * sections in blocks: each integrator is a running sum over the whole
+ * block, which keeps its register out of memory, and only the decimated
+ * samples reach the combs.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cic.h"
+
+
+typedef uint64_t v2du __attribute__((vector_size(16)));
+typedef int64_t v2di __attribute__((vector_size(16)));
+
+#define CIC_LANES (2)
+#define CIC_MAX_SECTIONS (8)
+#define CIC_MAX_ORDER (16)
+#define CIC_BLOCK (256)        /* frames */
+
+struct cic_section {
+  uint32_t decimation;
+  uint32_t shift;            /* output scaling */
+};
+
+typedef struct cic {
+  uint32_t order;
+  uint32_t num_channels;
+  uint32_t num_groups;       /* pairs of channels */
+  uint32_t num_sections;
+  struct cic_section sections[CIC_MAX_SECTIONS];
+  uint32_t phase[CIC_MAX_SECTIONS];
+  v2du *state;               /* [group][section][integrators, combs] */
+  double gain;
+} cic_t;
+
+
+/* internal functions */
+static uint32_t largest_divisor(uint32_t n, uint32_t max);
+static uint32_t run_section(const struct cic_section *section,
+                            uint32_t order, v2du *integrators,
+                            v2du *block, uint32_t length, uint32_t *phase);
+
+
+cic_t *cic_open(uint32_t order, uint32_t decimation, uint32_t num_channels,
+                uint32_t input_bits)
+{
+  cic_t *ret_val = 0;
+
+  if (order == 0 || order > CIC_MAX_ORDER || decimation < 2 ||
+      num_channels == 0 || input_bits < 2 || input_bits > 32) {
+    fprintf(stderr, "ERROR - cic_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+
+  /* largest section decimation R with R^order * 2^(input_bits - 1) < 2^63 */
+  uint32_t max_decimation = (uint32_t) floor(pow(2.0,
+                                   (64.0 - input_bits) / order) + 1e-9);
+  struct cic_section sections[CIC_MAX_SECTIONS];
+  uint32_t num_sections = 0;
+  double gain = 1.0;
+  uint32_t remaining = decimation;
+  while (remaining > 1) {
+    uint32_t r = largest_divisor(remaining, max_decimation);
+    if (r < 2 || num_sections == CIC_MAX_SECTIONS) {
+      fprintf(stderr, "ERROR - cic_open() failed: decimation %u cannot be split into sections of at most %u\n",
+              decimation, max_decimation);
+      return ret_val;
+    }
+    /* scale by 2^-ceil(log2(r^order)), so the output never grows */
+    double bits = order * log2((double) r);
+    uint32_t shift = (uint32_t) ceil(bits - 1e-9);
+    sections[num_sections].decimation = r;
+    sections[num_sections].shift = shift;
+    gain *= pow(r, order) / ldexp(1.0, shift);
+    ++num_sections;
+    remaining /= r;
+  }
+
+  cic_t *this = (cic_t *) calloc(1, sizeof(cic_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->order = order;
+  this->num_channels = num_channels;
+  this->num_groups = (num_channels + CIC_LANES - 1) / CIC_LANES;
+  this->num_sections = num_sections;
+  for (uint32_t s = 0; s < num_sections; ++s) {
+    this->sections[s] = sections[s];
+  }
+  this->gain = gain;
+  size_t state_size = (size_t) this->num_groups * num_sections * 2 * order *
+                      sizeof(v2du);
+  this->state = (v2du *) aligned_alloc(sizeof(v2du), state_size);
+  if (this->state == 0) {
+    fprintf(stderr, "ERROR - aligned_alloc() failed\n");
+    free(this);
+    return ret_val;
+  }
+  for (size_t i = 0; i < state_size / sizeof(v2du); ++i) {
+    this->state[i] = (v2du) { 0, 0 };
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void cic_close(cic_t *this)
+{
+  free(this->state);
+  free(this);
+  return;
+}
+
+
+double cic_get_gain(cic_t *this)
+{
+  return this->gain;
+}
+
+
+double cic_response(double frequency, void *context)
+{
+  cic_t *this = (cic_t *) context;
+  /* the last section runs at the output rate; going backwards each
+     section sees the frequency relative to a higher rate */
+  double response = 1.0;
+  double f = frequency;
+  for (uint32_t s = this->num_sections; s-- > 0; ) {
+    uint32_t r = this->sections[s].decimation;
+    f /= r;
+    double x = M_PI * f;
+    double h = fabs(x) < 1e-12 ? 1.0 : sin(r * x) / (r * sin(x));
+    response *= pow(fabs(h), this->order);
+  }
+  return response;
+}
+
+
+uint32_t cic_process(cic_t *this, const int32_t *input, uint32_t num_frames,
+                     int32_t *output)
+{
+  uint32_t order = this->order;
+  uint32_t num_channels = this->num_channels;
+  uint32_t num_sections = this->num_sections;
+  uint32_t num_output = 0;
+  v2du block[CIC_BLOCK];
+
+  for (uint32_t g = 0; g < this->num_groups; ++g) {
+    uint32_t c0 = g * CIC_LANES;
+    int has_c1 = c0 + 1 < num_channels;
+    v2du *state = this->state + (size_t) g * num_sections * 2 * order;
+    uint32_t phase[CIC_MAX_SECTIONS];
+    for (uint32_t s = 0; s < num_sections; ++s) {
+      phase[s] = this->phase[s];
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num_frames; i += CIC_BLOCK) {
+      uint32_t length = num_frames - i < CIC_BLOCK ? num_frames - i :
+                                                     CIC_BLOCK;
+      for (uint32_t j = 0; j < length; ++j) {
+        const int32_t *in = input + (size_t) (i + j) * num_channels + c0;
+        block[j] = (v2du) { (uint64_t) (int64_t) in[0],
+                            has_c1 ? (uint64_t) (int64_t) in[1] : 0 };
+      }
+      for (uint32_t s = 0; s < num_sections && length > 0; ++s) {
+        length = run_section(&this->sections[s], order, state + s * 2 * order,
+                             block, length, &phase[s]);
+      }
+      for (uint32_t j = 0; j < length; ++j) {
+        int32_t *out = output + (size_t) (n + j) * num_channels + c0;
+        out[0] = (int32_t) (int64_t) block[j][0];
+        if (has_c1) {
+          out[1] = (int32_t) (int64_t) block[j][1];
+        }
+      }
+      n += length;
+    }
+    num_output = n;
+    if (g + 1 == this->num_groups) {
+      for (uint32_t s = 0; s < num_sections; ++s) {
+        this->phase[s] = phase[s];
+      }
+    }
+  }
+
+  return num_output;
+}
+
+
+/* internal functions */
+static uint32_t largest_divisor(uint32_t n, uint32_t max)
+{
+  for (uint32_t r = n < max ? n : max; r >= 2; --r) {
+    if (n % r == 0) {
+      return r;
+    }
+  }
+  return 1;
+}
+
+/* all the integrators in one pass, with the registers in local variables:
+   only the first one is a dependency from one sample to the next, the
+   others overlap; the callers pass a constant order, so the inner loop is
+   unrolled and the registers stay in vector registers */
+static inline __attribute__((always_inline))
+void integrate(v2du *integrators, v2du *block, uint32_t length,
+               uint32_t order)
+{
+  v2du acc[CIC_MAX_ORDER];
+  for (uint32_t k = 0; k < order; ++k) {
+    acc[k] = integrators[k];
+  }
+  for (uint32_t j = 0; j < length; ++j) {
+    v2du x = block[j];
+    for (uint32_t k = 0; k < order; ++k) {
+      acc[k] += x;
+      x = acc[k];
+    }
+    block[j] = x;
+  }
+  for (uint32_t k = 0; k < order; ++k) {
+    integrators[k] = acc[k];
+  }
+}
+
+/* integrate, decimate and comb a block in place; returns the number of
+   decimated samples left at the start of the block */
+static uint32_t run_section(const struct cic_section *section,
+                            uint32_t order, v2du *integrators,
+                            v2du *block, uint32_t length, uint32_t *phase)
+{
+  switch (order) {
+  case 1: integrate(integrators, block, length, 1); break;
+  case 2: integrate(integrators, block, length, 2); break;
+  case 3: integrate(integrators, block, length, 3); break;
+  case 4: integrate(integrators, block, length, 4); break;
+  case 5: integrate(integrators, block, length, 5); break;
+  case 6: integrate(integrators, block, length, 6); break;
+  case 7: integrate(integrators, block, length, 7); break;
+  default: integrate(integrators, block, length, order); break;
+  }
+
+  /* phase is the number of samples since the last output */
+  uint32_t decimation = section->decimation;
+  uint32_t n = 0;
+  for (uint32_t j = decimation - 1 - *phase; j < length; j += decimation) {
+    block[n++] = block[j];
+  }
+  *phase = (*phase + length) % decimation;
+
+  v2du *combs = integrators + order;
+  for (uint32_t j = 0; j < n; ++j) {
+    v2du x = block[j];
+    for (uint32_t k = 0; k < order; ++k) {
+      v2du delayed = combs[k];
+      combs[k] = x;
+      x -= delayed;
+    }
+    /* arithmetic shift of the two's complement value */
+    block[j] = (v2du) ((v2di) x >> (int64_t) section->shift);
+  }
+  return n;
+}
@@ -0,0 +1,60 @@
+/*
+ * cic.h - CIC decimator
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CIC_H
+#define __CIC_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cic cic_t;
+
+/* cascade of CIC decimators with order (up to 16) integrator and comb
+   stages each, for num_channels interleaved int32 channels whose values
+   fit in input_bits bits (sign included); the decimation is split into
+   sections small enough for the 64 bit registers (it fails if it has a
+   prime factor too large for that), and the output of each section is
+   scaled down by a power of 2 so it fits in input_bits bits too */
+cic_t *cic_open(uint32_t order, uint32_t decimation, uint32_t num_channels,
+                uint32_t input_bits);
+
+void cic_close(cic_t *this);
+
+/* DC gain left after the scaling, between 0.5 and 1 per section */
+double cic_get_gain(cic_t *this);
+
+/* magnitude response normalized to 1 at DC; frequency is normalized to
+   the output sample rate */
+double cic_response(double frequency, void *context);
+
+/* returns the number of output frames; output can be the same as input */
+uint32_t cic_process(cic_t *this, const int32_t *input, uint32_t num_frames,
+                     int32_t *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CIC_H */
@@ -41,8 +41,19 @@
 
 typedef struct clock_source clock_source_t;
 
+/* output MS, R divider and feedback MS (a + b / c) for a frequency */
+struct clock_plan {
+  uint32_t output_ms;
+  uint8_t rdiv;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
 /* internal functions */
 static int power_down_clocks(clock_source_t *this);
+static int make_clock_plan(clock_source_t *this, double frequency,
+                           struct clock_plan *plan);
 static void rational_approximation(double value, uint32_t max_denominator,
                                    uint32_t *a, uint32_t *b, uint32_t *c);
 static int configure_clock_input_and_pll(clock_source_t *this, int index,
@@ -152,43 +163,18 @@ int clock_source_set_clock(clock_source_t *this, int index, double frequency)
     return -1;
   }
 
-  /* if the requested frequency is below 1MHz, use an R divider */
-  double r_frequency = frequency;
-  uint8_t rdiv = 0;
-  while (r_frequency < 1e6 && rdiv <= 7) {
-    r_frequency *= 2.0;
-    rdiv += 1;
-  }
-  if (r_frequency < 1e6) {
-    fprintf(stderr, "ERROR - requested frequency is too low: %lg\n", frequency);
+  struct clock_plan plan;
+  if (make_clock_plan(this, frequency, &plan) < 0) {
     return -1;
   }
 
-  /* choose an even integer for the output MS */
-  uint32_t output_ms = ((uint32_t) (SI5351_MAX_VCO_FREQ / r_frequency));
-  output_ms &= ~0x01;
-  double vco_frequency = r_frequency * output_ms;
-  if (output_ms < 4 || output_ms > 2048) {
-    fprintf(stderr, "ERROR - invalid output MS: %d  (frequency=%lg)\n",
-            output_ms, frequency);
-    return -1;
-  }
-
-  /* feedback MS */
-  double feedback_ms = vco_frequency / (this->crystal_frequency / this->frequency_correction);
-  /* find a good rational approximation for feedback_ms */
-  uint32_t a;
-  uint32_t b;
-  uint32_t c;
-  rational_approximation(feedback_ms, SI5351_MAX_DENOMINATOR, &a, &b, &c);
-
-  int ret = configure_clock_input_and_pll(this, index, a, b, c);
+  int ret = configure_clock_input_and_pll(this, index, plan.a, plan.b, plan.c);
   if (ret < 0) {
     fprintf(stderr, "ERROR - configure_clock_input_and_pll() failed\n");
     return -1;
   }
 
-  ret = configure_clock_output(this, index, output_ms, rdiv);
+  ret = configure_clock_output(this, index, plan.output_ms, plan.rdiv);
   if (ret < 0) {
     fprintf(stderr, "ERROR - configure_clock_output() failed\n");
     return -1;
@@ -198,6 +184,20 @@ int clock_source_set_clock(clock_source_t *this, int index, double frequency)
 }
 
 
+double clock_source_get_actual_frequency(clock_source_t *this,
+                                         double frequency)
+{
+  struct clock_plan plan;
+  if (make_clock_plan(this, frequency, &plan) < 0) {
+    return 0.0;
+  }
+  /* VCO = crystal * (a + b / c), then divided by the output MS and R */
+  double crystal = this->crystal_frequency / this->frequency_correction;
+  double vco_frequency = crystal * (plan.a + (double) plan.b / plan.c);
+  return vco_frequency / plan.output_ms / (1 << plan.rdiv);
+}
+
+
 int clock_source_start_clock(clock_source_t *this, int index)
 {
   /* reset the PLL */
@@ -273,6 +273,44 @@ static int power_down_clocks(clock_source_t *this)
 }
 
 
+/* the output MS (an even integer), R divider and feedback MS (a + b / c)
+   that give the requested frequency from the corrected crystal frequency */
+static int make_clock_plan(clock_source_t *this, double frequency,
+                           struct clock_plan *plan)
+{
+  /* if the requested frequency is below 1MHz, use an R divider */
+  double r_frequency = frequency;
+  uint8_t rdiv = 0;
+  while (r_frequency < 1e6 && rdiv <= 7) {
+    r_frequency *= 2.0;
+    rdiv += 1;
+  }
+  if (r_frequency < 1e6) {
+    fprintf(stderr, "ERROR - requested frequency is too low: %lg\n", frequency);
+    return -1;
+  }
+
+  /* choose an even integer for the output MS */
+  uint32_t output_ms = ((uint32_t) (SI5351_MAX_VCO_FREQ / r_frequency));
+  output_ms &= ~0x01;
+  double vco_frequency = r_frequency * output_ms;
+  if (output_ms < 4 || output_ms > 2048) {
+    fprintf(stderr, "ERROR - invalid output MS: %d  (frequency=%lg)\n",
+            output_ms, frequency);
+    return -1;
+  }
+
+  /* feedback MS */
+  double feedback_ms = vco_frequency / (this->crystal_frequency / this->frequency_correction);
+  /* find a good rational approximation for feedback_ms */
+  rational_approximation(feedback_ms, SI5351_MAX_DENOMINATOR, &plan->a,
+                         &plan->b, &plan->c);
+  plan->output_ms = output_ms;
+  plan->rdiv = rdiv;
+  return 0;
+}
+
+
 /* best rational approximation:
  *
  *     value ~= a + b/c     (where b <= max_denominator)
@@ -49,6 +49,12 @@ void clock_source_set_frequency_correction(clock_source_t *this,
 
 int clock_source_set_clock(clock_source_t *this, int index, double frequency);
 
+/* the frequency the clock actually runs at when set to frequency (the
+   dividers cannot synthesize every frequency exactly); 0 if it cannot be
+   set */
+double clock_source_get_actual_frequency(clock_source_t *this,
+                                         double frequency);
+
 int clock_source_start_clock(clock_source_t *this, int index);
 
 int clock_source_stop_clock(clock_source_t *this, int index);
@@ -0,0 +1,140 @@
+/*
+ * crc32c.c - CRC32C (Castagnoli) checksum
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - RFC 3720, Appendix B.4 (CRC32C polynomial)
+ *  - Intel SSE4.2 CRC32 instruction
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+
+static const uint32_t CRC32C_POLY = 0x82f63b78;   /* reversed 0x1edc6f41 */
+
+/* internal functions */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t length);
+static void init_tables();
+#if defined(__x86_64__) || defined(__i386__)
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length);
+#endif
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t) = 0;
+
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+  pthread_once(&crc32c_once, init_tables);
+  return ~crc32c_impl(~crc, (const uint8_t *) data, length);
+}
+
+
+/* internal functions */
+static void init_tables()
+{
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; ++j) {
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (int t = 1; t < 8; ++t) {
+      uint32_t prev = crc32c_table[t - 1][i];
+      crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+    }
+  }
+
+  crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_sse42;
+  }
+#endif
+}
+
+/* slicing-by-8 (or the ARMv8 CRC instructions if they are enabled) */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t length)
+{
+#if defined(__ARM_FEATURE_CRC32)
+  for (; length >= 8; length -= 8, data += 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; length > 0; --length, ++data) {
+    crc = __crc32cb(crc, *data);
+  }
+  return crc;
+#else
+  for (; length >= 8; length -= 8, data += 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, data, sizeof(lo));
+    memcpy(&hi, data + 4, sizeof(hi));
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+  for (; length > 0; --length, ++data) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data) & 0xff];
+  }
+  return crc;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length)
+{
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  for (; length >= 8; length -= 8, data += 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t) crc64;
+#endif
+  for (; length >= 4; length -= 4, data += 4) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+  for (; length > 0; --length, ++data) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
@@ -0,0 +1,864 @@
+/*
+ * ddc.c - real to complex digital down converter
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The first stage is a complex bandpass filter (the prototype lowpass
+ * shifted to the NCO frequency) that decimates by 4 (or 2) directly on the
+ * real ADC samples, so the NCO mixing is folded into the filter taps and
+ * only the (decimated) output of the first stage needs to be rotated back
+ * to baseband. The following stages are complex lowpass filters that
+ * decimate by 2, plus a last stage for the odd factor of the decimation.
+ * All the filters are designed for the same passband (+/- 0.4 times the
+ * output sample rate), so the aliases of each stage fall outside of it.
+ *
+ * With DDC_FIXED_POINT the same filters run on int16 samples and Q15 taps,
+ * so the ADC samples are used as they are and every stage passes int16
+ * samples to the next one. The taps of each stage are scaled by the
+ * largest power of 2 (up to 2^15) for which the sum of their absolute
+ * values times a full scale input still fits in the 32 bit accumulators,
+ * so the multiply-accumulate loops cannot overflow and saturation is only
+ * needed when an accumulator is rounded back to int16. The rotator of the
+ * first stage is a Q30 integer recursion.
+ *
+ * With DDC_CIC the first stage is replaced by a front end made of a
+ * vectorized NCO mixer and a CIC decimator, which needs only additions
+ * however large its decimation is, followed by a filter that decimates by
+ * 4 (or 2) and also flattens the droop of the CIC passband. The CIC works
+ * on integers: the mixer output is scaled by CIC_INPUT_SCALE to keep some
+ * fractional bits. In this mode the ADC samples are kept as int16 in the
+ * first stage buffer (buffer_q15_re) for both output formats.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cic.h"
+#include "ddc.h"
+#include "dsp.h"
+#include "filter_design.h"
+#include "simd.h"
+
+
+static const double DDC_PASSBAND = 0.4;       /* fraction of the output rate */
+static const double DDC_ATTENUATION = 80.0;   /* dB */
+
+static const uint32_t CIC_INPUT_SHIFT = 8;
+static const float CIC_INPUT_SCALE = 256.0f;  /* 2^CIC_INPUT_SHIFT */
+static const uint32_t CIC_INPUT_BITS = 26;    /* int16 range, gain, scale */
+static const uint32_t NCO_REFRESH = 64;       /* samples */
+
+#define DDC_MAX_STAGES (32)
+
+struct ddc_stage {
+  uint32_t decimation;
+  uint32_t num_taps;         /* padded to a multiple of SIMD_FLOAT_LANES */
+  float *taps_re;            /* reversed */
+  float *taps_im;            /* first stage only */
+  float *buffer_re;          /* filter history + new samples */
+  float *buffer_im;          /* not used by the first stage (real input) */
+  uint32_t buffer_length;
+  uint32_t buffer_size;
+  int16_t *taps_q15_re;      /* fixed point only: taps scaled by 2^shift */
+  int16_t *taps_q15_im;
+  uint32_t shift;
+  int16_t *buffer_q15_re;    /* fixed point only, instead of buffer_re/im */
+  int16_t *buffer_q15_im;
+  cic_t *cic;                /* CIC front end: no taps */
+};
+
+typedef struct ddc {
+  double frequency;
+  double pending_frequency;
+  atomic_int retune;
+  uint32_t decimation;
+  enum DDCFormat format;
+  int fixed_point;
+  int use_cic;
+  uint32_t cic_order;
+  ddc_output_cb_t callback;
+  void *callback_context;
+  float *prototype;          /* first stage lowpass, used when retuning */
+  uint32_t prototype_taps;
+  double phase;              /* NCO phase (in cycles) of the next output */
+  uint32_t num_stages;
+  struct ddc_stage stages[DDC_MAX_STAGES];
+  float *output_re;
+  float *output_im;
+  uint32_t output_size;
+  float *output;             /* interleaved (also used for int16) */
+  uint32_t interleaved_size;
+  int32_t *cic_buffer;       /* interleaved CIC input and output */
+  uint32_t cic_buffer_size;
+  float nco_lane_re[SIMD_FLOAT_LANES];   /* exp(-j 2 pi f l), scaled */
+  float nco_lane_im[SIMD_FLOAT_LANES];
+  float nco_step_re;                     /* exp(-j 2 pi f SIMD_FLOAT_LANES) */
+  float nco_step_im;
+} ddc_t;
+
+
+/* internal functions */
+static int design_stages(ddc_t *this);
+static uint32_t split_cic(ddc_t *this, uint32_t *decimations);
+static float *reverse_taps(const float *taps, uint32_t num_taps,
+                           uint32_t padded_taps, double gain);
+static void tune_first_stage(ddc_t *this);
+static int reserve(float **buffer, uint32_t *size, uint32_t length);
+static uint32_t run_first_stage(ddc_t *this, float *out_re, float *out_im);
+static uint32_t run_stage(struct ddc_stage *stage, float *out_re,
+                          float *out_im);
+static int reserve_cic(ddc_t *this, uint32_t num_samples);
+static uint32_t run_cic_front_end(ddc_t *this);
+static uint32_t run_cic_stage(ddc_t *this, float *out_re, float *out_im);
+static uint32_t quantize_taps(const float *taps_re, const float *taps_im,
+                              uint32_t num_taps, int16_t *taps_q15_re,
+                              int16_t *taps_q15_im);
+static int reserve_q15(int16_t **buffer, uint32_t *size, uint32_t length);
+static inline int16_t narrow_q15(int64_t acc, uint32_t shift);
+static int process_q15(ddc_t *this, const int16_t *samples,
+                       uint32_t num_samples);
+static uint32_t run_first_stage_q15(ddc_t *this, int16_t *out_re,
+                                    int16_t *out_im, uint32_t stride);
+static uint32_t run_stage_q15(struct ddc_stage *stage, int16_t *out_re,
+                              int16_t *out_im, uint32_t stride);
+static uint32_t run_cic_stage_q15(ddc_t *this, int16_t *out_re,
+                                  int16_t *out_im, uint32_t stride);
+
+
+ddc_t *ddc_open(double frequency, uint32_t decimation, enum DDCFormat format,
+                int flags, uint32_t cic_order, ddc_output_cb_t callback,
+                void *callback_context)
+{
+  ddc_t *ret_val = 0;
+
+  if (decimation < 2) {
+    fprintf(stderr, "ERROR - ddc_open() failed: decimation must be at least 2\n");
+    return ret_val;
+  }
+  if (frequency < 0.0 || frequency > 0.5) {
+    fprintf(stderr, "ERROR - ddc_open() failed: invalid frequency\n");
+    return ret_val;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed: no callback\n");
+    return ret_val;
+  }
+  if ((flags & DDC_FIXED_POINT) && format != DDC_FORMAT_INT16) {
+    fprintf(stderr, "ERROR - ddc_open() failed: fixed point requires int16 output\n");
+    return ret_val;
+  }
+
+  ddc_t *this = (ddc_t *) calloc(1, sizeof(ddc_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->frequency = frequency;
+  this->pending_frequency = frequency;
+  atomic_init(&this->retune, 0);
+  this->decimation = decimation;
+  this->format = format;
+  this->fixed_point = (flags & DDC_FIXED_POINT) != 0;
+  this->use_cic = (flags & DDC_CIC) != 0;
+  this->cic_order = cic_order;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->phase = 0.0;
+
+  if (design_stages(this) < 0) {
+    ddc_close(this);
+    return ret_val;
+  }
+  tune_first_stage(this);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void ddc_close(ddc_t *this)
+{
+  for (uint32_t i = 0; i < this->num_stages; ++i) {
+    struct ddc_stage *stage = &this->stages[i];
+    free(stage->taps_re);
+    free(stage->taps_im);
+    free(stage->buffer_re);
+    free(stage->buffer_im);
+    free(stage->taps_q15_re);
+    free(stage->taps_q15_im);
+    free(stage->buffer_q15_re);
+    free(stage->buffer_q15_im);
+    if (stage->cic) {
+      cic_close(stage->cic);
+    }
+  }
+  free(this->prototype);
+  free(this->output_re);
+  free(this->output_im);
+  free(this->output);
+  free(this->cic_buffer);
+  free(this);
+  return;
+}
+
+
+int ddc_set_frequency(ddc_t *this, double frequency)
+{
+  if (frequency < 0.0 || frequency > 0.5) {
+    fprintf(stderr, "ERROR - ddc_set_frequency() failed: invalid frequency\n");
+    return -1;
+  }
+  this->pending_frequency = frequency;
+  atomic_store_explicit(&this->retune, 1, memory_order_release);
+  return 0;
+}
+
+
+uint32_t ddc_get_decimation(ddc_t *this)
+{
+  return this->decimation;
+}
+
+
+int ddc_process(ddc_t *this, const int16_t *samples, uint32_t num_samples)
+{
+  if (atomic_exchange_explicit(&this->retune, 0, memory_order_acquire)) {
+    this->frequency = this->pending_frequency;
+    tune_first_stage(this);
+  }
+  if (this->fixed_point) {
+    return process_q15(this, samples, num_samples);
+  }
+
+  /* append the new samples to the first stage */
+  struct ddc_stage *first = &this->stages[0];
+  if (first->cic) {
+    if (reserve_q15(&first->buffer_q15_re, &first->buffer_size,
+                    first->buffer_length + num_samples) < 0) {
+      return -1;
+    }
+    memcpy(first->buffer_q15_re + first->buffer_length, samples,
+           num_samples * sizeof(int16_t));
+  } else {
+    if (reserve(&first->buffer_re, &first->buffer_size,
+                first->buffer_length + num_samples) < 0) {
+      return -1;
+    }
+    dsp_int16_to_float(samples, first->buffer_re + first->buffer_length,
+                       num_samples);
+  }
+  first->buffer_length += num_samples;
+
+  /* each stage appends its output to the input of the next one */
+  uint32_t num_output = 0;
+  for (uint32_t i = 0; i < this->num_stages; ++i) {
+    struct ddc_stage *stage = &this->stages[i];
+    uint32_t max_output = stage->buffer_length / stage->decimation + 1;
+    float *out_re;
+    float *out_im;
+    if (i + 1 < this->num_stages) {
+      struct ddc_stage *next = &this->stages[i + 1];
+      uint32_t length = next->buffer_length + max_output;
+      uint32_t size = next->buffer_size;
+      if (reserve(&next->buffer_re, &size, length) < 0 ||
+          reserve(&next->buffer_im, &next->buffer_size, length) < 0) {
+        return -1;
+      }
+      out_re = next->buffer_re + next->buffer_length;
+      out_im = next->buffer_im + next->buffer_length;
+    } else {
+      uint32_t size = this->output_size;
+      if (reserve(&this->output_re, &size, max_output) < 0 ||
+          reserve(&this->output_im, &this->output_size, max_output) < 0 ||
+          reserve(&this->output, &this->interleaved_size,
+                  2 * max_output) < 0) {
+        return -1;
+      }
+      out_re = this->output_re;
+      out_im = this->output_im;
+    }
+    if (stage->cic && reserve_cic(this, stage->buffer_length) < 0) {
+      return -1;
+    }
+    uint32_t n = stage->cic ? run_cic_stage(this, out_re, out_im) :
+                 i == 0 ? run_first_stage(this, out_re, out_im) :
+                          run_stage(stage, out_re, out_im);
+    if (i + 1 < this->num_stages) {
+      this->stages[i + 1].buffer_length += n;
+    } else {
+      num_output = n;
+    }
+  }
+
+  if (num_output == 0) {
+    return 0;
+  }
+  if (this->format == DDC_FORMAT_INT16) {
+    dsp_interleave_int16(this->output_re, this->output_im,
+                         (int16_t *) this->output, num_output);
+  } else {
+    dsp_interleave(this->output_re, this->output_im, this->output,
+                   num_output);
+  }
+  this->callback(num_output, this->output, this->callback_context);
+  return 0;
+}
+
+
+/* internal functions */
+static int design_stages(ddc_t *this)
+{
+  /* decimation = 2^a * r with r odd */
+  uint32_t r = this->decimation;
+  uint32_t a = 0;
+  while ((r & 1) == 0) {
+    r >>= 1;
+    ++a;
+  }
+
+  uint32_t decimations[DDC_MAX_STAGES];
+  uint32_t num_stages = this->use_cic ? split_cic(this, decimations) : 0;
+  int cic_chain = num_stages > 0;
+  if (cic_chain) {
+    /* CIC front end, compensation filter */
+    a = 0;
+    r = 1;
+  } else if (a >= 2) {
+    decimations[num_stages++] = 4;
+    a -= 2;
+  } else if (a == 1) {
+    decimations[num_stages++] = 2;
+    a = 0;
+  } else {
+    decimations[num_stages++] = r;
+    r = 1;
+  }
+  for (; a > 0; --a) {
+    decimations[num_stages++] = 2;
+  }
+  if (r > 1) {
+    decimations[num_stages++] = r;
+  }
+
+  /* all the frequencies normalized to the ADC sample rate */
+  double passband = DDC_PASSBAND / this->decimation;
+  double rate = 1.0;
+  for (uint32_t i = 0; i < num_stages; ++i) {
+    struct ddc_stage *stage = &this->stages[i];
+    stage->decimation = decimations[i];
+    double output_rate = rate / stage->decimation;
+    if (cic_chain && i == 0) {
+      stage->cic = cic_open(this->cic_order, stage->decimation, 2,
+                            CIC_INPUT_BITS);
+      if (stage->cic == 0) {
+        return -1;
+      }
+      this->num_stages = i + 1;
+      rate = output_rate;
+      continue;
+    }
+    double transition = (output_rate - 2.0 * passband) / rate;
+    double cutoff = 0.5 / stage->decimation;
+    uint32_t num_taps = fir_design_num_taps(transition, DDC_ATTENUATION);
+    cic_t *cic = i > 0 ? this->stages[i - 1].cic : 0;
+    float *taps = cic ? fir_design_compensator(num_taps, cutoff,
+                                               DDC_ATTENUATION, cic_response,
+                                               cic) :
+                        fir_design_lowpass(num_taps, cutoff, DDC_ATTENUATION);
+    if (taps == 0) {
+      return -1;
+    }
+    stage->num_taps = this->fixed_point ? SIMD_Q15_ROUND_UP(num_taps) :
+                                          SIMD_FLOAT_ROUND_UP(num_taps);
+    this->num_stages = i + 1;
+    if (i == 0) {
+      /* the complex taps are built by tune_first_stage() */
+      this->prototype = taps;
+      this->prototype_taps = num_taps;
+      stage->taps_re = (float *) calloc(stage->num_taps, sizeof(float));
+      stage->taps_im = (float *) calloc(stage->num_taps, sizeof(float));
+      if (stage->taps_re == 0 || stage->taps_im == 0) {
+        fprintf(stderr, "ERROR - calloc() failed\n");
+        return -1;
+      }
+      if (this->fixed_point) {
+        stage->taps_q15_re = (int16_t *) calloc(stage->num_taps,
+                                                sizeof(int16_t));
+        stage->taps_q15_im = (int16_t *) calloc(stage->num_taps,
+                                                sizeof(int16_t));
+        if (stage->taps_q15_re == 0 || stage->taps_q15_im == 0) {
+          fprintf(stderr, "ERROR - calloc() failed\n");
+          return -1;
+        }
+      }
+    } else {
+      /* the compensation filter also makes up for the CIC gain */
+      double gain = cic ? 1.0 / cic_get_gain(cic) : 1.0;
+      stage->taps_re = reverse_taps(taps, num_taps, stage->num_taps, gain);
+      free(taps);
+      if (stage->taps_re == 0) {
+        return -1;
+      }
+      if (this->fixed_point) {
+        stage->taps_q15_re = (int16_t *) calloc(stage->num_taps,
+                                                sizeof(int16_t));
+        if (stage->taps_q15_re == 0) {
+          fprintf(stderr, "ERROR - calloc() failed\n");
+          return -1;
+        }
+        stage->shift = quantize_taps(stage->taps_re, 0, stage->num_taps,
+                                     stage->taps_q15_re, 0);
+      }
+    }
+    rate = output_rate;
+  }
+
+  return 0;
+}
+
+/* decimation = R * 4 (or R * 2) for the CIC and the compensation filter;
+   returns 0 if the CIC cannot be used */
+static uint32_t split_cic(ddc_t *this, uint32_t *decimations)
+{
+  uint32_t compensation = this->decimation % 4 == 0 ? 4 : 2;
+  uint32_t cic_decimation = this->decimation / compensation;
+  if (this->decimation % 2 != 0 || cic_decimation < 2) {
+    return 0;
+  }
+  if (this->cic_order == 0) {
+    /* the worst aliases land on the passband edge, at 1 - passband of the
+       CIC output rate; each order attenuates them by the sinc there */
+    double f = 1.0 - DDC_PASSBAND / compensation;
+    double per_order = -20.0 * log10(fabs(sin(M_PI * f) / (M_PI * f)));
+    this->cic_order = (uint32_t) ceil(DDC_ATTENUATION / per_order);
+  }
+  decimations[0] = cic_decimation;
+  decimations[1] = compensation;
+  return 2;
+}
+
+static float *reverse_taps(const float *taps, uint32_t num_taps,
+                           uint32_t padded_taps, double gain)
+{
+  float *reversed = (float *) calloc(padded_taps, sizeof(float));
+  if (reversed == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return 0;
+  }
+  for (uint32_t k = 0; k < num_taps; ++k) {
+    reversed[num_taps - 1 - k] = (float) (gain * taps[k]);
+  }
+  return reversed;
+}
+
+static void tune_first_stage(ddc_t *this)
+{
+  if (this->stages[0].cic) {
+    /* NCO of the CIC front end, with the scaling of the CIC input; the
+       factor 2 gives unity gain for the positive frequency half of a real
+       signal */
+    for (uint32_t l = 0; l < SIMD_FLOAT_LANES; ++l) {
+      double arg = 2.0 * M_PI * fmod(this->frequency * l, 1.0);
+      this->nco_lane_re[l] = (float) (2.0 * CIC_INPUT_SCALE * cos(arg));
+      this->nco_lane_im[l] = (float) (-2.0 * CIC_INPUT_SCALE * sin(arg));
+    }
+    double arg = 2.0 * M_PI * fmod(this->frequency * SIMD_FLOAT_LANES, 1.0);
+    this->nco_step_re = (float) cos(arg);
+    this->nco_step_im = (float) -sin(arg);
+    return;
+  }
+
+  /* h[k] * exp(j 2 pi f k), reversed; the factor 2 gives unity gain for
+     the positive frequency half of a real signal */
+  struct ddc_stage *stage = &this->stages[0];
+  uint32_t num_taps = this->prototype_taps;
+  for (uint32_t k = 0; k < num_taps; ++k) {
+    double arg = 2.0 * M_PI * fmod(this->frequency * k, 1.0);
+    double tap = 2.0 * this->prototype[k];
+    stage->taps_re[num_taps - 1 - k] = (float) (tap * cos(arg));
+    stage->taps_im[num_taps - 1 - k] = (float) (tap * sin(arg));
+  }
+  if (this->fixed_point) {
+    stage->shift = quantize_taps(stage->taps_re, stage->taps_im,
+                                 stage->num_taps, stage->taps_q15_re,
+                                 stage->taps_q15_im);
+  }
+  return;
+}
+
+static int reserve(float **buffer, uint32_t *size, uint32_t length)
+{
+  /* the filters read up to a whole vector past the history */
+  length += SIMD_FLOAT_LANES;
+  if (length <= *size) {
+    return 0;
+  }
+  float *resized = (float *) realloc(*buffer, length * sizeof(float));
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  *buffer = resized;
+  *size = length;
+  return 0;
+}
+
+static uint32_t run_first_stage(ddc_t *this, float *out_re, float *out_im)
+{
+  struct ddc_stage *stage = &this->stages[0];
+  uint32_t decimation = stage->decimation;
+  uint32_t num_taps = stage->num_taps;
+
+  /* rotate the output of the bandpass filter back to baseband; the
+     rotator is recomputed from the phase accumulator at every block, so
+     its rounding errors do not build up */
+  double step = fmod(this->frequency * decimation, 1.0);
+  double rot_re = cos(2.0 * M_PI * this->phase);
+  double rot_im = -sin(2.0 * M_PI * this->phase);
+  double step_re = cos(2.0 * M_PI * step);
+  double step_im = -sin(2.0 * M_PI * step);
+
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  for (; pos + num_taps <= stage->buffer_length; pos += decimation, ++n) {
+    float re;
+    float im;
+    dsp_dot_complex_taps(stage->buffer_re + pos, stage->taps_re,
+                         stage->taps_im, num_taps, &re, &im);
+    out_re[n] = (float) (re * rot_re - im * rot_im);
+    out_im[n] = (float) (re * rot_im + im * rot_re);
+    double tmp = rot_re * step_re - rot_im * step_im;
+    rot_im = rot_re * step_im + rot_im * step_re;
+    rot_re = tmp;
+  }
+  this->phase = fmod(this->phase + n * step, 1.0);
+
+  stage->buffer_length -= pos;
+  memmove(stage->buffer_re, stage->buffer_re + pos,
+          stage->buffer_length * sizeof(float));
+  return n;
+}
+
+static int reserve_cic(ddc_t *this, uint32_t num_samples)
+{
+  uint32_t length = 2 * num_samples;
+  if (length <= this->cic_buffer_size) {
+    return 0;
+  }
+  int32_t *resized = (int32_t *) realloc(this->cic_buffer,
+                                         length * sizeof(int32_t));
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->cic_buffer = resized;
+  this->cic_buffer_size = length;
+  return 0;
+}
+
+/* mix the first stage samples (a whole number of vectors) down to
+   baseband and run them through the CIC; the output is left in cic_buffer */
+static uint32_t run_cic_front_end(ddc_t *this)
+{
+  struct ddc_stage *stage = &this->stages[0];
+  uint32_t length = stage->buffer_length & ~(SIMD_FLOAT_LANES - 1);
+  const int16_t *x = stage->buffer_q15_re;
+  int32_t *out = this->cic_buffer;
+
+  /* the lanes of the vector rotator are rebuilt every NCO_REFRESH samples
+     from a double precision rotator, so the float rounding errors of the
+     vector recursion do not build up */
+  double base_re = cos(2.0 * M_PI * this->phase);
+  double base_im = -sin(2.0 * M_PI * this->phase);
+  double refresh_arg = 2.0 * M_PI * fmod(this->frequency * NCO_REFRESH, 1.0);
+  double refresh_re = cos(refresh_arg);
+  double refresh_im = -sin(refresh_arg);
+  v8sf lane_re = V8SF_LOAD(this->nco_lane_re);
+  v8sf lane_im = V8SF_LOAD(this->nco_lane_im);
+  v8sf step_re = (v8sf) { 0 } + this->nco_step_re;
+  v8sf step_im = (v8sf) { 0 } + this->nco_step_im;
+
+  for (uint32_t pos = 0; pos < length; pos += NCO_REFRESH) {
+    float b_re = (float) base_re;
+    float b_im = (float) base_im;
+    v8sf rot_re = lane_re * b_re - lane_im * b_im;
+    v8sf rot_im = lane_re * b_im + lane_im * b_re;
+    uint32_t end = pos + NCO_REFRESH < length ? pos + NCO_REFRESH : length;
+    for (uint32_t i = pos; i < end; i += SIMD_FLOAT_LANES) {
+      v8sf xv;
+      for (uint32_t l = 0; l < SIMD_FLOAT_LANES; ++l) {
+        xv[l] = (float) x[i + l];
+      }
+      v8si re = __builtin_convertvector(xv * rot_re, v8si);
+      v8si im = __builtin_convertvector(xv * rot_im, v8si);
+      for (uint32_t l = 0; l < SIMD_FLOAT_LANES; ++l) {
+        out[2 * (i + l)] = re[l];
+        out[2 * (i + l) + 1] = im[l];
+      }
+      v8sf tmp = rot_re * step_re - rot_im * step_im;
+      rot_im = rot_re * step_im + rot_im * step_re;
+      rot_re = tmp;
+    }
+    double tmp = base_re * refresh_re - base_im * refresh_im;
+    base_im = base_re * refresh_im + base_im * refresh_re;
+    base_re = tmp;
+  }
+  this->phase = fmod(this->phase + length * this->frequency, 1.0);
+
+  stage->buffer_length -= length;
+  memmove(stage->buffer_q15_re, stage->buffer_q15_re + length,
+          stage->buffer_length * sizeof(int16_t));
+  return cic_process(stage->cic, out, length, out);
+}
+
+static uint32_t run_cic_stage(ddc_t *this, float *out_re, float *out_im)
+{
+  uint32_t n = run_cic_front_end(this);
+  const int32_t *buffer = this->cic_buffer;
+  for (uint32_t k = 0; k < n; ++k) {
+    out_re[k] = buffer[2 * k] * (1.0f / CIC_INPUT_SCALE);
+    out_im[k] = buffer[2 * k + 1] * (1.0f / CIC_INPUT_SCALE);
+  }
+  return n;
+}
+
+static uint32_t run_stage(struct ddc_stage *stage, float *out_re,
+                          float *out_im)
+{
+  uint32_t decimation = stage->decimation;
+  uint32_t num_taps = stage->num_taps;
+
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  for (; pos + num_taps <= stage->buffer_length; pos += decimation, ++n) {
+    dsp_dot_complex_data(stage->buffer_re + pos, stage->buffer_im + pos,
+                         stage->taps_re, num_taps, &out_re[n], &out_im[n]);
+  }
+
+  stage->buffer_length -= pos;
+  memmove(stage->buffer_re, stage->buffer_re + pos,
+          stage->buffer_length * sizeof(float));
+  memmove(stage->buffer_im, stage->buffer_im + pos,
+          stage->buffer_length * sizeof(float));
+  return n;
+}
+
+static uint32_t quantize_taps(const float *taps_re, const float *taps_im,
+                              uint32_t num_taps, int16_t *taps_q15_re,
+                              int16_t *taps_q15_im)
+{
+  double sum_re = 0.0;
+  double sum_im = 0.0;
+  double peak = 0.0;
+  for (uint32_t k = 0; k < num_taps; ++k) {
+    double re = fabs(taps_re[k]);
+    double im = taps_im ? fabs(taps_im[k]) : 0.0;
+    sum_re += re;
+    sum_im += im;
+    peak = fmax(peak, fmax(re, im));
+  }
+  /* worst case accumulator: a full scale input with the signs of the taps
+     (plus the rounding of each tap) */
+  double sum = fmax(sum_re, sum_im);
+  uint32_t shift = 0;
+  while (shift < 15) {
+    double scale = ldexp(1.0, shift + 1);
+    if (32768.0 * (sum * scale + 0.5 * num_taps) > 2147483647.0 ||
+        peak * scale >= 32767.5) {
+      break;
+    }
+    ++shift;
+  }
+  double scale = ldexp(1.0, shift);
+  for (uint32_t k = 0; k < num_taps; ++k) {
+    taps_q15_re[k] = (int16_t) lrint(taps_re[k] * scale);
+    if (taps_im) {
+      taps_q15_im[k] = (int16_t) lrint(taps_im[k] * scale);
+    }
+  }
+  return shift;
+}
+
+static int reserve_q15(int16_t **buffer, uint32_t *size, uint32_t length)
+{
+  /* the filters read up to a whole vector past the history */
+  length += SIMD_Q15_LANES;
+  if (length <= *size) {
+    return 0;
+  }
+  int16_t *resized = (int16_t *) realloc(*buffer, length * sizeof(int16_t));
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  *buffer = resized;
+  *size = length;
+  return 0;
+}
+
+/* round an accumulator scaled by 2^shift back to int16, saturating */
+static inline int16_t narrow_q15(int64_t acc, uint32_t shift)
+{
+  if (shift > 0) {
+    acc = (acc + ((int64_t) 1 << (shift - 1))) >> shift;
+  }
+  return acc > INT16_MAX ? INT16_MAX : acc < INT16_MIN ? INT16_MIN :
+         (int16_t) acc;
+}
+
+static int process_q15(ddc_t *this, const int16_t *samples,
+                       uint32_t num_samples)
+{
+  /* append the new samples to the first stage */
+  struct ddc_stage *first = &this->stages[0];
+  if (reserve_q15(&first->buffer_q15_re, &first->buffer_size,
+                  first->buffer_length + num_samples) < 0) {
+    return -1;
+  }
+  memcpy(first->buffer_q15_re + first->buffer_length, samples,
+         num_samples * sizeof(int16_t));
+  first->buffer_length += num_samples;
+
+  /* each stage appends its output to the input of the next one; the last
+     one writes the interleaved output directly */
+  uint32_t num_output = 0;
+  for (uint32_t i = 0; i < this->num_stages; ++i) {
+    struct ddc_stage *stage = &this->stages[i];
+    uint32_t max_output = stage->buffer_length / stage->decimation + 1;
+    int16_t *out_re;
+    int16_t *out_im;
+    uint32_t stride;
+    if (i + 1 < this->num_stages) {
+      struct ddc_stage *next = &this->stages[i + 1];
+      uint32_t length = next->buffer_length + max_output;
+      uint32_t size = next->buffer_size;
+      if (reserve_q15(&next->buffer_q15_re, &size, length) < 0 ||
+          reserve_q15(&next->buffer_q15_im, &next->buffer_size, length) < 0) {
+        return -1;
+      }
+      out_re = next->buffer_q15_re + next->buffer_length;
+      out_im = next->buffer_q15_im + next->buffer_length;
+      stride = 1;
+    } else {
+      /* one float holds an I/Q pair of int16 */
+      if (reserve(&this->output, &this->interleaved_size, max_output) < 0) {
+        return -1;
+      }
+      out_re = (int16_t *) this->output;
+      out_im = out_re + 1;
+      stride = 2;
+    }
+    if (stage->cic && reserve_cic(this, stage->buffer_length) < 0) {
+      return -1;
+    }
+    uint32_t n = stage->cic ? run_cic_stage_q15(this, out_re, out_im,
+                                                stride) :
+                 i == 0 ? run_first_stage_q15(this, out_re, out_im, stride) :
+                          run_stage_q15(stage, out_re, out_im, stride);
+    if (i + 1 < this->num_stages) {
+      this->stages[i + 1].buffer_length += n;
+    } else {
+      num_output = n;
+    }
+  }
+
+  if (num_output == 0) {
+    return 0;
+  }
+  this->callback(num_output, this->output, this->callback_context);
+  return 0;
+}
+
+static uint32_t run_first_stage_q15(ddc_t *this, int16_t *out_re,
+                                    int16_t *out_im, uint32_t stride)
+{
+  static const double Q30 = 1073741824.0;
+  struct ddc_stage *stage = &this->stages[0];
+  uint32_t decimation = stage->decimation;
+  uint32_t num_taps = stage->num_taps;
+  uint32_t shift = stage->shift + 30;
+
+  /* same rotator as the floating point version, in Q30 */
+  double step = fmod(this->frequency * decimation, 1.0);
+  int64_t rot_re = llround(Q30 * cos(2.0 * M_PI * this->phase));
+  int64_t rot_im = llround(-Q30 * sin(2.0 * M_PI * this->phase));
+  int64_t step_re = llround(Q30 * cos(2.0 * M_PI * step));
+  int64_t step_im = llround(-Q30 * sin(2.0 * M_PI * step));
+
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  for (; pos + num_taps <= stage->buffer_length; pos += decimation, ++n) {
+    int32_t re;
+    int32_t im;
+    dsp_dot_complex_taps_q15(stage->buffer_q15_re + pos, stage->taps_q15_re,
+                             stage->taps_q15_im, num_taps, &re, &im);
+    out_re[n * stride] = narrow_q15(re * rot_re - im * rot_im, shift);
+    out_im[n * stride] = narrow_q15(re * rot_im + im * rot_re, shift);
+    int64_t tmp = (rot_re * step_re - rot_im * step_im + (1 << 29)) >> 30;
+    rot_im = (rot_re * step_im + rot_im * step_re + (1 << 29)) >> 30;
+    rot_re = tmp;
+  }
+  this->phase = fmod(this->phase + n * step, 1.0);
+
+  stage->buffer_length -= pos;
+  memmove(stage->buffer_q15_re, stage->buffer_q15_re + pos,
+          stage->buffer_length * sizeof(int16_t));
+  return n;
+}
+
+static uint32_t run_stage_q15(struct ddc_stage *stage, int16_t *out_re,
+                              int16_t *out_im, uint32_t stride)
+{
+  uint32_t decimation = stage->decimation;
+  uint32_t num_taps = stage->num_taps;
+
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  for (; pos + num_taps <= stage->buffer_length; pos += decimation, ++n) {
+    int32_t re;
+    int32_t im;
+    dsp_dot_complex_data_q15(stage->buffer_q15_re + pos,
+                             stage->buffer_q15_im + pos, stage->taps_q15_re,
+                             num_taps, &re, &im);
+    out_re[n * stride] = narrow_q15(re, stage->shift);
+    out_im[n * stride] = narrow_q15(im, stage->shift);
+  }
+
+  stage->buffer_length -= pos;
+  memmove(stage->buffer_q15_re, stage->buffer_q15_re + pos,
+          stage->buffer_length * sizeof(int16_t));
+  memmove(stage->buffer_q15_im, stage->buffer_q15_im + pos,
+          stage->buffer_length * sizeof(int16_t));
+  return n;
+}
+
+static uint32_t run_cic_stage_q15(ddc_t *this, int16_t *out_re,
+                                  int16_t *out_im, uint32_t stride)
+{
+  uint32_t n = run_cic_front_end(this);
+  const int32_t *buffer = this->cic_buffer;
+  for (uint32_t k = 0; k < n; ++k) {
+    out_re[k * stride] = narrow_q15(buffer[2 * k], CIC_INPUT_SHIFT);
+    out_im[k * stride] = narrow_q15(buffer[2 * k + 1], CIC_INPUT_SHIFT);
+  }
+  return n;
+}
@@ -0,0 +1,72 @@
+/*
+ * ddc.h - real to complex digital down converter
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DDC_H
+#define __DDC_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ddc ddc_t;
+
+enum DDCFormat {
+  DDC_FORMAT_FLOAT32,     /* interleaved I/Q floats */
+  DDC_FORMAT_INT16        /* interleaved I/Q int16 (same scale as the ADC) */
+};
+
+enum DDCFlags {
+  DDC_FIXED_POINT = 0x01, /* Q15 arithmetic end to end (DDC_FORMAT_INT16) */
+  DDC_CIC         = 0x02  /* mixer and CIC decimator front end */
+};
+
+typedef void (*ddc_output_cb_t)(uint32_t num_samples, const void *samples,
+                                void *context);
+
+/* frequency is normalized to the ADC sample rate (0 to 0.5); the output
+   passband is +/- 0.4 times the output sample rate; decimation must be at
+   least 2; flags is a combination of DDCFlags; with DDC_CIC, even
+   decimations of at least 6 replace the first filter with a mixer and a
+   CIC decimator of order cic_order (0 means the lowest order that keeps
+   the aliases 80 dB down), followed by a compensation filter that
+   decimates by 4 (or 2), instead of the chain of halving filters */
+ddc_t *ddc_open(double frequency, uint32_t decimation, enum DDCFormat format,
+                int flags, uint32_t cic_order, ddc_output_cb_t callback,
+                void *callback_context);
+
+void ddc_close(ddc_t *this);
+
+/* can be called from any thread; the new frequency is applied (phase
+   continuous) at the start of the next block */
+int ddc_set_frequency(ddc_t *this, double frequency);
+
+uint32_t ddc_get_decimation(ddc_t *this);
+
+int ddc_process(ddc_t *this, const int16_t *samples, uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDC_H */
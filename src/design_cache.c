@@ -0,0 +1,368 @@
+/*
+ * design_cache.c - cache of filter designs
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The entries are kept in an array and found by a linear scan on the hash
+ * of the key (there are only a few dozen designs in a typical session),
+ * then by comparing the keys themselves. Every hit or insertion stamps the
+ * entry with a counter, so when the total size goes over the limit the
+ * entries with the oldest stamps are dropped first.
+ * The file format is a header followed by the entries, each one a small
+ * header (kind, key size, value size, hash) followed by the key and the
+ * value; it is written to a temporary file and then renamed, so a crash
+ * never leaves a truncated cache behind, and a file that is truncated
+ * anyway is rejected as a whole when it is loaded.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "design_cache.h"
+
+
+#define DESIGN_CACHE_MAX_BYTES (64 << 20)
+static const char DESIGN_CACHE_MAGIC[8] = { 'R', 'F', '1', '0', '3', 'D',
+                                            'C', '1' };
+
+struct cache_entry {
+  uint32_t kind;
+  uint32_t key_size;
+  uint64_t value_size;
+  uint64_t hash;
+  uint64_t last_used;
+  uint8_t *data;               /* key then value */
+};
+
+struct file_entry_header {
+  uint32_t kind;
+  uint32_t key_size;
+  uint64_t value_size;
+  uint64_t hash;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *entries = 0;
+static uint32_t num_entries = 0;
+static uint32_t max_entries = 0;
+static uint64_t total_bytes = 0;
+static uint64_t use_counter = 0;
+
+
+/* internal functions */
+static uint64_t hash_key(uint32_t kind, const void *key, size_t key_size);
+static struct cache_entry *find(uint32_t kind, const void *key,
+                                size_t key_size, uint64_t hash);
+static int insert(uint32_t kind, const void *key, size_t key_size,
+                  const void *value, size_t value_size, uint64_t hash);
+static void remove_entry(uint32_t index);
+static void evict(uint64_t max_bytes);
+
+
+void *design_cache_get(enum DesignCacheKind kind, const void *key,
+                       size_t key_size, size_t *value_size)
+{
+  uint64_t hash = hash_key(kind, key, key_size);
+  void *value = 0;
+
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry *entry = find(kind, key, key_size, hash);
+  if (entry) {
+    value = malloc(entry->value_size > 0 ? entry->value_size : 1);
+    if (value) {
+      memcpy(value, entry->data + entry->key_size, entry->value_size);
+      *value_size = entry->value_size;
+      entry->last_used = ++use_counter;
+    } else {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return value;
+}
+
+
+void design_cache_put(enum DesignCacheKind kind, const void *key,
+                      size_t key_size, const void *value, size_t value_size)
+{
+  uint64_t hash = hash_key(kind, key, key_size);
+  if (key_size + value_size > DESIGN_CACHE_MAX_BYTES / 4) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  if (find(kind, key, key_size, hash) == 0) {
+    evict(DESIGN_CACHE_MAX_BYTES - (key_size + value_size));
+    insert(kind, key, key_size, value, value_size, hash);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return;
+}
+
+
+int design_cache_load(const char *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    return -1;
+  }
+  char magic[sizeof(DESIGN_CACHE_MAGIC)];
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, DESIGN_CACHE_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "ERROR - design_cache_load() failed: %s is not a design cache\n",
+            filename);
+    fclose(fp);
+    return -1;
+  }
+
+  /* read the whole file before touching the cache, so a damaged or
+     truncated file is discarded as a whole instead of half loaded */
+  int ret_val = 0;
+  struct cache_entry *loaded = 0;
+  uint32_t num_loaded = 0;
+  uint32_t max_loaded = 0;
+  while (1) {
+    struct file_entry_header header;
+    size_t nread = fread(&header, 1, sizeof(header), fp);
+    if (nread == 0 && feof(fp)) {
+      break;
+    }
+    if (nread != sizeof(header)) {
+      fprintf(stderr, "ERROR - design_cache_load() failed: %s is truncated\n",
+              filename);
+      ret_val = -1;
+      break;
+    }
+    uint64_t size = (uint64_t) header.key_size + header.value_size;
+    if (size > DESIGN_CACHE_MAX_BYTES / 4) {
+      fprintf(stderr, "ERROR - design_cache_load() failed: invalid entry in %s\n",
+              filename);
+      ret_val = -1;
+      break;
+    }
+    if (num_loaded == max_loaded) {
+      uint32_t max = max_loaded > 0 ? 2 * max_loaded : 32;
+      struct cache_entry *new_loaded = (struct cache_entry *)
+                               realloc(loaded, max * sizeof(struct cache_entry));
+      if (new_loaded == 0) {
+        fprintf(stderr, "ERROR - realloc() failed\n");
+        ret_val = -1;
+        break;
+      }
+      loaded = new_loaded;
+      max_loaded = max;
+    }
+    uint8_t *data = (uint8_t *) malloc(size > 0 ? size : 1);
+    if (data == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      ret_val = -1;
+      break;
+    }
+    if (fread(data, 1, size, fp) != size ||
+        hash_key(header.kind, data, header.key_size) != header.hash) {
+      fprintf(stderr, "ERROR - design_cache_load() failed: invalid entry in %s\n",
+              filename);
+      free(data);
+      ret_val = -1;
+      break;
+    }
+    struct cache_entry *entry = &loaded[num_loaded++];
+    entry->kind = header.kind;
+    entry->key_size = header.key_size;
+    entry->value_size = header.value_size;
+    entry->hash = header.hash;
+    entry->data = data;
+  }
+  fclose(fp);
+
+  if (ret_val == 0) {
+    pthread_mutex_lock(&cache_lock);
+    for (uint32_t i = 0; i < num_loaded; ++i) {
+      const struct cache_entry *entry = &loaded[i];
+      if (find(entry->kind, entry->data, entry->key_size, entry->hash) == 0) {
+        evict(DESIGN_CACHE_MAX_BYTES - (entry->key_size + entry->value_size));
+        insert(entry->kind, entry->data, entry->key_size,
+               entry->data + entry->key_size, entry->value_size, entry->hash);
+      }
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+  for (uint32_t i = 0; i < num_loaded; ++i) {
+    free(loaded[i].data);
+  }
+  free(loaded);
+  return ret_val;
+}
+
+
+int design_cache_save(const char *filename)
+{
+  /* a unique temporary name, so two processes saving the same cache at
+     the same time do not write into each other's file */
+  size_t tmp_size = strlen(filename) + 8;
+  char *tmpfilename = (char *) malloc(tmp_size);
+  if (tmpfilename == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  snprintf(tmpfilename, tmp_size, "%s.XXXXXX", filename);
+  int fd = mkstemp(tmpfilename);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - mkstemp(%s) failed\n", tmpfilename);
+    free(tmpfilename);
+    return -1;
+  }
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - fdopen(%s) failed\n", tmpfilename);
+    close(fd);
+    remove(tmpfilename);
+    free(tmpfilename);
+    return -1;
+  }
+
+  int ret_val = 0;
+  pthread_mutex_lock(&cache_lock);
+  if (fwrite(DESIGN_CACHE_MAGIC, sizeof(DESIGN_CACHE_MAGIC), 1, fp) != 1) {
+    ret_val = -1;
+  }
+  for (uint32_t i = 0; i < num_entries && ret_val == 0; ++i) {
+    const struct cache_entry *entry = &entries[i];
+    struct file_entry_header header = { entry->kind, entry->key_size,
+                                        entry->value_size, entry->hash };
+    size_t size = entry->key_size + entry->value_size;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(entry->data, 1, size, fp) != size) {
+      ret_val = -1;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (fclose(fp) != 0) {
+    ret_val = -1;
+  }
+  if (ret_val != 0) {
+    fprintf(stderr, "ERROR - design_cache_save() failed: cannot write %s\n",
+            tmpfilename);
+    remove(tmpfilename);
+  } else if (rename(tmpfilename, filename) != 0) {
+    fprintf(stderr, "ERROR - rename(%s) failed\n", tmpfilename);
+    remove(tmpfilename);
+    ret_val = -1;
+  }
+  free(tmpfilename);
+  return ret_val;
+}
+
+
+void design_cache_clear(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  evict(0);
+  free(entries);
+  entries = 0;
+  max_entries = 0;
+  pthread_mutex_unlock(&cache_lock);
+  return;
+}
+
+
+/* internal functions */
+/* FNV-1a */
+static uint64_t hash_key(uint32_t kind, const void *key, size_t key_size)
+{
+  uint64_t hash = 14695981039346656037ULL ^ kind;
+  const uint8_t *bytes = (const uint8_t *) key;
+  for (size_t i = 0; i < key_size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static struct cache_entry *find(uint32_t kind, const void *key,
+                                size_t key_size, uint64_t hash)
+{
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    struct cache_entry *entry = &entries[i];
+    if (entry->hash == hash && entry->kind == kind &&
+        entry->key_size == key_size &&
+        memcmp(entry->data, key, key_size) == 0) {
+      return entry;
+    }
+  }
+  return 0;
+}
+
+static int insert(uint32_t kind, const void *key, size_t key_size,
+                  const void *value, size_t value_size, uint64_t hash)
+{
+  if (num_entries == max_entries) {
+    uint32_t max = max_entries > 0 ? 2 * max_entries : 32;
+    struct cache_entry *new_entries = (struct cache_entry *)
+                             realloc(entries, max * sizeof(struct cache_entry));
+    if (new_entries == 0) {
+      fprintf(stderr, "ERROR - realloc() failed\n");
+      return -1;
+    }
+    entries = new_entries;
+    max_entries = max;
+  }
+  uint8_t *data = (uint8_t *) malloc(key_size + value_size);
+  if (data == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  memcpy(data, key, key_size);
+  memcpy(data + key_size, value, value_size);
+  struct cache_entry *entry = &entries[num_entries++];
+  entry->kind = kind;
+  entry->key_size = (uint32_t) key_size;
+  entry->value_size = value_size;
+  entry->hash = hash;
+  entry->last_used = ++use_counter;
+  entry->data = data;
+  total_bytes += key_size + value_size;
+  return 0;
+}
+
+static void remove_entry(uint32_t index)
+{
+  total_bytes -= entries[index].key_size + entries[index].value_size;
+  free(entries[index].data);
+  entries[index] = entries[--num_entries];
+  return;
+}
+
+/* drop the least recently used entries until at most max_bytes are left */
+static void evict(uint64_t max_bytes)
+{
+  while (total_bytes > max_bytes && num_entries > 0) {
+    uint32_t oldest = 0;
+    for (uint32_t i = 1; i < num_entries; ++i) {
+      if (entries[i].last_used < entries[oldest].last_used) {
+        oldest = i;
+      }
+    }
+    remove_entry(oldest);
+  }
+  return;
+}
@@ -0,0 +1,63 @@
+/*
+ * design_cache.h - cache of filter designs
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DESIGN_CACHE_H
+#define __DESIGN_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a process wide cache of designed filters (or any other expensive to
+   compute and immutable array), looked up by an opaque key that must hold
+   every parameter of the design; all the functions are thread safe */
+
+enum DesignCacheKind {
+  DESIGN_CACHE_LOWPASS = 1,
+  DESIGN_CACHE_COMPENSATOR = 2
+};
+
+/* returns a malloc'd copy of the value stored for the key, or 0 */
+void *design_cache_get(enum DesignCacheKind kind, const void *key,
+                       size_t key_size, size_t *value_size);
+
+/* stores a copy of value; the least recently used entries are dropped
+   when the cache grows too big */
+void design_cache_put(enum DesignCacheKind kind, const void *key,
+                      size_t key_size, const void *value, size_t value_size);
+
+/* the file is only meant to be read back on the same kind of machine
+   (native byte order); loading adds to the entries already there */
+int design_cache_load(const char *filename);
+
+int design_cache_save(const char *filename);
+
+void design_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DESIGN_CACHE_H */
@@ -0,0 +1,271 @@
+/*
+ * dsp.c - vectorized DSP kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "dsp.h"
+#include "simd.h"
+
+
+/* Q15 multiply-accumulate of SIMD_Q15_LANES int16 pairs into 32 bit
+   lanes: pmaddwd on x86, vmlal on ARM */
+#if defined(__AVX2__)
+typedef __m256i q15_acc_t;
+
+static inline void q15_zero(q15_acc_t *acc)
+{
+  *acc = _mm256_setzero_si256();
+}
+
+static inline void q15_madd(q15_acc_t *acc, const int16_t *x,
+                            const int16_t *taps)
+{
+  __m256i xv = _mm256_loadu_si256((const __m256i *) x);
+  __m256i tv = _mm256_loadu_si256((const __m256i *) taps);
+  *acc = _mm256_add_epi32(*acc, _mm256_madd_epi16(xv, tv));
+}
+
+static inline int32_t q15_sum(const q15_acc_t *acc)
+{
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(*acc),
+                              _mm256_extracti128_si256(*acc, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+#elif defined(__SSE2__)
+typedef __m128i q15_acc_t;
+
+static inline void q15_zero(q15_acc_t *acc)
+{
+  *acc = _mm_setzero_si128();
+}
+
+static inline void q15_madd(q15_acc_t *acc, const int16_t *x,
+                            const int16_t *taps)
+{
+  __m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) x),
+                              _mm_loadu_si128((const __m128i *) taps));
+  __m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (x + 8)),
+                              _mm_loadu_si128((const __m128i *) (taps + 8)));
+  *acc = _mm_add_epi32(*acc, _mm_add_epi32(lo, hi));
+}
+
+static inline int32_t q15_sum(const q15_acc_t *acc)
+{
+  __m128i sum = _mm_add_epi32(*acc, _mm_shuffle_epi32(*acc, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+#elif defined(__ARM_NEON)
+typedef int32x4_t q15_acc_t;
+
+static inline void q15_zero(q15_acc_t *acc)
+{
+  *acc = vdupq_n_s32(0);
+}
+
+static inline void q15_madd(q15_acc_t *acc, const int16_t *x,
+                            const int16_t *taps)
+{
+  int16x8_t x0 = vld1q_s16(x);
+  int16x8_t x1 = vld1q_s16(x + 8);
+  int16x8_t t0 = vld1q_s16(taps);
+  int16x8_t t1 = vld1q_s16(taps + 8);
+  int32x4_t sum = vmull_s16(vget_low_s16(x0), vget_low_s16(t0));
+  sum = vmlal_s16(sum, vget_high_s16(x0), vget_high_s16(t0));
+  sum = vmlal_s16(sum, vget_low_s16(x1), vget_low_s16(t1));
+  sum = vmlal_s16(sum, vget_high_s16(x1), vget_high_s16(t1));
+  *acc = vaddq_s32(*acc, sum);
+}
+
+static inline int32_t q15_sum(const q15_acc_t *acc)
+{
+  int32x2_t sum = vadd_s32(vget_low_s32(*acc), vget_high_s32(*acc));
+  return vget_lane_s32(vpadd_s32(sum, sum), 0);
+}
+#else
+typedef int32_t q15_acc_t;
+
+static inline void q15_zero(q15_acc_t *acc)
+{
+  *acc = 0;
+}
+
+static inline void q15_madd(q15_acc_t *acc, const int16_t *x,
+                            const int16_t *taps)
+{
+  for (int i = 0; i < SIMD_Q15_LANES; ++i) {
+    *acc += (int32_t) x[i] * taps[i];
+  }
+}
+
+static inline int32_t q15_sum(const q15_acc_t *acc)
+{
+  return *acc;
+}
+#endif
+
+
+float dsp_dot(const float *x, const float *taps, size_t num_taps)
+{
+  v8sf acc = { 0 };
+  for (size_t i = 0; i < num_taps; i += SIMD_FLOAT_LANES) {
+    acc += V8SF_LOAD(x + i) * V8SF_LOAD(taps + i);
+  }
+  return V8SF_SUM(acc);
+}
+
+
+void dsp_dot_complex_taps(const float *x, const float *taps_re,
+                          const float *taps_im, size_t num_taps,
+                          float *out_re, float *out_im)
+{
+  v8sf acc_re = { 0 };
+  v8sf acc_im = { 0 };
+  for (size_t i = 0; i < num_taps; i += SIMD_FLOAT_LANES) {
+    v8sf xv = V8SF_LOAD(x + i);
+    acc_re += xv * V8SF_LOAD(taps_re + i);
+    acc_im += xv * V8SF_LOAD(taps_im + i);
+  }
+  *out_re = V8SF_SUM(acc_re);
+  *out_im = V8SF_SUM(acc_im);
+}
+
+
+void dsp_dot_complex_data(const float *x_re, const float *x_im,
+                          const float *taps, size_t num_taps,
+                          float *out_re, float *out_im)
+{
+  v8sf acc_re = { 0 };
+  v8sf acc_im = { 0 };
+  for (size_t i = 0; i < num_taps; i += SIMD_FLOAT_LANES) {
+    v8sf tv = V8SF_LOAD(taps + i);
+    acc_re += V8SF_LOAD(x_re + i) * tv;
+    acc_im += V8SF_LOAD(x_im + i) * tv;
+  }
+  *out_re = V8SF_SUM(acc_re);
+  *out_im = V8SF_SUM(acc_im);
+}
+
+
+void dsp_dot_complex_taps_q15(const int16_t *x, const int16_t *taps_re,
+                              const int16_t *taps_im, size_t num_taps,
+                              int32_t *out_re, int32_t *out_im)
+{
+  q15_acc_t acc_re;
+  q15_acc_t acc_im;
+  q15_zero(&acc_re);
+  q15_zero(&acc_im);
+  for (size_t i = 0; i < num_taps; i += SIMD_Q15_LANES) {
+    q15_madd(&acc_re, x + i, taps_re + i);
+    q15_madd(&acc_im, x + i, taps_im + i);
+  }
+  *out_re = q15_sum(&acc_re);
+  *out_im = q15_sum(&acc_im);
+}
+
+
+void dsp_dot_complex_data_q15(const int16_t *x_re, const int16_t *x_im,
+                              const int16_t *taps, size_t num_taps,
+                              int32_t *out_re, int32_t *out_im)
+{
+  q15_acc_t acc_re;
+  q15_acc_t acc_im;
+  q15_zero(&acc_re);
+  q15_zero(&acc_im);
+  for (size_t i = 0; i < num_taps; i += SIMD_Q15_LANES) {
+    q15_madd(&acc_re, x_re + i, taps + i);
+    q15_madd(&acc_im, x_im + i, taps + i);
+  }
+  *out_re = q15_sum(&acc_re);
+  *out_im = q15_sum(&acc_im);
+}
+
+
+/* the loops below are simple enough for the compiler to vectorize */
+float dsp_energy(const float *x, size_t length)
+{
+  v8sf acc0 = { 0 };
+  v8sf acc1 = { 0 };
+  size_t i = 0;
+  for (; i + 2 * SIMD_FLOAT_LANES <= length; i += 2 * SIMD_FLOAT_LANES) {
+    v8sf x0 = V8SF_LOAD(x + i);
+    v8sf x1 = V8SF_LOAD(x + i + SIMD_FLOAT_LANES);
+    acc0 += x0 * x0;
+    acc1 += x1 * x1;
+  }
+  float energy = V8SF_SUM(acc0 + acc1);
+  for (; i < length; ++i) {
+    energy += x[i] * x[i];
+  }
+  return energy;
+}
+
+
+void dsp_int16_to_float(const int16_t *in, float *out, size_t length)
+{
+  for (size_t i = 0; i < length; ++i) {
+    out[i] = (float) in[i];
+  }
+}
+
+
+void dsp_float_to_int16(const float *in, int16_t *out, size_t length)
+{
+  for (size_t i = 0; i < length; ++i) {
+    float x = in[i];
+    x = x > 32767.0f ? 32767.0f : x < -32768.0f ? -32768.0f : x;
+    /* round half away from zero */
+    out[i] = (int16_t) (int32_t) (x + (x < 0.0f ? -0.5f : 0.5f));
+  }
+}
+
+
+void dsp_interleave(const float *in_re, const float *in_im, float *out,
+                    size_t length)
+{
+  for (size_t i = 0; i < length; ++i) {
+    out[2 * i] = in_re[i];
+    out[2 * i + 1] = in_im[i];
+  }
+}
+
+
+void dsp_interleave_int16(const float *in_re, const float *in_im,
+                          int16_t *out, size_t length)
+{
+  for (size_t i = 0; i < length; ++i) {
+    float re = in_re[i];
+    float im = in_im[i];
+    re = re > 32767.0f ? 32767.0f : re < -32768.0f ? -32768.0f : re;
+    im = im > 32767.0f ? 32767.0f : im < -32768.0f ? -32768.0f : im;
+    /* round half away from zero */
+    out[2 * i] = (int16_t) (int32_t) (re + (re < 0.0f ? -0.5f : 0.5f));
+    out[2 * i + 1] = (int16_t) (int32_t) (im + (im < 0.0f ? -0.5f : 0.5f));
+  }
+}
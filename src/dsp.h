@@ -0,0 +1,82 @@
+/*
+ * dsp.h - vectorized DSP kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DSP_H
+#define __DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the filter kernels expect the tap arrays in reverse order (so they line
+   up with the oldest sample first) and zero padded to a multiple of
+   SIMD_FLOAT_LANES (see simd.h); the data arrays can have any alignment */
+
+float dsp_dot(const float *x, const float *taps, size_t num_taps);
+
+/* real data, complex taps */
+void dsp_dot_complex_taps(const float *x, const float *taps_re,
+                          const float *taps_im, size_t num_taps,
+                          float *out_re, float *out_im);
+
+/* complex (planar) data, real taps */
+void dsp_dot_complex_data(const float *x_re, const float *x_im,
+                          const float *taps, size_t num_taps,
+                          float *out_re, float *out_im);
+
+/* Q15 fixed point versions for int16 data: the taps are int16 too, scaled
+   by a power of 2 the caller chooses so that the 32 bit accumulators
+   cannot overflow, reversed and zero padded to a multiple of
+   SIMD_Q15_LANES; the results are the raw accumulators */
+void dsp_dot_complex_taps_q15(const int16_t *x, const int16_t *taps_re,
+                              const int16_t *taps_im, size_t num_taps,
+                              int32_t *out_re, int32_t *out_im);
+
+void dsp_dot_complex_data_q15(const int16_t *x_re, const int16_t *x_im,
+                              const int16_t *taps, size_t num_taps,
+                              int32_t *out_re, int32_t *out_im);
+
+/* sum of the squares of length floats (e.g. 2 * n interleaved I/Q
+   samples give the total power of n complex samples) */
+float dsp_energy(const float *x, size_t length);
+
+void dsp_int16_to_float(const int16_t *in, float *out, size_t length);
+
+/* with rounding and saturation */
+void dsp_float_to_int16(const float *in, int16_t *out, size_t length);
+
+/* planar to interleaved complex samples */
+void dsp_interleave(const float *in_re, const float *in_im, float *out,
+                    size_t length);
+
+/* same with rounding and saturation to int16 */
+void dsp_interleave_int16(const float *in_re, const float *in_im,
+                          int16_t *out, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DSP_H */
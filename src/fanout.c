@@ -0,0 +1,532 @@
+/*
+ * fanout.c - several consumers of the stream sharing the decimation stages
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The decimations are a chain: the fs/4 shift and first decimation by 2
+ * (halfband.c) turn the real stream into complex samples at fs/2, and each
+ * following stage is a complex half-band filter that halves the rate
+ * again. A subscriber at decimation 2^k takes the output of stage k, so
+ * the stages up to the deepest one any subscriber needs run exactly once
+ * per frame, however many subscribers share them; the int16 conversion of
+ * a stage output is also done once for all its int16 subscribers. Every
+ * stage has the same passband (+/- 0.4 times its output rate), as in the
+ * DDC. The complex stages split their input into even and odd samples
+ * like halfband.c: the even ones go through the nonzero taps and the odd
+ * ones only through the center tap.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanout.h"
+#include "dsp.h"
+#include "filter_design.h"
+#include "halfband.h"
+#include "simd.h"
+
+
+static const double FANOUT_TRANSITION = 0.1;     /* 0.2 fs to 0.3 fs */
+static const double FANOUT_ATTENUATION = 80.0;   /* dB */
+
+#define FANOUT_MAX_SUBSCRIBERS (64)
+#define FANOUT_MAX_STAGES (16)
+
+struct subscriber {
+  enum FanoutFormat format;
+  uint32_t stage;            /* log2 of the decimation */
+  uint32_t sample_size;      /* bytes */
+  fanout_output_cb_t callback;
+  void *callback_context;
+  frame_ring_t *ring;        /* FANOUT_WORKER_THREAD only */
+};
+
+struct stage {               /* complex half-band decimator */
+  float *even_re;            /* filter history + new even samples */
+  float *even_im;
+  float *odd_re;             /* delay line + new odd samples */
+  float *odd_im;
+  float *output_re;
+  float *output_im;
+  uint32_t buffer_size;
+};
+
+typedef struct fanout {
+  uint32_t frame_samples;
+  uint32_t num_frames;
+  pthread_mutex_t lock;      /* protects subscribers and depth */
+  struct subscriber *subscribers[FANOUT_MAX_SUBSCRIBERS];
+  uint32_t depth;            /* last stage needed (0: only the ADC samples) */
+  halfband_t *halfband;      /* stage 1 */
+  uint32_t num_taps;         /* stages 2 and up: nonzero taps (the center */
+  float *taps;               /* one excluded), reversed */
+  float center_tap;
+  struct stage stages[FANOUT_MAX_STAGES];
+  float *output;             /* interleaved output of stages 2 and up */
+  uint32_t output_size;
+  int16_t *output_int16;
+  uint32_t output_int16_size;
+} fanout_t;
+
+
+/* internal functions */
+static frame_ring_t *lock_ring(fanout_t *this, int subscriber);
+static void update_depth(fanout_t *this);
+static void clear_history(fanout_t *this, struct stage *stage);
+static void halfband_output(uint32_t num_samples, const void *samples,
+                            void *context);
+static uint32_t run_stage(fanout_t *this, struct stage *stage,
+                          const float *input, uint32_t num_samples);
+static void deliver(fanout_t *this, uint32_t stage, const void *samples,
+                    uint32_t num_samples);
+static void subscriber_worker(uint32_t data_size, uint8_t *data,
+                              void *context);
+static void subscriber_free(struct subscriber *subscriber);
+static int resize(float **buffer, uint32_t size);
+
+
+fanout_t *fanout_open(uint32_t frame_samples, uint32_t num_frames)
+{
+  fanout_t *ret_val = 0;
+
+  if (frame_samples == 0 || frame_samples % 2 != 0 || num_frames == 0) {
+    fprintf(stderr, "ERROR - fanout_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+
+  /* same design as halfband.c, without the factor 2 since the input of
+     these stages is already complex */
+  uint32_t length = fir_design_num_taps(FANOUT_TRANSITION,
+                                        FANOUT_ATTENUATION);
+  length = (length + 4) / 4 * 4 - 1;
+  float *prototype = fir_design_lowpass(length, 0.25, FANOUT_ATTENUATION);
+  if (prototype == 0) {
+    return ret_val;
+  }
+
+  fanout_t *this = (fanout_t *) calloc(1, sizeof(fanout_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(prototype);
+    return ret_val;
+  }
+  this->frame_samples = frame_samples;
+  this->num_frames = num_frames;
+  pthread_mutex_init(&this->lock, 0);
+  this->depth = 0;
+  this->num_taps = (length + 1) / 2;
+  this->taps = (float *) malloc(this->num_taps * sizeof(float));
+  this->halfband = halfband_open(DDC_FORMAT_FLOAT32, halfband_output, this);
+  if (this->taps == 0 || this->halfband == 0) {
+    fprintf(stderr, "ERROR - fanout_open() failed: out of memory\n");
+    free(prototype);
+    fanout_close(this);
+    return ret_val;
+  }
+  for (uint32_t i = 0; i < this->num_taps; ++i) {
+    this->taps[this->num_taps - 1 - i] = prototype[2 * i];
+  }
+  this->center_tap = prototype[(length - 1) / 2];
+  free(prototype);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void fanout_close(fanout_t *this)
+{
+  for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; ++i) {
+    if (this->subscribers[i]) {
+      subscriber_free(this->subscribers[i]);
+    }
+  }
+  for (int s = 0; s < FANOUT_MAX_STAGES; ++s) {
+    struct stage *stage = &this->stages[s];
+    free(stage->even_re);
+    free(stage->even_im);
+    free(stage->odd_re);
+    free(stage->odd_im);
+    free(stage->output_re);
+    free(stage->output_im);
+  }
+  if (this->halfband) {
+    halfband_close(this->halfband);
+  }
+  pthread_mutex_destroy(&this->lock);
+  free(this->taps);
+  free(this->output);
+  free(this->output_int16);
+  free(this);
+  return;
+}
+
+
+int fanout_add(fanout_t *this, enum FanoutFormat format, uint32_t decimation,
+               int flags, fanout_output_cb_t callback, void *callback_context)
+{
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - fanout_add() failed: no callback\n");
+    return -1;
+  }
+  if (decimation == 0 || (decimation & (decimation - 1)) != 0 ||
+      decimation >= (1U << FANOUT_MAX_STAGES) ||
+      this->frame_samples % decimation != 0) {
+    fprintf(stderr, "ERROR - fanout_add() failed: decimation must be a power of 2 that divides the frame (%u samples)\n",
+            this->frame_samples);
+    return -1;
+  }
+  uint32_t sample_size;
+  switch (format) {
+  case FANOUT_REAL_INT16:
+    if (decimation != 1) {
+      fprintf(stderr, "ERROR - fanout_add() failed: the real samples cannot be decimated\n");
+      return -1;
+    }
+    sample_size = sizeof(int16_t);
+    break;
+  case FANOUT_COMPLEX_FLOAT32:
+    sample_size = 2 * sizeof(float);
+    break;
+  case FANOUT_COMPLEX_INT16:
+    sample_size = 2 * sizeof(int16_t);
+    break;
+  default:
+    fprintf(stderr, "ERROR - fanout_add() failed: invalid format %d\n", format);
+    return -1;
+  }
+  if (format != FANOUT_REAL_INT16 && decimation < 2) {
+    fprintf(stderr, "ERROR - fanout_add() failed: the complex samples are decimated by at least 2\n");
+    return -1;
+  }
+
+  struct subscriber *subscriber = (struct subscriber *) calloc(1,
+                                            sizeof(struct subscriber));
+  if (subscriber == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return -1;
+  }
+  subscriber->format = format;
+  subscriber->stage = __builtin_ctz(decimation);
+  subscriber->sample_size = sample_size;
+  subscriber->callback = callback;
+  subscriber->callback_context = callback_context;
+  if (flags & FANOUT_WORKER_THREAD) {
+    subscriber->ring = frame_ring_open(this->frame_samples / decimation *
+                                       sample_size, this->num_frames,
+                                       subscriber_worker, subscriber);
+    if (subscriber->ring == 0) {
+      fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+      free(subscriber);
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&this->lock);
+  int index = -1;
+  for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; ++i) {
+    if (this->subscribers[i] == 0) {
+      this->subscribers[i] = subscriber;
+      index = i;
+      break;
+    }
+  }
+  update_depth(this);
+  pthread_mutex_unlock(&this->lock);
+  if (index < 0) {
+    fprintf(stderr, "ERROR - fanout_add() failed: too many subscribers\n");
+    subscriber_free(subscriber);
+  }
+  return index;
+}
+
+
+uint32_t fanout_get_num_subscribers(fanout_t *this)
+{
+  uint32_t num_subscribers = 0;
+  pthread_mutex_lock(&this->lock);
+  for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; ++i) {
+    if (this->subscribers[i]) {
+      ++num_subscribers;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return num_subscribers;
+}
+
+
+int fanout_remove(fanout_t *this, int subscriber)
+{
+  struct subscriber *removed = 0;
+  pthread_mutex_lock(&this->lock);
+  if (subscriber >= 0 && subscriber < FANOUT_MAX_SUBSCRIBERS) {
+    removed = this->subscribers[subscriber];
+    this->subscribers[subscriber] = 0;
+    update_depth(this);
+  }
+  pthread_mutex_unlock(&this->lock);
+  if (removed == 0) {
+    fprintf(stderr, "ERROR - fanout_remove() failed: invalid subscriber %d\n",
+            subscriber);
+    return -1;
+  }
+  /* outside the lock, since its worker may still be delivering frames */
+  subscriber_free(removed);
+  return 0;
+}
+
+
+int fanout_set_policy(fanout_t *this, int subscriber,
+                      enum FrameRingPolicy policy)
+{
+  frame_ring_t *ring = lock_ring(this, subscriber);
+  if (ring == 0) {
+    return -1;
+  }
+  frame_ring_set_policy(ring, policy);
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int fanout_get_stats(fanout_t *this, int subscriber,
+                     struct frame_ring_stats *stats)
+{
+  frame_ring_t *ring = lock_ring(this, subscriber);
+  if (ring == 0) {
+    return -1;
+  }
+  frame_ring_get_stats(ring, stats);
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int fanout_process(fanout_t *this, const int16_t *samples,
+                   uint32_t num_samples)
+{
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  deliver(this, 0, samples, num_samples);
+  if (this->depth > 0) {
+    ret_val = halfband_process(this->halfband, samples, num_samples);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+/* internal functions */
+
+/* returns with the lock held, unless there is no such ring */
+static frame_ring_t *lock_ring(fanout_t *this, int subscriber)
+{
+  pthread_mutex_lock(&this->lock);
+  if (subscriber >= 0 && subscriber < FANOUT_MAX_SUBSCRIBERS &&
+      this->subscribers[subscriber] && this->subscribers[subscriber]->ring) {
+    return this->subscribers[subscriber]->ring;
+  }
+  pthread_mutex_unlock(&this->lock);
+  fprintf(stderr, "ERROR - invalid subscriber %d (or without a thread of its own)\n",
+          subscriber);
+  return 0;
+}
+
+static void update_depth(fanout_t *this)
+{
+  uint32_t depth = 0;
+  for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; ++i) {
+    if (this->subscribers[i] && this->subscribers[i]->stage > depth) {
+      depth = this->subscribers[i]->stage;
+    }
+  }
+  /* the stages past the old depth have not been fed since they were last
+     needed, so their history would be stale samples from back then */
+  for (uint32_t s = this->depth + 1; s <= depth; ++s) {
+    if (s == 1) {
+      halfband_reset(this->halfband);
+    } else if (this->stages[s].buffer_size > 0) {
+      clear_history(this, &this->stages[s]);
+    }
+  }
+  this->depth = depth;
+}
+
+static void clear_history(fanout_t *this, struct stage *stage)
+{
+  uint32_t history = this->num_taps - 1;
+  uint32_t delay = this->num_taps / 2;
+  memset(stage->even_re, 0, history * sizeof(float));
+  memset(stage->even_im, 0, history * sizeof(float));
+  memset(stage->odd_re, 0, delay * sizeof(float));
+  memset(stage->odd_im, 0, delay * sizeof(float));
+}
+
+/* output of stage 1, called from halfband_process() with the lock held;
+   runs the rest of the chain */
+static void halfband_output(uint32_t num_samples, const void *samples,
+                            void *context)
+{
+  fanout_t *this = (fanout_t *) context;
+  const float *input = (const float *) samples;
+  deliver(this, 1, input, num_samples);
+  for (uint32_t s = 2; s <= this->depth; ++s) {
+    num_samples = run_stage(this, &this->stages[s], input, num_samples);
+    if (num_samples == 0) {
+      return;
+    }
+    input = this->output;
+    deliver(this, s, input, num_samples);
+  }
+  return;
+}
+
+/* num_samples interleaved complex samples in, half as many out in
+   this->output; input may be this->output itself, since it is split into
+   the even and odd buffers first */
+static uint32_t run_stage(fanout_t *this, struct stage *stage,
+                          const float *input, uint32_t num_samples)
+{
+  uint32_t history = this->num_taps - 1;
+  uint32_t delay = this->num_taps / 2;
+  uint32_t n = num_samples / 2;
+  uint32_t size = SIMD_FLOAT_ROUND_UP(history + n) + SIMD_FLOAT_LANES;
+  if (size > stage->buffer_size) {
+    if (resize(&stage->even_re, size) < 0 ||
+        resize(&stage->even_im, size) < 0 ||
+        resize(&stage->odd_re, size) < 0 ||
+        resize(&stage->odd_im, size) < 0 ||
+        resize(&stage->output_re, size) < 0 ||
+        resize(&stage->output_im, size) < 0) {
+      return 0;
+    }
+    if (stage->buffer_size == 0) {
+      clear_history(this, stage);
+    }
+    stage->buffer_size = size;
+  }
+  if (2 * n > this->output_size) {
+    if (resize(&this->output, 2 * n) < 0) {
+      return 0;
+    }
+    this->output_size = 2 * n;
+  }
+
+  float *even_re = stage->even_re + history;
+  float *even_im = stage->even_im + history;
+  float *odd_re = stage->odd_re + delay;
+  float *odd_im = stage->odd_im + delay;
+  for (uint32_t i = 0; i < n; ++i) {
+    even_re[i] = input[4 * i];
+    even_im[i] = input[4 * i + 1];
+    odd_re[i] = input[4 * i + 2];
+    odd_im[i] = input[4 * i + 3];
+  }
+
+  const float *taps = this->taps;
+  uint32_t num_taps = this->num_taps;
+  float center_tap = this->center_tap;
+  for (uint32_t m = 0; m < n; m += SIMD_FLOAT_LANES) {
+    const float *x_re = stage->even_re + m;
+    const float *x_im = stage->even_im + m;
+    v8sf acc_re = center_tap * V8SF_LOAD(stage->odd_re + m);
+    v8sf acc_im = center_tap * V8SF_LOAD(stage->odd_im + m);
+    for (uint32_t k = 0; k < num_taps; ++k) {
+      acc_re += taps[k] * V8SF_LOAD(x_re + k);
+      acc_im += taps[k] * V8SF_LOAD(x_im + k);
+    }
+    V8SF_STORE(stage->output_re + m, acc_re);
+    V8SF_STORE(stage->output_im + m, acc_im);
+  }
+
+  memmove(stage->even_re, stage->even_re + n, history * sizeof(float));
+  memmove(stage->even_im, stage->even_im + n, history * sizeof(float));
+  memmove(stage->odd_re, stage->odd_re + n, delay * sizeof(float));
+  memmove(stage->odd_im, stage->odd_im + n, delay * sizeof(float));
+
+  dsp_interleave(stage->output_re, stage->output_im, this->output, n);
+  return n;
+}
+
+static void deliver(fanout_t *this, uint32_t stage, const void *samples,
+                    uint32_t num_samples)
+{
+  int converted = 0;
+  for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; ++i) {
+    struct subscriber *subscriber = this->subscribers[i];
+    if (subscriber == 0 || subscriber->stage != stage) {
+      continue;
+    }
+    const void *data = samples;
+    if (subscriber->format == FANOUT_COMPLEX_INT16) {
+      if (!converted) {
+        if (2 * num_samples > this->output_int16_size) {
+          int16_t *resized = (int16_t *) realloc(this->output_int16,
+                                       2 * num_samples * sizeof(int16_t));
+          if (resized == 0) {
+            fprintf(stderr, "ERROR - realloc() failed\n");
+            continue;
+          }
+          this->output_int16 = resized;
+          this->output_int16_size = 2 * num_samples;
+        }
+        dsp_float_to_int16((const float *) samples, this->output_int16,
+                           2 * num_samples);
+        converted = 1;
+      }
+      data = this->output_int16;
+    }
+    if (subscriber->ring) {
+      frame_ring_push(subscriber->ring, (const uint8_t *) data,
+                      num_samples * subscriber->sample_size);
+    } else {
+      subscriber->callback(num_samples, data, subscriber->callback_context);
+    }
+  }
+}
+
+static void subscriber_worker(uint32_t data_size, uint8_t *data,
+                              void *context)
+{
+  struct subscriber *subscriber = (struct subscriber *) context;
+  subscriber->callback(data_size / subscriber->sample_size, data,
+                       subscriber->callback_context);
+  return;
+}
+
+static void subscriber_free(struct subscriber *subscriber)
+{
+  if (subscriber->ring) {
+    frame_ring_close(subscriber->ring);
+  }
+  free(subscriber);
+}
+
+static int resize(float **buffer, uint32_t size)
+{
+  float *resized = (float *) realloc(*buffer, size * sizeof(float));
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  *buffer = resized;
+  return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * fanout.h - several consumers of the stream sharing the decimation stages
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FANOUT_H
+#define __FANOUT_H
+
+#include <stdint.h>
+
+#include "frame_ring.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fanout fanout_t;
+
+enum FanoutFormat {
+  FANOUT_REAL_INT16,          /* the ADC samples (decimation 1 only) */
+  FANOUT_COMPLEX_FLOAT32,     /* interleaved I/Q floats */
+  FANOUT_COMPLEX_INT16        /* interleaved I/Q int16 (same scale as the ADC) */
+};
+
+enum FanoutFlags {
+  FANOUT_WORKER_THREAD = 0x01 /* call back from a thread of its own */
+};
+
+typedef void (*fanout_output_cb_t)(uint32_t num_samples, const void *samples,
+                                   void *context);
+
+/* frame_samples real samples per call to fanout_process(); num_frames is
+   the depth of the queues of the subscribers with their own thread */
+fanout_t *fanout_open(uint32_t frame_samples, uint32_t num_frames);
+
+void fanout_close(fanout_t *this);
+
+/* the complex outputs are the band centered on fs/4 at fs / decimation (a
+   power of 2 from 2 up), with a passband of +/- 0.4 times the output rate:
+   the fs/4 shift with the first decimation by 2, then one half-band filter
+   per further factor 2, each stage computed once per frame for all the
+   subscribers at that decimation or a larger one; frame_samples must be a
+   multiple of decimation; returns the subscriber number or -1 on error;
+   the subscriber functions can be called from any thread while streaming,
+   except from the callbacks */
+int fanout_add(fanout_t *this, enum FanoutFormat format, uint32_t decimation,
+               int flags, fanout_output_cb_t callback, void *callback_context);
+
+uint32_t fanout_get_num_subscribers(fanout_t *this);
+
+/* a subscriber with its own thread gets the frames still queued first */
+int fanout_remove(fanout_t *this, int subscriber);
+
+/* subscribers with their own thread only */
+int fanout_set_policy(fanout_t *this, int subscriber,
+                      enum FrameRingPolicy policy);
+
+int fanout_get_stats(fanout_t *this, int subscriber,
+                     struct frame_ring_stats *stats);
+
+int fanout_process(fanout_t *this, const int16_t *samples,
+                   uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FANOUT_H */
@@ -0,0 +1,390 @@
+/*
+ * fastconv.c - overlap-save fast convolution VFO bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - M. Borgerding, "Turning Overlap-Save into a Multiband Mixing,
+ *    Downsampling Filter Bank", IEEE Signal Processing Magazine, 2006
+ *
+ * Every block of N real samples (overlapping the previous one by N / 2) is
+ * transformed once; each VFO takes the N / D bins around its center,
+ * multiplies them by the frequency response of its filter and runs an
+ * inverse FFT of size N / D, which gives the filtered, shifted and
+ * decimated block; the first half of it is discarded (overlap-save). The
+ * block phase of the bin shift and the offset of the VFO from the center
+ * bin are corrected with a rotator on the decimated output.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastconv.h"
+#include "dsp.h"
+#include "fft.h"
+#include "filter_design.h"
+
+
+static const double FASTCONV_ATTENUATION = 80.0;   /* dB */
+
+#define FASTCONV_MAX_VFOS (64)
+
+struct vfo {
+  uint32_t decimation;
+  uint32_t size;             /* N / D */
+  int32_t center_bin;
+  double offset;             /* frequency - center_bin / N */
+  double block_phase;        /* phase (in cycles) of the next block */
+  float *response;           /* size bins, in FFT order */
+  fft_t *ifft;
+  float *bins;
+  float *time;
+  float *output;
+};
+
+typedef struct fastconv {
+  uint32_t fft_size;
+  uint32_t step;             /* new samples per block */
+  fft_t *fft;
+  float *buffer;
+  uint32_t buffer_length;
+  float *spectrum;           /* bins 0 to N / 2 */
+  fastconv_output_cb_t callback;
+  void *callback_context;
+  pthread_mutex_t lock;      /* protects vfos */
+  struct vfo *vfos[FASTCONV_MAX_VFOS];
+} fastconv_t;
+
+
+/* internal functions */
+static void vfo_tune(fastconv_t *this, struct vfo *vfo, double frequency);
+static void vfo_free(struct vfo *vfo);
+static void run_block(fastconv_t *this);
+static void run_vfo(fastconv_t *this, int index, struct vfo *vfo);
+
+
+fastconv_t *fastconv_open(uint32_t fft_size, fastconv_output_cb_t callback,
+                          void *callback_context)
+{
+  fastconv_t *ret_val = 0;
+
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - fastconv_open() failed: no callback\n");
+    return ret_val;
+  }
+  fft_t *fft = fft_open_real(fft_size);
+  if (fft == 0) {
+    return ret_val;
+  }
+
+  fastconv_t *this = (fastconv_t *) calloc(1, sizeof(fastconv_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    fft_close(fft);
+    return ret_val;
+  }
+  this->fft_size = fft_size;
+  this->step = fft_size / 2;
+  this->fft = fft;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->buffer = (float *) calloc(fft_size, sizeof(float));
+  this->spectrum = (float *) malloc((fft_size + 2) * sizeof(float));
+  if (this->buffer == 0 || this->spectrum == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    fastconv_close(this);
+    return ret_val;
+  }
+  /* the first block starts with half a block of zeros */
+  this->buffer_length = fft_size - this->step;
+  pthread_mutex_init(&this->lock, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void fastconv_close(fastconv_t *this)
+{
+  for (int i = 0; i < FASTCONV_MAX_VFOS; ++i) {
+    if (this->vfos[i]) {
+      vfo_free(this->vfos[i]);
+    }
+  }
+  pthread_mutex_destroy(&this->lock);
+  fft_close(this->fft);
+  free(this->buffer);
+  free(this->spectrum);
+  free(this);
+  return;
+}
+
+
+int fastconv_add_vfo(fastconv_t *this, double frequency, double bandwidth,
+                     uint32_t decimation)
+{
+  uint32_t n = this->fft_size;
+  if (decimation < 2 || (decimation & (decimation - 1)) != 0 ||
+      n / decimation < 8) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: decimation must be a power of 2 between 2 and %u\n",
+            n / 8);
+    return -1;
+  }
+  if (bandwidth <= 0.0 || bandwidth >= 0.9 / decimation) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: invalid bandwidth\n");
+    return -1;
+  }
+  if (frequency < 0.0 || frequency > 0.5) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: invalid frequency\n");
+    return -1;
+  }
+
+  /* the filter must be short enough for the overlap and must have reached
+     the stopband at the edge of the selected bins */
+  double edge = 0.5 / decimation;
+  double transition = edge - bandwidth / 2.0;
+  uint32_t num_taps = fir_design_num_taps(transition, FASTCONV_ATTENUATION);
+  if (num_taps > n - this->step + 1) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: FFT size too small for this bandwidth\n");
+    return -1;
+  }
+  float *taps = fir_design_lowpass(num_taps, (bandwidth / 2.0 + edge) / 2.0,
+                                   FASTCONV_ATTENUATION);
+  if (taps == 0) {
+    return -1;
+  }
+
+  struct vfo *vfo = (struct vfo *) calloc(1, sizeof(struct vfo));
+  if (vfo == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(taps);
+    return -1;
+  }
+  vfo->decimation = decimation;
+  vfo->size = n / decimation;
+  vfo->ifft = fft_open(vfo->size, FFT_INVERSE);
+  vfo->response = (float *) malloc(2 * vfo->size * sizeof(float));
+  vfo->bins = (float *) malloc(2 * vfo->size * sizeof(float));
+  vfo->time = (float *) malloc(2 * vfo->size * sizeof(float));
+  vfo->output = (float *) malloc(vfo->size * sizeof(float));
+  float *padded = (float *) calloc(n, sizeof(float));
+  float *spectrum = (float *) malloc((n + 2) * sizeof(float));
+  if (vfo->ifft == 0 || vfo->response == 0 || vfo->bins == 0 ||
+      vfo->time == 0 || vfo->output == 0 || padded == 0 || spectrum == 0) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: out of memory\n");
+    free(taps);
+    free(padded);
+    free(spectrum);
+    vfo_free(vfo);
+    return -1;
+  }
+
+  /* frequency response on the bins around DC; the scale includes the
+     1 / N of the inverse transform and the factor 2 for the positive
+     frequency half of a real signal */
+  memcpy(padded, taps, num_taps * sizeof(float));
+  fft_execute_real(this->fft, padded, spectrum);
+  float scale = 2.0f / n;
+  uint32_t half = vfo->size / 2;
+  for (uint32_t j = 0; j < half; ++j) {
+    vfo->response[2 * j] = scale * spectrum[2 * j];
+    vfo->response[2 * j + 1] = scale * spectrum[2 * j + 1];
+  }
+  for (uint32_t j = 1; j <= half; ++j) {
+    vfo->response[2 * (vfo->size - j)] = scale * spectrum[2 * j];
+    vfo->response[2 * (vfo->size - j) + 1] = -scale * spectrum[2 * j + 1];
+  }
+  free(taps);
+  free(padded);
+  free(spectrum);
+  vfo_tune(this, vfo, frequency);
+  vfo->block_phase = 0.0;
+
+  pthread_mutex_lock(&this->lock);
+  int index = -1;
+  for (int i = 0; i < FASTCONV_MAX_VFOS; ++i) {
+    if (this->vfos[i] == 0) {
+      this->vfos[i] = vfo;
+      index = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  if (index < 0) {
+    fprintf(stderr, "ERROR - fastconv_add_vfo() failed: too many VFOs\n");
+    vfo_free(vfo);
+  }
+  return index;
+}
+
+
+int fastconv_retune_vfo(fastconv_t *this, int vfo, double frequency)
+{
+  if (frequency < 0.0 || frequency > 0.5) {
+    fprintf(stderr, "ERROR - fastconv_retune_vfo() failed: invalid frequency\n");
+    return -1;
+  }
+  int ret_val = -1;
+  pthread_mutex_lock(&this->lock);
+  if (vfo >= 0 && vfo < FASTCONV_MAX_VFOS && this->vfos[vfo]) {
+    vfo_tune(this, this->vfos[vfo], frequency);
+    ret_val = 0;
+  }
+  pthread_mutex_unlock(&this->lock);
+  if (ret_val < 0) {
+    fprintf(stderr, "ERROR - fastconv_retune_vfo() failed: invalid VFO %d\n", vfo);
+  }
+  return ret_val;
+}
+
+
+int fastconv_remove_vfo(fastconv_t *this, int vfo)
+{
+  struct vfo *removed = 0;
+  pthread_mutex_lock(&this->lock);
+  if (vfo >= 0 && vfo < FASTCONV_MAX_VFOS) {
+    removed = this->vfos[vfo];
+    this->vfos[vfo] = 0;
+  }
+  pthread_mutex_unlock(&this->lock);
+  if (removed == 0) {
+    fprintf(stderr, "ERROR - fastconv_remove_vfo() failed: invalid VFO %d\n", vfo);
+    return -1;
+  }
+  vfo_free(removed);
+  return 0;
+}
+
+
+int fastconv_process(fastconv_t *this, const int16_t *samples,
+                     uint32_t num_samples)
+{
+  while (num_samples > 0) {
+    uint32_t count = this->fft_size - this->buffer_length;
+    if (count > num_samples) {
+      count = num_samples;
+    }
+    dsp_int16_to_float(samples, this->buffer + this->buffer_length, count);
+    this->buffer_length += count;
+    samples += count;
+    num_samples -= count;
+    if (this->buffer_length == this->fft_size) {
+      run_block(this);
+      uint32_t overlap = this->fft_size - this->step;
+      memmove(this->buffer, this->buffer + this->step,
+              overlap * sizeof(float));
+      this->buffer_length = overlap;
+    }
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static void vfo_tune(fastconv_t *this, struct vfo *vfo, double frequency)
+{
+  vfo->center_bin = (int32_t) lround(frequency * this->fft_size);
+  vfo->offset = frequency - (double) vfo->center_bin / this->fft_size;
+  return;
+}
+
+static void vfo_free(struct vfo *vfo)
+{
+  if (vfo->ifft) {
+    fft_close(vfo->ifft);
+  }
+  free(vfo->response);
+  free(vfo->bins);
+  free(vfo->time);
+  free(vfo->output);
+  free(vfo);
+  return;
+}
+
+static void run_block(fastconv_t *this)
+{
+  fft_execute_real(this->fft, this->buffer, this->spectrum);
+  pthread_mutex_lock(&this->lock);
+  for (int i = 0; i < FASTCONV_MAX_VFOS; ++i) {
+    if (this->vfos[i]) {
+      run_vfo(this, i, this->vfos[i]);
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+static void run_vfo(fastconv_t *this, int index, struct vfo *vfo)
+{
+  int32_t n = (int32_t) this->fft_size;
+  int32_t size = (int32_t) vfo->size;
+  const float *spectrum = this->spectrum;
+
+  /* bins center_bin - size / 2 to center_bin + size / 2 - 1, with the
+     negative frequencies taken from the conjugate of the positive ones */
+  for (int32_t j = -size / 2; j < size / 2; ++j) {
+    int32_t k = vfo->center_bin + j;
+    k = ((k % n) + n) % n;
+    float re;
+    float im;
+    if (k <= n / 2) {
+      re = spectrum[2 * k];
+      im = spectrum[2 * k + 1];
+    } else {
+      re = spectrum[2 * (n - k)];
+      im = -spectrum[2 * (n - k) + 1];
+    }
+    int32_t b = j < 0 ? j + size : j;
+    float h_re = vfo->response[2 * b];
+    float h_im = vfo->response[2 * b + 1];
+    vfo->bins[2 * b] = re * h_re - im * h_im;
+    vfo->bins[2 * b + 1] = re * h_im + im * h_re;
+  }
+  fft_execute(vfo->ifft, vfo->bins, vfo->time);
+
+  /* the second half is the valid part; rotate it by the phase of the bin
+     shift at the start of this block plus the fine offset */
+  uint32_t count = vfo->size / 2;
+  const float *valid = vfo->time + vfo->size;
+  double step = vfo->offset * vfo->decimation;
+  double phase = vfo->block_phase;
+  double rot_re = cos(2.0 * M_PI * phase);
+  double rot_im = -sin(2.0 * M_PI * phase);
+  double step_re = cos(2.0 * M_PI * step);
+  double step_im = -sin(2.0 * M_PI * step);
+  for (uint32_t t = 0; t < count; ++t) {
+    float re = valid[2 * t];
+    float im = valid[2 * t + 1];
+    vfo->output[2 * t] = (float) (re * rot_re - im * rot_im);
+    vfo->output[2 * t + 1] = (float) (re * rot_im + im * rot_re);
+    double tmp = rot_re * step_re - rot_im * step_im;
+    rot_im = rot_re * step_im + rot_im * step_re;
+    rot_re = tmp;
+  }
+  /* advance by one block: step samples of the shift and the offset */
+  double advance = (double) vfo->center_bin * this->step / this->fft_size +
+                   vfo->offset * this->step;
+  vfo->block_phase = fmod(phase + advance, 1.0);
+
+  this->callback(index, count, vfo->output, this->callback_context);
+  return;
+}
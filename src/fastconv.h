@@ -0,0 +1,65 @@
+/*
+ * fastconv.h - overlap-save fast convolution VFO bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FASTCONV_H
+#define __FASTCONV_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fastconv fastconv_t;
+
+/* num_samples complex samples (interleaved floats) from one VFO */
+typedef void (*fastconv_output_cb_t)(int vfo, uint32_t num_samples,
+                                     const float *samples, void *context);
+
+/* fft_size (a power of 2) real samples per forward FFT, with 50% overlap;
+   the frequency resolution of the bin selection is 1 / fft_size (finer
+   offsets are corrected in the time domain) */
+fastconv_t *fastconv_open(uint32_t fft_size, fastconv_output_cb_t callback,
+                          void *callback_context);
+
+void fastconv_close(fastconv_t *this);
+
+/* all the frequencies are normalized to the ADC sample rate; bandwidth is
+   the total width of the passband and must be less than 0.9 / decimation
+   (a power of 2); returns the VFO number or -1 on error; the VFO
+   functions can be called from any thread while streaming */
+int fastconv_add_vfo(fastconv_t *this, double frequency, double bandwidth,
+                     uint32_t decimation);
+
+/* phase continuous; takes effect at the next block */
+int fastconv_retune_vfo(fastconv_t *this, int vfo, double frequency);
+
+int fastconv_remove_vfo(fastconv_t *this, int vfo);
+
+int fastconv_process(fastconv_t *this, const int16_t *samples,
+                     uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FASTCONV_H */
@@ -0,0 +1,326 @@
+/*
+ * fft.c - radix-2 complex FFT
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Iterative decimation in time FFT: the input is copied in bit reversed
+ * order, then log2(N) passes of butterflies; the first two passes have
+ * trivial twiddles and are done together as radix-4 butterflies, the
+ * others work on four complex values per vector, with the twiddles of
+ * each pass stored contiguously.
+ * Real transforms of size N use a complex transform of size N / 2 on the
+ * even/odd samples packed as real/imaginary parts, followed by the usual
+ * split step.
+ * Plans are read only once built, so they are shared: opening a plan that
+ * is already open (or was closed recently) just takes another reference,
+ * and closing one keeps it around, up to FFT_MAX_UNUSED_PLANS of them, for
+ * the next stage that needs the same size.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fft.h"
+#include "simd.h"
+
+
+typedef struct fft {
+  uint32_t size;             /* size of the complex transform */
+  uint32_t log2_size;
+  uint32_t *bit_reverse;
+  float *twiddles;           /* pass with half size h at [2 h, 4 h) */
+  float sign;                /* -1 forward, +1 inverse */
+  float *real_twiddles;      /* real transforms only */
+  int real;
+  uint32_t refcount;         /* protected by plans_lock */
+  uint64_t last_used;
+  struct fft *next;
+} fft_t;
+
+#define FFT_MAX_UNUSED_PLANS (16)
+
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+static fft_t *plans = 0;
+static uint64_t plans_counter = 0;
+
+
+/* internal functions */
+static fft_t *fft_create(uint32_t size, float sign);
+static void fft_destroy(fft_t *this);
+static fft_t *find_plan(uint32_t size, float sign, int real);
+static fft_t *add_plan(fft_t *plan);
+
+
+fft_t *fft_open(uint32_t size, enum FFTDirection direction)
+{
+  if (size < 4 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "ERROR - fft_open() failed: size must be a power of 2 (at least 4)\n");
+    return 0;
+  }
+  float sign = direction == FFT_FORWARD ? -1.0f : 1.0f;
+  fft_t *this = find_plan(size, sign, 0);
+  if (this) {
+    return this;
+  }
+  this = fft_create(size, sign);
+  if (this == 0) {
+    return 0;
+  }
+  return add_plan(this);
+}
+
+
+fft_t *fft_open_real(uint32_t size)
+{
+  if (size < 8 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "ERROR - fft_open_real() failed: size must be a power of 2 (at least 8)\n");
+    return 0;
+  }
+  fft_t *this = find_plan(size / 2, -1.0f, 1);
+  if (this) {
+    return this;
+  }
+  this = fft_create(size / 2, -1.0f);
+  if (this == 0) {
+    return 0;
+  }
+  this->real = 1;
+  this->real_twiddles = (float *) malloc(size * sizeof(float));
+  if (this->real_twiddles == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    fft_destroy(this);
+    return 0;
+  }
+  for (uint32_t k = 0; k < size / 2; ++k) {
+    double arg = 2.0 * M_PI * k / size;
+    this->real_twiddles[2 * k] = (float) cos(arg);
+    this->real_twiddles[2 * k + 1] = (float) -sin(arg);
+  }
+  return add_plan(this);
+}
+
+
+void fft_close(fft_t *this)
+{
+  pthread_mutex_lock(&plans_lock);
+  --this->refcount;
+  this->last_used = ++plans_counter;
+  /* drop the least recently used plans nobody has open */
+  while (1) {
+    uint32_t num_unused = 0;
+    fft_t **oldest = 0;
+    for (fft_t **p = &plans; *p; p = &(*p)->next) {
+      if ((*p)->refcount == 0) {
+        ++num_unused;
+        if (oldest == 0 || (*p)->last_used < (*oldest)->last_used) {
+          oldest = p;
+        }
+      }
+    }
+    if (num_unused <= FFT_MAX_UNUSED_PLANS) {
+      break;
+    }
+    fft_t *plan = *oldest;
+    *oldest = plan->next;
+    fft_destroy(plan);
+  }
+  pthread_mutex_unlock(&plans_lock);
+  return;
+}
+
+
+uint32_t fft_get_size(fft_t *this)
+{
+  return this->real_twiddles ? 2 * this->size : this->size;
+}
+
+
+void fft_execute(fft_t *this, const float *in, float *out)
+{
+  uint32_t size = this->size;
+  const uint32_t *bit_reverse = this->bit_reverse;
+
+  /* bit reversal and the first two passes (radix-4, twiddles 1 and -/+j) */
+  float sign = this->sign;
+  for (uint32_t i = 0; i < size; i += 4) {
+    const float *x0 = in + 2 * bit_reverse[i];
+    const float *x1 = in + 2 * bit_reverse[i + 1];
+    const float *x2 = in + 2 * bit_reverse[i + 2];
+    const float *x3 = in + 2 * bit_reverse[i + 3];
+    float a_re = x0[0] + x1[0];
+    float a_im = x0[1] + x1[1];
+    float b_re = x0[0] - x1[0];
+    float b_im = x0[1] - x1[1];
+    float c_re = x2[0] + x3[0];
+    float c_im = x2[1] + x3[1];
+    /* (x2 - x3) times -j (forward) or +j (inverse) */
+    float d_re = -sign * (x2[1] - x3[1]);
+    float d_im = sign * (x2[0] - x3[0]);
+    float *y = out + 2 * i;
+    y[0] = a_re + c_re;
+    y[1] = a_im + c_im;
+    y[2] = b_re + d_re;
+    y[3] = b_im + d_im;
+    y[4] = a_re - c_re;
+    y[5] = a_im - c_im;
+    y[6] = b_re - d_re;
+    y[7] = b_im - d_im;
+  }
+
+  /* remaining radix-2 passes, four butterflies per vector */
+  const v8sf re_sign = { -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f };
+  for (uint32_t half = 4; half < size; half *= 2) {
+    const float *twiddles = this->twiddles + 2 * half;
+    for (uint32_t base = 0; base < size; base += 2 * half) {
+      float *lo = out + 2 * base;
+      float *hi = lo + 2 * half;
+      for (uint32_t k = 0; k < 2 * half; k += SIMD_FLOAT_LANES) {
+        v8sf w = V8SF_LOAD(twiddles + k);
+        v8sf h = V8SF_LOAD(hi + k);
+        v8sf l = V8SF_LOAD(lo + k);
+        v8sf w_re = V8SF_SHUFFLE(w, 0, 0, 2, 2, 4, 4, 6, 6);
+        v8sf w_im = V8SF_SHUFFLE(w, 1, 1, 3, 3, 5, 5, 7, 7);
+        v8sf h_swap = V8SF_SHUFFLE(h, 1, 0, 3, 2, 5, 4, 7, 6);
+        v8sf t = h * w_re + h_swap * w_im * re_sign;
+        V8SF_STORE(hi + k, l - t);
+        V8SF_STORE(lo + k, l + t);
+      }
+    }
+  }
+  return;
+}
+
+
+void fft_execute_real(fft_t *this, const float *in, float *out)
+{
+  /* Z = FFT(x[2n] + j x[2n+1]); then
+     X[k] = (Z[k] + Z*[M-k]) / 2 - j W^k (Z[k] - Z*[M-k]) / 2 */
+  uint32_t m = this->size;
+  fft_execute(this, in, out);
+
+  float z0_re = out[0];
+  float z0_im = out[1];
+  out[0] = z0_re + z0_im;
+  out[1] = 0.0f;
+  out[2 * m] = z0_re - z0_im;
+  out[2 * m + 1] = 0.0f;
+
+  const float *w = this->real_twiddles;
+  for (uint32_t k = 1, j = m - 1; k <= j; ++k, --j) {
+    float a_re = out[2 * k];
+    float a_im = out[2 * k + 1];
+    float b_re = out[2 * j];
+    float b_im = out[2 * j + 1];
+    /* even and odd parts for bin k */
+    float e_re = 0.5f * (a_re + b_re);
+    float e_im = 0.5f * (a_im - b_im);
+    float o_re = 0.5f * (a_im + b_im);
+    float o_im = -0.5f * (a_re - b_re);
+    /* X[k] = E + W^k O, X[j] = E* + W^j O* (W^j = -conj(W^k)) */
+    float wk_re = w[2 * k];
+    float wk_im = w[2 * k + 1];
+    float t_re = wk_re * o_re - wk_im * o_im;
+    float t_im = wk_re * o_im + wk_im * o_re;
+    out[2 * k] = e_re + t_re;
+    out[2 * k + 1] = e_im + t_im;
+    out[2 * j] = e_re - t_re;
+    out[2 * j + 1] = -e_im + t_im;
+  }
+  return;
+}
+
+
+/* internal functions */
+static fft_t *fft_create(uint32_t size, float sign)
+{
+  fft_t *this = (fft_t *) calloc(1, sizeof(fft_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return 0;
+  }
+  this->size = size;
+  this->log2_size = 0;
+  while ((1U << this->log2_size) < size) {
+    ++this->log2_size;
+  }
+  this->sign = sign;
+  this->bit_reverse = (uint32_t *) malloc(size * sizeof(uint32_t));
+  this->twiddles = (float *) malloc(2 * size * sizeof(float));
+  if (this->bit_reverse == 0 || this->twiddles == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    fft_destroy(this);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < size; ++i) {
+    uint32_t r = 0;
+    for (uint32_t b = 0; b < this->log2_size; ++b) {
+      r |= ((i >> b) & 1) << (this->log2_size - 1 - b);
+    }
+    this->bit_reverse[i] = r;
+  }
+  for (uint32_t half = 4; half < size; half *= 2) {
+    float *twiddles = this->twiddles + 2 * half;
+    for (uint32_t k = 0; k < half; ++k) {
+      double arg = M_PI * k / half;
+      twiddles[2 * k] = (float) cos(arg);
+      twiddles[2 * k + 1] = (float) (sign * sin(arg));
+    }
+  }
+
+  return this;
+}
+
+static void fft_destroy(fft_t *this)
+{
+  free(this->bit_reverse);
+  free(this->twiddles);
+  free(this->real_twiddles);
+  free(this);
+  return;
+}
+
+/* returns the plan with a new reference, or 0 */
+static fft_t *find_plan(uint32_t size, float sign, int real)
+{
+  pthread_mutex_lock(&plans_lock);
+  fft_t *plan = plans;
+  while (plan && !(plan->size == size && plan->sign == sign &&
+                   plan->real == real)) {
+    plan = plan->next;
+  }
+  if (plan) {
+    ++plan->refcount;
+  }
+  pthread_mutex_unlock(&plans_lock);
+  return plan;
+}
+
+/* a plan built by two threads at the same time is simply listed twice */
+static fft_t *add_plan(fft_t *plan)
+{
+  pthread_mutex_lock(&plans_lock);
+  plan->refcount = 1;
+  plan->next = plans;
+  plans = plan;
+  pthread_mutex_unlock(&plans_lock);
+  return plan;
+}
@@ -0,0 +1,63 @@
+/*
+ * fft.h - radix-2 complex FFT
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fft fft_t;
+
+enum FFTDirection {
+  FFT_FORWARD,      /* exp(-j 2 pi n k / N) */
+  FFT_INVERSE       /* exp(+j 2 pi n k / N), not normalized */
+};
+
+/* size must be a power of 2; plans of the same size and direction are
+   shared and kept for a while after they are closed, so opening one again
+   is cheap */
+fft_t *fft_open(uint32_t size, enum FFTDirection direction);
+
+/* forward transform of size real samples (size a power of 2, at least 8) */
+fft_t *fft_open_real(uint32_t size);
+
+void fft_close(fft_t *this);
+
+uint32_t fft_get_size(fft_t *this);
+
+/* interleaved complex floats; in and out must not overlap; the plan is
+   read only, so it can be shared by several threads */
+void fft_execute(fft_t *this, const float *in, float *out);
+
+/* size real samples in, bins 0 to size / 2 (size / 2 + 1 interleaved
+   complex floats) out */
+void fft_execute_real(fft_t *this, const float *in, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FFT_H */
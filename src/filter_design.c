@@ -0,0 +1,245 @@
+/*
+ * filter_design.c - FIR filter design
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - J. F. Kaiser, "Nonrecursive Digital Filter Design Using the I0-sinh
+ *    Window Function", Proc. IEEE ISCAS, 1974
+ *  - A. V. Oppenheim, R. W. Schafer, "Discrete-Time Signal Processing",
+ *    section 7.5.3
+ */
+
+/* The designs are kept in the design cache (see design_cache.h), keyed by
+ * all of their parameters as doubles, so that reconfiguring a stage with a
+ * filter used before costs a lookup and a copy instead of a few thousand
+ * Bessel function evaluations. The compensator is keyed by the samples of
+ * the response it compensates, which are cheap to compute and identify it
+ * whatever the response function and its context are.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "filter_design.h"
+#include "design_cache.h"
+
+
+/* points of the numerical integration over the passband (compensator) */
+#define COMPENSATOR_POINTS (1024)
+
+/* internal functions */
+static void design_lowpass(float *taps, uint32_t num_taps, double cutoff,
+                           double attenuation);
+static void design_compensator(float *taps, uint32_t num_taps, double cutoff,
+                               double attenuation, const double *inverse,
+                               double dc_response);
+static float *cached_taps(enum DesignCacheKind kind, const double *key,
+                          size_t key_size, uint32_t num_taps);
+static double bessel_i0(double x);
+
+
+uint32_t fir_design_num_taps(double transition, double attenuation)
+{
+  if (transition <= 0.0) {
+    return 0;
+  }
+  double num_taps = (attenuation - 7.95) / (14.36 * transition) + 1.0;
+  if (num_taps < 3.0) {
+    num_taps = 3.0;
+  }
+  /* odd length, so the filter has an integer group delay */
+  return ((uint32_t) ceil(num_taps)) | 1;
+}
+
+
+float *fir_design_lowpass(uint32_t num_taps, double cutoff,
+                          double attenuation)
+{
+  if (num_taps == 0 || cutoff <= 0.0 || cutoff > 0.5) {
+    fprintf(stderr, "ERROR - fir_design_lowpass() failed: invalid parameters\n");
+    return 0;
+  }
+  double key[3] = { num_taps, cutoff, attenuation };
+  float *taps = cached_taps(DESIGN_CACHE_LOWPASS, key, sizeof(key), num_taps);
+  if (taps) {
+    return taps;
+  }
+  taps = (float *) malloc(num_taps * sizeof(float));
+  if (taps == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return 0;
+  }
+  design_lowpass(taps, num_taps, cutoff, attenuation);
+  design_cache_put(DESIGN_CACHE_LOWPASS, key, sizeof(key), taps,
+                   num_taps * sizeof(float));
+  return taps;
+}
+
+
+float *fir_design_compensator(uint32_t num_taps, double cutoff,
+                              double attenuation,
+                              double (*response)(double frequency,
+                                                 void *context),
+                              void *context)
+{
+  if (num_taps == 0 || cutoff <= 0.0 || cutoff > 0.5) {
+    fprintf(stderr, "ERROR - fir_design_compensator() failed: invalid parameters\n");
+    return 0;
+  }
+  /* key: the parameters, the response at DC and the inverse of the
+     response at the integration points */
+  size_t key_size = (4 + COMPENSATOR_POINTS) * sizeof(double);
+  double *key = (double *) malloc(key_size);
+  if (key == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return 0;
+  }
+  key[0] = num_taps;
+  key[1] = cutoff;
+  key[2] = attenuation;
+  key[3] = response(0.0, context);
+  double *inverse = key + 4;
+  double df = cutoff / COMPENSATOR_POINTS;
+  for (uint32_t k = 0; k < COMPENSATOR_POINTS; ++k) {
+    inverse[k] = 1.0 / response((k + 0.5) * df, context);
+  }
+
+  float *taps = cached_taps(DESIGN_CACHE_COMPENSATOR, key, key_size,
+                            num_taps);
+  if (taps == 0) {
+    taps = (float *) malloc(num_taps * sizeof(float));
+    if (taps == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      free(key);
+      return 0;
+    }
+    design_compensator(taps, num_taps, cutoff, attenuation, inverse, key[3]);
+    design_cache_put(DESIGN_CACHE_COMPENSATOR, key, key_size, taps,
+                     num_taps * sizeof(float));
+  }
+  free(key);
+  return taps;
+}
+
+
+double fir_design_kaiser_beta(double attenuation)
+{
+  if (attenuation > 50.0) {
+    return 0.1102 * (attenuation - 8.7);
+  } else if (attenuation >= 21.0) {
+    return 0.5842 * pow(attenuation - 21.0, 0.4) +
+           0.07886 * (attenuation - 21.0);
+  }
+  return 0.0;
+}
+
+
+/* internal functions */
+static void design_lowpass(float *taps, uint32_t num_taps, double cutoff,
+                           double attenuation)
+{
+  double beta = fir_design_kaiser_beta(attenuation);
+  double i0_beta = bessel_i0(beta);
+  double center = (num_taps - 1) / 2.0;
+  double sum = 0.0;
+  for (uint32_t i = 0; i < num_taps; ++i) {
+    double t = i - center;
+    double sinc = t == 0.0 ? 2.0 * cutoff :
+                  sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+    double window = 1.0;
+    if (num_taps > 1) {
+      double r = t / center;
+      window = bessel_i0(beta * sqrt(1.0 - r * r)) / i0_beta;
+    }
+    double tap = sinc * window;
+    taps[i] = (float) tap;
+    sum += tap;
+  }
+  for (uint32_t i = 0; i < num_taps; ++i) {
+    taps[i] = (float) (taps[i] / sum);
+  }
+  return;
+}
+
+/* inverse is 1 / response at the COMPENSATOR_POINTS midpoints of the
+   passband */
+static void design_compensator(float *taps, uint32_t num_taps, double cutoff,
+                               double attenuation, const double *inverse,
+                               double dc_response)
+{
+  /* ideal response 1 / response(f) up to the cutoff (inverse Fourier
+     transform by the midpoint rule), then the Kaiser window */
+  double df = cutoff / COMPENSATOR_POINTS;
+  double beta = fir_design_kaiser_beta(attenuation);
+  double i0_beta = bessel_i0(beta);
+  double center = (num_taps - 1) / 2.0;
+  double sum = 0.0;
+  for (uint32_t i = 0; i < num_taps; ++i) {
+    double t = i - center;
+    double ideal = 0.0;
+    for (uint32_t k = 0; k < COMPENSATOR_POINTS; ++k) {
+      ideal += inverse[k] * cos(2.0 * M_PI * (k + 0.5) * df * t);
+    }
+    ideal *= 2.0 * df;
+    double window = 1.0;
+    if (num_taps > 1) {
+      double r = t / center;
+      window = bessel_i0(beta * sqrt(1.0 - r * r)) / i0_beta;
+    }
+    double tap = ideal * window;
+    taps[i] = (float) tap;
+    sum += tap;
+  }
+  /* exact gain at DC */
+  double gain = 1.0 / (dc_response * sum);
+  for (uint32_t i = 0; i < num_taps; ++i) {
+    taps[i] = (float) (taps[i] * gain);
+  }
+  return;
+}
+
+static float *cached_taps(enum DesignCacheKind kind, const double *key,
+                          size_t key_size, uint32_t num_taps)
+{
+  size_t value_size = 0;
+  float *taps = (float *) design_cache_get(kind, key, key_size, &value_size);
+  if (taps && value_size != num_taps * sizeof(float)) {
+    free(taps);
+    taps = 0;
+  }
+  return taps;
+}
+
+static double bessel_i0(double x)
+{
+  /* power series; converges quickly for the beta values used here */
+  double sum = 1.0;
+  double term = 1.0;
+  double half_x = x / 2.0;
+  for (int k = 1; k < 100; ++k) {
+    term *= (half_x / k) * (half_x / k);
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
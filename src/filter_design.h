@@ -0,0 +1,57 @@
+/*
+ * filter_design.h - FIR filter design
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FILTER_DESIGN_H
+#define __FILTER_DESIGN_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* all the frequencies are normalized to the sample rate (0.5 = Nyquist) */
+
+/* number of taps for a Kaiser window FIR with the given transition band
+   width and stopband attenuation (in dB) */
+uint32_t fir_design_num_taps(double transition, double attenuation);
+
+/* Kaiser window lowpass FIR with unity DC gain; the cutoff is the middle of
+   the transition band; returns a malloc'd array of num_taps taps */
+float *fir_design_lowpass(uint32_t num_taps, double cutoff,
+                          double attenuation);
+
+/* same with the passband shaped as 1 / response(f), e.g. to compensate the
+   droop of a CIC decimator; response must not vanish below the cutoff */
+float *fir_design_compensator(uint32_t num_taps, double cutoff,
+                              double attenuation,
+                              double (*response)(double frequency,
+                                                 void *context),
+                              void *context);
+
+double fir_design_kaiser_beta(double attenuation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FILTER_DESIGN_H */
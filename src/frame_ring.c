@@ -0,0 +1,375 @@
+/*
+ * frame_ring.c - hand off frames to a worker thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The frames are copied into num_frames + 1 slots, so the worker can
+ * handle a frame in place while num_frames others are queued. The queue
+ * holds slot numbers rather than being tied to the slot order, since with
+ * FRAME_RING_DROP_OLDEST the producer takes the oldest queued frame back
+ * (and reuses its slot) while the worker may still be busy with an older
+ * one; both claim the oldest frame with a compare and swap on tail. The
+ * slots the worker is done with go back to the producer through a second
+ * single producer, single consumer ring (free_slots). Only
+ * FRAME_RING_BLOCK ever takes a lock, and only while the queue is full.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_ring.h"
+
+
+typedef struct frame_ring {
+  uint32_t frame_size;
+  uint32_t num_frames;
+  uint32_t num_slots;         /* num_frames + 1 */
+  uint8_t *frames;
+  uint32_t *frame_sizes;
+  uint32_t *queue;            /* slot numbers, oldest at tail */
+  uint32_t *free_slots;
+  frame_ring_handler_t handler;
+  void *context;
+  _Atomic uint64_t head;      /* written by the producer */
+  _Atomic uint64_t tail;      /* claimed by the worker or the producer */
+  _Atomic uint64_t free_head; /* written by the worker */
+  _Atomic uint64_t free_tail; /* written by the producer */
+  atomic_int policy;
+  _Atomic uint64_t pushed;
+  _Atomic uint64_t dropped_newest;
+  _Atomic uint64_t dropped_oldest;
+  _Atomic uint64_t blocked;
+  _Atomic uint64_t blocked_ns;
+  _Atomic uint32_t max_queue_depth;
+  atomic_int waiting;         /* the producer is blocked */
+  pthread_mutex_t lock;
+  pthread_cond_t space;
+  atomic_int stop;
+  sem_t available;
+  pthread_t worker;
+} frame_ring_t;
+
+
+/* internal functions */
+static int has_room(frame_ring_t *this);
+static void wait_for_room(frame_ring_t *this);
+static void *frame_ring_worker(void *arg);
+
+
+frame_ring_t *frame_ring_open(uint32_t frame_size, uint32_t num_frames,
+                              frame_ring_handler_t handler, void *context)
+{
+  frame_ring_t *ret_val = 0;
+
+  if (frame_size == 0 || num_frames == 0 || handler == 0) {
+    fprintf(stderr, "ERROR - frame_ring_open() failed: invalid parameters\n");
+    goto FAIL0;
+  }
+
+  uint32_t num_slots = num_frames + 1;
+  uint8_t *frames = (uint8_t *) malloc((size_t) frame_size * num_slots);
+  if (frames == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL0;
+  }
+  /* frame sizes, queue and free slots in one block */
+  uint32_t *frame_sizes = (uint32_t *) malloc((2 * num_slots + num_frames) *
+                                              sizeof(uint32_t));
+  if (frame_sizes == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL1;
+  }
+
+  frame_ring_t *this = (frame_ring_t *) malloc(sizeof(frame_ring_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL2;
+  }
+  this->frame_size = frame_size;
+  this->num_frames = num_frames;
+  this->num_slots = num_slots;
+  this->frames = frames;
+  this->frame_sizes = frame_sizes;
+  this->free_slots = frame_sizes + num_slots;
+  this->queue = this->free_slots + num_slots;
+  for (uint32_t i = 0; i < num_slots; ++i) {
+    this->free_slots[i] = i;
+  }
+  this->handler = handler;
+  this->context = context;
+  atomic_init(&this->head, 0);
+  atomic_init(&this->tail, 0);
+  atomic_init(&this->free_head, num_slots);
+  atomic_init(&this->free_tail, 0);
+  atomic_init(&this->policy, FRAME_RING_DROP_NEWEST);
+  atomic_init(&this->pushed, 0);
+  atomic_init(&this->dropped_newest, 0);
+  atomic_init(&this->dropped_oldest, 0);
+  atomic_init(&this->blocked, 0);
+  atomic_init(&this->blocked_ns, 0);
+  atomic_init(&this->max_queue_depth, 0);
+  atomic_init(&this->waiting, 0);
+  atomic_init(&this->stop, 0);
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->space, 0);
+  if (sem_init(&this->available, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed\n");
+    goto FAIL3;
+  }
+  if (pthread_create(&this->worker, 0, frame_ring_worker, this) != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed\n");
+    goto FAIL4;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL4:
+  sem_destroy(&this->available);
+FAIL3:
+  pthread_cond_destroy(&this->space);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+FAIL2:
+  free(frame_sizes);
+FAIL1:
+  free(frames);
+FAIL0:
+  return ret_val;
+}
+
+
+void frame_ring_close(frame_ring_t *this)
+{
+  atomic_store(&this->stop, 1);
+  sem_post(&this->available);
+  pthread_join(this->worker, 0);
+  sem_destroy(&this->available);
+  pthread_cond_destroy(&this->space);
+  pthread_mutex_destroy(&this->lock);
+  free(this->frame_sizes);
+  free(this->frames);
+  free(this);
+  return;
+}
+
+
+int frame_ring_push(frame_ring_t *this, const uint8_t *data,
+                    uint32_t data_size)
+{
+  if (data_size > this->frame_size) {
+    atomic_fetch_add_explicit(&this->dropped_newest, 1, memory_order_relaxed);
+    return 1;
+  }
+
+  int policy = atomic_load_explicit(&this->policy, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  uint32_t slot = 0;
+  int reused = 0;
+  if (policy == FRAME_RING_DROP_OLDEST) {
+    /* the frame being handled has the spare slot, so only the queue can
+       be full; when it is, take back the oldest frame, unless the worker
+       claims it first */
+    uint64_t tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+    while (head - tail >= this->num_frames) {
+      uint32_t oldest = this->queue[tail % this->num_frames];
+      if (atomic_compare_exchange_weak_explicit(&this->tail, &tail, tail + 1,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+        atomic_fetch_add_explicit(&this->dropped_oldest, 1,
+                                  memory_order_relaxed);
+        slot = oldest;
+        reused = 1;
+        break;
+      }
+    }
+  } else if (!has_room(this)) {
+    if (policy == FRAME_RING_DROP_NEWEST) {
+      atomic_fetch_add_explicit(&this->dropped_newest, 1,
+                                memory_order_relaxed);
+      return 1;
+    }
+    wait_for_room(this);
+  }
+
+  if (!reused) {
+    uint64_t free_tail = atomic_load_explicit(&this->free_tail,
+                                              memory_order_relaxed);
+    if (atomic_load_explicit(&this->free_head, memory_order_acquire) ==
+        free_tail) {
+      /* not expected: the spare slot is always free here */
+      atomic_fetch_add_explicit(&this->dropped_newest, 1,
+                                memory_order_relaxed);
+      return 1;
+    }
+    slot = this->free_slots[free_tail % this->num_slots];
+    atomic_store_explicit(&this->free_tail, free_tail + 1,
+                          memory_order_relaxed);
+  }
+  memcpy(this->frames + (size_t) slot * this->frame_size, data, data_size);
+  this->frame_sizes[slot] = data_size;
+  this->queue[head % this->num_frames] = slot;
+  atomic_store_explicit(&this->head, head + 1, memory_order_release);
+  atomic_fetch_add_explicit(&this->pushed, 1, memory_order_relaxed);
+  uint32_t depth = (uint32_t) (head + 1 - atomic_load_explicit(&this->tail,
+                                                   memory_order_relaxed));
+  if (depth > atomic_load_explicit(&this->max_queue_depth,
+                                   memory_order_relaxed)) {
+    atomic_store_explicit(&this->max_queue_depth, depth,
+                          memory_order_relaxed);
+  }
+  sem_post(&this->available);
+  return 0;
+}
+
+
+uint64_t frame_ring_dropped(frame_ring_t *this)
+{
+  return atomic_load_explicit(&this->dropped_newest, memory_order_relaxed) +
+         atomic_load_explicit(&this->dropped_oldest, memory_order_relaxed);
+}
+
+
+void frame_ring_set_policy(frame_ring_t *this, enum FrameRingPolicy policy)
+{
+  atomic_store(&this->policy, policy);
+}
+
+
+void frame_ring_get_stats(frame_ring_t *this, struct frame_ring_stats *stats)
+{
+  stats->pushed = atomic_load_explicit(&this->pushed, memory_order_relaxed);
+  stats->dropped_newest = atomic_load_explicit(&this->dropped_newest,
+                                               memory_order_relaxed);
+  stats->dropped_oldest = atomic_load_explicit(&this->dropped_oldest,
+                                               memory_order_relaxed);
+  stats->blocked = atomic_load_explicit(&this->blocked, memory_order_relaxed);
+  stats->blocked_ns = atomic_load_explicit(&this->blocked_ns,
+                                           memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  stats->queue_depth = (uint32_t) (head - tail);
+  stats->max_queue_depth = atomic_load_explicit(&this->max_queue_depth,
+                                                memory_order_relaxed);
+  stats->queue_size = this->num_frames;
+}
+
+
+int frame_ring_set_background(frame_ring_t *this)
+{
+#ifdef SCHED_IDLE
+  struct sched_param param = { .sched_priority = 0 };
+  int ret = pthread_setschedparam(this->worker, SCHED_IDLE, &param);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_setschedparam() failed: %s\n",
+            strerror(ret));
+    return -1;
+  }
+  return 0;
+#else
+  fprintf(stderr, "ERROR - SCHED_IDLE not supported\n");
+  return -1;
+#endif
+}
+
+
+/* internal functions */
+
+/* with the frame being handled, at most num_frames frames in the slots */
+static int has_room(frame_ring_t *this)
+{
+  uint64_t free_head = atomic_load_explicit(&this->free_head,
+                                            memory_order_acquire);
+  uint64_t free_tail = atomic_load_explicit(&this->free_tail,
+                                            memory_order_relaxed);
+  return free_head - free_tail > this->num_slots - this->num_frames;
+}
+
+static void wait_for_room(frame_ring_t *this)
+{
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&this->lock);
+  atomic_store(&this->waiting, 1);
+  /* has_room() only does an acquire load of free_head; without a full
+     fence it could read a stale free_head while the worker reads a stale
+     waiting, and neither would wake the other (StoreLoad ordering) */
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!has_room(this)) {
+    pthread_cond_wait(&this->space, &this->lock);
+  }
+  atomic_store(&this->waiting, 0);
+  pthread_mutex_unlock(&this->lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t elapsed = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+                     end.tv_nsec - start.tv_nsec;
+  atomic_fetch_add_explicit(&this->blocked_ns, elapsed, memory_order_relaxed);
+  atomic_fetch_add_explicit(&this->blocked, 1, memory_order_relaxed);
+}
+
+static void *frame_ring_worker(void *arg)
+{
+  frame_ring_t *this = (frame_ring_t *) arg;
+  while (1) {
+    sem_wait(&this->available);
+    /* a wakeup may find no frame: the producer dropped it (there is a post
+       for every push), or frame_ring_close() */
+    uint64_t tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+    uint32_t slot = 0;
+    int claimed = 0;
+    while (tail != atomic_load_explicit(&this->head, memory_order_acquire)) {
+      slot = this->queue[tail % this->num_frames];
+      if (atomic_compare_exchange_weak_explicit(&this->tail, &tail, tail + 1,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+        claimed = 1;
+        break;
+      }
+    }
+    if (!claimed) {
+      if (atomic_load(&this->stop)) {
+        break;
+      }
+      continue;
+    }
+    this->handler(this->frame_sizes[slot],
+                  this->frames + (size_t) slot * this->frame_size,
+                  this->context);
+    uint64_t free_head = atomic_load_explicit(&this->free_head,
+                                              memory_order_relaxed);
+    this->free_slots[free_head % this->num_slots] = slot;
+    atomic_store(&this->free_head, free_head + 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&this->waiting)) {
+      pthread_mutex_lock(&this->lock);
+      pthread_cond_signal(&this->space);
+      pthread_mutex_unlock(&this->lock);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * frame_ring.h - hand off frames to a worker thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FRAME_RING_H
+#define __FRAME_RING_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct frame_ring frame_ring_t;
+
+typedef void (*frame_ring_handler_t)(uint32_t data_size, uint8_t *data,
+                                     void *context);
+
+/* what frame_ring_push() does when the worker falls behind */
+enum FrameRingPolicy {
+  FRAME_RING_DROP_NEWEST,     /* drop the new frame (the default) */
+  FRAME_RING_DROP_OLDEST,     /* drop the oldest queued frame instead */
+  FRAME_RING_BLOCK            /* wait for the worker (e.g. file replay) */
+};
+
+struct frame_ring_stats {
+  uint64_t pushed;            /* queued by frame_ring_push() */
+  uint64_t dropped_newest;
+  uint64_t dropped_oldest;
+  uint64_t blocked;           /* pushes that had to wait for the worker */
+  uint64_t blocked_ns;        /* total time spent waiting */
+  uint32_t queue_depth;
+  uint32_t max_queue_depth;
+  uint32_t queue_size;
+};
+
+/* single producer (the USB callback) and a single worker thread calling
+   handler for every frame; with the default policy frame_ring_push() never
+   blocks: when the worker falls behind the frame is dropped and counted */
+frame_ring_t *frame_ring_open(uint32_t frame_size, uint32_t num_frames,
+                              frame_ring_handler_t handler, void *context);
+
+/* processes the frames still queued before returning */
+void frame_ring_close(frame_ring_t *this);
+
+/* returns 0 if the frame was queued (with FRAME_RING_DROP_OLDEST, perhaps
+   in place of an older one), 1 if it was dropped */
+int frame_ring_push(frame_ring_t *this, const uint8_t *data,
+                    uint32_t data_size);
+
+/* frames dropped with either policy */
+uint64_t frame_ring_dropped(frame_ring_t *this);
+
+/* can be changed at any time, from any thread; each frame_ring_push()
+   applies the policy it finds */
+void frame_ring_set_policy(frame_ring_t *this, enum FrameRingPolicy policy);
+
+void frame_ring_get_stats(frame_ring_t *this, struct frame_ring_stats *stats);
+
+/* runs the worker only when the CPUs would otherwise be idle (SCHED_IDLE),
+   for consumers that must never take time from the others */
+int frame_ring_set_background(frame_ring_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FRAME_RING_H */
@@ -0,0 +1,272 @@
+/*
+ * goertzel.c - Goertzel tone detector bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - G. Goertzel, "An Algorithm for the Evaluation of Finite Trigonometric
+ *    Series", The American Mathematical Monthly, vol. 65, 1958
+ */
+
+/* Each filter runs the real recurrence s[n] = x[n] + 2 cos(w) s[n-1] -
+ * s[n-2] on the I and on the Q samples, and at the end of the block
+ * combines the last two states into the DFT of the block at w: since the
+ * recurrence is linear with real coefficients, the complex input gives
+ * both the positive and the negative frequencies. The states are kept in
+ * planar arrays, and each pass updates GOERTZEL_BINS_PER_PASS frequencies
+ * for every sample, so that there are enough independent recurrences to
+ * hide the latency of the multiply-adds. The inner loop is written on
+ * plain float arrays rather than on v8sf vectors: the compiler vectorizes
+ * it at the native width of the target and keeps the states in registers,
+ * whereas v8sf variables live in memory on targets without 256 bit
+ * vectors.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf103_goertzel.h"
+#include "simd.h"
+
+
+#define GOERTZEL_GROUPS (8)
+#define GOERTZEL_BINS_PER_PASS (GOERTZEL_GROUPS * SIMD_FLOAT_LANES)
+
+typedef struct rf103_goertzel {
+  uint32_t num_frequencies;
+  uint32_t num_bins;           /* padded to GOERTZEL_BINS_PER_PASS */
+  uint32_t block_length;
+  rf103_goertzel_cb_t callback;
+  void *callback_context;
+  float *coefficients;         /* 2 cos(w) */
+  float *cosines;
+  float *sines;
+  float *s1_re;                /* s[n-1] and s[n-2] of the I recurrence */
+  float *s2_re;
+  float *s1_im;                /* same for Q */
+  float *s2_im;
+  float *power_sum;            /* since the last report */
+  float *power;                /* report */
+  float *buffers;
+  uint32_t block_samples;
+  uint32_t num_blocks;         /* since the last report */
+  uint64_t sample_index;
+  double report_interval;      /* samples */
+  double next_report;
+} rf103_goertzel_t;
+
+
+/* internal functions */
+static void run_filters(rf103_goertzel_t *this, const float *samples,
+                        uint32_t num_samples);
+static void end_of_block(rf103_goertzel_t *this);
+static void report(rf103_goertzel_t *this);
+
+
+rf103_goertzel_t *rf103_goertzel_open(double sample_rate,
+                                      const double *frequencies,
+                                      uint32_t num_frequencies,
+                                      uint32_t block_length,
+                                      double report_rate,
+                                      rf103_goertzel_cb_t callback,
+                                      void *callback_context)
+{
+  rf103_goertzel_t *ret_val = 0;
+
+  if (sample_rate <= 0.0 || num_frequencies == 0 || block_length == 0 ||
+      report_rate <= 0.0 || callback == 0) {
+    fprintf(stderr, "ERROR - rf103_goertzel_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+  double report_interval = sample_rate / report_rate;
+  if (report_interval < block_length) {
+    fprintf(stderr, "ERROR - rf103_goertzel_open() failed: report rate %g is higher than the block rate %g\n",
+            report_rate, sample_rate / block_length);
+    return ret_val;
+  }
+  for (uint32_t i = 0; i < num_frequencies; ++i) {
+    if (fabs(frequencies[i]) > sample_rate / 2) {
+      fprintf(stderr, "ERROR - rf103_goertzel_open() failed: frequency %g out of range\n",
+              frequencies[i]);
+      return ret_val;
+    }
+  }
+
+  rf103_goertzel_t *this = (rf103_goertzel_t *)
+                           malloc(sizeof(rf103_goertzel_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
+  uint32_t num_bins = (num_frequencies + GOERTZEL_BINS_PER_PASS - 1) /
+                      GOERTZEL_BINS_PER_PASS * GOERTZEL_BINS_PER_PASS;
+  this->buffers = (float *) calloc((size_t) 9 * num_bins, sizeof(float));
+  if (this->buffers == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(this);
+    return ret_val;
+  }
+  this->num_frequencies = num_frequencies;
+  this->num_bins = num_bins;
+  this->block_length = block_length;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->coefficients = this->buffers;
+  this->cosines = this->coefficients + num_bins;
+  this->sines = this->cosines + num_bins;
+  this->s1_re = this->sines + num_bins;
+  this->s2_re = this->s1_re + num_bins;
+  this->s1_im = this->s2_re + num_bins;
+  this->s2_im = this->s1_im + num_bins;
+  this->power_sum = this->s2_im + num_bins;
+  this->power = this->power_sum + num_bins;
+  /* the padding bins are at frequency 0 and never reported */
+  for (uint32_t i = 0; i < num_bins; ++i) {
+    double w = i < num_frequencies ? 2.0 * M_PI * frequencies[i] /
+                                     sample_rate : 0.0;
+    this->coefficients[i] = (float) (2.0 * cos(w));
+    this->cosines[i] = (float) cos(w);
+    this->sines[i] = (float) sin(w);
+  }
+  this->block_samples = 0;
+  this->num_blocks = 0;
+  this->sample_index = 0;
+  this->report_interval = report_interval;
+  this->next_report = report_interval;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void rf103_goertzel_close(rf103_goertzel_t *this)
+{
+  free(this->buffers);
+  free(this);
+  return;
+}
+
+
+int rf103_goertzel_process(rf103_goertzel_t *this, const float *samples,
+                           uint32_t num_samples)
+{
+  uint32_t i = 0;
+  while (i < num_samples) {
+    /* up to the end of the block or to the next report */
+    uint32_t length = this->block_length - this->block_samples;
+    if (length > num_samples - i) {
+      length = num_samples - i;
+    }
+    uint64_t report_index = (uint64_t) llround(this->next_report);
+    if (report_index - this->sample_index < length) {
+      length = (uint32_t) (report_index - this->sample_index);
+    }
+    if (length > 0) {
+      run_filters(this, samples + 2 * (size_t) i, length);
+      this->block_samples += length;
+      this->sample_index += length;
+      i += length;
+    }
+    if (this->block_samples == this->block_length) {
+      end_of_block(this);
+    }
+    if (this->sample_index == report_index) {
+      report(this);
+      this->next_report += this->report_interval;
+    }
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static void run_filters(rf103_goertzel_t *this, const float *samples,
+                        uint32_t num_samples)
+{
+  for (uint32_t b = 0; b < this->num_bins; b += GOERTZEL_BINS_PER_PASS) {
+    float c[GOERTZEL_BINS_PER_PASS];
+    float s1_re[GOERTZEL_BINS_PER_PASS];
+    float s2_re[GOERTZEL_BINS_PER_PASS];
+    float s1_im[GOERTZEL_BINS_PER_PASS];
+    float s2_im[GOERTZEL_BINS_PER_PASS];
+    memcpy(c, this->coefficients + b, sizeof(c));
+    memcpy(s1_re, this->s1_re + b, sizeof(c));
+    memcpy(s2_re, this->s2_re + b, sizeof(c));
+    memcpy(s1_im, this->s1_im + b, sizeof(c));
+    memcpy(s2_im, this->s2_im + b, sizeof(c));
+    for (uint32_t n = 0; n < num_samples; ++n) {
+      float x_re = samples[2 * n];
+      float x_im = samples[2 * n + 1];
+      for (uint32_t k = 0; k < GOERTZEL_BINS_PER_PASS; ++k) {
+        float s0_re = x_re + c[k] * s1_re[k] - s2_re[k];
+        float s0_im = x_im + c[k] * s1_im[k] - s2_im[k];
+        s2_re[k] = s1_re[k];
+        s1_re[k] = s0_re;
+        s2_im[k] = s1_im[k];
+        s1_im[k] = s0_im;
+      }
+    }
+    memcpy(this->s1_re + b, s1_re, sizeof(c));
+    memcpy(this->s2_re + b, s2_re, sizeof(c));
+    memcpy(this->s1_im + b, s1_im, sizeof(c));
+    memcpy(this->s2_im + b, s2_im, sizeof(c));
+  }
+  return;
+}
+
+static void end_of_block(rf103_goertzel_t *this)
+{
+  /* X = (s1_re - e^-jw s2_re) + j (s1_im - e^-jw s2_im), scaled so that a
+     tone at w gives its mean power */
+  float scale = 1.0f / ((float) this->block_length *
+                        (float) this->block_length);
+  for (uint32_t k = 0; k < this->num_bins; k += SIMD_FLOAT_LANES) {
+    v8sf cw = V8SF_LOAD(this->cosines + k);
+    v8sf sw = V8SF_LOAD(this->sines + k);
+    v8sf s1_re = V8SF_LOAD(this->s1_re + k);
+    v8sf s2_re = V8SF_LOAD(this->s2_re + k);
+    v8sf s1_im = V8SF_LOAD(this->s1_im + k);
+    v8sf s2_im = V8SF_LOAD(this->s2_im + k);
+    v8sf re = s1_re - cw * s2_re - sw * s2_im;
+    v8sf im = s1_im - cw * s2_im + sw * s2_re;
+    v8sf power = V8SF_LOAD(this->power_sum + k) + (re * re + im * im) * scale;
+    V8SF_STORE(this->power_sum + k, power);
+  }
+  /* the four state arrays are contiguous */
+  memset(this->s1_re, 0, 4 * (size_t) this->num_bins * sizeof(float));
+  this->block_samples = 0;
+  ++this->num_blocks;
+  return;
+}
+
+static void report(rf103_goertzel_t *this)
+{
+  float scale = this->num_blocks > 0 ? 1.0f / this->num_blocks : 0.0f;
+  for (uint32_t i = 0; i < this->num_frequencies; ++i) {
+    float power = this->power_sum[i] * scale;
+    this->power[i] = power > 0.0f ? 10.0f * log10f(power) : -INFINITY;
+  }
+  memset(this->power_sum, 0, (size_t) this->num_bins * sizeof(float));
+  this->num_blocks = 0;
+  this->callback(this->sample_index, this->num_frequencies, this->power,
+                 this->callback_context);
+  return;
+}
@@ -0,0 +1,231 @@
+/*
+ * halfband.c - fs/4 real to complex conversion with a half-band filter
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Mixing with exp(-j pi n / 2) only multiplies the samples by 1, -j, -1, j,
+ * so the even samples end up (with alternating signs) in I and the odd
+ * ones in Q. In a half-band filter every other tap is zero except the
+ * center one, so after decimating by 2 the I output is a FIR on the even
+ * samples only, and the Q output is just the odd samples delayed by half
+ * the filter length; there are no multiplications for the mixer and only
+ * half of the taps are computed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "halfband.h"
+#include "dsp.h"
+#include "filter_design.h"
+#include "simd.h"
+
+
+static const double HALFBAND_TRANSITION = 0.1;    /* 0.2 fs to 0.3 fs */
+static const double HALFBAND_ATTENUATION = 80.0;  /* dB */
+
+typedef struct halfband {
+  enum DDCFormat format;
+  ddc_output_cb_t callback;
+  void *callback_context;
+  uint32_t num_taps;         /* nonzero taps (the center one excluded) */
+  float *taps;               /* reversed */
+  float center_tap;
+  uint32_t parity;           /* sign of the next pair of samples */
+  float *even;               /* filter history + new even samples */
+  float *odd;                /* delay line + new odd samples */
+  uint32_t buffer_size;
+  float *output_re;
+  float *output_im;
+  float *output;             /* interleaved (also used for int16) */
+  uint32_t output_size;
+} halfband_t;
+
+
+/* internal functions */
+static int resize(float **buffer, uint32_t size);
+
+
+halfband_t *halfband_open(enum DDCFormat format, ddc_output_cb_t callback,
+                          void *callback_context)
+{
+  halfband_t *ret_val = 0;
+
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - halfband_open() failed: no callback\n");
+    return ret_val;
+  }
+
+  /* the length must be 3 mod 4, so the center tap has an odd index and
+     the other nonzero taps have even indexes */
+  uint32_t length = fir_design_num_taps(HALFBAND_TRANSITION,
+                                        HALFBAND_ATTENUATION);
+  length = (length + 4) / 4 * 4 - 1;
+  float *prototype = fir_design_lowpass(length, 0.25, HALFBAND_ATTENUATION);
+  if (prototype == 0) {
+    return ret_val;
+  }
+
+  halfband_t *this = (halfband_t *) calloc(1, sizeof(halfband_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(prototype);
+    return ret_val;
+  }
+  this->format = format;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->num_taps = (length + 1) / 2;
+  this->taps = (float *) malloc(this->num_taps * sizeof(float));
+  if (this->taps == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    free(prototype);
+    halfband_close(this);
+    return ret_val;
+  }
+  /* the factor 2 gives unity gain for the positive frequency half of a
+     real signal */
+  for (uint32_t i = 0; i < this->num_taps; ++i) {
+    this->taps[this->num_taps - 1 - i] = 2.0f * prototype[2 * i];
+  }
+  this->center_tap = 2.0f * prototype[(length - 1) / 2];
+  free(prototype);
+  this->parity = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void halfband_close(halfband_t *this)
+{
+  free(this->taps);
+  free(this->even);
+  free(this->odd);
+  free(this->output_re);
+  free(this->output_im);
+  free(this->output);
+  free(this);
+  return;
+}
+
+
+void halfband_reset(halfband_t *this)
+{
+  if (this->buffer_size > 0) {
+    memset(this->even, 0, (this->num_taps - 1) * sizeof(float));
+    memset(this->odd, 0, this->num_taps / 2 * sizeof(float));
+  }
+  return;
+}
+
+
+int halfband_process(halfband_t *this, const int16_t *samples,
+                     uint32_t num_samples)
+{
+  if (num_samples % 2 != 0) {
+    fprintf(stderr, "ERROR - halfband_process() failed: odd number of samples\n");
+    return -1;
+  }
+
+  /* history: num_taps - 1 even samples, and half as many odd ones to line
+     up with the center tap */
+  uint32_t history = this->num_taps - 1;
+  uint32_t delay = this->num_taps / 2;
+  uint32_t n = num_samples / 2;
+  uint32_t size = SIMD_FLOAT_ROUND_UP(history + n) + SIMD_FLOAT_LANES;
+  if (size > this->buffer_size) {
+    if (resize(&this->even, size) < 0 || resize(&this->odd, size) < 0 ||
+        resize(&this->output_re, size) < 0 ||
+        resize(&this->output_im, size) < 0 ||
+        resize(&this->output, 2 * size) < 0) {
+      return -1;
+    }
+    if (this->buffer_size == 0) {
+      memset(this->even, 0, history * sizeof(float));
+      memset(this->odd, 0, delay * sizeof(float));
+    }
+    this->buffer_size = size;
+  }
+
+  /* mixer: x0 -x2 x4 -x6 ... in I and -x1 x3 -x5 x7 ... in Q */
+  float *even = this->even + history;
+  float *odd = this->odd + delay;
+  uint32_t i = 0;
+  if (this->parity) {
+    even[0] = -samples[0];
+    odd[0] = samples[1];
+    i = 1;
+  }
+  for (; i + 1 < n; i += 2) {
+    even[i] = samples[2 * i];
+    odd[i] = -samples[2 * i + 1];
+    even[i + 1] = -samples[2 * i + 2];
+    odd[i + 1] = samples[2 * i + 3];
+  }
+  if (i < n) {
+    even[i] = samples[2 * i];
+    odd[i] = -samples[2 * i + 1];
+  }
+  this->parity = (this->parity + n) & 1;
+
+  /* I: eight outputs at a time, each tap broadcast across the vector */
+  const float *taps = this->taps;
+  uint32_t num_taps = this->num_taps;
+  for (uint32_t m = 0; m < n; m += SIMD_FLOAT_LANES) {
+    const float *x = this->even + m;
+    v8sf acc = { 0 };
+    for (uint32_t k = 0; k < num_taps; ++k) {
+      acc += taps[k] * V8SF_LOAD(x + k);
+    }
+    V8SF_STORE(this->output_re + m, acc);
+  }
+
+  /* Q: the center tap only */
+  float center_tap = this->center_tap;
+  for (uint32_t m = 0; m < n; ++m) {
+    this->output_im[m] = center_tap * this->odd[m];
+  }
+
+  memmove(this->even, this->even + n, history * sizeof(float));
+  memmove(this->odd, this->odd + n, delay * sizeof(float));
+
+  if (this->format == DDC_FORMAT_INT16) {
+    dsp_interleave_int16(this->output_re, this->output_im,
+                         (int16_t *) this->output, n);
+  } else {
+    dsp_interleave(this->output_re, this->output_im, this->output, n);
+  }
+  this->callback(n, this->output, this->callback_context);
+  return 0;
+}
+
+
+/* internal functions */
+static int resize(float **buffer, uint32_t size)
+{
+  float *resized = (float *) realloc(*buffer, size * sizeof(float));
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  *buffer = resized;
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * halfband.h - fs/4 real to complex conversion with a half-band filter
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __HALFBAND_H
+#define __HALFBAND_H
+
+#include <stdint.h>
+
+#include "ddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct halfband halfband_t;
+
+/* shift the real stream down by fs/4 and decimate by 2: the output covers
+   the whole 0 to fs/2 band as complex samples at fs/2 (the usable passband
+   is +/- 0.4 times the output rate); the output formats and callback are
+   the same as the DDC */
+halfband_t *halfband_open(enum DDCFormat format, ddc_output_cb_t callback,
+                          void *callback_context);
+
+void halfband_close(halfband_t *this);
+
+/* forget the filter history, for a stream that starts over (or that has
+   not been fed for a while) */
+void halfband_reset(halfband_t *this);
+
+/* num_samples must be even */
+int halfband_process(halfband_t *this, const int16_t *samples,
+                     uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HALFBAND_H */
@@ -0,0 +1,363 @@
+/*
+ * integrity.c - per block CRC32C sidecar for recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "integrity.h"
+#include "crc32c.h"
+
+
+#define INTEGRITY_MAGIC "RF103CRC"
+#define INTEGRITY_VERSION (1)
+#define INTEGRITY_NUM_BUFFERS (8)
+#define INTEGRITY_MAX_THREADS (64)
+
+static const uint32_t DEFAULT_INTEGRITY_BLOCK_SIZE = 1024 * 1024;
+
+/* file layout: header followed by one CRC32C per block */
+struct integrity_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t num_blocks;
+};
+
+
+typedef struct integrity {
+  FILE *file;
+  struct integrity_header header;
+  uint8_t *buffers[INTEGRITY_NUM_BUFFERS];
+  size_t lengths[INTEGRITY_NUM_BUFFERS];
+  unsigned head;            /* buffer being filled by the writer */
+  unsigned tail;            /* next buffer for the worker */
+  unsigned count;           /* buffers waiting for the worker */
+  size_t fill;
+  int done;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_t worker;
+} integrity_t;
+
+struct verify_job {
+  const uint8_t *data;
+  const uint32_t *crcs;
+  uint64_t data_size;
+  uint32_t block_size;
+  uint64_t first_block;
+  uint64_t last_block;
+  int64_t bad_blocks;
+};
+
+
+/* internal functions */
+static void *integrity_worker(void *arg);
+static void submit_buffer(integrity_t *this);
+static void *verify_worker(void *arg);
+
+
+/******************************
+ * writer
+ ******************************/
+
+integrity_t *integrity_open(const char *filename, uint64_t data_offset,
+                            uint32_t block_size)
+{
+  integrity_t *ret_val = 0;
+
+  block_size = block_size > 0 ? block_size : DEFAULT_INTEGRITY_BLOCK_SIZE;
+
+  FILE *file = fopen(filename, "wb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", filename, strerror(errno));
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the integrity stream */
+  integrity_t *this = (integrity_t *) malloc(sizeof(integrity_t));
+  this->file = file;
+  memset(&this->header, 0, sizeof(this->header));
+  memcpy(this->header.magic, INTEGRITY_MAGIC, sizeof(this->header.magic));
+  this->header.version = INTEGRITY_VERSION;
+  this->header.block_size = block_size;
+  this->header.data_offset = data_offset;
+  this->header.data_size = 0;     /* to fix */
+  this->header.num_blocks = 0;    /* to fix */
+  for (int i = 0; i < INTEGRITY_NUM_BUFFERS; ++i) {
+    this->buffers[i] = (uint8_t *) malloc(block_size);
+    this->lengths[i] = 0;
+  }
+  this->head = 0;
+  this->tail = 0;
+  this->count = 0;
+  this->fill = 0;
+  this->done = 0;
+  this->failed = 0;
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->not_empty, 0);
+  pthread_cond_init(&this->not_full, 0);
+
+  if (fwrite(&this->header, sizeof(this->header), 1, file) != 1 ||
+      pthread_create(&this->worker, 0, integrity_worker, this) != 0) {
+    fprintf(stderr, "ERROR - unable to start the integrity stream for %s\n", filename);
+    for (int i = 0; i < INTEGRITY_NUM_BUFFERS; ++i) {
+      free(this->buffers[i]);
+    }
+    fclose(file);
+    free(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+int integrity_write(integrity_t *this, const void *data, size_t length)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint32_t block_size = this->header.block_size;
+  this->header.data_size += length;
+  while (length > 0) {
+    size_t n = block_size - this->fill;
+    n = n < length ? n : length;
+    memcpy(this->buffers[this->head] + this->fill, bytes, n);
+    this->fill += n;
+    bytes += n;
+    length -= n;
+    if (this->fill == block_size) {
+      submit_buffer(this);
+    }
+  }
+  return this->failed ? -1 : 0;
+}
+
+
+int integrity_close(integrity_t *this)
+{
+  if (this->fill > 0) {
+    submit_buffer(this);
+  }
+  pthread_mutex_lock(&this->lock);
+  this->done = 1;
+  pthread_cond_signal(&this->not_empty);
+  pthread_mutex_unlock(&this->lock);
+  pthread_join(this->worker, 0);
+
+  int ret_val = 0;
+  if (fseek(this->file, 0, SEEK_SET) != 0 ||
+      fwrite(&this->header, sizeof(this->header), 1, this->file) != 1) {
+    fprintf(stderr, "ERROR - unable to finalize integrity sidecar: %s\n",
+            strerror(errno));
+    ret_val = -1;
+  }
+  if (fclose(this->file) != 0 || this->failed) {
+    ret_val = -1;
+  }
+
+  pthread_cond_destroy(&this->not_full);
+  pthread_cond_destroy(&this->not_empty);
+  pthread_mutex_destroy(&this->lock);
+  for (int i = 0; i < INTEGRITY_NUM_BUFFERS; ++i) {
+    free(this->buffers[i]);
+  }
+  free(this);
+  return ret_val;
+}
+
+
+/******************************
+ * verification
+ ******************************/
+
+int64_t integrity_verify(const char *filename, const char *crcfilename,
+                         int num_threads)
+{
+  int64_t ret_val = -1;
+
+  FILE *crcfile = fopen(crcfilename, "rb");
+  if (crcfile == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", crcfilename, strerror(errno));
+    goto FAIL0;
+  }
+  struct integrity_header header;
+  if (fread(&header, sizeof(header), 1, crcfile) != 1 ||
+      memcmp(header.magic, INTEGRITY_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != INTEGRITY_VERSION || header.block_size == 0 ||
+      header.num_blocks != (header.data_size + header.block_size - 1) / header.block_size) {
+    fprintf(stderr, "ERROR - %s is not a valid integrity sidecar\n", crcfilename);
+    goto FAIL1;
+  }
+  uint32_t *crcs = (uint32_t *) malloc(header.num_blocks * sizeof(uint32_t) + 1);
+  if (fread(crcs, sizeof(uint32_t), header.num_blocks, crcfile) != header.num_blocks) {
+    fprintf(stderr, "ERROR - %s is truncated\n", crcfilename);
+    goto FAIL2;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL2;
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL3;
+  }
+  size_t size = statbuf.st_size;
+  if (header.data_offset + header.data_size > size) {
+    fprintf(stderr, "ERROR - %s is shorter than expected: %llu < %llu\n", filename,
+            (unsigned long long) size,
+            (unsigned long long) (header.data_offset + header.data_size));
+    ret_val = header.num_blocks;
+    goto FAIL3;
+  }
+  if (size == 0) {
+    ret_val = 0;
+    goto FAIL3;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL3;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);
+
+  /* split the blocks evenly across the threads */
+  if (num_threads <= 0) {
+    num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads > INTEGRITY_MAX_THREADS) {
+    num_threads = INTEGRITY_MAX_THREADS;
+  }
+  if ((uint64_t) num_threads > header.num_blocks) {
+    num_threads = header.num_blocks > 0 ? (int) header.num_blocks : 1;
+  }
+  struct verify_job jobs[INTEGRITY_MAX_THREADS];
+  pthread_t threads[INTEGRITY_MAX_THREADS];
+  int started[INTEGRITY_MAX_THREADS];
+  for (int i = 0; i < num_threads; ++i) {
+    jobs[i].data = base + header.data_offset;
+    jobs[i].crcs = crcs;
+    jobs[i].data_size = header.data_size;
+    jobs[i].block_size = header.block_size;
+    jobs[i].first_block = header.num_blocks * i / num_threads;
+    jobs[i].last_block = header.num_blocks * (i + 1) / num_threads;
+    jobs[i].bad_blocks = 0;
+    started[i] = pthread_create(&threads[i], 0, verify_worker, &jobs[i]) == 0;
+    if (!started[i]) {
+      /* do it here then */
+      verify_worker(&jobs[i]);
+    }
+  }
+  ret_val = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], 0);
+    }
+    ret_val += jobs[i].bad_blocks;
+  }
+
+  munmap(base, size);
+FAIL3:
+  close(fd);
+FAIL2:
+  free(crcs);
+FAIL1:
+  fclose(crcfile);
+FAIL0:
+  return ret_val;
+}
+
+
+/* internal functions */
+static void *integrity_worker(void *arg)
+{
+  integrity_t *this = (integrity_t *) arg;
+  pthread_mutex_lock(&this->lock);
+  while (1) {
+    while (this->count == 0 && !this->done) {
+      pthread_cond_wait(&this->not_empty, &this->lock);
+    }
+    if (this->count == 0) {
+      break;
+    }
+    unsigned index = this->tail;
+    pthread_mutex_unlock(&this->lock);
+
+    uint32_t crc = crc32c(0, this->buffers[index], this->lengths[index]);
+    if (fwrite(&crc, sizeof(crc), 1, this->file) != 1) {
+      this->failed = 1;
+    }
+
+    pthread_mutex_lock(&this->lock);
+    this->header.num_blocks++;
+    this->tail = (this->tail + 1) % INTEGRITY_NUM_BUFFERS;
+    this->count--;
+    pthread_cond_signal(&this->not_full);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+/* hand the current buffer to the worker and wait for a free one */
+static void submit_buffer(integrity_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->lengths[this->head] = this->fill;
+  this->head = (this->head + 1) % INTEGRITY_NUM_BUFFERS;
+  this->count++;
+  pthread_cond_signal(&this->not_empty);
+  while (this->count == INTEGRITY_NUM_BUFFERS) {
+    pthread_cond_wait(&this->not_full, &this->lock);
+  }
+  pthread_mutex_unlock(&this->lock);
+  this->fill = 0;
+}
+
+static void *verify_worker(void *arg)
+{
+  struct verify_job *job = (struct verify_job *) arg;
+  for (uint64_t block = job->first_block; block < job->last_block; ++block) {
+    uint64_t offset = block * job->block_size;
+    uint64_t length = job->data_size - offset;
+    length = length < job->block_size ? length : job->block_size;
+    uint32_t crc = crc32c(0, job->data + offset, length);
+    if (crc != job->crcs[block]) {
+      fprintf(stderr, "ERROR - block %llu (data offset %llu) checksum mismatch\n",
+              (unsigned long long) block, (unsigned long long) offset);
+      job->bad_blocks++;
+    }
+  }
+  return 0;
+}
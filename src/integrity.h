@@ -0,0 +1,55 @@
+/*
+ * integrity.h - per block CRC32C sidecar for recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __INTEGRITY_H
+#define __INTEGRITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct integrity integrity_t;
+
+/* the checksums cover the bytes written after data_offset in the
+   recording (i.e. the samples, since the header is rewritten at the end);
+   they are computed on a worker thread, so integrity_write() only copies
+   the data and must not be called from the USB callback */
+integrity_t *integrity_open(const char *filename, uint64_t data_offset,
+                            uint32_t block_size);
+
+int integrity_write(integrity_t *this, const void *data, size_t length);
+
+int integrity_close(integrity_t *this);
+
+/* check a recording against its sidecar using num_threads threads (0 means
+   one per core); returns the number of bad blocks or -1 on error */
+int64_t integrity_verify(const char *filename, const char *crcfilename,
+                         int num_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __INTEGRITY_H */
@@ -0,0 +1,168 @@
+/*
+ * lfqueue.c - bounded lock-free MPMC queue
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - D. Vyukov, "Bounded MPMC queue",
+ *    https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Every cell has a sequence number that tells whether it is ready to be
+ * written (sequence == position) or read (sequence == position + 1);
+ * producers and consumers claim positions with a CAS on their own counter.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lfqueue.h"
+
+
+struct lfqueue_cell {
+  _Atomic uint64_t sequence;
+  void *item;
+};
+
+typedef struct lfqueue {
+  uint32_t size;
+  uint32_t mask;
+  struct lfqueue_cell *cells;
+  /* on separate cache lines, since they are written by different threads */
+  _Alignas(64) _Atomic uint64_t enqueue_position;
+  _Alignas(64) _Atomic uint64_t dequeue_position;
+} lfqueue_t;
+
+
+lfqueue_t *lfqueue_create(uint32_t size)
+{
+  uint32_t rounded = 2;
+  while (rounded < size) {
+    rounded *= 2;
+  }
+
+  /* sizeof(lfqueue_t) is a multiple of its alignment */
+  lfqueue_t *this = (lfqueue_t *) aligned_alloc(_Alignof(lfqueue_t),
+                                                sizeof(lfqueue_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - aligned_alloc() failed\n");
+    return 0;
+  }
+  this->cells = (struct lfqueue_cell *) malloc(rounded *
+                                               sizeof(struct lfqueue_cell));
+  if (this->cells == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    free(this);
+    return 0;
+  }
+  this->size = rounded;
+  this->mask = rounded - 1;
+  for (uint32_t i = 0; i < rounded; ++i) {
+    atomic_init(&this->cells[i].sequence, i);
+    this->cells[i].item = 0;
+  }
+  atomic_init(&this->enqueue_position, 0);
+  atomic_init(&this->dequeue_position, 0);
+  return this;
+}
+
+
+void lfqueue_destroy(lfqueue_t *this)
+{
+  free(this->cells);
+  free(this);
+  return;
+}
+
+
+int lfqueue_push(lfqueue_t *this, void *item)
+{
+  uint64_t position = atomic_load_explicit(&this->enqueue_position,
+                                           memory_order_relaxed);
+  struct lfqueue_cell *cell;
+  while (1) {
+    cell = &this->cells[position & this->mask];
+    uint64_t sequence = atomic_load_explicit(&cell->sequence,
+                                             memory_order_acquire);
+    int64_t difference = (int64_t) (sequence - position);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->enqueue_position,
+                                                &position, position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return -1;
+    } else {
+      position = atomic_load_explicit(&this->enqueue_position,
+                                      memory_order_relaxed);
+    }
+  }
+  cell->item = item;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+  return 0;
+}
+
+
+void *lfqueue_pop(lfqueue_t *this)
+{
+  uint64_t position = atomic_load_explicit(&this->dequeue_position,
+                                           memory_order_relaxed);
+  struct lfqueue_cell *cell;
+  while (1) {
+    cell = &this->cells[position & this->mask];
+    uint64_t sequence = atomic_load_explicit(&cell->sequence,
+                                             memory_order_acquire);
+    int64_t difference = (int64_t) (sequence - (position + 1));
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->dequeue_position,
+                                                &position, position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return 0;
+    } else {
+      position = atomic_load_explicit(&this->dequeue_position,
+                                      memory_order_relaxed);
+    }
+  }
+  void *item = cell->item;
+  atomic_store_explicit(&cell->sequence, position + this->mask + 1,
+                        memory_order_release);
+  return item;
+}
+
+
+uint32_t lfqueue_depth(lfqueue_t *this)
+{
+  uint64_t dequeue = atomic_load_explicit(&this->dequeue_position,
+                                          memory_order_relaxed);
+  uint64_t enqueue = atomic_load_explicit(&this->enqueue_position,
+                                          memory_order_relaxed);
+  return enqueue > dequeue ? (uint32_t) (enqueue - dequeue) : 0;
+}
+
+
+uint32_t lfqueue_size(lfqueue_t *this)
+{
+  return this->size;
+}
@@ -0,0 +1,55 @@
+/*
+ * lfqueue.h - bounded lock-free MPMC queue
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __LFQUEUE_H
+#define __LFQUEUE_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lfqueue lfqueue_t;
+
+/* queue of pointers for any number of producers and consumers; size is
+   rounded up to a power of 2 */
+lfqueue_t *lfqueue_create(uint32_t size);
+
+void lfqueue_destroy(lfqueue_t *this);
+
+/* returns 0 or -1 if the queue is full */
+int lfqueue_push(lfqueue_t *this, void *item);
+
+/* returns 0 if the queue is empty */
+void *lfqueue_pop(lfqueue_t *this);
+
+/* approximate when other threads are using the queue */
+uint32_t lfqueue_depth(lfqueue_t *this);
+
+uint32_t lfqueue_size(lfqueue_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LFQUEUE_H */
@@ -23,17 +23,47 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "rf103.h"
+#include "rf103_pipeline.h"
 #include "logging.h"
 #include "usb_device.h"
 #include "clock_source.h"
 #include "adc.h"
+#include "parallel.h"
+#include "shm_ring.h"
+#include "ddc.h"
+#include "resampler.h"
+#include "frame_ring.h"
+#include "fanout.h"
+#include "channelizer.h"
+#include "fastconv.h"
+#include "psd.h"
+#include "design_cache.h"
 
 typedef struct rf103 rf103_t;
 
 /* internal functions */
 static uint8_t initial_gpio_register();
+static int rf103_has_consumers(rf103_t *this);
+static void rf103_async_callback(uint32_t data_size, uint8_t *data,
+                                 void *context);
+static void rf103_ddc_worker(uint32_t data_size, uint8_t *data,
+                            void *context);
+static void rf103_ddc_output(uint32_t num_samples, const void *samples,
+                             void *context);
+static double rf103_resampler_ratio(rf103_t *this);
+static void rf103_channelizer_worker(uint32_t data_size, uint8_t *data,
+                                    void *context);
+static void rf103_vfo_bank_worker(uint32_t data_size, uint8_t *data,
+                                  void *context);
+static void rf103_psd_worker(uint32_t data_size, uint8_t *data,
+                             void *context);
+static void rf103_preview_worker(uint32_t data_size, uint8_t *data,
+                                 void *context);
+static frame_ring_t *rf103_consumer_ring(rf103_t *this,
+                                         enum RF103Consumer consumer);
 
 
 enum RFMode {
@@ -49,9 +79,41 @@ typedef struct rf103 {
   usb_device_t *usb_device;
   clock_source_t *clock_source;
   adc_t *adc;
+  parallel_t *parallel;
   double sample_rate;
+  int random;
+  rf103_read_async_cb_t callback;
+  void *callback_context;
+  int is_async;               /* started with rf103_async_callback() */
+  shm_ring_t *shm_ring;
+  ddc_t *ddc;
+  frame_ring_t *ddc_ring;
+  enum RF103DDCFormat ddc_format;
+  rf103_ddc_cb_t ddc_callback;
+  void *ddc_callback_context;
+  resampler_t *resampler;
+  double ddc_output_rate;
+  double rate_correction;     /* ppm */
+  fanout_t *fanout;
+  int iq_fs4;                 /* fanout subscriber */
+  channelizer_t *channelizer;
+  frame_ring_t *channelizer_ring;
+  fastconv_t *vfo_bank;
+  frame_ring_t *vfo_bank_ring;
+  psd_t *psd;
+  frame_ring_t *psd_ring;
+  frame_ring_t *preview_ring;
+  uint32_t preview_interval;
+  uint32_t preview_decimation;
+  uint64_t preview_count;
+  rf103_preview_cb_t preview_callback;
+  void *preview_callback_context;
+  rf103_stage_t *pipeline_source;
+  uint64_t pipeline_sequence;
 } rf103_t;
 
+static const uint32_t DEFAULT_VFO_BANK_FFT_SIZE = 32768;
+
 
 /******************************
  * basic functions
@@ -129,7 +191,37 @@ rf103_t *rf103_open(int index, const char* imagefile)
   this->usb_device = usb_device;
   this->clock_source = clock_source;
   this->adc = 0;
+  this->parallel = 0;
   this->sample_rate = 0;    /* default sample rate */
+  this->random = 0;
+  this->callback = 0;
+  this->callback_context = 0;
+  this->is_async = 0;
+  this->shm_ring = 0;
+  this->ddc = 0;
+  this->ddc_ring = 0;
+  this->ddc_format = RF103_DDC_COMPLEX_FLOAT32;
+  this->ddc_callback = 0;
+  this->ddc_callback_context = 0;
+  this->resampler = 0;
+  this->ddc_output_rate = 0.0;
+  this->rate_correction = 0.0;
+  this->fanout = 0;
+  this->iq_fs4 = -1;
+  this->channelizer = 0;
+  this->channelizer_ring = 0;
+  this->vfo_bank = 0;
+  this->vfo_bank_ring = 0;
+  this->psd = 0;
+  this->psd_ring = 0;
+  this->preview_ring = 0;
+  this->preview_interval = 0;
+  this->preview_decimation = 0;
+  this->preview_count = 0;
+  this->preview_callback = 0;
+  this->preview_callback_context = 0;
+  this->pipeline_source = 0;
+  this->pipeline_sequence = 0;
 
   ret_val = this;
   return ret_val;
@@ -145,6 +237,32 @@ void rf103_close(rf103_t *this)
 {
   if (this->adc)
     adc_close(this->adc);
+  if (this->parallel)
+    parallel_close(this->parallel);
+  if (this->shm_ring)
+    shm_ring_destroy(this->shm_ring);
+  if (this->ddc_ring)
+    frame_ring_close(this->ddc_ring);
+  if (this->ddc)
+    ddc_close(this->ddc);
+  if (this->resampler)
+    resampler_close(this->resampler);
+  if (this->fanout)
+    fanout_close(this->fanout);
+  if (this->channelizer_ring)
+    frame_ring_close(this->channelizer_ring);
+  if (this->channelizer)
+    channelizer_close(this->channelizer);
+  if (this->vfo_bank_ring)
+    frame_ring_close(this->vfo_bank_ring);
+  if (this->vfo_bank)
+    fastconv_close(this->vfo_bank);
+  if (this->psd_ring)
+    frame_ring_close(this->psd_ring);
+  if (this->psd)
+    psd_close(this->psd);
+  if (this->preview_ring)
+    frame_ring_close(this->preview_ring);
   clock_source_close(this->clock_source);
   usb_device_close(this->usb_device);
   free(this);
@@ -154,6 +272,10 @@ void rf103_close(rf103_t *this)
 
 enum RF103Status rf103_status(rf103_t *this)
 {
+  /* a failed transfer stops the stream from the USB event thread */
+  if (this->status == STATUS_STREAMING && adc_has_failed(this->adc)) {
+    this->status = STATUS_FAILED;
+  }
   return this->status;
 }
 
@@ -222,12 +344,21 @@ int rf103_adc_dither(rf103_t *this, int dither)
 
 int rf103_adc_random(rf103_t *this, int random)
 {
+  int ret;
   if (random) {
-    return usb_device_gpio_on(this->usb_device, GPIO_RANDOM);
+    ret = usb_device_gpio_on(this->usb_device, GPIO_RANDOM);
   } else {
-    return usb_device_gpio_off(this->usb_device, GPIO_RANDOM);
+    ret = usb_device_gpio_off(this->usb_device, GPIO_RANDOM);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+  /* the ADC removes the randomization from the samples */
+  this->random = random;
+  if (this->adc) {
+    adc_set_random(this->adc, random);
   }
-  adc_set_random(this->adc, random);
+  return 0;
 }
 
 
@@ -239,6 +370,14 @@ int rf103_set_sample_rate(rf103_t *this, double sample_rate)
 {
   /* no checks yet */
   this->sample_rate = sample_rate;
+  /* the resampler ratio depends on the actual ADC clock */
+  if (this->resampler) {
+    double ratio = rf103_resampler_ratio(this);
+    if (ratio <= 0.0 || resampler_set_ratio(this->resampler, ratio) < 0) {
+      fprintf(stderr, "ERROR - resampler_set_ratio() failed\n");
+      return -1;
+    }
+  }
   return 0;
 }
 
@@ -248,16 +387,33 @@ int rf103_set_async_params(rf103_t *this, uint32_t frame_size,
                            void *callback_context)
 {
   if (this->adc) {
-    fprintf(stderr, "ERROR - adc_open_async() failed: already opened\n");
+    fprintf(stderr, "ERROR - adc_open_async() failed: already opened (use rf103_add_subscriber() for more consumers)\n");
     return -1;
   }
 
+  /* the ADC calls back into the library, so frames can also be handed to
+     the internal consumers (shared memory, ...); without a callback the
+     stream stays synchronous, unless some consumer is set up before
+     rf103_start_streaming() */
+  this->callback = callback;
+  this->callback_context = callback_context;
   this->adc = adc_open_async(this->usb_device, frame_size, num_frames,
-                              callback, callback_context);
+                              callback ? rf103_async_callback : 0, this);
   if (this->adc == 0) {
     fprintf(stderr, "ERROR - adc_open_async() failed\n");
     return -1;
   }
+  adc_set_random(this->adc, this->random);
+  /* room for twice the USB transfers in flight for the subscribers with
+     their own thread */
+  this->fanout = fanout_open(adc_get_frame_size(this->adc) / sizeof(int16_t),
+                             2 * adc_get_num_frames(this->adc));
+  if (this->fanout == 0) {
+    fprintf(stderr, "ERROR - fanout_open() failed\n");
+    adc_close(this->adc);
+    this->adc = 0;
+    return -1;
+  }
 
   return 0;
 }
@@ -268,26 +424,42 @@ int rf103_start_streaming(rf103_t *this)
   int ret = clock_source_set_clock(this->clock_source, ADC_CLOCK, this->sample_rate);
   if (ret < 0) {
     fprintf(stderr, "ERROR - clock_source_set_clock() failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
   ret = clock_source_start_clock(this->clock_source, ADC_CLOCK);
   if (ret < 0) {
     fprintf(stderr, "ERROR - clock_source_start_clock() failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
   adc_set_sample_rate(this->adc, (uint32_t) this->sample_rate);
+  this->is_async = this->callback || rf103_has_consumers(this);
+  ret = adc_set_callback(this->adc,
+                         this->is_async ? rf103_async_callback : 0, this);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - adc_set_callback() failed\n");
+    this->status = STATUS_FAILED;
+    return -1;
+  }
+  if (this->shm_ring) {
+    shm_ring_set_sample_rate(this->shm_ring, (uint32_t) this->sample_rate);
+  }
   ret = adc_start(this->adc);
   if (ret < 0) {
     fprintf(stderr, "ERROR - adc_start() failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
   ret = usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
   if (ret < 0) {
     fprintf(stderr, "ERROR - usb_device_control(STARTFX3) failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
 
   /* all good */
+  this->status = STATUS_STREAMING;
   return 0;
 }
 
@@ -301,19 +473,23 @@ int rf103_stop_streaming(rf103_t *this)
   int ret = usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
   if (ret < 0) {
     fprintf(stderr, "ERROR - usb_device_control(STOPFX3) failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
   ret = adc_stop(this->adc);
   if (ret < 0) {
     fprintf(stderr, "ERROR - adc_stop() failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
   ret = clock_source_stop_clock(this->clock_source, ADC_CLOCK);
   if (ret < 0) {
     fprintf(stderr, "ERROR - clock_source_stop_clock() failed\n");
+    this->status = STATUS_FAILED;
     return -1;
   }
 
+  this->status = adc_has_failed(this->adc) ? STATUS_FAILED : STATUS_READY;
   return 0;
 }
 
@@ -325,6 +501,9 @@ int rf103_reset_status(rf103_t *this)
     fprintf(stderr, "ERROR - adc_reset_status() failed\n");
     return -1;
   }
+  if (this->status == STATUS_FAILED) {
+    this->status = STATUS_READY;
+  }
   return 0;
 }
 
@@ -333,3 +512,829 @@ int rf103_read_sync(rf103_t *this, uint8_t *data, int length, int *transferred)
 {
   return adc_read_sync(this->adc, data, length, transferred);
 }
+
+
+/******************************
+ * shared memory related functions
+ ******************************/
+
+int rf103_set_shm_producer(rf103_t *this, const char *name,
+                           uint32_t num_slots, int flags)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_shm_producer() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->shm_ring) {
+    fprintf(stderr, "ERROR - shm_ring_create() failed: already created\n");
+    return -1;
+  }
+
+  int shm_flags = (flags & RF103_SHM_HUGEPAGES) ? SHM_RING_HUGEPAGES : 0;
+  this->shm_ring = shm_ring_create(name, adc_get_frame_size(this->adc),
+                                   num_slots, shm_flags);
+  if (this->shm_ring == 0) {
+    fprintf(stderr, "ERROR - shm_ring_create() failed\n");
+    return -1;
+  }
+  shm_ring_set_sample_rate(this->shm_ring, (uint32_t) this->sample_rate);
+
+  return 0;
+}
+
+
+/******************************
+ * parallel processing related functions
+ ******************************/
+
+int rf103_set_parallel_threads(rf103_t *this, uint32_t num_threads)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_parallel_threads() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  parallel_t *parallel = 0;
+  if (num_threads != 1) {
+    parallel = parallel_open(num_threads);
+    if (parallel == 0) {
+      fprintf(stderr, "ERROR - parallel_open() failed\n");
+      return -1;
+    }
+  }
+  adc_set_parallel(this->adc, parallel);
+  if (this->parallel)
+    parallel_close(this->parallel);
+  this->parallel = parallel;
+  return 0;
+}
+
+
+/******************************
+ * ADC correction related functions
+ ******************************/
+
+int rf103_set_adc_correction(rf103_t *this, double gain, double offset,
+                             double time_constant, int flags)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_adc_correction() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  int adc_flags = ((flags & RF103_ADC_MEASURE_DC) ? ADC_MEASURE_DC : 0) |
+                  ((flags & RF103_ADC_REMOVE_DC) ? ADC_REMOVE_DC : 0) |
+                  ((flags & RF103_ADC_CALIBRATE) ? ADC_CALIBRATE : 0) |
+                  ((flags & RF103_ADC_MEASURE_LEVELS) ? ADC_MEASURE_LEVELS :
+                                                        0);
+  return adc_set_correction(this->adc, gain, offset, time_constant,
+                            adc_flags);
+}
+
+
+int rf103_get_adc_stats(rf103_t *this, struct rf103_adc_stats *stats)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_get_adc_stats() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  return adc_get_stats(this->adc, stats);
+}
+
+
+/******************************
+ * DSP pipeline related functions
+ ******************************/
+
+int rf103_set_pipeline_source(rf103_t *this, rf103_stage_t *stage)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_pipeline_source() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (stage && rf103_pipeline_get_frame_size(rf103_stage_pipeline(stage)) <
+               adc_get_frame_size(this->adc)) {
+    fprintf(stderr, "ERROR - rf103_set_pipeline_source() failed: pipeline frames smaller than USB frames\n");
+    return -1;
+  }
+  this->pipeline_source = stage;
+  this->pipeline_sequence = 0;
+  return 0;
+}
+
+
+/******************************
+ * digital down converter related functions
+ ******************************/
+
+int rf103_set_ddc(rf103_t *this, double center_frequency, uint32_t decimation,
+                  enum RF103DDCFormat format, int flags,
+                  rf103_ddc_cb_t callback, void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_ddc() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->ddc) {
+    fprintf(stderr, "ERROR - ddc_open() failed: already opened\n");
+    return -1;
+  }
+  if (this->sample_rate <= 0.0) {
+    fprintf(stderr, "ERROR - rf103_set_ddc() called before rf103_set_sample_rate()\n");
+    return -1;
+  }
+
+  enum DDCFormat ddc_format = format == RF103_DDC_COMPLEX_INT16 ?
+                              DDC_FORMAT_INT16 : DDC_FORMAT_FLOAT32;
+  int ddc_flags = ((flags & RF103_DDC_FIXED_POINT) ? DDC_FIXED_POINT : 0) |
+                  ((flags & RF103_DDC_CIC) ? DDC_CIC : 0);
+  ddc_t *ddc = ddc_open(center_frequency / this->sample_rate, decimation,
+                        ddc_format, ddc_flags, 0, rf103_ddc_output, this);
+  if (ddc == 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed\n");
+    return -1;
+  }
+  if (flags & RF103_DDC_WORKER_THREAD) {
+    /* room for twice the USB transfers in flight */
+    this->ddc_ring = frame_ring_open(adc_get_frame_size(this->adc),
+                                     2 * adc_get_num_frames(this->adc),
+                                     rf103_ddc_worker, ddc);
+    if (this->ddc_ring == 0) {
+      fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+      ddc_close(ddc);
+      return -1;
+    }
+  }
+  this->ddc = ddc;
+  this->ddc_format = format;
+  this->ddc_callback = callback;
+  this->ddc_callback_context = callback_context;
+
+  return 0;
+}
+
+
+int rf103_set_ddc_frequency(rf103_t *this, double center_frequency)
+{
+  if (this->ddc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_ddc_frequency() called before rf103_set_ddc()\n");
+    return -1;
+  }
+  return ddc_set_frequency(this->ddc, center_frequency / this->sample_rate);
+}
+
+
+int rf103_set_ddc_output_rate(rf103_t *this, double output_rate)
+{
+  if (this->ddc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_ddc_output_rate() called before rf103_set_ddc()\n");
+    return -1;
+  }
+  if (this->resampler) {
+    fprintf(stderr, "ERROR - resampler_open() failed: already opened\n");
+    return -1;
+  }
+  if (output_rate <= 0.0) {
+    fprintf(stderr, "ERROR - rf103_set_ddc_output_rate() failed: invalid output rate\n");
+    return -1;
+  }
+
+  this->ddc_output_rate = output_rate;
+  double ratio = rf103_resampler_ratio(this);
+  if (ratio <= 0.0) {
+    fprintf(stderr, "ERROR - clock_source_get_actual_frequency() failed\n");
+    return -1;
+  }
+  enum ResamplerFormat resampler_format =
+                       this->ddc_format == RF103_DDC_COMPLEX_INT16 ?
+                       RESAMPLER_FORMAT_INT16 : RESAMPLER_FORMAT_FLOAT32;
+  this->resampler = resampler_open(ratio, resampler_format,
+                                   this->ddc_callback,
+                                   this->ddc_callback_context);
+  if (this->resampler == 0) {
+    fprintf(stderr, "ERROR - resampler_open() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+int rf103_set_ddc_rate_correction(rf103_t *this, double ppm)
+{
+  this->rate_correction = ppm;
+  if (this->resampler == 0) {
+    return 0;
+  }
+  return resampler_set_ratio(this->resampler, rf103_resampler_ratio(this));
+}
+
+
+int rf103_set_iq_fs4(rf103_t *this, enum RF103DDCFormat format,
+                     rf103_ddc_cb_t callback, void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_iq_fs4() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->iq_fs4 >= 0) {
+    fprintf(stderr, "ERROR - rf103_set_iq_fs4() failed: already set\n");
+    return -1;
+  }
+
+  /* the first stage of the subscriber chain, shared with them */
+  enum FanoutFormat fanout_format = format == RF103_DDC_COMPLEX_INT16 ?
+                                    FANOUT_COMPLEX_INT16 :
+                                    FANOUT_COMPLEX_FLOAT32;
+  this->iq_fs4 = fanout_add(this->fanout, fanout_format, 2, 0, callback,
+                            callback_context);
+  if (this->iq_fs4 < 0) {
+    fprintf(stderr, "ERROR - fanout_add() failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/******************************
+ * channelizer related functions
+ ******************************/
+
+int rf103_set_channelizer(rf103_t *this, uint32_t num_channels, int flags,
+                          rf103_channel_cb_t callback, void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_channelizer() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->channelizer) {
+    fprintf(stderr, "ERROR - channelizer_open() failed: already opened\n");
+    return -1;
+  }
+
+  channelizer_t *channelizer = channelizer_open(num_channels,
+                                   flags & RF103_CHANNELIZER_OVERSAMPLED,
+                                   callback, callback_context);
+  if (channelizer == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed\n");
+    return -1;
+  }
+  if (flags & RF103_CHANNELIZER_WORKER_THREAD) {
+    this->channelizer_ring = frame_ring_open(adc_get_frame_size(this->adc),
+                                             2 * adc_get_num_frames(this->adc),
+                                             rf103_channelizer_worker,
+                                             channelizer);
+    if (this->channelizer_ring == 0) {
+      fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+      channelizer_close(channelizer);
+      return -1;
+    }
+  }
+  this->channelizer = channelizer;
+
+  return 0;
+}
+
+
+int rf103_channelizer_enable(rf103_t *this, uint32_t channel, int enable)
+{
+  if (this->channelizer == 0) {
+    fprintf(stderr, "ERROR - rf103_channelizer_enable() called before rf103_set_channelizer()\n");
+    return -1;
+  }
+  return channelizer_enable(this->channelizer, channel, enable);
+}
+
+
+/******************************
+ * VFO bank related functions
+ ******************************/
+
+int rf103_set_vfo_bank(rf103_t *this, uint32_t fft_size, int flags,
+                       rf103_vfo_cb_t callback, void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_vfo_bank() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->vfo_bank) {
+    fprintf(stderr, "ERROR - fastconv_open() failed: already opened\n");
+    return -1;
+  }
+
+  fft_size = fft_size > 0 ? fft_size : DEFAULT_VFO_BANK_FFT_SIZE;
+  fastconv_t *vfo_bank = fastconv_open(fft_size, callback, callback_context);
+  if (vfo_bank == 0) {
+    fprintf(stderr, "ERROR - fastconv_open() failed\n");
+    return -1;
+  }
+  if (flags & RF103_VFO_WORKER_THREAD) {
+    this->vfo_bank_ring = frame_ring_open(adc_get_frame_size(this->adc),
+                                          2 * adc_get_num_frames(this->adc),
+                                          rf103_vfo_bank_worker, vfo_bank);
+    if (this->vfo_bank_ring == 0) {
+      fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+      fastconv_close(vfo_bank);
+      return -1;
+    }
+  }
+  this->vfo_bank = vfo_bank;
+
+  return 0;
+}
+
+
+int rf103_add_vfo(rf103_t *this, double frequency, double bandwidth,
+                  uint32_t decimation)
+{
+  if (this->vfo_bank == 0) {
+    fprintf(stderr, "ERROR - rf103_add_vfo() called before rf103_set_vfo_bank()\n");
+    return -1;
+  }
+  if (this->sample_rate <= 0.0) {
+    fprintf(stderr, "ERROR - rf103_add_vfo() called before rf103_set_sample_rate()\n");
+    return -1;
+  }
+  return fastconv_add_vfo(this->vfo_bank, frequency / this->sample_rate,
+                          bandwidth / this->sample_rate, decimation);
+}
+
+
+int rf103_retune_vfo(rf103_t *this, int vfo, double frequency)
+{
+  if (this->vfo_bank == 0) {
+    fprintf(stderr, "ERROR - rf103_retune_vfo() called before rf103_set_vfo_bank()\n");
+    return -1;
+  }
+  return fastconv_retune_vfo(this->vfo_bank, vfo,
+                             frequency / this->sample_rate);
+}
+
+
+int rf103_remove_vfo(rf103_t *this, int vfo)
+{
+  if (this->vfo_bank == 0) {
+    fprintf(stderr, "ERROR - rf103_remove_vfo() called before rf103_set_vfo_bank()\n");
+    return -1;
+  }
+  return fastconv_remove_vfo(this->vfo_bank, vfo);
+}
+
+
+/******************************
+ * power spectrum related functions
+ ******************************/
+
+int rf103_set_psd(rf103_t *this, uint32_t fft_size, double overlap,
+                  uint32_t num_averages, enum RF103PSDWindow window,
+                  double frame_rate, uint32_t num_threads,
+                  rf103_psd_cb_t callback, void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_psd() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->psd) {
+    fprintf(stderr, "ERROR - psd_open() failed: already opened\n");
+    return -1;
+  }
+
+  enum PSDWindow psd_window;
+  switch (window) {
+  case RF103_PSD_WINDOW_HANN:
+    psd_window = PSD_WINDOW_HANN;
+    break;
+  case RF103_PSD_WINDOW_BLACKMAN_HARRIS:
+    psd_window = PSD_WINDOW_BLACKMAN_HARRIS;
+    break;
+  case RF103_PSD_WINDOW_FLAT_TOP:
+    psd_window = PSD_WINDOW_FLAT_TOP;
+    break;
+  default:
+    fprintf(stderr, "ERROR - invalid PSD window: %d\n", window);
+    return -1;
+  }
+  psd_t *psd = psd_open(fft_size, overlap, num_averages, psd_window,
+                        this->sample_rate, frame_rate, num_threads,
+                        callback, callback_context);
+  if (psd == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed\n");
+    return -1;
+  }
+  /* always off the USB event thread */
+  this->psd_ring = frame_ring_open(adc_get_frame_size(this->adc),
+                                   2 * adc_get_num_frames(this->adc),
+                                   rf103_psd_worker, psd);
+  if (this->psd_ring == 0) {
+    fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+    psd_close(psd);
+    return -1;
+  }
+  this->psd = psd;
+
+  return 0;
+}
+
+
+int rf103_set_psd_mode(rf103_t *this, enum RF103PSDMode mode)
+{
+  if (this->psd == 0) {
+    fprintf(stderr, "ERROR - rf103_set_psd_mode() called before rf103_set_psd()\n");
+    return -1;
+  }
+  switch (mode) {
+  case RF103_PSD_AVERAGE:
+    return psd_set_mode(this->psd, PSD_MODE_AVERAGE);
+  case RF103_PSD_PEAK_HOLD:
+    return psd_set_mode(this->psd, PSD_MODE_PEAK_HOLD);
+  case RF103_PSD_MIN_HOLD:
+    return psd_set_mode(this->psd, PSD_MODE_MIN_HOLD);
+  }
+  fprintf(stderr, "ERROR - invalid PSD mode: %d\n", mode);
+  return -1;
+}
+
+
+/******************************
+ * preview related functions
+ ******************************/
+
+int rf103_set_preview(rf103_t *this, uint32_t frame_interval,
+                      uint32_t decimation, rf103_preview_cb_t callback,
+                      void *callback_context)
+{
+  if (this->adc == 0) {
+    fprintf(stderr, "ERROR - rf103_set_preview() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (this->preview_ring) {
+    fprintf(stderr, "ERROR - preview already set\n");
+    return -1;
+  }
+  if (frame_interval == 0 || decimation == 0 || callback == 0) {
+    fprintf(stderr, "ERROR - invalid preview parameters\n");
+    return -1;
+  }
+  uint32_t frame_size = adc_get_frame_size(this->adc);
+  if (decimation > frame_size / sizeof(int16_t)) {
+    fprintf(stderr, "ERROR - preview decimation %u larger than a frame\n",
+            decimation);
+    return -1;
+  }
+  this->preview_interval = frame_interval;
+  this->preview_decimation = decimation;
+  this->preview_count = 0;
+  this->preview_callback = callback;
+  this->preview_callback_context = callback_context;
+  /* a single slot: a frame is only queued when the previous one is done */
+  this->preview_ring = frame_ring_open(frame_size, 1, rf103_preview_worker,
+                                       this);
+  if (this->preview_ring == 0) {
+    fprintf(stderr, "ERROR - frame_ring_open() failed\n");
+    return -1;
+  }
+  /* not fatal: the drops still keep it off the USB event thread */
+  frame_ring_set_background(this->preview_ring);
+
+  return 0;
+}
+
+
+uint64_t rf103_get_preview_dropped(rf103_t *this)
+{
+  if (this->preview_ring == 0) {
+    return 0;
+  }
+  return frame_ring_dropped(this->preview_ring);
+}
+
+
+/******************************
+ * subscriber related functions
+ ******************************/
+
+int rf103_add_subscriber(rf103_t *this, enum RF103SubscriberFormat format,
+                         uint32_t decimation, int flags,
+                         rf103_subscriber_cb_t callback,
+                         void *callback_context)
+{
+  if (this->fanout == 0) {
+    fprintf(stderr, "ERROR - rf103_add_subscriber() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  /* a synchronous stream never goes through the fanout, so the
+     subscriber would not get any data until the stream is restarted */
+  if (this->status == STATUS_STREAMING && !this->is_async) {
+    fprintf(stderr, "ERROR - rf103_add_subscriber() failed: the stream was started synchronously\n");
+    return -1;
+  }
+  enum FanoutFormat fanout_format;
+  switch (format) {
+  case RF103_SUBSCRIBER_REAL_INT16:
+    fanout_format = FANOUT_REAL_INT16;
+    break;
+  case RF103_SUBSCRIBER_COMPLEX_FLOAT32:
+    fanout_format = FANOUT_COMPLEX_FLOAT32;
+    break;
+  case RF103_SUBSCRIBER_COMPLEX_INT16:
+    fanout_format = FANOUT_COMPLEX_INT16;
+    break;
+  default:
+    fprintf(stderr, "ERROR - invalid subscriber format: %d\n", format);
+    return -1;
+  }
+  int fanout_flags = (flags & RF103_SUBSCRIBER_WORKER_THREAD) ?
+                     FANOUT_WORKER_THREAD : 0;
+  return fanout_add(this->fanout, fanout_format, decimation, fanout_flags,
+                    callback, callback_context);
+}
+
+
+int rf103_remove_subscriber(rf103_t *this, int subscriber)
+{
+  if (this->fanout == 0) {
+    fprintf(stderr, "ERROR - rf103_remove_subscriber() called before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (subscriber == this->iq_fs4) {
+    this->iq_fs4 = -1;
+  }
+  return fanout_remove(this->fanout, subscriber);
+}
+
+
+/******************************
+ * overflow related functions
+ ******************************/
+
+int rf103_set_overflow_policy(rf103_t *this, enum RF103Consumer consumer,
+                              int subscriber,
+                              enum RF103OverflowPolicy policy)
+{
+  enum FrameRingPolicy frame_ring_policy;
+  switch (policy) {
+  case RF103_OVERFLOW_DROP_NEWEST:
+    frame_ring_policy = FRAME_RING_DROP_NEWEST;
+    break;
+  case RF103_OVERFLOW_DROP_OLDEST:
+    frame_ring_policy = FRAME_RING_DROP_OLDEST;
+    break;
+  case RF103_OVERFLOW_BLOCK:
+    frame_ring_policy = FRAME_RING_BLOCK;
+    break;
+  default:
+    fprintf(stderr, "ERROR - invalid overflow policy: %d\n", policy);
+    return -1;
+  }
+  /* the preview worker runs at idle priority: blocking on it could stall
+     the USB thread indefinitely */
+  if (consumer == RF103_CONSUMER_PREVIEW &&
+      frame_ring_policy == FRAME_RING_BLOCK) {
+    fprintf(stderr, "ERROR - rf103_set_overflow_policy() failed: the preview cannot block\n");
+    return -1;
+  }
+  if (consumer == RF103_CONSUMER_SUBSCRIBER) {
+    if (this->fanout == 0) {
+      fprintf(stderr, "ERROR - rf103_set_overflow_policy() called before rf103_set_async_params()\n");
+      return -1;
+    }
+    return fanout_set_policy(this->fanout, subscriber, frame_ring_policy);
+  }
+  frame_ring_t *ring = rf103_consumer_ring(this, consumer);
+  if (ring == 0) {
+    return -1;
+  }
+  frame_ring_set_policy(ring, frame_ring_policy);
+  return 0;
+}
+
+
+int rf103_get_overflow_stats(rf103_t *this, enum RF103Consumer consumer,
+                             int subscriber,
+                             struct rf103_overflow_stats *stats)
+{
+  struct frame_ring_stats frame_ring_stats;
+  if (consumer == RF103_CONSUMER_SUBSCRIBER) {
+    if (this->fanout == 0) {
+      fprintf(stderr, "ERROR - rf103_get_overflow_stats() called before rf103_set_async_params()\n");
+      return -1;
+    }
+    if (fanout_get_stats(this->fanout, subscriber, &frame_ring_stats) < 0) {
+      return -1;
+    }
+  } else {
+    frame_ring_t *ring = rf103_consumer_ring(this, consumer);
+    if (ring == 0) {
+      return -1;
+    }
+    frame_ring_get_stats(ring, &frame_ring_stats);
+  }
+  stats->frames = frame_ring_stats.pushed;
+  stats->dropped_newest = frame_ring_stats.dropped_newest;
+  stats->dropped_oldest = frame_ring_stats.dropped_oldest;
+  stats->blocked = frame_ring_stats.blocked;
+  stats->blocked_ns = frame_ring_stats.blocked_ns;
+  stats->queue_depth = frame_ring_stats.queue_depth;
+  stats->max_queue_depth = frame_ring_stats.max_queue_depth;
+  stats->queue_size = frame_ring_stats.queue_size;
+  return 0;
+}
+
+
+/******************************
+ * design cache related functions
+ ******************************/
+
+int rf103_load_design_cache(const char *filename)
+{
+  return design_cache_load(filename);
+}
+
+
+int rf103_save_design_cache(const char *filename)
+{
+  return design_cache_save(filename);
+}
+
+
+/* internal functions */
+static int rf103_has_consumers(rf103_t *this)
+{
+  return this->shm_ring || this->ddc || this->channelizer ||
+         this->vfo_bank || this->psd || this->preview_ring ||
+         this->pipeline_source ||
+         (this->fanout && fanout_get_num_subscribers(this->fanout) > 0);
+}
+
+static void rf103_async_callback(uint32_t data_size, uint8_t *data,
+                                 void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  if (this->shm_ring) {
+    shm_ring_publish(this->shm_ring, data, data_size);
+  }
+  if (this->fanout) {
+    fanout_process(this->fanout, (const int16_t *) data,
+                   data_size / sizeof(int16_t));
+  }
+  if (this->ddc_ring) {
+    frame_ring_push(this->ddc_ring, data, data_size);
+  } else if (this->ddc) {
+    ddc_process(this->ddc, (const int16_t *) data,
+                data_size / sizeof(int16_t));
+  }
+  if (this->channelizer_ring) {
+    frame_ring_push(this->channelizer_ring, data, data_size);
+  } else if (this->channelizer) {
+    channelizer_process(this->channelizer, (const int16_t *) data,
+                        data_size / sizeof(int16_t));
+  }
+  if (this->vfo_bank_ring) {
+    frame_ring_push(this->vfo_bank_ring, data, data_size);
+  } else if (this->vfo_bank) {
+    fastconv_process(this->vfo_bank, (const int16_t *) data,
+                     data_size / sizeof(int16_t));
+  }
+  if (this->psd_ring) {
+    frame_ring_push(this->psd_ring, data, data_size);
+  }
+  if (this->pipeline_source) {
+    rf103_frame_t *frame = rf103_pipeline_lease(
+                             rf103_stage_pipeline(this->pipeline_source));
+    if (frame) {
+      memcpy(frame->data, data, data_size);
+      frame->length = data_size;
+      frame->sequence = this->pipeline_sequence;
+      rf103_pipeline_push(this->pipeline_source, frame);
+      rf103_frame_release(frame);
+    } else {
+      rf103_stage_count_lost(this->pipeline_source);
+    }
+    ++this->pipeline_sequence;
+  }
+  if (this->callback) {
+    this->callback(data_size, data, this->callback_context);
+  }
+  /* after the full rate callback, and only one frame in preview_interval
+     is copied */
+  if (this->preview_ring) {
+    if (this->preview_count++ % this->preview_interval == 0) {
+      frame_ring_push(this->preview_ring, data, data_size);
+    }
+  }
+  return;
+}
+
+static void rf103_ddc_worker(uint32_t data_size, uint8_t *data,
+                            void *context)
+{
+  ddc_t *ddc = (ddc_t *) context;
+  ddc_process(ddc, (const int16_t *) data, data_size / sizeof(int16_t));
+  return;
+}
+
+static void rf103_ddc_output(uint32_t num_samples, const void *samples,
+                             void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  if (this->resampler) {
+    resampler_process(this->resampler, samples, num_samples);
+  } else {
+    this->ddc_callback(num_samples, samples, this->ddc_callback_context);
+  }
+  return;
+}
+
+/* output rate over the DDC rate, from the rate the ADC clock is actually
+   synthesized at and the measured correction */
+static double rf103_resampler_ratio(rf103_t *this)
+{
+  double adc_rate = clock_source_get_actual_frequency(this->clock_source,
+                                                      this->sample_rate);
+  if (adc_rate <= 0.0) {
+    return 0.0;
+  }
+  adc_rate *= 1.0 + this->rate_correction * 1e-6;
+  return this->ddc_output_rate * ddc_get_decimation(this->ddc) / adc_rate;
+}
+
+static void rf103_channelizer_worker(uint32_t data_size, uint8_t *data,
+                                    void *context)
+{
+  channelizer_t *channelizer = (channelizer_t *) context;
+  channelizer_process(channelizer, (const int16_t *) data,
+                      data_size / sizeof(int16_t));
+  return;
+}
+
+static void rf103_vfo_bank_worker(uint32_t data_size, uint8_t *data,
+                                  void *context)
+{
+  fastconv_t *vfo_bank = (fastconv_t *) context;
+  fastconv_process(vfo_bank, (const int16_t *) data,
+                   data_size / sizeof(int16_t));
+  return;
+}
+
+static void rf103_psd_worker(uint32_t data_size, uint8_t *data,
+                             void *context)
+{
+  psd_t *psd = (psd_t *) context;
+  psd_process(psd, (const int16_t *) data, data_size / sizeof(int16_t));
+  return;
+}
+
+/* boxcar average in place: each output sample is written over the first
+   sample of its own group, so nothing is overwritten before it is read */
+static void rf103_preview_worker(uint32_t data_size, uint8_t *data,
+                                 void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  int16_t *samples = (int16_t *) data;
+  uint32_t num_samples = data_size / sizeof(int16_t);
+  uint32_t decimation = this->preview_decimation;
+  if (decimation > 1) {
+    uint32_t num_output = num_samples / decimation;
+    for (uint32_t i = 0; i < num_output; ++i) {
+      const int16_t *group = samples + (size_t) i * decimation;
+      int64_t sum = 0;
+      for (uint32_t j = 0; j < decimation; ++j) {
+        sum += group[j];
+      }
+      samples[i] = (int16_t) (sum / (int64_t) decimation);
+    }
+    num_samples = num_output;
+  }
+  this->preview_callback(num_samples, samples,
+                         this->preview_callback_context);
+  return;
+}
+
+static frame_ring_t *rf103_consumer_ring(rf103_t *this,
+                                         enum RF103Consumer consumer)
+{
+  frame_ring_t *ring = 0;
+  switch (consumer) {
+  case RF103_CONSUMER_DDC:
+    ring = this->ddc_ring;
+    break;
+  case RF103_CONSUMER_CHANNELIZER:
+    ring = this->channelizer_ring;
+    break;
+  case RF103_CONSUMER_VFO_BANK:
+    ring = this->vfo_bank_ring;
+    break;
+  case RF103_CONSUMER_PSD:
+    ring = this->psd_ring;
+    break;
+  case RF103_CONSUMER_PREVIEW:
+    ring = this->preview_ring;
+    break;
+  default:
+    fprintf(stderr, "ERROR - invalid consumer: %d\n", consumer);
+    return 0;
+  }
+  if (ring == 0) {
+    fprintf(stderr, "ERROR - consumer %d not set up, or not on a thread of its own\n",
+            consumer);
+  }
+  return ring;
+}
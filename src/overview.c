@@ -0,0 +1,504 @@
+/*
+ * overview.c - multi-resolution min/max/RMS overview of recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "overview.h"
+
+
+#define OVERVIEW_MAGIC "RF103OVW"
+#define OVERVIEW_VERSION (1)
+#define OVERVIEW_MAX_LEVELS (48)
+
+static const uint32_t DEFAULT_OVERVIEW_BASE_SHIFT = 10;  /* 1024 samples */
+
+/* file layout: header, num_levels level headers, then the bins of every
+   level (finest first) */
+struct overview_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t base_shift;
+  uint32_t num_levels;
+  uint32_t bin_size;
+  double sample_rate;
+  uint64_t num_samples;
+};
+
+struct overview_level {
+  uint32_t shift;
+  uint32_t reserved;
+  uint64_t num_bins;
+  uint64_t offset;
+};
+
+struct accumulator {
+  int16_t min;
+  int16_t max;
+  double sum_squares;
+  uint64_t num_samples;
+  uint32_t count;
+};
+
+
+typedef struct overview {
+  char *filename;
+  double sample_rate;
+  uint32_t base_shift;
+  uint64_t block_size;
+  uint64_t num_samples;
+  int failed;
+  FILE *levels[OVERVIEW_MAX_LEVELS];
+  uint64_t num_bins[OVERVIEW_MAX_LEVELS];
+  struct accumulator acc[OVERVIEW_MAX_LEVELS];
+} overview_t;
+
+typedef struct overview_reader {
+  int fd;
+  uint8_t *base;
+  size_t size;
+  const struct overview_header *header;
+  const struct overview_level *levels;
+} overview_reader_t;
+
+
+/* internal functions */
+static void reduce_block(const int16_t *samples, size_t n, int16_t *min,
+                         int16_t *max, uint64_t *sum_squares);
+static void reset_accumulator(struct accumulator *acc);
+static void merge_accumulator(struct accumulator *acc, int16_t min,
+                              int16_t max, double sum_squares,
+                              uint64_t num_samples);
+static void emit_bin(overview_t *this, int level);
+
+
+/******************************
+ * builder
+ ******************************/
+
+overview_t *overview_open(const char *filename, double sample_rate,
+                          uint32_t base_shift)
+{
+  overview_t *ret_val = 0;
+
+  base_shift = base_shift > 0 ? base_shift : DEFAULT_OVERVIEW_BASE_SHIFT;
+  if (base_shift > 24) {
+    fprintf(stderr, "ERROR - invalid overview base shift: %u\n", base_shift);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the overview; the levels are
+     collected in temporary files and put together in overview_close() */
+  overview_t *this = (overview_t *) malloc(sizeof(overview_t));
+  this->filename = strdup(filename);
+  this->sample_rate = sample_rate;
+  this->base_shift = base_shift;
+  this->block_size = 1ULL << base_shift;
+  this->num_samples = 0;
+  this->failed = 0;
+  for (int i = 0; i < OVERVIEW_MAX_LEVELS; ++i) {
+    this->levels[i] = 0;
+    this->num_bins[i] = 0;
+    reset_accumulator(&this->acc[i]);
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+int overview_add(overview_t *this, const int16_t *samples, size_t num_samples)
+{
+  struct accumulator *acc = &this->acc[0];
+  while (num_samples > 0) {
+    size_t n = this->block_size - acc->num_samples;
+    n = n < num_samples ? n : num_samples;
+    int16_t min;
+    int16_t max;
+    uint64_t sum_squares;
+    reduce_block(samples, n, &min, &max, &sum_squares);
+    merge_accumulator(acc, min, max, (double) sum_squares, n);
+    if (acc->num_samples == this->block_size) {
+      emit_bin(this, 0);
+    }
+    samples += n;
+    num_samples -= n;
+    this->num_samples += n;
+  }
+  return this->failed ? -1 : 0;
+}
+
+
+int overview_close(overview_t *this)
+{
+  int ret_val = -1;
+
+  /* flush the partial bins up to the level with a single bin */
+  int num_levels = 1;
+  for (int i = 0; i < OVERVIEW_MAX_LEVELS - 1; ++i) {
+    if (this->acc[i].num_samples > 0) {
+      emit_bin(this, i);
+    }
+    if (this->num_bins[i] <= 1) {
+      num_levels = i + 1;
+      break;
+    }
+  }
+
+  FILE *file = fopen(this->filename, "wb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", this->filename, strerror(errno));
+    goto DONE;
+  }
+
+  struct overview_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, OVERVIEW_MAGIC, sizeof(header.magic));
+  header.version = OVERVIEW_VERSION;
+  header.base_shift = this->base_shift;
+  header.num_levels = num_levels;
+  header.bin_size = sizeof(struct overview_bin);
+  header.sample_rate = this->sample_rate;
+  header.num_samples = this->num_samples;
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  uint64_t offset = sizeof(header) + num_levels * sizeof(struct overview_level);
+  for (int i = 0; i < num_levels && ok; ++i) {
+    struct overview_level level = { this->base_shift + i, 0, this->num_bins[i], offset };
+    ok = fwrite(&level, sizeof(level), 1, file) == 1;
+    offset += this->num_bins[i] * sizeof(struct overview_bin);
+  }
+  for (int i = 0; i < num_levels && ok; ++i) {
+    if (this->levels[i] == 0) {
+      continue;
+    }
+    rewind(this->levels[i]);
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), this->levels[i])) > 0 && ok) {
+      ok = fwrite(buffer, 1, n, file) == n;
+    }
+  }
+  if (fclose(file) != 0 || !ok || this->failed) {
+    fprintf(stderr, "ERROR - unable to write overview %s\n", this->filename);
+    goto DONE;
+  }
+
+  ret_val = 0;
+
+DONE:
+  for (int i = 0; i < OVERVIEW_MAX_LEVELS; ++i) {
+    if (this->levels[i]) {
+      fclose(this->levels[i]);
+    }
+  }
+  free(this->filename);
+  free(this);
+  return ret_val;
+}
+
+
+/******************************
+ * reader
+ ******************************/
+
+overview_reader_t *overview_reader_open(const char *filename)
+{
+  overview_reader_t *ret_val = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL0;
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL1;
+  }
+  size_t size = statbuf.st_size;
+  if (size < sizeof(struct overview_header)) {
+    fprintf(stderr, "ERROR - %s is not an overview\n", filename);
+    goto FAIL1;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL1;
+  }
+  const struct overview_header *header = (const struct overview_header *) base;
+  const struct overview_level *levels = (const struct overview_level *) (base + sizeof(*header));
+  int valid = memcmp(header->magic, OVERVIEW_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == OVERVIEW_VERSION &&
+              header->bin_size == sizeof(struct overview_bin) &&
+              header->num_levels >= 1 && header->num_levels <= OVERVIEW_MAX_LEVELS &&
+              sizeof(*header) + header->num_levels * sizeof(*levels) <= size;
+  for (uint32_t i = 0; valid && i < header->num_levels; ++i) {
+    valid = levels[i].offset + levels[i].num_bins * sizeof(struct overview_bin) <= size;
+  }
+  if (!valid) {
+    fprintf(stderr, "ERROR - %s is not a valid overview\n", filename);
+    goto FAIL2;
+  }
+
+  /* we are good here - create and initialize the reader */
+  overview_reader_t *this = (overview_reader_t *) malloc(sizeof(overview_reader_t));
+  this->fd = fd;
+  this->base = base;
+  this->size = size;
+  this->header = header;
+  this->levels = levels;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  munmap(base, size);
+FAIL1:
+  close(fd);
+FAIL0:
+  return ret_val;
+}
+
+
+void overview_reader_close(overview_reader_t *this)
+{
+  munmap(this->base, this->size);
+  close(this->fd);
+  free(this);
+  return;
+}
+
+
+uint64_t overview_reader_num_samples(overview_reader_t *this)
+{
+  return this->header->num_samples;
+}
+
+
+double overview_reader_sample_rate(overview_reader_t *this)
+{
+  return this->header->sample_rate;
+}
+
+
+int overview_reader_query(overview_reader_t *this, uint64_t start,
+                          uint64_t end, int num_columns,
+                          struct overview_bin *columns)
+{
+  if (end > this->header->num_samples) {
+    end = this->header->num_samples;
+  }
+  if (num_columns <= 0 || start >= end) {
+    return -1;
+  }
+
+  /* coarsest level with at least one bin per column */
+  uint64_t span = (end - start) / num_columns;
+  uint32_t level = 0;
+  while (level + 1 < this->header->num_levels &&
+         (1ULL << this->levels[level + 1].shift) <= span) {
+    level++;
+  }
+  const struct overview_level *l = &this->levels[level];
+  const struct overview_bin *bins = (const struct overview_bin *) (this->base + l->offset);
+
+  for (int c = 0; c < num_columns; ++c) {
+    uint64_t s0 = start + (end - start) * c / num_columns;
+    uint64_t s1 = start + (end - start) * (c + 1) / num_columns;
+    uint64_t b0 = s0 >> l->shift;
+    uint64_t b1 = (s1 + (1ULL << l->shift) - 1) >> l->shift;
+    if (b1 <= b0) {
+      b1 = b0 + 1;
+    }
+    if (b1 > l->num_bins) {
+      b1 = l->num_bins;
+    }
+    int16_t min = INT16_MAX;
+    int16_t max = INT16_MIN;
+    double mean_squares = 0;
+    for (uint64_t b = b0; b < b1; ++b) {
+      min = bins[b].min < min ? bins[b].min : min;
+      max = bins[b].max > max ? bins[b].max : max;
+      mean_squares += (double) bins[b].rms * bins[b].rms;
+    }
+    columns[c].min = min;
+    columns[c].max = max;
+    columns[c].rms = b1 > b0 ? sqrt(mean_squares / (b1 - b0)) : 0;
+  }
+  return num_columns;
+}
+
+
+/* internal functions */
+static void reduce_block(const int16_t *samples, size_t n, int16_t *min,
+                         int16_t *max, uint64_t *sum_squares)
+{
+  int16_t vmin = INT16_MAX;
+  int16_t vmax = INT16_MIN;
+  uint64_t vsum = 0;
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  /* _mm256_madd_epi16() can reach 2^31 (two times -32768^2), so its result
+     is taken as unsigned and widened to 64 bits */
+  __m256i min16 = _mm256_set1_epi16(INT16_MAX);
+  __m256i max16 = _mm256_set1_epi16(INT16_MIN);
+  __m256i sum64 = _mm256_setzero_si256();
+  __m256i zero = _mm256_setzero_si256();
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (samples + i));
+    min16 = _mm256_min_epi16(min16, x);
+    max16 = _mm256_max_epi16(max16, x);
+    __m256i sq = _mm256_madd_epi16(x, x);
+    sum64 = _mm256_add_epi64(sum64, _mm256_unpacklo_epi32(sq, zero));
+    sum64 = _mm256_add_epi64(sum64, _mm256_unpackhi_epi32(sq, zero));
+  }
+  int16_t mins[16], maxs[16];
+  uint64_t sums[4];
+  _mm256_storeu_si256((__m256i *) mins, min16);
+  _mm256_storeu_si256((__m256i *) maxs, max16);
+  _mm256_storeu_si256((__m256i *) sums, sum64);
+  for (int j = 0; j < 16; ++j) {
+    vmin = mins[j] < vmin ? mins[j] : vmin;
+    vmax = maxs[j] > vmax ? maxs[j] : vmax;
+  }
+  vsum = sums[0] + sums[1] + sums[2] + sums[3];
+#elif defined(__SSE2__)
+  __m128i min16 = _mm_set1_epi16(INT16_MAX);
+  __m128i max16 = _mm_set1_epi16(INT16_MIN);
+  __m128i sum64 = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (samples + i));
+    min16 = _mm_min_epi16(min16, x);
+    max16 = _mm_max_epi16(max16, x);
+    __m128i sq = _mm_madd_epi16(x, x);
+    sum64 = _mm_add_epi64(sum64, _mm_unpacklo_epi32(sq, zero));
+    sum64 = _mm_add_epi64(sum64, _mm_unpackhi_epi32(sq, zero));
+  }
+  int16_t mins[8], maxs[8];
+  uint64_t sums[2];
+  _mm_storeu_si128((__m128i *) mins, min16);
+  _mm_storeu_si128((__m128i *) maxs, max16);
+  _mm_storeu_si128((__m128i *) sums, sum64);
+  for (int j = 0; j < 8; ++j) {
+    vmin = mins[j] < vmin ? mins[j] : vmin;
+    vmax = maxs[j] > vmax ? maxs[j] : vmax;
+  }
+  vsum = sums[0] + sums[1];
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  /* the across-vector min and max are AArch64 only: 32 bit ARM takes the
+     scalar loop below */
+  int16x8_t min16 = vdupq_n_s16(INT16_MAX);
+  int16x8_t max16 = vdupq_n_s16(INT16_MIN);
+  int64x2_t sum64 = vdupq_n_s64(0);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(samples + i);
+    min16 = vminq_s16(min16, x);
+    max16 = vmaxq_s16(max16, x);
+    /* widen each square on its own: two of (-32768)^2 overflow int32 */
+    sum64 = vpadalq_s32(sum64, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+    sum64 = vpadalq_s32(sum64, vmull_s16(vget_high_s16(x),
+                                         vget_high_s16(x)));
+  }
+  vmin = vminvq_s16(min16);
+  vmax = vmaxvq_s16(max16);
+  vsum = vgetq_lane_s64(sum64, 0) + vgetq_lane_s64(sum64, 1);
+#endif
+
+  for (; i < n; ++i) {
+    int16_t x = samples[i];
+    vmin = x < vmin ? x : vmin;
+    vmax = x > vmax ? x : vmax;
+    vsum += (int32_t) x * x;
+  }
+  *min = vmin;
+  *max = vmax;
+  *sum_squares = vsum;
+}
+
+static void reset_accumulator(struct accumulator *acc)
+{
+  acc->min = INT16_MAX;
+  acc->max = INT16_MIN;
+  acc->sum_squares = 0;
+  acc->num_samples = 0;
+  acc->count = 0;
+}
+
+static void merge_accumulator(struct accumulator *acc, int16_t min,
+                              int16_t max, double sum_squares,
+                              uint64_t num_samples)
+{
+  acc->min = min < acc->min ? min : acc->min;
+  acc->max = max > acc->max ? max : acc->max;
+  acc->sum_squares += sum_squares;
+  acc->num_samples += num_samples;
+  acc->count++;
+}
+
+/* write the bin of a level and fold it into the next level up */
+static void emit_bin(overview_t *this, int level)
+{
+  struct accumulator *acc = &this->acc[level];
+  if (this->levels[level] == 0) {
+    this->levels[level] = tmpfile();
+    if (this->levels[level] == 0) {
+      fprintf(stderr, "ERROR - tmpfile() failed: %s\n", strerror(errno));
+      this->failed = 1;
+      reset_accumulator(acc);
+      return;
+    }
+  }
+  struct overview_bin bin;
+  bin.min = acc->min;
+  bin.max = acc->max;
+  bin.rms = sqrt(acc->sum_squares / acc->num_samples);
+  if (fwrite(&bin, sizeof(bin), 1, this->levels[level]) != 1) {
+    this->failed = 1;
+  }
+  this->num_bins[level]++;
+
+  if (level + 1 < OVERVIEW_MAX_LEVELS) {
+    struct accumulator *up = &this->acc[level + 1];
+    merge_accumulator(up, acc->min, acc->max, acc->sum_squares, acc->num_samples);
+    reset_accumulator(acc);
+    if (up->count == 2) {
+      emit_bin(this, level + 1);
+    }
+  } else {
+    reset_accumulator(acc);
+  }
+}
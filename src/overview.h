@@ -0,0 +1,73 @@
+/*
+ * overview.h - multi-resolution min/max/RMS overview of recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __OVERVIEW_H
+#define __OVERVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* level k of the pyramid has one bin every 2^(base_shift + k) samples */
+struct overview_bin {
+  int16_t min;
+  int16_t max;
+  float rms;
+};
+
+typedef struct overview overview_t;
+typedef struct overview_reader overview_reader_t;
+
+
+/* builder: fed with the samples as they are written to the recording */
+overview_t *overview_open(const char *filename, double sample_rate,
+                          uint32_t base_shift);
+
+int overview_add(overview_t *this, const int16_t *samples, size_t num_samples);
+
+int overview_close(overview_t *this);
+
+
+/* reader (the overview file is mmap'd) */
+overview_reader_t *overview_reader_open(const char *filename);
+
+void overview_reader_close(overview_reader_t *this);
+
+uint64_t overview_reader_num_samples(overview_reader_t *this);
+
+double overview_reader_sample_rate(overview_reader_t *this);
+
+/* summarize samples [start, end) into num_columns bins using the coarsest
+   level that still has at least one bin per column; returns the number of
+   columns filled in or -1 on error */
+int overview_reader_query(overview_reader_t *this, uint64_t start,
+                          uint64_t end, int num_columns,
+                          struct overview_bin *columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OVERVIEW_H */
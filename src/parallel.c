@@ -0,0 +1,245 @@
+/*
+ * parallel.c - parallel for over a pool of pinned threads
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The helper threads sleep on a condition variable until a new job is
+ * posted; then all the threads, the caller included, take chunks from a
+ * shared atomic counter until there are none left, so faster threads
+ * simply do more chunks. A helper counts itself as busy from the moment
+ * it picks up a job until it stops taking chunks, and the caller waits
+ * for the busy count to drop to zero both before returning (so every
+ * chunk is done) and before posting the next job (so a late helper never
+ * mixes up two jobs).
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+
+typedef struct parallel {
+  uint32_t num_threads;        /* including the caller */
+  uint32_t num_started;        /* helper threads running */
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;         /* protected by lock */
+  uint32_t busy;               /* protected by lock */
+  int stop;                    /* protected by lock */
+  parallel_fn_t function;
+  void *context;
+  uint32_t num_items;
+  uint32_t chunk_size;
+  uint32_t num_chunks;
+  atomic_uint next_chunk;
+} parallel_t;
+
+
+/* internal functions */
+static void *parallel_worker(void *arg);
+static void run_chunks(parallel_t *this, parallel_fn_t function,
+                       void *context);
+static void pin_thread(pthread_t thread, uint32_t index);
+
+
+parallel_t *parallel_open(uint32_t num_threads)
+{
+  parallel_t *ret_val = 0;
+
+  if (num_threads == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = num_cpus > 0 ? (uint32_t) num_cpus : 1;
+  }
+
+  parallel_t *this = (parallel_t *) calloc(1, sizeof(parallel_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->num_threads = num_threads;
+  this->threads = (pthread_t *) calloc(num_threads, sizeof(pthread_t));
+  if (this->threads == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    free(this);
+    return ret_val;
+  }
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->start, 0);
+  pthread_cond_init(&this->done, 0);
+  atomic_init(&this->next_chunk, 0);
+
+  /* the calling thread works as thread 0 */
+  for (uint32_t t = 1; t < num_threads; ++t) {
+    if (pthread_create(&this->threads[t], 0, parallel_worker, this) != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed\n");
+      parallel_close(this);
+      return ret_val;
+    }
+    this->num_started = t;
+    pin_thread(this->threads[t], t);
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void parallel_close(parallel_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->stop = 1;
+  pthread_cond_broadcast(&this->start);
+  pthread_mutex_unlock(&this->lock);
+  for (uint32_t t = 1; t <= this->num_started; ++t) {
+    pthread_join(this->threads[t], 0);
+  }
+  pthread_cond_destroy(&this->start);
+  pthread_cond_destroy(&this->done);
+  pthread_mutex_destroy(&this->lock);
+  free(this->threads);
+  free(this);
+  return;
+}
+
+
+uint32_t parallel_get_num_threads(parallel_t *this)
+{
+  return this->num_threads;
+}
+
+
+void parallel_for(parallel_t *this, uint32_t num_items, uint32_t chunk_size,
+                  parallel_fn_t function, void *context)
+{
+  if (num_items == 0) {
+    return;
+  }
+  if (chunk_size == 0) {
+    chunk_size = num_items;
+  }
+  uint32_t num_chunks = (num_items + chunk_size - 1) / chunk_size;
+
+  /* not worth waking anybody up */
+  if (num_chunks == 1 || this->num_started == 0) {
+    function(0, num_items, context);
+    return;
+  }
+
+  pthread_mutex_lock(&this->lock);
+  while (this->busy > 0) {
+    pthread_cond_wait(&this->done, &this->lock);
+  }
+  this->function = function;
+  this->context = context;
+  this->num_items = num_items;
+  this->chunk_size = chunk_size;
+  this->num_chunks = num_chunks;
+  atomic_store(&this->next_chunk, 0);
+  ++this->generation;
+  pthread_cond_broadcast(&this->start);
+  pthread_mutex_unlock(&this->lock);
+
+  run_chunks(this, function, context);
+
+  pthread_mutex_lock(&this->lock);
+  while (this->busy > 0) {
+    pthread_cond_wait(&this->done, &this->lock);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+
+/* internal functions */
+static void *parallel_worker(void *arg)
+{
+  parallel_t *this = (parallel_t *) arg;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&this->lock);
+  while (1) {
+    while (this->generation == generation && !this->stop) {
+      pthread_cond_wait(&this->start, &this->lock);
+    }
+    if (this->stop) {
+      break;
+    }
+    generation = this->generation;
+    parallel_fn_t function = this->function;
+    void *context = this->context;
+    ++this->busy;
+    pthread_mutex_unlock(&this->lock);
+
+    run_chunks(this, function, context);
+
+    pthread_mutex_lock(&this->lock);
+    if (--this->busy == 0) {
+      pthread_cond_signal(&this->done);
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+static void run_chunks(parallel_t *this, parallel_fn_t function,
+                       void *context)
+{
+  while (1) {
+    uint32_t chunk = atomic_fetch_add(&this->next_chunk, 1);
+    if (chunk >= this->num_chunks) {
+      break;
+    }
+    uint32_t begin = chunk * this->chunk_size;
+    uint32_t end = begin + this->chunk_size;
+    function(begin, end < this->num_items ? end : this->num_items, context);
+  }
+  return;
+}
+
+/* pin to the index-th core the process is allowed to run on; failures
+   (e.g. fewer cores than threads) just leave the thread unpinned */
+static void pin_thread(pthread_t thread, uint32_t index)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+  int num_allowed = CPU_COUNT(&allowed);
+  if (num_allowed <= 1) {
+    return;
+  }
+  uint32_t target = index % (uint32_t) num_allowed;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+      break;
+    }
+  }
+  return;
+}
@@ -0,0 +1,56 @@
+/*
+ * parallel.h - parallel for over a pool of pinned threads
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct parallel parallel_t;
+
+/* processes the items [begin, end) */
+typedef void (*parallel_fn_t)(uint32_t begin, uint32_t end, void *context);
+
+/* num_threads includes the calling thread (0 means one per core); the
+   helper threads are pinned one per core, skipping the first core, which
+   is left to the thread calling parallel_for() */
+parallel_t *parallel_open(uint32_t num_threads);
+
+void parallel_close(parallel_t *this);
+
+uint32_t parallel_get_num_threads(parallel_t *this);
+
+/* split num_items into chunks of chunk_size items and run them on all the
+   threads, including the calling one; returns when every chunk is done.
+   Only one thread at a time may call parallel_for() on a pool */
+void parallel_for(parallel_t *this, uint32_t num_items, uint32_t chunk_size,
+                  parallel_fn_t function, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PARALLEL_H */
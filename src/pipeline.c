@@ -0,0 +1,444 @@
+/*
+ * pipeline.c - multi-threaded DSP pipeline
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Every stage has an input queue and a 'scheduled' flag; pushing a frame
+ * into a stage that is not scheduled yet puts the stage in the ready queue
+ * of the pipeline, where the first idle worker picks it up, runs a batch
+ * of frames and then either clears the flag or, if more frames arrived in
+ * the meantime, puts the stage back in the ready queue. This way a stage
+ * never runs on two workers at the same time.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rf103_pipeline.h"
+#include "lfqueue.h"
+
+
+#define PIPELINE_MAX_OUTPUTS (16)
+static const uint32_t PIPELINE_BATCH = 8;     /* frames per scheduling */
+
+struct pipeline_frame {
+  rf103_frame_t frame;     /* must be first */
+  atomic_uint refcount;
+  struct rf103_pipeline *pipeline;
+};
+
+typedef struct rf103_stage {
+  struct rf103_pipeline *pipeline;
+  char name[32];
+  rf103_stage_fn_t function;
+  void *context;
+  lfqueue_t *input;
+  struct rf103_stage *outputs[PIPELINE_MAX_OUTPUTS];
+  uint32_t num_outputs;
+  atomic_int scheduled;
+  _Atomic uint64_t frames;
+  _Atomic uint64_t dropped;
+  _Atomic uint64_t lost;
+  _Atomic uint64_t busy_ns;
+  atomic_uint max_queue_depth;
+} rf103_stage_t;
+
+typedef struct rf103_pipeline {
+  uint32_t num_threads;
+  uint32_t num_started;
+  pthread_t *threads;
+  uint32_t frame_size;
+  uint32_t num_frames;
+  struct pipeline_frame *frames;
+  uint8_t *frame_data;
+  lfqueue_t *free_frames;
+  rf103_stage_t **stages;
+  uint32_t num_stages;
+  lfqueue_t *ready;
+  sem_t ready_count;
+  int has_ready_count;
+  atomic_int stop;
+  int started;
+} rf103_pipeline_t;
+
+
+/* internal functions */
+static void *pipeline_worker(void *arg);
+static void run_stage(rf103_stage_t *stage);
+static void schedule(rf103_stage_t *stage);
+
+
+rf103_pipeline_t *rf103_pipeline_create(uint32_t num_threads,
+                                        uint32_t frame_size,
+                                        uint32_t num_frames)
+{
+  rf103_pipeline_t *ret_val = 0;
+
+  if (frame_size == 0 || num_frames == 0) {
+    fprintf(stderr, "ERROR - rf103_pipeline_create() failed: invalid parameters\n");
+    return ret_val;
+  }
+  if (num_threads == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = num_cpus > 0 ? (uint32_t) num_cpus : 1;
+  }
+
+  rf103_pipeline_t *this = (rf103_pipeline_t *) calloc(1,
+                                                 sizeof(rf103_pipeline_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->num_threads = num_threads;
+  this->frame_size = frame_size;
+  this->num_frames = num_frames;
+  atomic_init(&this->stop, 0);
+  this->threads = (pthread_t *) calloc(num_threads, sizeof(pthread_t));
+  this->frames = (struct pipeline_frame *) calloc(num_frames,
+                                              sizeof(struct pipeline_frame));
+  this->frame_data = (uint8_t *) malloc((size_t) frame_size * num_frames);
+  this->free_frames = lfqueue_create(num_frames);
+  if (this->threads == 0 || this->frames == 0 || this->frame_data == 0 ||
+      this->free_frames == 0) {
+    fprintf(stderr, "ERROR - rf103_pipeline_create() failed: out of memory\n");
+    rf103_pipeline_destroy(this);
+    return ret_val;
+  }
+  for (uint32_t i = 0; i < num_frames; ++i) {
+    struct pipeline_frame *frame = &this->frames[i];
+    frame->frame.data = this->frame_data + (size_t) i * frame_size;
+    frame->frame.size = frame_size;
+    frame->pipeline = this;
+    atomic_init(&frame->refcount, 0);
+    lfqueue_push(this->free_frames, frame);
+  }
+  if (sem_init(&this->ready_count, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sem_init() failed\n");
+    rf103_pipeline_destroy(this);
+    return ret_val;
+  }
+  this->has_ready_count = 1;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void rf103_pipeline_destroy(rf103_pipeline_t *this)
+{
+  atomic_store(&this->stop, 1);
+  for (uint32_t t = 0; t < this->num_started; ++t) {
+    sem_post(&this->ready_count);
+  }
+  for (uint32_t t = 0; t < this->num_started; ++t) {
+    pthread_join(this->threads[t], 0);
+  }
+  if (this->has_ready_count) {
+    sem_destroy(&this->ready_count);
+  }
+  for (uint32_t i = 0; i < this->num_stages; ++i) {
+    lfqueue_destroy(this->stages[i]->input);
+    free(this->stages[i]);
+  }
+  free(this->stages);
+  if (this->ready) {
+    lfqueue_destroy(this->ready);
+  }
+  if (this->free_frames) {
+    lfqueue_destroy(this->free_frames);
+  }
+  free(this->frame_data);
+  free(this->frames);
+  free(this->threads);
+  free(this);
+  return;
+}
+
+
+rf103_stage_t *rf103_pipeline_add_stage(rf103_pipeline_t *this,
+                                        const char *name, uint32_t queue_size,
+                                        rf103_stage_fn_t function,
+                                        void *context)
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - rf103_pipeline_add_stage() failed: pipeline already started\n");
+    return 0;
+  }
+  if (function == 0 || queue_size == 0) {
+    fprintf(stderr, "ERROR - rf103_pipeline_add_stage() failed: invalid parameters\n");
+    return 0;
+  }
+  rf103_stage_t **stages = (rf103_stage_t **) realloc(this->stages,
+                              (this->num_stages + 1) * sizeof(rf103_stage_t *));
+  if (stages == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return 0;
+  }
+  this->stages = stages;
+
+  rf103_stage_t *stage = (rf103_stage_t *) calloc(1, sizeof(rf103_stage_t));
+  if (stage == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return 0;
+  }
+  stage->input = lfqueue_create(queue_size);
+  if (stage->input == 0) {
+    free(stage);
+    return 0;
+  }
+  stage->pipeline = this;
+  snprintf(stage->name, sizeof(stage->name), "%s", name ? name : "");
+  stage->function = function;
+  stage->context = context;
+  atomic_init(&stage->scheduled, 0);
+  atomic_init(&stage->frames, 0);
+  atomic_init(&stage->dropped, 0);
+  atomic_init(&stage->lost, 0);
+  atomic_init(&stage->busy_ns, 0);
+  atomic_init(&stage->max_queue_depth, 0);
+  this->stages[this->num_stages++] = stage;
+  return stage;
+}
+
+
+int rf103_pipeline_connect(rf103_stage_t *from, rf103_stage_t *to)
+{
+  if (from->pipeline != to->pipeline || from->pipeline->started) {
+    fprintf(stderr, "ERROR - rf103_pipeline_connect() failed: invalid stages or pipeline already started\n");
+    return -1;
+  }
+  if (from->num_outputs == PIPELINE_MAX_OUTPUTS) {
+    fprintf(stderr, "ERROR - rf103_pipeline_connect() failed: too many outputs\n");
+    return -1;
+  }
+  from->outputs[from->num_outputs++] = to;
+  return 0;
+}
+
+
+int rf103_pipeline_start(rf103_pipeline_t *this)
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - rf103_pipeline_start() failed: already started\n");
+    return -1;
+  }
+  /* every stage is in the ready queue at most once; the spare cells make
+     it rare for a push to find its cell still being released by a pop */
+  this->ready = lfqueue_create(2 * this->num_stages + 2);
+  if (this->ready == 0) {
+    return -1;
+  }
+  for (uint32_t t = 0; t < this->num_threads; ++t) {
+    if (pthread_create(&this->threads[t], 0, pipeline_worker, this) != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed\n");
+      return -1;
+    }
+    this->num_started = t + 1;
+  }
+  this->started = 1;
+  return 0;
+}
+
+
+rf103_frame_t *rf103_pipeline_lease(rf103_pipeline_t *this)
+{
+  struct pipeline_frame *frame = (struct pipeline_frame *)
+                                 lfqueue_pop(this->free_frames);
+  if (frame == 0) {
+    return 0;
+  }
+  atomic_store_explicit(&frame->refcount, 1, memory_order_relaxed);
+  frame->frame.length = 0;
+  frame->frame.sequence = 0;
+  return &frame->frame;
+}
+
+
+void rf103_frame_retain(rf103_frame_t *frame)
+{
+  struct pipeline_frame *this = (struct pipeline_frame *) frame;
+  atomic_fetch_add_explicit(&this->refcount, 1, memory_order_relaxed);
+  return;
+}
+
+
+void rf103_frame_release(rf103_frame_t *frame)
+{
+  struct pipeline_frame *this = (struct pipeline_frame *) frame;
+  if (atomic_fetch_sub_explicit(&this->refcount, 1,
+                                memory_order_acq_rel) == 1) {
+    lfqueue_push(this->pipeline->free_frames, this);
+  }
+  return;
+}
+
+
+int rf103_pipeline_push(rf103_stage_t *stage, rf103_frame_t *frame)
+{
+  if (!stage->pipeline->started) {
+    fprintf(stderr, "ERROR - rf103_pipeline_push() failed: pipeline not started\n");
+    return -1;
+  }
+  rf103_frame_retain(frame);
+  if (lfqueue_push(stage->input, frame) < 0) {
+    atomic_fetch_add_explicit(&stage->dropped, 1, memory_order_relaxed);
+    rf103_frame_release(frame);
+    return 1;
+  }
+  uint32_t depth = lfqueue_depth(stage->input);
+  uint32_t max_depth = atomic_load_explicit(&stage->max_queue_depth,
+                                            memory_order_relaxed);
+  while (depth > max_depth &&
+         !atomic_compare_exchange_weak_explicit(&stage->max_queue_depth,
+                                                &max_depth, depth,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+  /* pairs with the fence in run_stage(): either this thread sees the
+     stage unscheduled, or the worker sees the new frame */
+  atomic_thread_fence(memory_order_seq_cst);
+  schedule(stage);
+  return 0;
+}
+
+
+void rf103_stage_count_lost(rf103_stage_t *stage)
+{
+  atomic_fetch_add_explicit(&stage->lost, 1, memory_order_relaxed);
+  return;
+}
+
+
+int rf103_stage_emit(rf103_stage_t *stage, rf103_frame_t *frame)
+{
+  int dropped = 0;
+  for (uint32_t i = 0; i < stage->num_outputs; ++i) {
+    if (rf103_pipeline_push(stage->outputs[i], frame) != 0) {
+      ++dropped;
+    }
+  }
+  return dropped;
+}
+
+
+rf103_pipeline_t *rf103_stage_pipeline(rf103_stage_t *stage)
+{
+  return stage->pipeline;
+}
+
+
+uint32_t rf103_pipeline_get_frame_size(rf103_pipeline_t *this)
+{
+  return this->frame_size;
+}
+
+
+int rf103_stage_get_stats(rf103_stage_t *stage,
+                          struct rf103_stage_stats *stats)
+{
+  stats->name = stage->name;
+  stats->frames = atomic_load_explicit(&stage->frames, memory_order_relaxed);
+  stats->dropped = atomic_load_explicit(&stage->dropped,
+                                        memory_order_relaxed);
+  stats->lost = atomic_load_explicit(&stage->lost, memory_order_relaxed);
+  stats->busy_ns = atomic_load_explicit(&stage->busy_ns,
+                                        memory_order_relaxed);
+  stats->queue_depth = lfqueue_depth(stage->input);
+  stats->max_queue_depth = atomic_load_explicit(&stage->max_queue_depth,
+                                                memory_order_relaxed);
+  stats->queue_size = lfqueue_size(stage->input);
+  return 0;
+}
+
+
+/* internal functions */
+static void *pipeline_worker(void *arg)
+{
+  rf103_pipeline_t *this = (rf103_pipeline_t *) arg;
+  while (1) {
+    sem_wait(&this->ready_count);
+    /* the token means a stage is in the ready queue, but the pop can fail
+       for a moment while the producer is still publishing it: the stage
+       must not be lost, or it would stay scheduled forever */
+    rf103_stage_t *stage = 0;
+    while (!atomic_load(&this->stop)) {
+      stage = (rf103_stage_t *) lfqueue_pop(this->ready);
+      if (stage) {
+        break;
+      }
+      sched_yield();
+    }
+    if (stage == 0) {
+      break;
+    }
+    run_stage(stage);
+  }
+  return 0;
+}
+
+static void run_stage(rf103_stage_t *stage)
+{
+  for (uint32_t i = 0; i < PIPELINE_BATCH; ++i) {
+    rf103_frame_t *frame = (rf103_frame_t *) lfqueue_pop(stage->input);
+    if (frame == 0) {
+      break;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stage->function(stage, frame, stage->context);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t elapsed = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+                       end.tv_nsec - start.tv_nsec;
+    atomic_fetch_add_explicit(&stage->busy_ns, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stage->frames, 1, memory_order_relaxed);
+    rf103_frame_release(frame);
+  }
+
+  /* a frame pushed after the last pop but before the flag is cleared would
+     not reschedule the stage, so check again */
+  atomic_store(&stage->scheduled, 0);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (lfqueue_depth(stage->input) > 0) {
+    schedule(stage);
+  }
+  return;
+}
+
+static void schedule(rf103_stage_t *stage)
+{
+  int expected = 0;
+  if (atomic_compare_exchange_strong(&stage->scheduled, &expected, 1)) {
+    /* the queue has room for every stage, so a failed push only means a
+       pop has not released the cell yet; giving up would leave the stage
+       scheduled and never run */
+    while (lfqueue_push(stage->pipeline->ready, stage) < 0) {
+      sched_yield();
+    }
+    sem_post(&stage->pipeline->ready_count);
+  }
+  return;
+}
@@ -0,0 +1,511 @@
+/*
+ * psd.c - streaming power spectrum (Welch method)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - P. D. Welch, "The use of fast Fourier transform for the estimation of
+ *    power spectra", IEEE Trans. Audio Electroacoustics, 1967
+ *  - G. Heinzel, A. Ruediger, R. Schilling, "Spectrum and spectral density
+ *    estimation by the Discrete Fourier transform (DFT)", 2002
+ *
+ * The FFTs of each call are split between the calling thread and the
+ * worker threads (segment i goes to thread i % num_threads); every thread
+ * sums the power in its own accumulator, and the accumulators are combined
+ * once per output frame.
+ *
+ * The samples are kept in a ring mapped twice in a row (vring.c), so every
+ * segment is read in place, even when it wraps around the end of the
+ * ring, and the samples no segment needs any more are dropped without
+ * moving the others.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "psd.h"
+#include "fft.h"
+#include "vring.h"
+
+
+struct psd_worker {
+  struct psd *psd;
+  uint32_t index;
+  pthread_t thread;
+  float *segment;
+  float *spectrum;
+  float *power;
+};
+
+typedef struct psd {
+  uint32_t fft_size;
+  uint32_t num_bins;
+  uint32_t hop;
+  uint32_t num_averages;
+  float *window;
+  double scale;
+  fft_t *fft;
+  double samples_per_frame;
+  uint64_t frame_index;
+  uint64_t frame_end;
+  vring_t *ring;
+  float *buffer;               /* start of the ring */
+  uint32_t ring_size;          /* samples */
+  uint64_t buffer_start;       /* absolute index of the oldest sample kept */
+  uint32_t buffer_length;
+  uint64_t next_segment;       /* absolute index */
+  uint32_t segment_count;      /* in the current frame */
+  uint32_t num_threads;
+  uint32_t num_started;        /* worker threads running */
+  struct psd_worker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  uint32_t pending;
+  int stop;
+  uint64_t job_start;
+  uint32_t job_count;
+  atomic_int mode;
+  atomic_int restart_hold;
+  int hold_valid;
+  float *output;
+  float *hold;
+  psd_output_cb_t callback;
+  void *callback_context;
+} psd_t;
+
+
+/* internal functions */
+static int make_window(float *window, uint32_t size, enum PSDWindow type);
+static void *psd_worker_thread(void *arg);
+static void run_segments(struct psd_worker *worker, uint32_t num_threads);
+static void dispatch(psd_t *this, uint64_t start, uint32_t count);
+static void emit_frame(psd_t *this);
+static int grow_ring(psd_t *this, uint32_t length);
+
+
+psd_t *psd_open(uint32_t fft_size, double overlap, uint32_t num_averages,
+                enum PSDWindow window, double sample_rate, double frame_rate,
+                uint32_t num_threads, psd_output_cb_t callback,
+                void *callback_context)
+{
+  psd_t *ret_val = 0;
+
+  if (overlap < 0.0 || overlap >= 1.0) {
+    fprintf(stderr, "ERROR - psd_open() failed: invalid overlap\n");
+    return ret_val;
+  }
+  if (sample_rate <= 0.0 || frame_rate <= 0.0 || callback == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+  fft_t *fft = fft_open_real(fft_size);
+  if (fft == 0) {
+    return ret_val;
+  }
+  if (num_threads == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = num_cpus > 0 ? (uint32_t) num_cpus : 1;
+  }
+
+  psd_t *this = (psd_t *) calloc(1, sizeof(psd_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    fft_close(fft);
+    return ret_val;
+  }
+  this->fft_size = fft_size;
+  this->num_bins = fft_size / 2 + 1;
+  this->hop = fft_size - (uint32_t) lround(overlap * fft_size);
+  if (this->hop == 0) {
+    this->hop = 1;
+  }
+  this->num_averages = num_averages;
+  this->fft = fft;
+  this->samples_per_frame = sample_rate / frame_rate;
+  this->frame_index = 1;
+  this->frame_end = (uint64_t) llround(this->samples_per_frame);
+  this->callback = callback;
+  this->callback_context = callback_context;
+  atomic_init(&this->mode, PSD_MODE_AVERAGE);
+  atomic_init(&this->restart_hold, 0);
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->start, 0);
+  pthread_cond_init(&this->done, 0);
+
+  this->num_threads = num_threads;
+  this->window = (float *) malloc(fft_size * sizeof(float));
+  this->output = (float *) malloc(this->num_bins * sizeof(float));
+  this->hold = (float *) malloc(this->num_bins * sizeof(float));
+  this->workers = (struct psd_worker *) calloc(num_threads,
+                                               sizeof(struct psd_worker));
+  if (this->window == 0 || this->output == 0 || this->hold == 0 ||
+      this->workers == 0) {
+    fprintf(stderr, "ERROR - psd_open() failed: out of memory\n");
+    psd_close(this);
+    return ret_val;
+  }
+  if (make_window(this->window, fft_size, window) < 0) {
+    psd_close(this);
+    return ret_val;
+  }
+  /* a full scale sine in the middle of a bin is at 0 dB */
+  double coherent_gain = 0.0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    coherent_gain += this->window[i];
+  }
+  this->scale = 4.0 / (coherent_gain * coherent_gain * 32768.0 * 32768.0);
+  if (grow_ring(this, 2 * fft_size) < 0) {
+    psd_close(this);
+    return ret_val;
+  }
+
+  for (uint32_t t = 0; t < num_threads; ++t) {
+    struct psd_worker *worker = &this->workers[t];
+    worker->psd = this;
+    worker->index = t;
+    worker->segment = (float *) malloc(fft_size * sizeof(float));
+    worker->spectrum = (float *) malloc((fft_size + 2) * sizeof(float));
+    worker->power = (float *) calloc(this->num_bins, sizeof(float));
+    if (worker->segment == 0 || worker->spectrum == 0 || worker->power == 0) {
+      fprintf(stderr, "ERROR - psd_open() failed: out of memory\n");
+      psd_close(this);
+      return ret_val;
+    }
+  }
+  /* the calling thread works as worker 0 */
+  for (uint32_t t = 1; t < num_threads; ++t) {
+    if (pthread_create(&this->workers[t].thread, 0, psd_worker_thread,
+                       &this->workers[t]) != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed\n");
+      psd_close(this);
+      return ret_val;
+    }
+    this->num_started = t;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void psd_close(psd_t *this)
+{
+  pthread_mutex_lock(&this->lock);
+  this->stop = 1;
+  pthread_cond_broadcast(&this->start);
+  pthread_mutex_unlock(&this->lock);
+  for (uint32_t t = 1; t <= this->num_started; ++t) {
+    pthread_join(this->workers[t].thread, 0);
+  }
+  if (this->workers) {
+    for (uint32_t t = 0; t < this->num_threads; ++t) {
+      free(this->workers[t].segment);
+      free(this->workers[t].spectrum);
+      free(this->workers[t].power);
+    }
+  }
+  pthread_cond_destroy(&this->start);
+  pthread_cond_destroy(&this->done);
+  pthread_mutex_destroy(&this->lock);
+  fft_close(this->fft);
+  free(this->workers);
+  free(this->window);
+  free(this->output);
+  free(this->hold);
+  if (this->ring) {
+    vring_close(this->ring);
+  }
+  free(this);
+  return;
+}
+
+
+int psd_set_mode(psd_t *this, enum PSDMode mode)
+{
+  if (mode != PSD_MODE_AVERAGE && mode != PSD_MODE_PEAK_HOLD &&
+      mode != PSD_MODE_MIN_HOLD) {
+    fprintf(stderr, "ERROR - psd_set_mode() failed: invalid mode\n");
+    return -1;
+  }
+  atomic_store(&this->mode, mode);
+  atomic_store(&this->restart_hold, 1);
+  return 0;
+}
+
+
+int psd_process(psd_t *this, const int16_t *samples, uint32_t num_samples)
+{
+  /* append the new samples */
+  uint32_t length = this->buffer_length + num_samples;
+  if (length > this->ring_size && grow_ring(this, length) < 0) {
+    return -1;
+  }
+  float *tail = this->buffer + (this->buffer_start + this->buffer_length) %
+                               this->ring_size;
+  for (uint32_t i = 0; i < num_samples; ++i) {
+    tail[i] = (float) samples[i];
+  }
+  this->buffer_length = length;
+  uint64_t buffer_end = this->buffer_start + this->buffer_length;
+
+  while (1) {
+    /* all the segments starting in this frame that are complete */
+    uint64_t start = this->next_segment;
+    uint64_t count = 0;
+    if (start < this->frame_end && start + this->fft_size <= buffer_end) {
+      uint64_t in_frame = (this->frame_end - start + this->hop - 1) /
+                          this->hop;
+      uint64_t available = (buffer_end - this->fft_size - start) /
+                           this->hop + 1;
+      count = in_frame < available ? in_frame : available;
+      if (this->num_averages > 0 &&
+          count > this->num_averages - this->segment_count) {
+        count = this->num_averages - this->segment_count;
+      }
+    }
+    if (count > 0) {
+      dispatch(this, start, (uint32_t) count);
+      this->next_segment += count * this->hop;
+      this->segment_count += (uint32_t) count;
+    }
+
+    int all_segments = this->next_segment >= this->frame_end ||
+                       (this->num_averages > 0 &&
+                        this->segment_count >= this->num_averages);
+    if (!all_segments || buffer_end < this->frame_end) {
+      break;
+    }
+    emit_frame(this);
+    uint64_t frame_start = this->frame_end;
+    this->frame_index++;
+    this->frame_end = (uint64_t) llround(this->frame_index *
+                                         this->samples_per_frame);
+    if (this->num_averages > 0 && this->next_segment < frame_start) {
+      this->next_segment = frame_start;
+    }
+  }
+
+  /* drop the samples no segment needs any more; once the segments of the
+     current frame are all done, the next one starts at its end */
+  uint64_t needed = this->next_segment;
+  if (this->num_averages > 0 && this->segment_count >= this->num_averages &&
+      this->frame_end > needed) {
+    needed = this->frame_end;
+  }
+  uint64_t keep = needed < buffer_end ? needed : buffer_end;
+  this->buffer_length -= (uint32_t) (keep - this->buffer_start);
+  this->buffer_start = keep;
+  return 0;
+}
+
+
+/* internal functions */
+static int make_window(float *window, uint32_t size, enum PSDWindow type)
+{
+  /* periodic windows (the usual choice for spectral analysis) */
+  static const double hann[] = { 0.5, 0.5 };
+  static const double blackman_harris[] = { 0.35875, 0.48829, 0.14128,
+                                            0.01168 };
+  static const double flat_top[] = { 0.21557895, 0.41663158, 0.277263158,
+                                     0.083578947, 0.006947368 };
+  const double *coefficients;
+  int num_coefficients;
+  switch (type) {
+  case PSD_WINDOW_HANN:
+    coefficients = hann;
+    num_coefficients = sizeof(hann) / sizeof(hann[0]);
+    break;
+  case PSD_WINDOW_BLACKMAN_HARRIS:
+    coefficients = blackman_harris;
+    num_coefficients = sizeof(blackman_harris) / sizeof(blackman_harris[0]);
+    break;
+  case PSD_WINDOW_FLAT_TOP:
+    coefficients = flat_top;
+    num_coefficients = sizeof(flat_top) / sizeof(flat_top[0]);
+    break;
+  default:
+    fprintf(stderr, "ERROR - invalid window type: %d\n", type);
+    return -1;
+  }
+  for (uint32_t n = 0; n < size; ++n) {
+    double w = 0.0;
+    double sign = 1.0;
+    for (int k = 0; k < num_coefficients; ++k) {
+      w += sign * coefficients[k] * cos(2.0 * M_PI * k * n / size);
+      sign = -sign;
+    }
+    window[n] = (float) w;
+  }
+  return 0;
+}
+
+static void *psd_worker_thread(void *arg)
+{
+  struct psd_worker *worker = (struct psd_worker *) arg;
+  psd_t *this = worker->psd;
+  uint64_t generation = 0;
+  while (1) {
+    pthread_mutex_lock(&this->lock);
+    while (this->generation == generation && !this->stop) {
+      pthread_cond_wait(&this->start, &this->lock);
+    }
+    if (this->stop) {
+      pthread_mutex_unlock(&this->lock);
+      break;
+    }
+    generation = this->generation;
+    pthread_mutex_unlock(&this->lock);
+
+    run_segments(worker, this->num_threads);
+
+    pthread_mutex_lock(&this->lock);
+    if (--this->pending == 0) {
+      pthread_cond_signal(&this->done);
+    }
+    pthread_mutex_unlock(&this->lock);
+  }
+  return 0;
+}
+
+static void run_segments(struct psd_worker *worker, uint32_t num_threads)
+{
+  psd_t *this = worker->psd;
+  uint32_t fft_size = this->fft_size;
+  const float *window = this->window;
+  float *segment = worker->segment;
+  float *spectrum = worker->spectrum;
+  float *power = worker->power;
+  for (uint32_t i = worker->index; i < this->job_count; i += num_threads) {
+    const float *x = this->buffer + (this->job_start +
+                                     (uint64_t) i * this->hop) %
+                                    this->ring_size;
+    for (uint32_t n = 0; n < fft_size; ++n) {
+      segment[n] = x[n] * window[n];
+    }
+    fft_execute_real(this->fft, segment, spectrum);
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      power[k] += spectrum[2 * k] * spectrum[2 * k] +
+                  spectrum[2 * k + 1] * spectrum[2 * k + 1];
+    }
+  }
+  return;
+}
+
+static void dispatch(psd_t *this, uint64_t start, uint32_t count)
+{
+  this->job_start = start;
+  this->job_count = count;
+  /* not worth waking up the other threads for a single segment */
+  int parallel = this->num_threads > 1 && count > 1;
+  if (parallel) {
+    pthread_mutex_lock(&this->lock);
+    this->pending = this->num_threads - 1;
+    this->generation++;
+    pthread_cond_broadcast(&this->start);
+    pthread_mutex_unlock(&this->lock);
+  }
+  run_segments(&this->workers[0], parallel ? this->num_threads : 1);
+  if (parallel) {
+    pthread_mutex_lock(&this->lock);
+    while (this->pending > 0) {
+      pthread_cond_wait(&this->done, &this->lock);
+    }
+    pthread_mutex_unlock(&this->lock);
+  }
+  return;
+}
+
+static void emit_frame(psd_t *this)
+{
+  if (this->segment_count == 0) {
+    return;
+  }
+  float *output = this->output;
+  memcpy(output, this->workers[0].power, this->num_bins * sizeof(float));
+  memset(this->workers[0].power, 0, this->num_bins * sizeof(float));
+  for (uint32_t t = 1; t < this->num_threads; ++t) {
+    float *power = this->workers[t].power;
+    for (uint32_t k = 0; k < this->num_bins; ++k) {
+      output[k] += power[k];
+    }
+    memset(power, 0, this->num_bins * sizeof(float));
+  }
+  double scale = this->scale / this->segment_count;
+  for (uint32_t k = 0; k < this->num_bins; ++k) {
+    output[k] = (float) (10.0 * log10(output[k] * scale + 1e-30));
+  }
+  this->segment_count = 0;
+
+  int mode = atomic_load(&this->mode);
+  if (atomic_exchange(&this->restart_hold, 0)) {
+    this->hold_valid = 0;
+  }
+  if (mode != PSD_MODE_AVERAGE) {
+    float *hold = this->hold;
+    if (!this->hold_valid) {
+      memcpy(hold, output, this->num_bins * sizeof(float));
+      this->hold_valid = 1;
+    } else if (mode == PSD_MODE_PEAK_HOLD) {
+      for (uint32_t k = 0; k < this->num_bins; ++k) {
+        hold[k] = output[k] > hold[k] ? output[k] : hold[k];
+      }
+    } else {
+      for (uint32_t k = 0; k < this->num_bins; ++k) {
+        hold[k] = output[k] < hold[k] ? output[k] : hold[k];
+      }
+    }
+    output = hold;
+  }
+  this->callback(this->num_bins, output, this->callback_context);
+  return;
+}
+
+/* room for at least length samples (and twice a segment, so this happens
+   only once for a given frame size); the samples kept move to the same
+   position modulo the new size */
+static int grow_ring(psd_t *this, uint32_t length)
+{
+  uint32_t size = 2 * this->fft_size;
+  while (size < length) {
+    size *= 2;
+  }
+  vring_t *ring = vring_open((size_t) size * sizeof(float));
+  if (ring == 0) {
+    return -1;
+  }
+  float *buffer = (float *) vring_get_base(ring);
+  uint32_t ring_size = (uint32_t) (vring_get_size(ring) / sizeof(float));
+  if (this->ring) {
+    memcpy(buffer + this->buffer_start % ring_size,
+           this->buffer + this->buffer_start % this->ring_size,
+           this->buffer_length * sizeof(float));
+    vring_close(this->ring);
+  }
+  this->ring = ring;
+  this->buffer = buffer;
+  this->ring_size = ring_size;
+  return 0;
+}
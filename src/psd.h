@@ -0,0 +1,71 @@
+/*
+ * psd.h - streaming power spectrum (Welch method)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PSD_H
+#define __PSD_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct psd psd_t;
+
+enum PSDWindow {
+  PSD_WINDOW_HANN,
+  PSD_WINDOW_BLACKMAN_HARRIS,
+  PSD_WINDOW_FLAT_TOP
+};
+
+enum PSDMode {
+  PSD_MODE_AVERAGE,
+  PSD_MODE_PEAK_HOLD,
+  PSD_MODE_MIN_HOLD
+};
+
+/* bins 0 to fft_size / 2 in dB relative to a full scale sine */
+typedef void (*psd_output_cb_t)(uint32_t num_bins, const float *bins,
+                                void *context);
+
+/* one output every sample_rate / frame_rate samples, averaging the
+   windowed FFTs (overlapping by the given fraction) in that interval; with
+   num_averages > 0 only the first num_averages FFTs of every interval are
+   computed; num_threads worker threads (0 means one per core) share the
+   FFTs; psd_process() returns when they are done */
+psd_t *psd_open(uint32_t fft_size, double overlap, uint32_t num_averages,
+                enum PSDWindow window, double sample_rate, double frame_rate,
+                uint32_t num_threads, psd_output_cb_t callback,
+                void *callback_context);
+
+void psd_close(psd_t *this);
+
+/* can be called from any thread; also restarts the hold */
+int psd_set_mode(psd_t *this, enum PSDMode mode);
+
+int psd_process(psd_t *this, const int16_t *samples, uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PSD_H */
@@ -0,0 +1,473 @@
+/*
+ * recindex.c - timestamp index sidecar for recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "recindex.h"
+
+
+#define RECINDEX_MAGIC "RF103IDX"
+#define RECINDEX_VERSION (1)
+
+struct recindex_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  double sample_rate;
+  uint32_t bytes_per_sample;
+  uint32_t samples_per_entry;
+  uint64_t data_offset;
+  uint64_t num_entries;
+  uint64_t num_samples;
+};
+
+/* host timestamps only have positive jitter (latency), so the estimate
+   follows their lower envelope; the USB transfers can hold a whole queue
+   of frames that then arrive late all at once, so each frame is compared
+   with the estimate only after the next queue of frames has arrived, and
+   the smallest offset of them all counts: lost samples delay every frame
+   that follows, queueing does not; an offset larger than this is taken as
+   a sign that samples were lost */
+static const double GAP_THRESHOLD = 5e6;       /* 5ms (plus two frames) */
+static const uint32_t DEFAULT_QUEUED_FRAMES = 96;   /* as in the ADC */
+static const double DRIFT_TRACKING = 1.0 / 1024;
+
+
+/* a frame waiting for the ones that follow it */
+struct recindex_frame {
+  uint64_t sample_index;
+  uint64_t arrival_time;
+  uint32_t num_samples;
+  uint32_t flags;
+};
+
+typedef struct recindex {
+  FILE *file;
+  struct recindex_header header;
+  double ns_per_sample;
+  int has_anchor;
+  double anchor_time;
+  uint64_t anchor_sample;
+  uint64_t last_est_time;
+  struct recindex_frame *frames;   /* circular, queued_frames + 1 */
+  uint32_t frames_size;
+  uint32_t frames_head;
+  uint32_t num_frames;
+  int pending;
+  struct recindex_entry entry;
+} recindex_t;
+
+typedef struct recindex_reader {
+  int fd;
+  uint8_t *base;
+  size_t size;
+  const struct recindex_header *header;
+  const struct recindex_entry *entries;
+  uint64_t num_entries;
+  double ns_per_sample;
+} recindex_reader_t;
+
+
+/* internal functions */
+static int add_frame(recindex_t *this);
+static int flush_entry(recindex_t *this);
+static int64_t find_time(recindex_reader_t *this, uint64_t time);
+static int64_t find_sample(recindex_reader_t *this, uint64_t sample_index);
+
+
+/******************************
+ * writer
+ ******************************/
+
+recindex_t *recindex_open(const char *filename, double sample_rate,
+                          uint32_t bytes_per_sample, uint64_t data_offset,
+                          uint32_t samples_per_entry, uint32_t queued_frames)
+{
+  recindex_t *ret_val = 0;
+
+  if (sample_rate <= 0 || bytes_per_sample == 0) {
+    fprintf(stderr, "ERROR - invalid recording index parameters\n");
+    return ret_val;
+  }
+  queued_frames = queued_frames > 0 ? queued_frames : DEFAULT_QUEUED_FRAMES;
+  struct recindex_frame *frames = (struct recindex_frame *)
+                  malloc((queued_frames + 1) * sizeof(struct recindex_frame));
+  if (frames == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return ret_val;
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", filename, strerror(errno));
+    free(frames);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the recindex */
+  recindex_t *this = (recindex_t *) malloc(sizeof(recindex_t));
+  this->file = file;
+  memset(&this->header, 0, sizeof(this->header));
+  memcpy(this->header.magic, RECINDEX_MAGIC, sizeof(this->header.magic));
+  this->header.version = RECINDEX_VERSION;
+  this->header.entry_size = sizeof(struct recindex_entry);
+  this->header.sample_rate = sample_rate;
+  this->header.bytes_per_sample = bytes_per_sample;
+  this->header.samples_per_entry = samples_per_entry;
+  this->header.data_offset = data_offset;
+  this->header.num_entries = 0;    /* to fix */
+  this->header.num_samples = 0;    /* to fix */
+  this->ns_per_sample = 1e9 / sample_rate;
+  this->has_anchor = 0;
+  this->anchor_time = 0;
+  this->anchor_sample = 0;
+  this->last_est_time = 0;
+  this->frames = frames;
+  this->frames_size = queued_frames + 1;
+  this->frames_head = 0;
+  this->num_frames = 0;
+  this->pending = 0;
+
+  if (fwrite(&this->header, sizeof(this->header), 1, file) != 1) {
+    fprintf(stderr, "ERROR - fwrite(%s) failed: %s\n", filename, strerror(errno));
+    fclose(file);
+    free(frames);
+    free(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+int recindex_add(recindex_t *this, uint64_t sample_index,
+                 uint32_t num_samples, uint64_t arrival_time, uint32_t flags)
+{
+  uint32_t tail = (this->frames_head + this->num_frames) % this->frames_size;
+  struct recindex_frame *frame = &this->frames[tail];
+  frame->sample_index = sample_index;
+  frame->arrival_time = arrival_time;
+  frame->num_samples = num_samples;
+  frame->flags = flags;
+  this->num_frames++;
+
+  /* the oldest frame has now seen a whole queue of frames after it */
+  if (this->num_frames == this->frames_size) {
+    return add_frame(this);
+  }
+  return 0;
+}
+
+
+int recindex_close(recindex_t *this)
+{
+  int ret_val = 0;
+  while (this->num_frames > 0) {
+    if (add_frame(this) < 0) {
+      ret_val = -1;
+    }
+  }
+  if (this->pending && flush_entry(this) < 0) {
+    ret_val = -1;
+  }
+  if (fseek(this->file, 0, SEEK_SET) != 0 ||
+      fwrite(&this->header, sizeof(this->header), 1, this->file) != 1) {
+    fprintf(stderr, "ERROR - unable to finalize recording index: %s\n",
+            strerror(errno));
+    ret_val = -1;
+  }
+  if (fclose(this->file) != 0) {
+    ret_val = -1;
+  }
+  free(this->frames);
+  free(this);
+  return ret_val;
+}
+
+
+/******************************
+ * reader
+ ******************************/
+
+recindex_reader_t *recindex_reader_open(const char *filename)
+{
+  recindex_reader_t *ret_val = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL0;
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL1;
+  }
+  size_t size = statbuf.st_size;
+  if (size < sizeof(struct recindex_header)) {
+    fprintf(stderr, "ERROR - %s is not a recording index\n", filename);
+    goto FAIL1;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap(%s) failed: %s\n", filename, strerror(errno));
+    goto FAIL1;
+  }
+  const struct recindex_header *header = (const struct recindex_header *) base;
+  if (memcmp(header->magic, RECINDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != RECINDEX_VERSION ||
+      header->entry_size != sizeof(struct recindex_entry) ||
+      header->sample_rate <= 0 ||
+      sizeof(*header) + header->num_entries * header->entry_size > size) {
+    fprintf(stderr, "ERROR - %s is not a valid recording index\n", filename);
+    goto FAIL2;
+  }
+
+  /* we are good here - create and initialize the reader */
+  recindex_reader_t *this = (recindex_reader_t *) malloc(sizeof(recindex_reader_t));
+  this->fd = fd;
+  this->base = base;
+  this->size = size;
+  this->header = header;
+  this->entries = (const struct recindex_entry *) (base + sizeof(*header));
+  this->num_entries = header->num_entries;
+  this->ns_per_sample = 1e9 / header->sample_rate;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  munmap(base, size);
+FAIL1:
+  close(fd);
+FAIL0:
+  return ret_val;
+}
+
+
+void recindex_reader_close(recindex_reader_t *this)
+{
+  munmap(this->base, this->size);
+  close(this->fd);
+  free(this);
+  return;
+}
+
+
+double recindex_reader_sample_rate(recindex_reader_t *this)
+{
+  return this->header->sample_rate;
+}
+
+
+uint64_t recindex_reader_num_entries(recindex_reader_t *this)
+{
+  return this->num_entries;
+}
+
+
+const struct recindex_entry *recindex_reader_entry(recindex_reader_t *this,
+                                                   uint64_t index)
+{
+  return index < this->num_entries ? &this->entries[index] : 0;
+}
+
+
+int recindex_reader_seek_time(recindex_reader_t *this, uint64_t time,
+                              uint64_t *sample_index, uint64_t *file_offset)
+{
+  int64_t i = find_time(this, time);
+  if (i < 0) {
+    return -1;
+  }
+  const struct recindex_entry *entry = &this->entries[i];
+  uint64_t delta = (uint64_t) ((time - entry->est_time) / this->ns_per_sample);
+  int ret_val = 0;
+  if (delta >= entry->num_samples) {
+    /* past the end of this entry: either in a gap or past the end */
+    if ((uint64_t) i + 1 >= this->num_entries) {
+      return -1;
+    }
+    entry++;
+    delta = 0;
+    ret_val = (entry->flags & RECINDEX_GAP) ? 1 : 0;
+  }
+  if (sample_index) {
+    *sample_index = entry->sample_index + delta;
+  }
+  if (file_offset) {
+    *file_offset = entry->file_offset + delta * this->header->bytes_per_sample;
+  }
+  return ret_val;
+}
+
+
+int recindex_reader_sample_time(recindex_reader_t *this,
+                                uint64_t sample_index, uint64_t *time)
+{
+  int64_t i = find_sample(this, sample_index);
+  if (i < 0) {
+    return -1;
+  }
+  const struct recindex_entry *entry = &this->entries[i];
+  uint64_t delta = sample_index - entry->sample_index;
+  if (delta >= entry->num_samples) {
+    return -1;
+  }
+  *time = entry->est_time + (uint64_t) (delta * this->ns_per_sample);
+  return 0;
+}
+
+
+/* internal functions */
+/* index the oldest waiting frame, using the frames after it to tell
+   lost samples from latency */
+static int add_frame(recindex_t *this)
+{
+  struct recindex_frame *frame = &this->frames[this->frames_head];
+  uint64_t sample_index = frame->sample_index;
+  uint32_t num_samples = frame->num_samples;
+  uint32_t flags = frame->flags;
+  double frame_duration = num_samples * this->ns_per_sample;
+  double start_time = (double) frame->arrival_time - frame_duration;
+  uint64_t lost_samples = 0;
+
+  if (!this->has_anchor) {
+    this->has_anchor = 1;
+    this->anchor_time = start_time;
+    this->anchor_sample = sample_index;
+  }
+  double est_time = this->anchor_time +
+                    (sample_index - this->anchor_sample) * this->ns_per_sample;
+  double own_offset = start_time - est_time;
+  double offset = own_offset;
+  for (uint32_t i = 1; i < this->num_frames; ++i) {
+    const struct recindex_frame *next =
+                &this->frames[(this->frames_head + i) % this->frames_size];
+    double next_offset = (double) next->arrival_time -
+                         next->num_samples * this->ns_per_sample -
+                         (this->anchor_time + (next->sample_index -
+                          this->anchor_sample) * this->ns_per_sample);
+    offset = next_offset < offset ? next_offset : offset;
+  }
+  this->frames_head = (this->frames_head + 1) % this->frames_size;
+  this->num_frames--;
+
+  double threshold = GAP_THRESHOLD + 2 * frame_duration;
+  if (offset > threshold && own_offset - offset > threshold) {
+    /* a queued frame that arrived late: the samples were lost after it,
+       where the frames stop being later than the ones that follow */
+  } else if (offset > threshold) {
+    /* the data is contiguous in the recording, but not in time */
+    lost_samples = (uint64_t) (offset / this->ns_per_sample);
+    flags |= RECINDEX_GAP;
+    this->anchor_time = est_time + offset;
+    this->anchor_sample = sample_index;
+  } else if (offset < 0) {
+    this->anchor_time += offset;
+  } else {
+    this->anchor_time += offset * DRIFT_TRACKING;
+  }
+  est_time = this->anchor_time +
+             (sample_index - this->anchor_sample) * this->ns_per_sample;
+  uint64_t est = est_time > this->last_est_time ? (uint64_t) est_time :
+                                                  this->last_est_time;
+  this->last_est_time = est;
+
+  /* a discontinuity always starts a new entry */
+  if (this->pending && (flags != 0 ||
+      sample_index != this->entry.sample_index + this->entry.num_samples)) {
+    if (flush_entry(this) < 0) {
+      return -1;
+    }
+  }
+
+  if (!this->pending) {
+    this->pending = 1;
+    this->entry.sample_index = sample_index;
+    this->entry.file_offset = this->header.data_offset +
+                              sample_index * this->header.bytes_per_sample;
+    this->entry.host_time = (uint64_t) start_time;
+    this->entry.est_time = est;
+    this->entry.num_samples = 0;
+    this->entry.flags = flags;
+    this->entry.lost_samples = lost_samples;
+  }
+  this->entry.num_samples += num_samples;
+  this->header.num_samples = sample_index + num_samples;
+
+  if (this->entry.num_samples >= this->header.samples_per_entry) {
+    return flush_entry(this);
+  }
+  return 0;
+}
+
+static int flush_entry(recindex_t *this)
+{
+  this->pending = 0;
+  if (fwrite(&this->entry, sizeof(this->entry), 1, this->file) != 1) {
+    fprintf(stderr, "ERROR - fwrite() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  this->header.num_entries++;
+  return 0;
+}
+
+/* index of the last entry starting at or before time; -1 if none */
+static int64_t find_time(recindex_reader_t *this, uint64_t time)
+{
+  int64_t lo = 0;
+  int64_t hi = this->num_entries;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (this->entries[mid].est_time <= time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+/* index of the last entry starting at or before sample_index; -1 if none */
+static int64_t find_sample(recindex_reader_t *this, uint64_t sample_index)
+{
+  int64_t lo = 0;
+  int64_t hi = this->num_entries;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (this->entries[mid].sample_index <= sample_index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * recindex.h - timestamp index sidecar for recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RECINDEX_H
+#define __RECINDEX_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the index is a fixed size header followed by an array of entries sorted
+ * by sample index (and time); samples are contiguous in the recording, so
+ * a gap (samples lost before they reached the recorder) only shows up as a
+ * jump in time between two entries */
+
+enum RecIndexFlags {
+  RECINDEX_GAP  = 0x01,    /* samples went missing right before this entry */
+  RECINDEX_DROP = 0x02     /* the recorder dropped samples before this entry */
+};
+
+struct recindex_entry {
+  uint64_t sample_index;   /* index of the first sample in the recording */
+  uint64_t file_offset;    /* byte offset of that sample in the recording */
+  uint64_t host_time;      /* host time of that sample (ns since the epoch) */
+  uint64_t est_time;       /* smoothed estimate of the same time */
+  uint32_t num_samples;    /* samples covered by this entry */
+  uint32_t flags;
+  uint64_t lost_samples;   /* estimated samples missing before this entry */
+};
+
+typedef struct recindex recindex_t;
+typedef struct recindex_reader recindex_reader_t;
+
+
+/* writer; queued_frames is how many frames the USB transfers can hold
+   (the num_frames of the ADC, 0 for its default): a gap is only marked when
+   the frames of a whole queue after it confirm it, so the entries are
+   written that many frames late */
+recindex_t *recindex_open(const char *filename, double sample_rate,
+                          uint32_t bytes_per_sample, uint64_t data_offset,
+                          uint32_t samples_per_entry, uint32_t queued_frames);
+
+/* arrival_time is the host time (ns since the epoch) when the last of the
+   num_samples samples was received */
+int recindex_add(recindex_t *this, uint64_t sample_index,
+                 uint32_t num_samples, uint64_t arrival_time, uint32_t flags);
+
+int recindex_close(recindex_t *this);
+
+
+/* reader (the index file is mmap'd, nothing is read up front) */
+recindex_reader_t *recindex_reader_open(const char *filename);
+
+void recindex_reader_close(recindex_reader_t *this);
+
+double recindex_reader_sample_rate(recindex_reader_t *this);
+
+uint64_t recindex_reader_num_entries(recindex_reader_t *this);
+
+const struct recindex_entry *recindex_reader_entry(recindex_reader_t *this,
+                                                   uint64_t index);
+
+/* O(log n) seek by time; returns 0 if time is covered by the recording,
+   1 if it falls into a gap (the first sample after the gap is returned)
+   and -1 if it is outside of the recording */
+int recindex_reader_seek_time(recindex_reader_t *this, uint64_t time,
+                              uint64_t *sample_index, uint64_t *file_offset);
+
+/* O(log n) estimated time of a sample; returns -1 if out of range */
+int recindex_reader_sample_time(recindex_reader_t *this,
+                                uint64_t sample_index, uint64_t *time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RECINDEX_H */
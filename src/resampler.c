@@ -0,0 +1,358 @@
+/*
+ * resampler.c - arbitrary ratio resampler for complex samples
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The resampler is a polyphase filter bank: the lowpass prototype is
+ * designed at RESAMPLER_PHASES times the input rate, and each phase (one
+ * tap every RESAMPLER_PHASES) interpolates the input at a fixed fraction
+ * of a sample. Between two phases the output is interpolated linearly
+ * (a first order Farrow structure): every phase also stores the difference
+ * to the next one, so an output sample costs two dot products whatever
+ * the ratio is.
+ *
+ * The time of the next output is kept in 32.32 fixed point (in input
+ * samples), so the average output rate is exact to a few parts in 10^10
+ * and does not drift over long runs; the top bits of the fraction select
+ * the phase and the others the interpolation between phases.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "filter_design.h"
+#include "resampler.h"
+#include "simd.h"
+
+
+static const uint32_t RESAMPLER_PHASE_BITS = 8;
+static const uint32_t RESAMPLER_PHASES = 256;      /* 2^RESAMPLER_PHASE_BITS */
+static const double RESAMPLER_PASSBAND = 0.4;      /* fraction of the rate */
+static const double RESAMPLER_ATTENUATION = 80.0;  /* dB */
+static const double RESAMPLER_MAX_DRIFT = 0.01;
+static const double TIME_ONE = 4294967296.0;       /* 2^32 */
+
+
+typedef struct resampler {
+  double ratio;              /* as designed */
+  double pending_ratio;
+  atomic_int update;
+  uint64_t step;             /* input samples per output (32.32) */
+  uint64_t time;             /* of the next output in the buffer (32.32) */
+  uint32_t num_taps;         /* per phase, multiple of SIMD_FLOAT_LANES */
+  float *taps;               /* [phase][tap], reversed */
+  float *slopes;             /* [phase][tap], next phase minus this one */
+  enum ResamplerFormat format;
+  float *buffer_re;          /* planar input, with num_taps - 1 history */
+  float *buffer_im;
+  uint32_t buffer_size;
+  uint32_t buffer_length;
+  float *output_re;
+  float *output_im;
+  void *output;
+  uint32_t output_size;
+  resampler_output_cb_t callback;
+  void *callback_context;
+} resampler_t;
+
+
+/* internal functions */
+static int design_taps(resampler_t *this);
+static uint64_t ratio_to_step(double ratio);
+static int reserve_input(resampler_t *this, uint32_t length);
+static int reserve_output(resampler_t *this, uint32_t length);
+
+
+resampler_t *resampler_open(double ratio, enum ResamplerFormat format,
+                            resampler_output_cb_t callback,
+                            void *callback_context)
+{
+  resampler_t *ret_val = 0;
+
+  if (!(ratio >= 0.25 && ratio <= 4.0)) {
+    fprintf(stderr, "ERROR - resampler_open() failed: invalid ratio %lg\n",
+            ratio);
+    return ret_val;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - resampler_open() failed: no callback\n");
+    return ret_val;
+  }
+
+  resampler_t *this = (resampler_t *) calloc(1, sizeof(resampler_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->ratio = ratio;
+  this->pending_ratio = ratio;
+  atomic_init(&this->update, 0);
+  this->step = ratio_to_step(ratio);
+  this->format = format;
+  this->callback = callback;
+  this->callback_context = callback_context;
+
+  if (design_taps(this) < 0) {
+    resampler_close(this);
+    return ret_val;
+  }
+
+  /* start with a window of zeros */
+  uint32_t history = this->num_taps - 1;
+  if (reserve_input(this, history) < 0) {
+    resampler_close(this);
+    return ret_val;
+  }
+  memset(this->buffer_re, 0, history * sizeof(float));
+  memset(this->buffer_im, 0, history * sizeof(float));
+  this->buffer_length = history;
+  this->time = (uint64_t) history << 32;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void resampler_close(resampler_t *this)
+{
+  free(this->taps);
+  free(this->slopes);
+  free(this->buffer_re);
+  free(this->buffer_im);
+  free(this->output_re);
+  free(this->output_im);
+  free(this->output);
+  free(this);
+  return;
+}
+
+
+int resampler_set_ratio(resampler_t *this, double ratio)
+{
+  if (!(fabs(ratio / this->ratio - 1.0) <= RESAMPLER_MAX_DRIFT)) {
+    fprintf(stderr, "ERROR - resampler_set_ratio() failed: ratio %lg too far from %lg\n",
+            ratio, this->ratio);
+    return -1;
+  }
+  this->pending_ratio = ratio;
+  atomic_store_explicit(&this->update, 1, memory_order_release);
+  return 0;
+}
+
+
+int resampler_process(resampler_t *this, const void *samples,
+                      uint32_t num_samples)
+{
+  if (atomic_exchange_explicit(&this->update, 0, memory_order_acquire)) {
+    this->step = ratio_to_step(this->pending_ratio);
+  }
+
+  /* append the new samples */
+  if (reserve_input(this, this->buffer_length + num_samples) < 0) {
+    return -1;
+  }
+  float *in_re = this->buffer_re + this->buffer_length;
+  float *in_im = this->buffer_im + this->buffer_length;
+  if (this->format == RESAMPLER_FORMAT_INT16) {
+    const int16_t *x = (const int16_t *) samples;
+    for (uint32_t k = 0; k < num_samples; ++k) {
+      in_re[k] = x[2 * k];
+      in_im[k] = x[2 * k + 1];
+    }
+  } else {
+    const float *x = (const float *) samples;
+    for (uint32_t k = 0; k < num_samples; ++k) {
+      in_re[k] = x[2 * k];
+      in_im[k] = x[2 * k + 1];
+    }
+  }
+  this->buffer_length += num_samples;
+
+  /* the output whose window ends at sample i is due while i is in the
+     buffer */
+  uint64_t end = (uint64_t) this->buffer_length << 32;
+  uint32_t max_output = this->time < end ?
+                        (uint32_t) ((end - this->time - 1) / this->step) + 1 :
+                        0;
+  if (reserve_output(this, max_output) < 0) {
+    return -1;
+  }
+
+  uint32_t num_taps = this->num_taps;
+  const uint32_t fraction_bits = 32 - RESAMPLER_PHASE_BITS;
+  const float fraction_scale = 1.0f / (float) (1u << fraction_bits);
+  uint64_t time = this->time;
+  uint32_t n = 0;
+  while (time < end) {
+    uint32_t i = (uint32_t) (time >> 32);
+    uint32_t fraction = (uint32_t) time;
+    uint32_t phase = fraction >> fraction_bits;
+    float mu = (fraction & ((1u << fraction_bits) - 1)) * fraction_scale;
+    const float *x_re = this->buffer_re + i + 1 - num_taps;
+    const float *x_im = this->buffer_im + i + 1 - num_taps;
+    float a_re, a_im, b_re, b_im;
+    dsp_dot_complex_data(x_re, x_im, this->taps + phase * num_taps,
+                         num_taps, &a_re, &a_im);
+    dsp_dot_complex_data(x_re, x_im, this->slopes + phase * num_taps,
+                         num_taps, &b_re, &b_im);
+    this->output_re[n] = a_re + mu * b_re;
+    this->output_im[n] = a_im + mu * b_im;
+    ++n;
+    time += this->step;
+  }
+
+  /* keep the window of the next output; the step is shorter than a
+     window, so the window always starts inside the buffer */
+  uint32_t consumed = (uint32_t) (time >> 32) + 1 - num_taps;
+  this->buffer_length -= consumed;
+  memmove(this->buffer_re, this->buffer_re + consumed,
+          this->buffer_length * sizeof(float));
+  memmove(this->buffer_im, this->buffer_im + consumed,
+          this->buffer_length * sizeof(float));
+  this->time = time - ((uint64_t) consumed << 32);
+
+  if (n > 0) {
+    if (this->format == RESAMPLER_FORMAT_INT16) {
+      dsp_interleave_int16(this->output_re, this->output_im,
+                           (int16_t *) this->output, n);
+    } else {
+      dsp_interleave(this->output_re, this->output_im,
+                     (float *) this->output, n);
+    }
+    this->callback(n, this->output, this->callback_context);
+  }
+
+  return 0;
+}
+
+
+/* internal functions */
+static int design_taps(resampler_t *this)
+{
+  /* frequencies normalized to the input rate: the passband is limited by
+     the lower of the two rates, and the stopband starts where either the
+     images of the input (at 1 - passband) or the aliases of the output (at
+     ratio - passband) would fall into the passband */
+  double ratio = this->ratio;
+  double passband = RESAMPLER_PASSBAND * (ratio < 1.0 ? ratio : 1.0);
+  double stopband = ratio < 1.0 ? ratio - passband : 1.0 - passband;
+
+  /* the prototype runs at RESAMPLER_PHASES times the input rate */
+  uint32_t phases = RESAMPLER_PHASES;
+  uint32_t prototype_taps = fir_design_num_taps((stopband - passband) / phases,
+                                                RESAMPLER_ATTENUATION);
+  uint32_t num_taps = SIMD_FLOAT_ROUND_UP((prototype_taps + phases - 1) /
+                                          phases);
+  float *prototype = fir_design_lowpass(num_taps * phases,
+                                        0.5 * (passband + stopband) / phases,
+                                        RESAMPLER_ATTENUATION);
+  if (prototype == 0) {
+    return -1;
+  }
+
+  this->num_taps = num_taps;
+  this->taps = (float *) malloc(phases * num_taps * sizeof(float));
+  this->slopes = (float *) malloc(phases * num_taps * sizeof(float));
+  if (this->taps == 0 || this->slopes == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    free(prototype);
+    return -1;
+  }
+
+  /* phase p, tap k (reversed) is prototype[j * phases + p] with
+     j = num_taps - 1 - k; the prototype has unity gain at its own rate,
+     so each phase is scaled by the number of phases */
+  uint32_t length = num_taps * phases;
+  for (uint32_t p = 0; p < phases; ++p) {
+    for (uint32_t k = 0; k < num_taps; ++k) {
+      uint32_t m = (num_taps - 1 - k) * phases + p;
+      float h0 = prototype[m];
+      float h1 = m + 1 < length ? prototype[m + 1] : 0.0f;
+      this->taps[p * num_taps + k] = phases * h0;
+      this->slopes[p * num_taps + k] = phases * (h1 - h0);
+    }
+  }
+  free(prototype);
+  return 0;
+}
+
+static uint64_t ratio_to_step(double ratio)
+{
+  return (uint64_t) llround(TIME_ONE / ratio);
+}
+
+static int reserve_input(resampler_t *this, uint32_t length)
+{
+  /* the filters read up to a whole vector past the window */
+  length += SIMD_FLOAT_LANES;
+  if (length <= this->buffer_size) {
+    return 0;
+  }
+  float *resized_re = (float *) realloc(this->buffer_re,
+                                        length * sizeof(float));
+  if (resized_re == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->buffer_re = resized_re;
+  float *resized_im = (float *) realloc(this->buffer_im,
+                                        length * sizeof(float));
+  if (resized_im == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->buffer_im = resized_im;
+  this->buffer_size = length;
+  return 0;
+}
+
+static int reserve_output(resampler_t *this, uint32_t length)
+{
+  if (length <= this->output_size) {
+    return 0;
+  }
+  size_t sample_size = this->format == RESAMPLER_FORMAT_INT16 ?
+                       2 * sizeof(int16_t) : 2 * sizeof(float);
+  float *resized_re = (float *) realloc(this->output_re,
+                                        length * sizeof(float));
+  if (resized_re == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->output_re = resized_re;
+  float *resized_im = (float *) realloc(this->output_im,
+                                        length * sizeof(float));
+  if (resized_im == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->output_im = resized_im;
+  void *resized = realloc(this->output, length * sample_size);
+  if (resized == 0) {
+    fprintf(stderr, "ERROR - realloc() failed\n");
+    return -1;
+  }
+  this->output = resized;
+  this->output_size = length;
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * resampler.h - arbitrary ratio resampler for complex samples
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RESAMPLER_H
+#define __RESAMPLER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct resampler resampler_t;
+
+enum ResamplerFormat {
+  RESAMPLER_FORMAT_FLOAT32,     /* interleaved I/Q floats */
+  RESAMPLER_FORMAT_INT16        /* interleaved I/Q int16 */
+};
+
+typedef void (*resampler_output_cb_t)(uint32_t num_samples,
+                                      const void *samples, void *context);
+
+/* ratio is the output sample rate over the input sample rate (between
+   0.25 and 4); the input and output samples have the same format; the
+   passband is +/- 0.4 times the lower of the two rates */
+resampler_t *resampler_open(double ratio, enum ResamplerFormat format,
+                            resampler_output_cb_t callback,
+                            void *callback_context);
+
+void resampler_close(resampler_t *this);
+
+/* can be called from any thread to follow small changes of the input rate
+   (up to 1% from the ratio the resampler was opened with); the new ratio
+   is applied at the start of the next block */
+int resampler_set_ratio(resampler_t *this, double ratio);
+
+int resampler_process(resampler_t *this, const void *samples,
+                      uint32_t num_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RESAMPLER_H */
@@ -0,0 +1,248 @@
+/*
+ * rf103_ddc_check - compare the fixed point DDC with the floating point one
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* runs the same synthetic ADC stream (an in band tone, a tone in the
+ * stopband and some noise) through the DDC twice, in floating point and
+ * in Q15 fixed point (DDC_FIXED_POINT), and fails if the outputs differ by
+ * more than the given bounds, in ADC LSB; without -d it checks a set of
+ * decimations, with and without the CIC front end.
+ *
+ * The default bounds, 2.5 LSB RMS and 8 LSB peak, hold for all of them
+ * (the fixed point filters add about 1 LSB of noise, see rf103_set_ddc()).
+ * Left out are the decimations with a large odd factor (25 or more),
+ * whose long filter has taps too small for Q15, so the error grows to
+ * about 10 LSB, and the CIC at a decimation of 6 (about 3 LSB) */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ddc.h"
+
+
+static const uint32_t BLOCK_SIZE = 65536;   /* ADC samples */
+static const double DEFAULT_MAX_RMS_ERROR = 2.5;    /* LSB */
+static const double DEFAULT_MAX_PEAK_ERROR = 8.0;   /* LSB */
+static const uint32_t DEFAULT_DECIMATIONS[] = {
+  2, 3, 4, 5, 8, 10, 12, 16, 20, 32, 40, 64, 96, 128, 160, 256, 1024
+};
+
+struct output {
+  float *samples;     /* interleaved I/Q */
+  uint32_t length;    /* I/Q pairs */
+  uint32_t size;
+};
+
+struct bounds {
+  double max_rms_error;
+  double max_peak_error;
+};
+
+static int check(double frequency, uint32_t decimation, int flags,
+                 uint32_t num_samples, const struct bounds *bounds);
+static void float_callback(uint32_t num_samples, const void *samples,
+                           void *context);
+static void int16_callback(uint32_t num_samples, const void *samples,
+                           void *context);
+static float *output_append(struct output *output, uint32_t num_samples);
+static double fold(double frequency);
+
+
+int main(int argc, char **argv)
+{
+  double frequency = 0.1;
+  uint32_t decimation = 0;
+  int flags = 0;
+  uint32_t num_samples = 1 << 22;
+  struct bounds bounds = { DEFAULT_MAX_RMS_ERROR, DEFAULT_MAX_PEAK_ERROR };
+  int opt;
+  while ((opt = getopt(argc, argv, "f:d:cn:e:p:")) != -1) {
+    switch (opt) {
+      case 'f':
+        frequency = atof(optarg);
+        break;
+      case 'd':
+        decimation = (uint32_t) atoi(optarg);
+        break;
+      case 'c':
+        flags |= DDC_CIC;
+        break;
+      case 'n':
+        num_samples = (uint32_t) atoi(optarg);
+        break;
+      case 'e':
+        bounds.max_rms_error = atof(optarg);
+        break;
+      case 'p':
+        bounds.max_peak_error = atof(optarg);
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind != argc) {
+    fprintf(stderr, "usage: %s [-f <frequency / ADC sample rate>] [-d <decimation> [-c]] [-n <ADC samples>] [-e <max RMS error in LSB>] [-p <max peak error in LSB>]\n", argv[0]);
+    return -1;
+  }
+
+  if (decimation != 0) {
+    return check(frequency, decimation, flags, num_samples, &bounds);
+  }
+  int ret_val = 0;
+  uint32_t num_decimations = sizeof(DEFAULT_DECIMATIONS) /
+                             sizeof(DEFAULT_DECIMATIONS[0]);
+  for (uint32_t i = 0; i < num_decimations; ++i) {
+    if (check(frequency, DEFAULT_DECIMATIONS[i], 0, num_samples,
+              &bounds) != 0) {
+      ret_val = -1;
+    }
+    /* the CIC front end needs an even decimation of at least 6 */
+    if (DEFAULT_DECIMATIONS[i] % 2 == 0 && DEFAULT_DECIMATIONS[i] >= 6 &&
+        check(frequency, DEFAULT_DECIMATIONS[i], DDC_CIC, num_samples,
+              &bounds) != 0) {
+      ret_val = -1;
+    }
+  }
+  return ret_val;
+}
+
+
+static int check(double frequency, uint32_t decimation, int flags,
+                 uint32_t num_samples, const struct bounds *bounds)
+{
+  struct output outputs[2] = { { 0, 0, 0 }, { 0, 0, 0 } };
+  ddc_t *ddcs[2];
+  ddcs[0] = ddc_open(frequency, decimation, DDC_FORMAT_FLOAT32, flags, 0,
+                     float_callback, &outputs[0]);
+  ddcs[1] = ddc_open(frequency, decimation, DDC_FORMAT_INT16,
+                     flags | DDC_FIXED_POINT, 0, int16_callback, &outputs[1]);
+  if (ddcs[0] == 0 || ddcs[1] == 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed\n");
+    exit(-1);
+  }
+  int16_t *samples = (int16_t *) malloc(BLOCK_SIZE * sizeof(int16_t));
+  if (samples == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    exit(-1);
+  }
+
+  /* a tone in the passband, one well into the stopband of the first
+     filters, and uniform noise that exercises the low bits */
+  double f0 = fold(frequency + 0.15 / decimation);
+  double f1 = fold(frequency + 1.5 / decimation);
+  srand(1);
+  for (uint32_t n = 0; n < num_samples; n += BLOCK_SIZE) {
+    uint32_t block = num_samples - n < BLOCK_SIZE ? num_samples - n :
+                                                    BLOCK_SIZE;
+    for (uint32_t k = 0; k < block; ++k) {
+      double t = (double) (n + k);
+      double x = 12000.0 * cos(2.0 * M_PI * f0 * t) +
+                 8000.0 * cos(2.0 * M_PI * f1 * t) +
+                 (rand() % 513) - 256;
+      samples[k] = (int16_t) lrint(x);
+    }
+    if (ddc_process(ddcs[0], samples, block) != 0 ||
+        ddc_process(ddcs[1], samples, block) != 0) {
+      fprintf(stderr, "ERROR - ddc_process() failed\n");
+      exit(-1);
+    }
+  }
+  ddc_close(ddcs[1]);
+  ddc_close(ddcs[0]);
+  free(samples);
+
+  /* the fixed point filters are padded to a different number of taps, so
+     one of the outputs can end a few samples earlier */
+  uint32_t length = outputs[0].length < outputs[1].length ?
+                    outputs[0].length : outputs[1].length;
+  double signal_power = 0.0;
+  double error_power = 0.0;
+  double peak_error = 0.0;
+  for (uint32_t k = 0; k < 2 * length; ++k) {
+    double reference = outputs[0].samples[k];
+    double error = outputs[1].samples[k] - reference;
+    signal_power += reference * reference;
+    error_power += error * error;
+    peak_error = fabs(error) > peak_error ? fabs(error) : peak_error;
+  }
+  free(outputs[1].samples);
+  free(outputs[0].samples);
+  if (length == 0) {
+    fprintf(stderr, "ERROR - decimation %u: no output\n", decimation);
+    return -1;
+  }
+
+  double rms_error = sqrt(error_power / (2 * length));
+  int ret_val = rms_error <= bounds->max_rms_error &&
+                peak_error <= bounds->max_peak_error ? 0 : -1;
+  printf("decimation %u%s: RMS error %.3f LSB, peak error %.1f LSB, SNR %.1f dB%s\n",
+         decimation, flags & DDC_CIC ? " CIC" : "", rms_error, peak_error,
+         10.0 * log10(signal_power / error_power),
+         ret_val == 0 ? "" : " - FAILED");
+  return ret_val;
+}
+
+static void float_callback(uint32_t num_samples, const void *samples,
+                           void *context)
+{
+  const float *in = (const float *) samples;
+  float *out = output_append((struct output *) context, num_samples);
+  for (uint32_t k = 0; k < 2 * num_samples; ++k) {
+    out[k] = in[k];
+  }
+  return;
+}
+
+static void int16_callback(uint32_t num_samples, const void *samples,
+                           void *context)
+{
+  const int16_t *in = (const int16_t *) samples;
+  float *out = output_append((struct output *) context, num_samples);
+  for (uint32_t k = 0; k < 2 * num_samples; ++k) {
+    out[k] = in[k];
+  }
+  return;
+}
+
+static float *output_append(struct output *output, uint32_t num_samples)
+{
+  if (output->length + num_samples > output->size) {
+    output->size = 2 * (output->length + num_samples);
+    output->samples = (float *) realloc(output->samples,
+                                        2 * output->size * sizeof(float));
+    if (output->samples == 0) {
+      fprintf(stderr, "ERROR - realloc() failed\n");
+      exit(-1);
+    }
+  }
+  float *ret_val = output->samples + 2 * output->length;
+  output->length += num_samples;
+  return ret_val;
+}
+
+/* keep a normalized frequency between 0 and the Nyquist frequency */
+static double fold(double frequency)
+{
+  frequency = fmod(frequency, 1.0);
+  return frequency > 0.5 ? 1.0 - frequency : frequency;
+}
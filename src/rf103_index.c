@@ -0,0 +1,85 @@
+/*
+ * rf103_index - show a recording index and seek into it by time
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "recindex.h"
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <index file> [<time in s since the epoch> | +<seconds from start>]\n", argv[0]);
+    return -1;
+  }
+
+  recindex_reader_t *reader = recindex_reader_open(argv[1]);
+  if (reader == 0) {
+    fprintf(stderr, "ERROR - recindex_reader_open() failed\n");
+    return -1;
+  }
+
+  uint64_t num_entries = recindex_reader_num_entries(reader);
+  if (num_entries == 0) {
+    fprintf(stderr, "empty index\n");
+    recindex_reader_close(reader);
+    return 0;
+  }
+  const struct recindex_entry *first = recindex_reader_entry(reader, 0);
+  const struct recindex_entry *last = recindex_reader_entry(reader, num_entries - 1);
+
+  if (argc < 3) {
+    printf("sample rate=%f entries=%llu samples=%llu\n",
+           recindex_reader_sample_rate(reader), (unsigned long long) num_entries,
+           (unsigned long long) (last->sample_index + last->num_samples));
+    printf("start=%.9f end=%.9f\n", first->est_time * 1e-9,
+           last->est_time * 1e-9 + last->num_samples / recindex_reader_sample_rate(reader));
+    for (uint64_t i = 0; i < num_entries; ++i) {
+      const struct recindex_entry *entry = recindex_reader_entry(reader, i);
+      if (entry->flags & (RECINDEX_GAP | RECINDEX_DROP)) {
+        printf("%s at sample %llu time=%.9f: ~%llu samples lost\n",
+               entry->flags & RECINDEX_GAP ? "gap" : "drop",
+               (unsigned long long) entry->sample_index, entry->est_time * 1e-9,
+               (unsigned long long) entry->lost_samples);
+      }
+    }
+  } else {
+    double seconds = atof(argv[2] + (argv[2][0] == '+'));
+    uint64_t time = (uint64_t) (seconds * 1e9);
+    if (argv[2][0] == '+') {
+      time += first->est_time;
+    }
+    uint64_t sample_index;
+    uint64_t file_offset;
+    int ret = recindex_reader_seek_time(reader, time, &sample_index, &file_offset);
+    if (ret < 0) {
+      printf("time %.9f is outside of the recording\n", time * 1e-9);
+    } else {
+      printf("time=%.9f sample=%llu offset=%llu%s\n", time * 1e-9,
+             (unsigned long long) sample_index, (unsigned long long) file_offset,
+             ret == 1 ? " (in a gap - first sample after it)" : "");
+    }
+  }
+
+  recindex_reader_close(reader);
+  return 0;
+}
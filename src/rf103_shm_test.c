@@ -0,0 +1,94 @@
+/*
+ * rf103_shm_test - simple shared memory reader test program for librf103_shm
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rf103_shm.h"
+
+
+static struct timespec clk_start, clk_end;
+
+static double clk_diff() {
+  return ((double)clk_end.tv_sec + 1.0e-9*clk_end.tv_nsec) -
+           ((double)clk_start.tv_sec + 1.0e-9*clk_start.tv_nsec);
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <shared memory name> [<runtime_in_ms>]\n", argv[0]);
+    return -1;
+  }
+  const char *name = argv[1];
+  int runtime = 3000;
+  if (2 < argc)
+    runtime = atoi(argv[2]);
+
+  rf103_shm_reader_t *reader = rf103_shm_reader_open(name);
+  if (reader == 0) {
+    fprintf(stderr, "ERROR - rf103_shm_reader_open() failed\n");
+    return -1;
+  }
+  fprintf(stderr, "attached to %s: frame size=%u sample rate=%u\n", name,
+          rf103_shm_reader_frame_size(reader),
+          rf103_shm_reader_sample_rate(reader));
+
+  unsigned long long received_samples = 0;
+  unsigned long long num_frames = 0;
+  unsigned long long overwritten_frames = 0;
+  int ret_val = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  clk_end = clk_start;
+  while (clk_diff() * 1000.0 < runtime) {
+    const uint8_t *data;
+    uint32_t data_size;
+    int ret = rf103_shm_reader_next(reader, &data, &data_size, 0, 100);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - rf103_shm_reader_next() failed\n");
+      ret_val = -1;
+      break;
+    }
+    if (ret == 1) {
+      if (rf103_shm_reader_release(reader) == 0) {
+        received_samples += data_size / sizeof(int16_t);
+        ++num_frames;
+      } else {
+        ++overwritten_frames;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &clk_end);
+  }
+
+  double dur = clk_diff();
+  fprintf(stderr, "received=%llu 16-Bit samples in %llu frames\n", received_samples, num_frames);
+  fprintf(stderr, "lost frames=%llu (overwritten while reading=%llu)\n",
+          (unsigned long long) rf103_shm_reader_lost_frames(reader), overwritten_frames);
+  fprintf(stderr, "run for %f sec\n", dur);
+  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
+
+  rf103_shm_reader_close(reader);
+
+  return ret_val;
+}
@@ -27,6 +27,9 @@
 
 #include "rf103.h"
 #include "wavewrite.h"
+#include "recindex.h"
+#include "overview.h"
+#include "integrity.h"
 
 
 static void count_bytes_callback(uint32_t data_size, uint8_t *data,
@@ -36,6 +39,13 @@ static unsigned long long received_samples = 0;
 static unsigned long long total_samples = 0;
 static int num_callbacks;
 static int16_t *sampleData = 0;
+static struct frame_time {
+  unsigned long long sample_index;
+  uint32_t num_samples;
+  uint64_t arrival_time;
+} *frameTimes = 0;
+static unsigned max_frame_times = 0;
+static unsigned num_frame_times = 0;
 static int runtime = 3000;
 static struct timespec clk_start, clk_end;
 static int stop_reception = 0;
@@ -84,18 +94,33 @@ int main(int argc, char **argv)
     goto DONE;
   }
 
+  /* measure the DC offset for the auxi chunk of the recording */
+  if (rf103_set_adc_correction(rf103, 1.0, 0.0, 1.0, RF103_ADC_MEASURE_DC) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_adc_correction() failed\n");
+    goto DONE;
+  }
+
   received_samples = 0;
   num_callbacks = 0;
   if (rf103_start_streaming(rf103) < 0) {
     fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
     return -1;
   }
+  if (rf103_status(rf103) != STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_status() is %d after rf103_start_streaming()\n",
+            rf103_status(rf103));
+    return -1;
+  }
 
   fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
   total_samples = (unsigned long long)(runtime * sample_rate / 1000.0);
 
-  if (outfilename)
+  if (outfilename) {
     sampleData = (int16_t*)malloc(total_samples * sizeof(int16_t));
+    /* frames are at least 512 samples */
+    max_frame_times = total_samples / 512 + 16;
+    frameTimes = (struct frame_time*)malloc(max_frame_times * sizeof(struct frame_time));
+  }
 
   /* todo: move this into a thread */
   stop_reception = 0;
@@ -108,21 +133,69 @@ int main(int argc, char **argv)
     fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
     return -1;
   }
+  if (rf103_status(rf103) != STATUS_READY) {
+    fprintf(stderr, "ERROR - rf103_status() is %d after rf103_stop_streaming()\n",
+            rf103_status(rf103));
+    return -1;
+  }
 
   double dur = clk_diff();
   fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
   fprintf(stderr, "run for %f sec\n", dur);
   fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
 
+  struct rf103_adc_stats adc_stats;
+  rf103_get_adc_stats(rf103, &adc_stats);
+  fprintf(stderr, "DC offset is %f\n", adc_stats.dc_offset);
+
   if (outfilename && sampleData && received_samples) {
     FILE * f = fopen(outfilename, "wb");
     if (f) {
       fprintf(stderr, "saving received real samples to file ..\n");
       waveWriteHeader( (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, f);
-      for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 )
+      waveSetIQOffset(adc_stats.dc_offset);
+      long data_offset = ftell(f);
+      unsigned long long written_samples = 0;
+
+      /* min/max/RMS overview pyramid, built while the data is written */
+      char ovwfilename[1024];
+      snprintf(ovwfilename, sizeof(ovwfilename), "%s.ovw", outfilename);
+      overview_t *overview = overview_open(ovwfilename, sample_rate, 0);
+
+      /* per block CRC32C of the samples, computed on a worker thread */
+      char crcfilename[1024];
+      snprintf(crcfilename, sizeof(crcfilename), "%s.crc", outfilename);
+      integrity_t *integrity = integrity_open(crcfilename, data_offset, 0);
+
+      for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 ) {
         waveWriteSamples(f,  sampleData + off, 65536, 0 /*needCleanData*/);
+        if (overview)
+          overview_add(overview, sampleData + off, 65536);
+        if (integrity)
+          integrity_write(integrity, sampleData + off, 65536 * sizeof(int16_t));
+        written_samples = off + 65536;
+      }
       waveFinalizeHeader(f);
       fclose(f);
+      if (overview && overview_close(overview) < 0)
+        fprintf(stderr, "ERROR - overview_close() failed\n");
+      if (integrity && integrity_close(integrity) < 0)
+        fprintf(stderr, "ERROR - integrity_close() failed\n");
+
+      /* timestamp index sidecar: one entry per frame */
+      char idxfilename[1024];
+      snprintf(idxfilename, sizeof(idxfilename), "%s.idx", outfilename);
+      recindex_t *recindex = recindex_open(idxfilename, sample_rate, sizeof(int16_t), data_offset, 0, 0);
+      if (recindex) {
+        for (unsigned i = 0; i < num_frame_times; ++i) {
+          struct frame_time *ft = &frameTimes[i];
+          if (ft->sample_index + ft->num_samples > written_samples)
+            break;
+          recindex_add(recindex, ft->sample_index, ft->num_samples, ft->arrival_time, 0);
+        }
+        if (recindex_close(recindex) < 0)
+          fprintf(stderr, "ERROR - recindex_close() failed\n");
+      }
     }
   }
 
@@ -146,6 +219,14 @@ static void count_bytes_callback(uint32_t data_size,
   if ( received_samples + N < total_samples ) {
     if (sampleData)
       memcpy( sampleData+received_samples, data, data_size);
+    if (frameTimes && num_frame_times < max_frame_times) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      frameTimes[num_frame_times].sample_index = received_samples;
+      frameTimes[num_frame_times].num_samples = N;
+      frameTimes[num_frame_times].arrival_time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+      ++num_frame_times;
+    }
     received_samples += N;
   }
   else {
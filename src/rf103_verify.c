@@ -0,0 +1,66 @@
+/*
+ * rf103_verify - check recordings against their CRC32C sidecar
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "integrity.h"
+
+
+int main(int argc, char **argv)
+{
+  int num_threads = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+      case 'j':
+        num_threads = atoi(optarg);
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-j <threads>] <recording> [<recording> ...]\n", argv[0]);
+    return -1;
+  }
+
+  /* the sidecar of each recording is <recording>.crc */
+  int ret_val = 0;
+  for (int i = optind; i < argc; ++i) {
+    char crcfilename[1024];
+    snprintf(crcfilename, sizeof(crcfilename), "%s.crc", argv[i]);
+    long long bad_blocks = integrity_verify(argv[i], crcfilename, num_threads);
+    if (bad_blocks < 0) {
+      printf("%s: ERROR\n", argv[i]);
+      ret_val = -1;
+    } else if (bad_blocks > 0) {
+      printf("%s: %lld bad blocks\n", argv[i], bad_blocks);
+      ret_val = -1;
+    } else {
+      printf("%s: OK\n", argv[i]);
+    }
+  }
+
+  return ret_val;
+}
@@ -0,0 +1,142 @@
+/*
+ * rf103_xcorr - cross-correlate two recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* replays two recordings of interleaved float I/Q samples (e.g. the
+ * .sigmf-data files of rf103_burst_sink or the output of the DDC saved to
+ * a file) through the cross-correlation engine, and prints the lag
+ * between them for each interval */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rf103_xcorr.h"
+
+
+static const uint32_t BLOCK_SIZE = 16384;   /* samples */
+
+static double sample_rate = 0.0;
+
+static void result_callback(const struct rf103_xcorr_result *result,
+                            void *context);
+
+
+int main(int argc, char **argv)
+{
+  uint32_t fft_size = 4096;
+  uint32_t max_lag = 0;
+  double update_rate = 10.0;
+  int flags = 0;
+  uint32_t num_threads = 0;
+  long long offset = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:r:pj:o:")) != -1) {
+    switch (opt) {
+      case 'n':
+        fft_size = (uint32_t) atoi(optarg);
+        break;
+      case 'm':
+        max_lag = (uint32_t) atoi(optarg);
+        break;
+      case 'r':
+        update_rate = atof(optarg);
+        break;
+      case 'p':
+        flags |= RF103_XCORR_PHAT;
+        break;
+      case 'j':
+        num_threads = (uint32_t) atoi(optarg);
+        break;
+      case 'o':
+        offset = atoll(optarg);
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind + 3 != argc) {
+    fprintf(stderr, "usage: %s [-n <fft size>] [-m <max lag>] [-r <updates per second>] [-p] [-j <threads>] [-o <offset of the second recording in samples>] <sample rate> <recording 0> <recording 1>\n", argv[0]);
+    return -1;
+  }
+  sample_rate = atof(argv[optind]);
+
+  FILE *fp[2];
+  for (int s = 0; s < 2; ++s) {
+    fp[s] = fopen(argv[optind + 1 + s], "rb");
+    if (fp[s] == 0) {
+      fprintf(stderr, "ERROR - fopen(%s) failed\n", argv[optind + 1 + s]);
+      return -1;
+    }
+  }
+
+  rf103_xcorr_t *xcorr = rf103_xcorr_open(sample_rate, fft_size, max_lag,
+                                          update_rate, 0, flags, num_threads,
+                                          result_callback, 0);
+  if (xcorr == 0) {
+    fprintf(stderr, "ERROR - rf103_xcorr_open() failed\n");
+    return -1;
+  }
+
+  /* a positive offset means the second recording started later */
+  uint64_t sample_index[2];
+  sample_index[0] = offset < 0 ? (uint64_t) -offset : 0;
+  sample_index[1] = offset > 0 ? (uint64_t) offset : 0;
+  float *samples = (float *) malloc(BLOCK_SIZE * 2 * sizeof(float));
+  if (samples == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    return -1;
+  }
+  printf("# sample_index time lag_samples lag_us peak phase\n");
+
+  /* feed whichever recording is behind, so neither gets too far ahead;
+     the correlation ends with the shorter recording */
+  while (1) {
+    int s = sample_index[1] < sample_index[0] ? 1 : 0;
+    size_t n = fread(samples, 2 * sizeof(float), BLOCK_SIZE, fp[s]);
+    if (n == 0) {
+      break;
+    }
+    if (rf103_xcorr_write(xcorr, (uint32_t) s, sample_index[s], samples,
+                          (uint32_t) n) != 0) {
+      break;
+    }
+    sample_index[s] += n;
+  }
+
+  rf103_xcorr_close(xcorr);
+  free(samples);
+  fclose(fp[1]);
+  fclose(fp[0]);
+  return 0;
+}
+
+
+static void result_callback(const struct rf103_xcorr_result *result,
+                            void *context)
+{
+  (void) context;
+  printf("%llu %.6f %.3f %.4f %.4f %.4f\n",
+         (unsigned long long) result->sample_index,
+         result->sample_index / sample_rate, result->lag,
+         1e6 * result->lag / sample_rate, result->peak, result->phase);
+  return;
+}
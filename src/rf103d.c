@@ -0,0 +1,488 @@
+/*
+ * rf103d - device sharing daemon for librf103
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* rf103d opens the device once (firmware upload, clock bring up) and keeps
+ * it streaming into a shared memory ring (data plane); clients attach to the
+ * ring with librf103_shm and come and go as they like.
+ * A Unix socket accepts one command per line (control plane):
+ *     status
+ *     subscribe
+ *     samplerate <sample rate>
+ *     dither on|off
+ *     random on|off
+ *     led on|off|toggle red|yellow|blue|<bit pattern>
+ *     quit
+ * every command is answered with a single line starting with OK or ERROR
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rf103.h"
+
+
+#define MAX_CLIENTS (32)
+#define MAX_LINE (256)
+
+struct client {
+  int fd;
+  int length;
+  char line[MAX_LINE];
+};
+
+static rf103_t *rf103 = 0;
+static double sample_rate = 64e6;
+static const char *shm_name = "rf103";
+static uint32_t shm_slots = 256;
+static int shm_flags = 0;
+static const char *socket_path = "/tmp/rf103d.sock";
+static volatile sig_atomic_t stop_daemon = 0;
+static volatile int stop_events = 0;
+static struct client clients[MAX_CLIENTS];
+
+static void signal_handler(int signum);
+static void *handle_events(void *arg);
+static int open_control_socket(const char *path);
+static void handle_client(struct client *client);
+static void handle_command(struct client *client, char *command);
+static int restart_streaming(double new_sample_rate);
+static int parse_led(const char *arg, uint8_t *led_pattern);
+static int parse_on_off(const char *arg, int *value);
+static void reply(struct client *client, const char *format, ...)
+                  __attribute__((format(printf, 2, 3)));
+
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "r:n:N:s:H")) != -1) {
+    switch (opt) {
+      case 'r':
+        sscanf(optarg, "%lf", &sample_rate);
+        break;
+      case 'n':
+        shm_name = optarg;
+        break;
+      case 'N':
+        shm_slots = atoi(optarg);
+        break;
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'H':
+        shm_flags |= RF103_SHM_HUGEPAGES;
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-r <sample rate>] [-n <shared memory name>] [-N <ring frames>] [-H] [-s <socket path>] <image file>\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[optind];
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+
+  int ret_val = -1;
+
+  rf103 = rf103_open(0, imagefile);
+  if (rf103 == 0) {
+    fprintf(stderr, "ERROR - rf103_open() failed\n");
+    return -1;
+  }
+
+  if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  /* no callback: the frames only go to the shared memory ring */
+  if (rf103_set_async_params(rf103, 0, 0, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_async_params() failed\n");
+    goto DONE;
+  }
+
+  if (rf103_set_shm_producer(rf103, shm_name, shm_slots, shm_flags) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_shm_producer() failed\n");
+    goto DONE;
+  }
+
+  int listen_fd = open_control_socket(socket_path);
+  if (listen_fd < 0) {
+    fprintf(stderr, "ERROR - open_control_socket() failed\n");
+    goto DONE;
+  }
+
+  if (rf103_start_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
+    goto CLOSE_SOCKET;
+  }
+
+  pthread_t events_thread;
+  stop_events = 0;
+  if (pthread_create(&events_thread, 0, handle_events, 0) != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed\n");
+    rf103_stop_streaming(rf103);
+    goto CLOSE_SOCKET;
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "streaming to shared memory '%s' - control socket %s\n",
+          shm_name, socket_path);
+
+  for (int i = 0; i < MAX_CLIENTS; ++i) {
+    clients[i].fd = -1;
+  }
+
+  while (!stop_daemon) {
+    struct pollfd pollfds[MAX_CLIENTS + 1];
+    struct client *pollclients[MAX_CLIENTS + 1];
+    int nfds = 0;
+    pollfds[nfds].fd = listen_fd;
+    pollfds[nfds].events = POLLIN;
+    pollclients[nfds++] = 0;
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+      if (clients[i].fd >= 0) {
+        pollfds[nfds].fd = clients[i].fd;
+        pollfds[nfds].events = POLLIN;
+        pollclients[nfds++] = &clients[i];
+      }
+    }
+
+    int ret = poll(pollfds, nfds, 500);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - poll() failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (pollfds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, 0, 0);
+      if (fd >= 0) {
+        int i;
+        for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; ++i)
+          ;
+        if (i < MAX_CLIENTS) {
+          clients[i].fd = fd;
+          clients[i].length = 0;
+        } else {
+          fprintf(stderr, "WARNING - too many control clients\n");
+          close(fd);
+        }
+      }
+    }
+    for (int j = 1; j < nfds; ++j) {
+      if (pollfds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+        handle_client(pollclients[j]);
+      }
+    }
+  }
+
+  fprintf(stderr, "stopping ..\n");
+  for (int i = 0; i < MAX_CLIENTS; ++i) {
+    if (clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+
+  if (rf103_stop_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+  }
+  stop_events = 1;
+  pthread_join(events_thread, 0);
+
+  /* done - all good */
+  ret_val = 0;
+
+CLOSE_SOCKET:
+  close(listen_fd);
+  unlink(socket_path);
+DONE:
+  rf103_close(rf103);
+
+  return ret_val;
+}
+
+
+static void signal_handler(int signum __attribute__((unused)))
+{
+  stop_daemon = 1;
+}
+
+
+static void *handle_events(void *arg __attribute__((unused)))
+{
+  while (!stop_events) {
+    rf103_handle_events(rf103);
+  }
+  return 0;
+}
+
+
+static int open_control_socket(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ERROR - socket path too long: %s\n", path);
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - socket() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "ERROR - bind(%s) failed: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (listen(fd, 8) < 0) {
+    fprintf(stderr, "ERROR - listen() failed: %s\n", strerror(errno));
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  return fd;
+}
+
+
+static void handle_client(struct client *client)
+{
+  ssize_t n = read(client->fd, client->line + client->length,
+                   MAX_LINE - 1 - client->length);
+  if (n <= 0) {
+    close(client->fd);
+    client->fd = -1;
+    return;
+  }
+  client->length += n;
+  client->line[client->length] = '\0';
+
+  /* execute every complete line */
+  char *start = client->line;
+  char *eol;
+  while ((eol = strchr(start, '\n')) != 0) {
+    *eol = '\0';
+    if (eol > start && eol[-1] == '\r') {
+      eol[-1] = '\0';
+    }
+    handle_command(client, start);
+    if (client->fd < 0) {
+      return;
+    }
+    start = eol + 1;
+  }
+  client->length -= start - client->line;
+  memmove(client->line, start, client->length);
+  if (client->length == MAX_LINE - 1) {
+    reply(client, "ERROR line too long");
+    client->length = 0;
+  }
+}
+
+
+static void handle_command(struct client *client, char *command)
+{
+  char *saveptr;
+  char *verb = strtok_r(command, " \t", &saveptr);
+  char *arg1 = strtok_r(0, " \t", &saveptr);
+  char *arg2 = strtok_r(0, " \t", &saveptr);
+  if (verb == 0) {
+    return;
+  }
+
+  if (strcmp(verb, "status") == 0) {
+    static const char *status_names[] = { "off", "ready", "streaming" };
+    enum RF103Status status = rf103_status(rf103);
+    reply(client, "OK status=%s samplerate=%.0f shm=%s",
+          status <= STATUS_STREAMING ? status_names[status] : "failed",
+          sample_rate, shm_name);
+  } else if (strcmp(verb, "subscribe") == 0) {
+    reply(client, "OK shm=%s samplerate=%.0f", shm_name, sample_rate);
+  } else if (strcmp(verb, "samplerate") == 0) {
+    double new_sample_rate = 0;
+    if (arg1 == 0 || sscanf(arg1, "%lf", &new_sample_rate) != 1 ||
+        new_sample_rate <= 0) {
+      reply(client, "ERROR invalid sample rate");
+    } else if (restart_streaming(new_sample_rate) < 0) {
+      reply(client, "ERROR restart_streaming() failed");
+    } else {
+      reply(client, "OK samplerate=%.0f", sample_rate);
+    }
+  } else if (strcmp(verb, "dither") == 0 || strcmp(verb, "random") == 0) {
+    int value;
+    if (parse_on_off(arg1, &value) < 0) {
+      reply(client, "ERROR expected on or off");
+    } else if ((verb[0] == 'd' ? rf103_adc_dither(rf103, value) :
+                                 rf103_adc_random(rf103, value)) < 0) {
+      reply(client, "ERROR %s failed", verb);
+    } else {
+      reply(client, "OK %s=%s", verb, value ? "on" : "off");
+    }
+  } else if (strcmp(verb, "led") == 0) {
+    uint8_t led_pattern;
+    int ret;
+    if (arg1 == 0 || parse_led(arg2, &led_pattern) < 0) {
+      reply(client, "ERROR usage: led on|off|toggle red|yellow|blue|<bit pattern>");
+      return;
+    }
+    if (strcmp(arg1, "on") == 0) {
+      ret = rf103_led_on(rf103, led_pattern);
+    } else if (strcmp(arg1, "off") == 0) {
+      ret = rf103_led_off(rf103, led_pattern);
+    } else if (strcmp(arg1, "toggle") == 0) {
+      ret = rf103_led_toggle(rf103, led_pattern);
+    } else {
+      reply(client, "ERROR usage: led on|off|toggle red|yellow|blue|<bit pattern>");
+      return;
+    }
+    if (ret < 0) {
+      reply(client, "ERROR led %s failed", arg1);
+    } else {
+      reply(client, "OK");
+    }
+  } else if (strcmp(verb, "quit") == 0) {
+    reply(client, "OK");
+    close(client->fd);
+    client->fd = -1;
+  } else {
+    reply(client, "ERROR unknown command: %s", verb);
+  }
+}
+
+
+/* a new sample rate needs the clock to be reprogrammed: stop the stream,
+   wait for all the transfers to be cancelled and start again (the firmware
+   and the shared memory ring are left alone, so readers stay attached) */
+static int restart_streaming(double new_sample_rate)
+{
+  if (rf103_stop_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+    return -1;
+  }
+  int ret = -1;
+  for (int i = 0; i < 100 && ret < 0; ++i) {
+    usleep(10000);
+    ret = rf103_reset_status(rf103);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - rf103_reset_status() failed\n");
+    return -1;
+  }
+
+  double old_sample_rate = sample_rate;
+  sample_rate = new_sample_rate;
+  if (rf103_set_sample_rate(rf103, sample_rate) < 0 ||
+      rf103_start_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - restart at %f failed - going back to %f\n",
+            sample_rate, old_sample_rate);
+    sample_rate = old_sample_rate;
+    rf103_set_sample_rate(rf103, sample_rate);
+    rf103_reset_status(rf103);
+    rf103_start_streaming(rf103);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int parse_led(const char *arg, uint8_t *led_pattern)
+{
+  if (arg == 0) {
+    return -1;
+  }
+  if (strcmp(arg, "red") == 0) {
+    *led_pattern = LED_RED;
+  } else if (strcmp(arg, "yellow") == 0) {
+    *led_pattern = LED_YELLOW;
+  } else if (strcmp(arg, "blue") == 0) {
+    *led_pattern = LED_BLUE;
+  } else {
+    char *end;
+    long value = strtol(arg, &end, 0);
+    if (*end != '\0' || value <= 0 || value > 0xff) {
+      return -1;
+    }
+    *led_pattern = (uint8_t) value;
+  }
+  return 0;
+}
+
+
+static int parse_on_off(const char *arg, int *value)
+{
+  if (arg == 0) {
+    return -1;
+  }
+  if (strcmp(arg, "on") == 0 || strcmp(arg, "1") == 0) {
+    *value = 1;
+  } else if (strcmp(arg, "off") == 0 || strcmp(arg, "0") == 0) {
+    *value = 0;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+static void reply(struct client *client, const char *format, ...)
+{
+  char buffer[MAX_LINE + 64];
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(buffer, sizeof(buffer) - 1, format, ap);
+  va_end(ap);
+  if (n < 0) {
+    return;
+  }
+  if (n > (int) sizeof(buffer) - 2) {
+    n = sizeof(buffer) - 2;
+  }
+  buffer[n++] = '\n';
+  if (write(client->fd, buffer, n) < 0) {
+    close(client->fd);
+    client->fd = -1;
+  }
+}
@@ -0,0 +1,624 @@
+/*
+ * shm_ring.c - shared memory broadcast ring (producer and reader side)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - Linux seqlock: https://www.kernel.org/doc/html/latest/locking/seqlock.html
+ *  - futex(2) man page
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+#include "rf103_shm.h"
+
+
+/* shared memory layout:
+ *   - header (including the per reader cursors)
+ *   - num_slots slot descriptors (one seqlock each)
+ *   - num_slots * slot_size bytes of frame data
+ *
+ * the producer writes frame 'seq' into slot 'seq % num_slots'; the slot
+ * seqlock is odd (2*seq+1) while the slot is being written and becomes
+ * 2*seq+2 once the frame is complete. A reader holding frame 'seq' knows its
+ * data was not overwritten if the seqlock is still 2*seq+2 after reading */
+
+#define SHM_RING_MAGIC "RF103SHM"
+#define SHM_RING_VERSION (1)
+#define SHM_RING_MAX_READERS (64)
+#define SHM_RING_CACHE_LINE (64)
+
+static const size_t SHM_RING_PAGE_SIZE = 4096;
+static const size_t SHM_RING_HUGEPAGE_SIZE = 2 * 1024 * 1024;
+static const char *SHM_RING_HUGEPAGES_DIR = "/dev/hugepages";
+/* readers write their cursors into the header, so they need write access
+   too: the owner and its group only */
+static const mode_t SHM_RING_MODE = 0660;
+
+struct shm_ring_reader_entry {
+  _Alignas(SHM_RING_CACHE_LINE) _Atomic int32_t pid;
+  _Atomic uint64_t cursor;
+  _Atomic uint64_t lost_frames;
+};
+
+struct shm_ring_slot {
+  _Alignas(SHM_RING_CACHE_LINE) _Atomic uint64_t seqlock;
+  uint32_t data_size;
+  uint64_t timestamp;
+};
+
+struct shm_ring_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t num_slots;
+  uint32_t flags;
+  uint64_t slots_offset;
+  uint64_t data_offset;
+  uint64_t total_size;
+  _Atomic uint32_t sample_rate;
+  _Atomic uint32_t producer_closed;
+  _Alignas(SHM_RING_CACHE_LINE) _Atomic uint64_t write_sequence;
+  _Alignas(SHM_RING_CACHE_LINE) _Atomic uint32_t futex_word;
+  _Atomic uint32_t waiters;
+  struct shm_ring_reader_entry readers[SHM_RING_MAX_READERS];
+};
+
+
+typedef struct shm_ring {
+  char *path;
+  int hugepages;
+  int fd;
+  uint8_t *base;
+  size_t size;
+  struct shm_ring_header *header;
+  struct shm_ring_slot *slots;
+  uint8_t *data;
+  uint64_t next_sequence;
+} shm_ring_t;
+
+typedef struct rf103_shm_reader {
+  int fd;
+  uint8_t *base;
+  size_t size;
+  struct shm_ring_header *header;
+  struct shm_ring_slot *slots;
+  uint8_t *data;
+  struct shm_ring_reader_entry *entry;
+  uint64_t cursor;
+  int holding;
+  uint32_t data_size;
+  uint64_t timestamp;
+  uint64_t lost_frames;
+} rf103_shm_reader_t;
+
+
+/* internal functions */
+static char *shm_name(const char *name);
+static size_t round_up(size_t value, size_t alignment);
+static int futex_wait(_Atomic uint32_t *addr, uint32_t value, int timeout_ms);
+static int futex_wake(_Atomic uint32_t *addr);
+static uint64_t realtime_ns();
+static uint64_t monotonic_ms();
+
+
+/******************************
+ * producer side
+ ******************************/
+
+shm_ring_t *shm_ring_create(const char *name, uint32_t slot_size,
+                            uint32_t num_slots, int flags)
+{
+  shm_ring_t *ret_val = 0;
+
+  if (slot_size == 0 || num_slots < 2) {
+    fprintf(stderr, "ERROR - invalid shared memory ring geometry: %u x %u\n",
+            slot_size, num_slots);
+    goto FAIL0;
+  }
+
+  char *path = shm_name(name);
+  if (path == 0) {
+    fprintf(stderr, "ERROR - invalid shared memory ring name: %s\n", name);
+    goto FAIL0;
+  }
+
+  /* hugepages need a hugetlbfs file; fall back to regular shared memory
+     (with a transparent hugepage hint) if it is not available */
+  int hugepages = 0;
+  int fd = -1;
+  if (flags & SHM_RING_HUGEPAGES) {
+    char hugepath[PATH_MAX];
+    snprintf(hugepath, sizeof(hugepath), "%s%s", SHM_RING_HUGEPAGES_DIR, path);
+    /* a stale file from a previous producer would make O_EXCL fail */
+    if (unlink(hugepath) < 0 && errno != ENOENT) {
+      fprintf(stderr, "WARNING - unlink(%s) failed: %s\n", hugepath,
+              strerror(errno));
+    }
+    fd = open(hugepath, O_CREAT | O_EXCL | O_RDWR, SHM_RING_MODE);
+    if (fd >= 0) {
+      hugepages = 1;
+      free(path);
+      path = strdup(hugepath);
+    } else {
+      fprintf(stderr, "WARNING - open(%s) failed: %s - using regular shared memory\n",
+              hugepath, strerror(errno));
+    }
+  }
+  if (fd < 0) {
+    /* a stale ring from a previous producer would never be written again */
+    if (shm_unlink(path) < 0 && errno != ENOENT) {
+      fprintf(stderr, "WARNING - shm_unlink(%s) failed: %s\n", path,
+              strerror(errno));
+    }
+    fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, SHM_RING_MODE);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR - shm_open(%s) failed: %s\n", path, strerror(errno));
+      goto FAIL1;
+    }
+  }
+
+  size_t page_size = hugepages ? SHM_RING_HUGEPAGE_SIZE : SHM_RING_PAGE_SIZE;
+  size_t slots_offset = round_up(sizeof(struct shm_ring_header), SHM_RING_CACHE_LINE);
+  size_t data_offset = round_up(slots_offset + num_slots * sizeof(struct shm_ring_slot),
+                                SHM_RING_PAGE_SIZE);
+  size_t total_size = round_up(data_offset + (size_t) num_slots * slot_size, page_size);
+
+  /* the umask would take away the write access of the group */
+  if (fchmod(fd, SHM_RING_MODE) < 0) {
+    fprintf(stderr, "WARNING - fchmod() failed: %s\n", strerror(errno));
+  }
+  if (ftruncate(fd, total_size) < 0) {
+    fprintf(stderr, "ERROR - ftruncate() failed: %s\n", strerror(errno));
+    goto FAIL2;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, total_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+    goto FAIL2;
+  }
+#ifdef MADV_HUGEPAGE
+  if ((flags & SHM_RING_HUGEPAGES) && !hugepages) {
+    madvise(base, total_size, MADV_HUGEPAGE);
+  }
+#endif
+
+  /* initialize the header; the magic goes in last so a reader attaching
+     right now does not see a half initialized ring */
+  struct shm_ring_header *header = (struct shm_ring_header *) base;
+  memset(header, 0, data_offset);
+  header->version = SHM_RING_VERSION;
+  header->slot_size = slot_size;
+  header->num_slots = num_slots;
+  header->flags = hugepages ? SHM_RING_HUGEPAGES : 0;
+  header->slots_offset = slots_offset;
+  header->data_offset = data_offset;
+  header->total_size = total_size;
+  atomic_init(&header->sample_rate, 0);
+  atomic_init(&header->producer_closed, 0);
+  atomic_init(&header->write_sequence, 0);
+  atomic_init(&header->futex_word, 0);
+  atomic_init(&header->waiters, 0);
+  for (int i = 0; i < SHM_RING_MAX_READERS; ++i) {
+    atomic_init(&header->readers[i].pid, 0);
+    atomic_init(&header->readers[i].cursor, 0);
+    atomic_init(&header->readers[i].lost_frames, 0);
+  }
+  struct shm_ring_slot *slots = (struct shm_ring_slot *) (base + slots_offset);
+  for (uint32_t i = 0; i < num_slots; ++i) {
+    atomic_init(&slots[i].seqlock, 0);
+  }
+  atomic_thread_fence(memory_order_release);
+  memcpy(header->magic, SHM_RING_MAGIC, sizeof(header->magic));
+
+  /* we are good here - create and initialize the shm_ring */
+  shm_ring_t *this = (shm_ring_t *) malloc(sizeof(shm_ring_t));
+  this->path = path;
+  this->hugepages = hugepages;
+  this->fd = fd;
+  this->base = base;
+  this->size = total_size;
+  this->header = header;
+  this->slots = slots;
+  this->data = base + data_offset;
+  this->next_sequence = 0;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  close(fd);
+  if (hugepages) {
+    unlink(path);
+  } else {
+    shm_unlink(path);
+  }
+FAIL1:
+  free(path);
+FAIL0:
+  return ret_val;
+}
+
+
+void shm_ring_destroy(shm_ring_t *this)
+{
+  /* let the attached readers know they have to reattach */
+  atomic_store(&this->header->producer_closed, 1);
+  atomic_fetch_add(&this->header->futex_word, 1);
+  futex_wake(&this->header->futex_word);
+
+  munmap(this->base, this->size);
+  close(this->fd);
+  if (this->hugepages) {
+    unlink(this->path);
+  } else {
+    shm_unlink(this->path);
+  }
+  free(this->path);
+  free(this);
+  return;
+}
+
+
+int shm_ring_set_sample_rate(shm_ring_t *this, uint32_t sample_rate)
+{
+  atomic_store(&this->header->sample_rate, sample_rate);
+  return 0;
+}
+
+
+int shm_ring_num_readers(shm_ring_t *this)
+{
+  int count = 0;
+  for (int i = 0; i < SHM_RING_MAX_READERS; ++i) {
+    if (atomic_load_explicit(&this->header->readers[i].pid, memory_order_relaxed) != 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+
+int shm_ring_publish(shm_ring_t *this, const uint8_t *data,
+                     uint32_t data_size)
+{
+  struct shm_ring_header *header = this->header;
+  uint64_t sequence = this->next_sequence;
+  uint32_t index = sequence % header->num_slots;
+  struct shm_ring_slot *slot = &this->slots[index];
+
+  if (data_size > header->slot_size) {
+    data_size = header->slot_size;
+  }
+
+  atomic_store_explicit(&slot->seqlock, 2 * sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->data_size = data_size;
+  slot->timestamp = realtime_ns();
+  memcpy(this->data + (size_t) index * header->slot_size, data, data_size);
+  atomic_store_explicit(&slot->seqlock, 2 * sequence + 2, memory_order_release);
+
+  this->next_sequence = sequence + 1;
+  atomic_store_explicit(&header->write_sequence, sequence + 1, memory_order_release);
+
+  /* only pay for the system call if somebody is actually sleeping; the
+     increment must be visible before waiters is read (and the reader
+     does the opposite), or both could miss each other */
+  atomic_fetch_add_explicit(&header->futex_word, 1, memory_order_seq_cst);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&header->waiters, memory_order_seq_cst) > 0) {
+    futex_wake(&header->futex_word);
+  }
+  return 0;
+}
+
+
+/******************************
+ * reader side
+ ******************************/
+
+rf103_shm_reader_t *rf103_shm_reader_open(const char *name)
+{
+  rf103_shm_reader_t *ret_val = 0;
+
+  char *path = shm_name(name);
+  if (path == 0) {
+    fprintf(stderr, "ERROR - invalid shared memory ring name: %s\n", name);
+    goto FAIL0;
+  }
+
+  int fd = shm_open(path, O_RDWR, 0);
+  if (fd < 0) {
+    char hugepath[PATH_MAX];
+    snprintf(hugepath, sizeof(hugepath), "%s%s", SHM_RING_HUGEPAGES_DIR, path);
+    fd = open(hugepath, O_RDWR);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - shared memory ring %s not found: %s\n", path,
+            strerror(errno));
+    goto FAIL1;
+  }
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) {
+    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", path, strerror(errno));
+    goto FAIL2;
+  }
+  size_t size = statbuf.st_size;
+  if (size < sizeof(struct shm_ring_header)) {
+    fprintf(stderr, "ERROR - shared memory ring %s is not ready\n", path);
+    goto FAIL2;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+    goto FAIL2;
+  }
+
+  struct shm_ring_header *header = (struct shm_ring_header *) base;
+  if (memcmp(header->magic, SHM_RING_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SHM_RING_VERSION || header->total_size != size) {
+    fprintf(stderr, "ERROR - %s is not a valid shared memory ring\n", path);
+    goto FAIL3;
+  }
+  atomic_thread_fence(memory_order_acquire);
+
+  /* claim a cursor entry; entries left behind by readers that died are
+     taken over */
+  struct shm_ring_reader_entry *entry = 0;
+  int32_t pid = (int32_t) getpid();
+  for (int i = 0; i < SHM_RING_MAX_READERS && entry == 0; ++i) {
+    int32_t owner = atomic_load(&header->readers[i].pid);
+    if (owner != 0 && !(kill(owner, 0) < 0 && errno == ESRCH)) {
+      continue;
+    }
+    if (atomic_compare_exchange_strong(&header->readers[i].pid, &owner, pid)) {
+      entry = &header->readers[i];
+    }
+  }
+  if (entry == 0) {
+    fprintf(stderr, "WARNING - no free reader entries in %s - cursor will not be published\n",
+            path);
+  }
+
+  /* we are good here - create and initialize the reader; start with the
+     most recent data */
+  rf103_shm_reader_t *this = (rf103_shm_reader_t *) malloc(sizeof(rf103_shm_reader_t));
+  this->fd = fd;
+  this->base = base;
+  this->size = size;
+  this->header = header;
+  this->slots = (struct shm_ring_slot *) (base + header->slots_offset);
+  this->data = base + header->data_offset;
+  this->entry = entry;
+  this->cursor = atomic_load_explicit(&header->write_sequence, memory_order_acquire);
+  this->holding = 0;
+  this->data_size = 0;
+  this->timestamp = 0;
+  this->lost_frames = 0;
+  if (entry) {
+    atomic_store(&entry->cursor, this->cursor);
+    atomic_store(&entry->lost_frames, 0);
+  }
+
+  free(path);
+  ret_val = this;
+  return ret_val;
+
+FAIL3:
+  munmap(base, size);
+FAIL2:
+  close(fd);
+FAIL1:
+  free(path);
+FAIL0:
+  return ret_val;
+}
+
+
+void rf103_shm_reader_close(rf103_shm_reader_t *this)
+{
+  if (this->entry) {
+    atomic_store(&this->entry->pid, 0);
+  }
+  munmap(this->base, this->size);
+  close(this->fd);
+  free(this);
+  return;
+}
+
+
+int rf103_shm_reader_next(rf103_shm_reader_t *this, const uint8_t **data,
+                          uint32_t *data_size, uint64_t *sequence,
+                          int timeout_ms)
+{
+  struct shm_ring_header *header = this->header;
+  uint32_t num_slots = header->num_slots;
+
+  if (this->holding) {
+    rf103_shm_reader_release(this);
+  }
+
+  uint64_t deadline = monotonic_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+  while (1) {
+    if (atomic_load_explicit(&header->producer_closed, memory_order_acquire)) {
+      fprintf(stderr, "ERROR - shared memory ring closed by the producer\n");
+      return -1;
+    }
+
+    /* the futex word must be read before checking for new data, otherwise
+       a wakeup could be missed */
+    uint32_t futex_value = atomic_load_explicit(&header->futex_word,
+                                                memory_order_acquire);
+    uint64_t write_sequence = atomic_load_explicit(&header->write_sequence,
+                                                   memory_order_acquire);
+
+    /* fell behind by a whole ring: skip ahead to the middle of the ring, so
+       we do not get overwritten again right away */
+    if (write_sequence > this->cursor + num_slots) {
+      uint64_t new_cursor = write_sequence - num_slots / 2;
+      this->lost_frames += new_cursor - this->cursor;
+      this->cursor = new_cursor;
+    }
+
+    while (this->cursor < write_sequence) {
+      uint64_t cursor = this->cursor;
+      struct shm_ring_slot *slot = &this->slots[cursor % num_slots];
+      uint64_t seqlock = atomic_load_explicit(&slot->seqlock, memory_order_acquire);
+      if (seqlock == 2 * cursor + 2) {
+        this->data_size = slot->data_size;
+        this->timestamp = slot->timestamp;
+        this->holding = 1;
+        *data = this->data + (size_t) (cursor % num_slots) * header->slot_size;
+        *data_size = this->data_size;
+        if (sequence) {
+          *sequence = cursor;
+        }
+        return 1;
+      }
+      /* overwritten before we got to it */
+      this->lost_frames++;
+      this->cursor++;
+    }
+
+    uint64_t now = monotonic_ms();
+    if (now >= deadline) {
+      break;
+    }
+    atomic_fetch_add_explicit(&header->waiters, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    futex_wait(&header->futex_word, futex_value, (int) (deadline - now));
+    atomic_fetch_sub(&header->waiters, 1);
+  }
+
+  return 0;
+}
+
+
+int rf103_shm_reader_release(rf103_shm_reader_t *this)
+{
+  if (!this->holding) {
+    return 0;
+  }
+
+  atomic_thread_fence(memory_order_acquire);
+  struct shm_ring_slot *slot = &this->slots[this->cursor % this->header->num_slots];
+  uint64_t seqlock = atomic_load_explicit(&slot->seqlock, memory_order_relaxed);
+  int overwritten = seqlock != 2 * this->cursor + 2;
+  if (overwritten) {
+    this->lost_frames++;
+  }
+
+  this->holding = 0;
+  this->cursor++;
+  if (this->entry) {
+    atomic_store_explicit(&this->entry->cursor, this->cursor, memory_order_relaxed);
+    atomic_store_explicit(&this->entry->lost_frames, this->lost_frames, memory_order_relaxed);
+  }
+  return overwritten;
+}
+
+
+uint32_t rf103_shm_reader_frame_size(rf103_shm_reader_t *this)
+{
+  return this->header->slot_size;
+}
+
+
+uint32_t rf103_shm_reader_sample_rate(rf103_shm_reader_t *this)
+{
+  return atomic_load(&this->header->sample_rate);
+}
+
+
+uint64_t rf103_shm_reader_timestamp(rf103_shm_reader_t *this)
+{
+  return this->timestamp;
+}
+
+
+uint64_t rf103_shm_reader_lost_frames(rf103_shm_reader_t *this)
+{
+  return this->lost_frames;
+}
+
+
+/* internal functions */
+static char *shm_name(const char *name)
+{
+  if (name == 0 || name[0] == '\0' || strchr(name + 1, '/') != 0) {
+    return 0;
+  }
+  if (name[0] == '/') {
+    return strdup(name);
+  }
+  char *path = (char *) malloc(strlen(name) + 2);
+  path[0] = '/';
+  strcpy(path + 1, name);
+  return path;
+}
+
+static size_t round_up(size_t value, size_t alignment)
+{
+  return alignment * ((value + alignment - 1) / alignment);
+}
+
+static int futex_wait(_Atomic uint32_t *addr, uint32_t value, int timeout_ms)
+{
+  struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  return syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT, value, &timeout, 0, 0);
+}
+
+static int futex_wake(_Atomic uint32_t *addr)
+{
+  return syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+static uint64_t realtime_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,56 @@
+/*
+ * shm_ring.h - shared memory broadcast ring (producer side)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SHM_RING_H
+#define __SHM_RING_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct shm_ring shm_ring_t;
+
+enum ShmRingFlags {
+  SHM_RING_HUGEPAGES = 0x01
+};
+
+shm_ring_t *shm_ring_create(const char *name, uint32_t slot_size,
+                            uint32_t num_slots, int flags);
+
+void shm_ring_destroy(shm_ring_t *this);
+
+int shm_ring_set_sample_rate(shm_ring_t *this, uint32_t sample_rate);
+
+/* number of readers currently attached */
+int shm_ring_num_readers(shm_ring_t *this);
+
+/* must only be called from a single thread (the USB event thread) */
+int shm_ring_publish(shm_ring_t *this, const uint8_t *data,
+                     uint32_t data_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHM_RING_H */
@@ -0,0 +1,57 @@
+/*
+ * simd.h - portable SIMD vector types for the DSP kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SIMD_H
+#define __SIMD_H
+
+/* GCC vector extensions: an 8 lane float vector is a single AVX/AVX2
+ * register when the target has them (see the RF103_NATIVE build option) and
+ * a pair of SSE or NEON registers otherwise. The unaligned load/store types
+ * may alias plain float arrays. Vectors are only ever passed around through
+ * macros, since passing them by value would depend on the target ABI */
+
+typedef float v8sf __attribute__((vector_size(32)));
+typedef float v8sf_u __attribute__((vector_size(32), aligned(4), may_alias));
+typedef int v8si __attribute__((vector_size(32)));
+
+#define SIMD_FLOAT_LANES (8)
+
+#define V8SF_LOAD(p) (*(const v8sf_u *) (p))
+#define V8SF_STORE(p, v) (*(v8sf_u *) (p) = (v))
+#define V8SF_SUM(v) ((((v)[0] + (v)[4]) + ((v)[1] + (v)[5])) + \
+                     (((v)[2] + (v)[6]) + ((v)[3] + (v)[7])))
+
+/* lane permutation within a vector, e.g. V8SF_SHUFFLE(v, 1, 0, 3, 2, ...) */
+#if defined(__clang__)
+#define V8SF_SHUFFLE(v, ...) __builtin_shufflevector((v), (v), __VA_ARGS__)
+#else
+#define V8SF_SHUFFLE(v, ...) __builtin_shuffle((v), (v8si) { __VA_ARGS__ })
+#endif
+
+/* round up to a whole number of vectors */
+#define SIMD_FLOAT_ROUND_UP(n) (((n) + SIMD_FLOAT_LANES - 1) & ~(SIMD_FLOAT_LANES - 1))
+
+/* int16 lanes per step of the Q15 fixed point kernels (see dsp.c), which
+ * use the integer multiply-add instructions directly */
+#define SIMD_Q15_LANES (16)
+#define SIMD_Q15_ROUND_UP(n) (((n) + SIMD_Q15_LANES - 1) & ~(SIMD_Q15_LANES - 1))
+
+#endif /* __SIMD_H */
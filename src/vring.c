@@ -0,0 +1,120 @@
+/*
+ * vring.c - ring buffer mapped twice in a row in virtual memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* An anonymous memory file (memfd) of the ring size is mapped twice into
+ * a reservation of twice that size: the first mmap() reserves the whole
+ * address range, so the two MAP_FIXED mappings of the file cannot land on
+ * anything else. The file descriptor is not needed once the pages are
+ * mapped.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vring.h"
+
+
+typedef struct vring {
+  size_t size;
+  uint8_t *base;
+} vring_t;
+
+
+vring_t *vring_open(size_t size)
+{
+  vring_t *ret_val = 0;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (size == 0 || page_size <= 0) {
+    fprintf(stderr, "ERROR - vring_open() failed: invalid size\n");
+    goto FAIL0;
+  }
+  size = (size + page_size - 1) / page_size * page_size;
+
+  int fd = memfd_create("rf103-vring", MFD_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - memfd_create() failed: %s\n", strerror(errno));
+    goto FAIL0;
+  }
+  if (ftruncate(fd, size) < 0) {
+    fprintf(stderr, "ERROR - ftruncate() failed: %s\n", strerror(errno));
+    goto FAIL1;
+  }
+  uint8_t *base = (uint8_t *) mmap(0, 2 * size, PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+    goto FAIL1;
+  }
+  for (int copy = 0; copy < 2; ++copy) {
+    void *mapped = mmap(base + copy * size, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+      goto FAIL2;
+    }
+  }
+
+  vring_t *this = (vring_t *) malloc(sizeof(vring_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto FAIL2;
+  }
+  this->size = size;
+  this->base = base;
+  close(fd);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL2:
+  munmap(base, 2 * size);
+FAIL1:
+  close(fd);
+FAIL0:
+  return ret_val;
+}
+
+
+void vring_close(vring_t *this)
+{
+  munmap(this->base, 2 * this->size);
+  free(this);
+  return;
+}
+
+
+size_t vring_get_size(vring_t *this)
+{
+  return this->size;
+}
+
+
+void *vring_get_base(vring_t *this)
+{
+  return this->base;
+}
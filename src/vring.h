@@ -0,0 +1,51 @@
+/*
+ * vring.h - ring buffer mapped twice in a row in virtual memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __VRING_H
+#define __VRING_H
+
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct vring vring_t;
+
+/* size bytes (rounded up to a multiple of the page size) of memory, mapped
+   twice back to back: the byte at base + size + i is the byte at
+   base + i, so any window of up to size bytes starting in the first
+   mapping is contiguous, wherever it wraps around; the initial contents
+   are zero */
+vring_t *vring_open(size_t size);
+
+void vring_close(vring_t *this);
+
+size_t vring_get_size(vring_t *this);
+
+void *vring_get_base(vring_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __VRING_H */
@@ -89,6 +89,12 @@ void waveSetStartTime(time_t tim, double fraction)
 }
 
 
+void waveSetIQOffset(double offset)
+{
+	waveHdr.a.IQOffset = (int32_t)( offset * 1000.0 + ( offset < 0.0 ? -0.5 : 0.5 ) );
+}
+
+
 void wavePrepareHeader(unsigned samplerate, unsigned freq, int bitsPerSample, int numChannels)
 {
 	int	bytesPerSample = bitsPerSample / 8;
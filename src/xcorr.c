@@ -0,0 +1,463 @@
+/*
+ * xcorr.c - cross-correlation of two receivers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - C. H. Knapp, G. C. Carter, "The Generalized Correlation Method for
+ *    Estimation of Time Delay", IEEE Trans. ASSP, vol. 24, 1976
+ */
+
+/* Each stream goes into a ring buffer addressed by sample index, so the
+ * two streams can arrive in blocks of different sizes and at different
+ * times. When both streams have the segments of the current interval, the
+ * segments are split in as many chunks as there are threads; each chunk
+ * accumulates the cross spectrum conj(A) B of its segments in its own
+ * slot, and the slots are then added up and transformed back into the
+ * cross-correlation. Zero padding each segment to twice its length makes
+ * the circular correlation of the FFTs a linear one.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf103_xcorr.h"
+#include "dsp.h"
+#include "fft.h"
+#include "parallel.h"
+
+
+#define XCORR_STREAMS (2)
+
+struct xcorr_stream {
+  float *buffer;               /* ring, indexed by sample index */
+  uint64_t first;              /* oldest sample in the ring */
+  uint64_t end;                /* next sample expected */
+  int started;
+};
+
+struct xcorr_slot {
+  float *segment;              /* zero padded to fft_size */
+  float *spectrum[XCORR_STREAMS];
+  float *cross;
+  double energy[XCORR_STREAMS];
+};
+
+typedef struct rf103_xcorr {
+  uint32_t fft_size;
+  uint32_t segment_size;
+  uint32_t max_lag;
+  int flags;
+  rf103_xcorr_cb_t callback;
+  void *callback_context;
+  fft_t *forward;
+  fft_t *inverse;
+  parallel_t *parallel;
+  uint32_t num_threads;
+  struct xcorr_slot *slots;
+  float *slot_buffers;
+  uint64_t capacity;           /* of the rings (power of 2) */
+  struct xcorr_stream streams[XCORR_STREAMS];
+  pthread_mutex_t lock;
+  double interval;             /* samples */
+  uint32_t num_segments;       /* per interval */
+  uint32_t chunk_size;         /* segments per slot */
+  int started;                 /* both streams have started */
+  uint64_t interval_start;
+  double next_start;
+  float *lags;                 /* inverse FFT output */
+  float *correlation;          /* magnitudes, lag -fft_size / 2 first */
+} rf103_xcorr_t;
+
+
+/* internal functions */
+static int write_stream(rf103_xcorr_t *this, uint32_t stream,
+                        uint64_t sample_index, const float *samples,
+                        uint32_t num_samples);
+static void correlate(rf103_xcorr_t *this);
+static void correlate_segments(uint32_t begin, uint32_t end, void *context);
+static void read_ring(rf103_xcorr_t *this, uint32_t stream,
+                      uint64_t sample_index, float *samples,
+                      uint32_t num_samples);
+
+
+rf103_xcorr_t *rf103_xcorr_open(double sample_rate, uint32_t fft_size,
+                                uint32_t max_lag, double update_rate,
+                                uint32_t num_averages, int flags,
+                                uint32_t num_threads,
+                                rf103_xcorr_cb_t callback,
+                                void *callback_context)
+{
+  rf103_xcorr_t *ret_val = 0;
+
+  if (sample_rate <= 0.0 || fft_size < 16 ||
+      (fft_size & (fft_size - 1)) != 0 || max_lag >= fft_size / 2 ||
+      update_rate <= 0.0 || callback == 0) {
+    fprintf(stderr, "ERROR - rf103_xcorr_open() failed: invalid parameters\n");
+    return ret_val;
+  }
+  double interval = sample_rate / update_rate;
+  uint32_t segment_size = fft_size / 2;
+  if (interval < segment_size) {
+    fprintf(stderr, "ERROR - rf103_xcorr_open() failed: update rate %g is higher than the segment rate %g\n",
+            update_rate, sample_rate / segment_size);
+    return ret_val;
+  }
+
+  rf103_xcorr_t *this = (rf103_xcorr_t *) calloc(1, sizeof(rf103_xcorr_t));
+  if (this == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    return ret_val;
+  }
+  this->fft_size = fft_size;
+  this->segment_size = segment_size;
+  this->max_lag = max_lag > 0 ? max_lag : fft_size / 2 - 1;
+  this->flags = flags;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  pthread_mutex_init(&this->lock, 0);
+  this->interval = interval;
+  /* the intervals differ by a sample at most, because of the rounding */
+  uint64_t num_segments = (uint64_t) floor(interval) / segment_size;
+  if (num_averages > 0 && num_segments > num_averages) {
+    num_segments = num_averages;
+  }
+  this->num_segments = (uint32_t) num_segments;
+
+  this->forward = fft_open(fft_size, FFT_FORWARD);
+  this->inverse = fft_open(fft_size, FFT_INVERSE);
+  if (this->forward == 0 || this->inverse == 0) {
+    fprintf(stderr, "ERROR - fft_open() failed\n");
+    goto FAIL;
+  }
+  this->parallel = parallel_open(num_threads);
+  if (this->parallel == 0) {
+    fprintf(stderr, "ERROR - parallel_open() failed\n");
+    goto FAIL;
+  }
+  this->num_threads = parallel_get_num_threads(this->parallel);
+
+  /* a stream can run ahead of the other by one interval (plus rounding) */
+  this->capacity = 1;
+  while (this->capacity < 2 * (uint64_t) ceil(interval) + segment_size) {
+    this->capacity *= 2;
+  }
+  for (uint32_t s = 0; s < XCORR_STREAMS; ++s) {
+    this->streams[s].buffer = (float *) malloc(this->capacity * 2 *
+                                               sizeof(float));
+    if (this->streams[s].buffer == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      goto FAIL;
+    }
+  }
+
+  /* per slot: segment, two spectra and the cross spectrum */
+  size_t complex_size = 2 * (size_t) fft_size;
+  this->slots = (struct xcorr_slot *) calloc(this->num_threads,
+                                             sizeof(struct xcorr_slot));
+  this->slot_buffers = (float *) calloc(this->num_threads * 4 *
+                                        complex_size, sizeof(float));
+  this->lags = (float *) malloc(complex_size * sizeof(float));
+  this->correlation = (float *) malloc(fft_size * sizeof(float));
+  if (this->slots == 0 || this->slot_buffers == 0 || this->lags == 0 ||
+      this->correlation == 0) {
+    fprintf(stderr, "ERROR - calloc() failed\n");
+    goto FAIL;
+  }
+  for (uint32_t t = 0; t < this->num_threads; ++t) {
+    float *buffers = this->slot_buffers + t * 4 * complex_size;
+    this->slots[t].segment = buffers;
+    this->slots[t].spectrum[0] = buffers + complex_size;
+    this->slots[t].spectrum[1] = buffers + 2 * complex_size;
+    this->slots[t].cross = buffers + 3 * complex_size;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  rf103_xcorr_close(this);
+  return ret_val;
+}
+
+
+void rf103_xcorr_close(rf103_xcorr_t *this)
+{
+  free(this->correlation);
+  free(this->lags);
+  free(this->slot_buffers);
+  free(this->slots);
+  for (uint32_t s = 0; s < XCORR_STREAMS; ++s) {
+    free(this->streams[s].buffer);
+  }
+  if (this->parallel)
+    parallel_close(this->parallel);
+  if (this->inverse)
+    fft_close(this->inverse);
+  if (this->forward)
+    fft_close(this->forward);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return;
+}
+
+
+int rf103_xcorr_write(rf103_xcorr_t *this, uint32_t stream,
+                      uint64_t sample_index, const float *samples,
+                      uint32_t num_samples)
+{
+  if (stream >= XCORR_STREAMS) {
+    fprintf(stderr, "ERROR - rf103_xcorr_write() failed: invalid stream %u\n",
+            stream);
+    return -1;
+  }
+
+  pthread_mutex_lock(&this->lock);
+  int ret_val = write_stream(this, stream, sample_index, samples,
+                             num_samples);
+
+  /* the first interval starts where both streams have samples */
+  struct xcorr_stream *streams = this->streams;
+  if (!this->started && streams[0].started && streams[1].started) {
+    this->interval_start = streams[0].first > streams[1].first ?
+                           streams[0].first : streams[1].first;
+    this->next_start = this->interval_start + this->interval;
+    this->started = 1;
+  }
+
+  if (this->started) {
+    uint64_t used = (uint64_t) this->num_segments * this->segment_size;
+    while (streams[0].end >= this->interval_start + used &&
+           streams[1].end >= this->interval_start + used) {
+      correlate(this);
+      this->interval_start = (uint64_t) llround(this->next_start);
+      this->next_start += this->interval;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+/* internal functions */
+static int write_stream(rf103_xcorr_t *this, uint32_t stream,
+                        uint64_t sample_index, const float *samples,
+                        uint32_t num_samples)
+{
+  struct xcorr_stream *s = &this->streams[stream];
+  uint64_t capacity = this->capacity;
+
+  if (!s->started) {
+    s->first = sample_index;
+    s->end = sample_index;
+    s->started = 1;
+  }
+  /* samples already written (or already correlated) are skipped */
+  uint64_t oldest = this->started ? this->interval_start : s->end;
+  if (oldest < s->end) {
+    oldest = s->end;
+  }
+  if (sample_index < oldest) {
+    uint64_t skip = oldest - sample_index;
+    if (skip >= num_samples) {
+      return 0;
+    }
+    samples += 2 * skip;
+    num_samples -= (uint32_t) skip;
+    sample_index = oldest;
+  }
+
+  /* until both streams have started, the ring just keeps the latest
+     samples; after that it cannot overwrite the current interval */
+  if (this->started &&
+      sample_index + num_samples > this->interval_start + capacity) {
+    fprintf(stderr, "ERROR - rf103_xcorr_write() failed: stream %u is too far ahead\n",
+            stream);
+    return -1;
+  }
+  if (sample_index - s->end >= capacity) {
+    s->end = sample_index - capacity;
+  }
+  while (s->end < sample_index) {
+    uint64_t position = s->end & (capacity - 1);
+    uint64_t length = sample_index - s->end;
+    if (length > capacity - position) {
+      length = capacity - position;
+    }
+    memset(s->buffer + 2 * position, 0, length * 2 * sizeof(float));
+    s->end += length;
+  }
+  while (num_samples > 0) {
+    uint64_t position = sample_index & (capacity - 1);
+    uint32_t length = num_samples;
+    if (length > capacity - position) {
+      length = (uint32_t) (capacity - position);
+    }
+    memcpy(s->buffer + 2 * position, samples, length * 2 * sizeof(float));
+    samples += 2 * (size_t) length;
+    num_samples -= length;
+    sample_index += length;
+  }
+  s->end = sample_index;
+  if (s->end - s->first > capacity) {
+    s->first = s->end - capacity;
+  }
+  return 0;
+}
+
+static void correlate(rf103_xcorr_t *this)
+{
+  uint32_t fft_size = this->fft_size;
+  uint32_t num_segments = this->num_segments;
+  uint32_t chunk_size = (num_segments + this->num_threads - 1) /
+                        this->num_threads;
+  uint32_t num_slots = (num_segments + chunk_size - 1) / chunk_size;
+  for (uint32_t t = 0; t < num_slots; ++t) {
+    memset(this->slots[t].cross, 0, 2 * (size_t) fft_size * sizeof(float));
+    this->slots[t].energy[0] = 0.0;
+    this->slots[t].energy[1] = 0.0;
+  }
+  this->chunk_size = chunk_size;
+  parallel_for(this->parallel, num_segments, chunk_size, correlate_segments,
+               this);
+
+  float *cross = this->slots[0].cross;
+  double energy[XCORR_STREAMS] = { this->slots[0].energy[0],
+                                   this->slots[0].energy[1] };
+  for (uint32_t t = 1; t < num_slots; ++t) {
+    const float *slot_cross = this->slots[t].cross;
+    for (uint32_t k = 0; k < 2 * fft_size; ++k) {
+      cross[k] += slot_cross[k];
+    }
+    energy[0] += this->slots[t].energy[0];
+    energy[1] += this->slots[t].energy[1];
+  }
+
+  /* normalized so that identical streams give a peak of 1 */
+  double scale;
+  if (this->flags & RF103_XCORR_PHAT) {
+    for (uint32_t k = 0; k < fft_size; ++k) {
+      float re = cross[2 * k];
+      float im = cross[2 * k + 1];
+      float magnitude = sqrtf(re * re + im * im);
+      float weight = magnitude > 0.0f ? 1.0f / magnitude : 0.0f;
+      cross[2 * k] = re * weight;
+      cross[2 * k + 1] = im * weight;
+    }
+    scale = 1.0 / fft_size;
+  } else {
+    double norm = sqrt(energy[0] * energy[1]);
+    scale = norm > 0.0 ? 1.0 / (fft_size * norm) : 0.0;
+  }
+  fft_execute(this->inverse, cross, this->lags);
+
+  /* lag l is at index l mod fft_size */
+  const float *lags = this->lags;
+  uint32_t half = fft_size / 2;
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    uint32_t n = (k + half) & (fft_size - 1);
+    float re = lags[2 * n];
+    float im = lags[2 * n + 1];
+    this->correlation[k] = (float) (sqrtf(re * re + im * im) * scale);
+  }
+
+  uint32_t peak = half;
+  for (uint32_t k = half - this->max_lag; k <= half + this->max_lag; ++k) {
+    if (this->correlation[k] > this->correlation[peak]) {
+      peak = k;
+    }
+  }
+  /* Gaussian through the peak and its neighbours (a parabola through the
+     logarithms), which fits the shape of a correlation peak better than a
+     parabola and halves the bias of the fractional lag */
+  double peak_value = this->correlation[peak];
+  double y0 = this->correlation[(peak + fft_size - 1) & (fft_size - 1)];
+  double y2 = this->correlation[(peak + 1) & (fft_size - 1)];
+  double offset = 0.0;
+  if (y0 > 0.0 && peak_value > 0.0 && y2 > 0.0) {
+    double y1 = log(peak_value);
+    y0 = log(y0);
+    y2 = log(y2);
+    double denominator = y0 - 2.0 * y1 + y2;
+    offset = denominator < 0.0 ? 0.5 * (y0 - y2) / denominator : 0.0;
+  }
+  uint32_t n = (peak + half) & (fft_size - 1);
+
+  struct rf103_xcorr_result result;
+  result.sample_index = this->interval_start;
+  result.num_segments = num_segments;
+  result.lag = (double) peak - half + offset;
+  result.peak = peak_value;
+  result.phase = atan2(lags[2 * n + 1], lags[2 * n]);
+  result.num_lags = fft_size;
+  result.correlation = this->correlation;
+  this->callback(&result, this->callback_context);
+  return;
+}
+
+static void correlate_segments(uint32_t begin, uint32_t end, void *context)
+{
+  rf103_xcorr_t *this = (rf103_xcorr_t *) context;
+  struct xcorr_slot *slot = &this->slots[begin / this->chunk_size];
+  uint32_t fft_size = this->fft_size;
+  uint32_t segment_size = this->segment_size;
+
+  for (uint32_t i = begin; i < end; ++i) {
+    uint64_t sample_index = this->interval_start +
+                            (uint64_t) i * segment_size;
+    /* the second half of the segment buffer stays zero */
+    for (uint32_t s = 0; s < XCORR_STREAMS; ++s) {
+      read_ring(this, s, sample_index, slot->segment, segment_size);
+      slot->energy[s] += dsp_energy(slot->segment, 2 * (size_t) segment_size);
+      fft_execute(this->forward, slot->segment, slot->spectrum[s]);
+    }
+    const float *a = slot->spectrum[0];
+    const float *b = slot->spectrum[1];
+    float *cross = slot->cross;
+    for (uint32_t k = 0; k < fft_size; ++k) {
+      float a_re = a[2 * k];
+      float a_im = a[2 * k + 1];
+      float b_re = b[2 * k];
+      float b_im = b[2 * k + 1];
+      cross[2 * k] += a_re * b_re + a_im * b_im;
+      cross[2 * k + 1] += a_re * b_im - a_im * b_re;
+    }
+  }
+  return;
+}
+
+static void read_ring(rf103_xcorr_t *this, uint32_t stream,
+                      uint64_t sample_index, float *samples,
+                      uint32_t num_samples)
+{
+  const float *buffer = this->streams[stream].buffer;
+  uint64_t capacity = this->capacity;
+  uint64_t position = sample_index & (capacity - 1);
+  uint32_t length = num_samples;
+  if (length > capacity - position) {
+    length = (uint32_t) (capacity - position);
+  }
+  memcpy(samples, buffer + 2 * position, length * 2 * sizeof(float));
+  memcpy(samples + 2 * (size_t) length, buffer,
+         (num_samples - length) * 2 * sizeof(float));
+  return;
+}